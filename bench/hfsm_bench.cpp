@@ -0,0 +1,366 @@
+/*
+ * Hierarchical finite state machine
+ * Benchmarks of C and C++ engines
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <benchmark/benchmark.h>
+
+#include <hfsm.h>
+#include "StateMachine.h"
+
+using namespace utils;
+using namespace hfsm;
+
+/// Events sent by every producer in one iteration of throughput benchmarks
+static const int kProducerEvents = 10000;
+
+/// Context of C benchmarks, passed as userdata
+struct BenchContext {
+    std::atomic<uint64_t> handled{0};
+    state_id a = 0;     /// leaves the transition benchmark toggles between
+    state_id b = 0;
+};
+
+static bool bench_c_count(const event_t *evt, void *userdata, state_id *next)
+{
+    static_cast<BenchContext*>(userdata)->handled.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+static bool bench_c_toggle(const event_t *evt, void *userdata, state_id *next)
+{
+    BenchContext *ctx = static_cast<BenchContext*>(userdata);
+    *next = *next == ctx->a ? ctx->b : ctx->a;
+    return true;
+}
+
+/// Flat states 1..n under root 0, root moves to the next one on every event
+static bool bench_c_next(const event_t *evt, void *userdata, state_id *next)
+{
+    BenchContext *ctx = static_cast<BenchContext*>(userdata);
+    *next = *next % ctx->a + 1;
+    return true;
+}
+
+static state_t* bench_c_state(hfsm_handle hfsm, state_id id, state_t *parent,
+    bool (*process)(const event_t*, void*, state_id*))
+{
+    state_t *s = hfsm_new_state(hfsm);
+    *s = state_t{ id, parent, { NULL, NULL, process } };
+    hfsm_add_state(hfsm, s);
+    return s;
+}
+
+static hfsm_handle bench_c_inline(BenchContext *ctx, unsigned char states)
+{
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {};
+    param.max_states = states;
+    param.userdata = ctx;
+    param.mode = HFSM_MODE_INLINE;
+    hfsm_create(&hfsm, &param);
+    return hfsm;
+}
+
+/// Latency of an event handled by current state in place
+static void BM_C_Dispatch(benchmark::State &state)
+{
+    BenchContext ctx;
+    hfsm_handle hfsm = bench_c_inline(&ctx, 1);
+    bench_c_state(hfsm, 1, NULL, bench_c_count);
+    hfsm_start(hfsm, 1);
+    event_t evt = { EVENT_ID_USER_BASE, 1, NULL };
+    for (auto _ : state) {
+        hfsm_dispatch_event(hfsm, &evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+    hfsm_destroy(&hfsm);
+}
+BENCHMARK(BM_C_Dispatch);
+
+/// Transition between two leaves whose common parent is the root,
+/// every transition exits and enters depth states
+static void BM_C_TransitionDepth(benchmark::State &state)
+{
+    const int depth = static_cast<int>(state.range(0));
+    BenchContext ctx;
+    hfsm_handle hfsm = bench_c_inline(&ctx, static_cast<unsigned char>(depth * 2 + 1));
+    state_t *root = bench_c_state(hfsm, 0, NULL, NULL);
+    state_t *left = root, *right = root;
+    for (int i=1; i<=depth; ++i) {
+        bool leaf = i == depth;
+        left = bench_c_state(hfsm, i, left, leaf ? bench_c_toggle : NULL);
+        right = bench_c_state(hfsm, depth + i, right, leaf ? bench_c_toggle : NULL);
+    }
+    ctx.a = left->id;
+    ctx.b = right->id;
+    hfsm_start(hfsm, ctx.a);
+    event_t evt = { EVENT_ID_USER_BASE, 1, NULL };
+    for (auto _ : state) {
+        hfsm_dispatch_event(hfsm, &evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+    hfsm_destroy(&hfsm);
+}
+BENCHMARK(BM_C_TransitionDepth)->RangeMultiplier(2)->Range(1, 64);
+
+/// Transitions cycling through n states, every pair is looked up
+static void BM_C_Lookup(benchmark::State &state)
+{
+    const int num = static_cast<int>(state.range(0));
+    BenchContext ctx;
+    hfsm_handle hfsm = bench_c_inline(&ctx, static_cast<unsigned char>(num + 1));
+    state_t *root = bench_c_state(hfsm, 0, NULL, bench_c_next);
+    for (int i=1; i<=num; ++i) {
+        bench_c_state(hfsm, i, root, NULL);
+    }
+    ctx.a = static_cast<state_id>(num);
+    hfsm_start(hfsm, 1);
+    event_t evt = { EVENT_ID_USER_BASE, 1, NULL };
+    for (auto _ : state) {
+        hfsm_dispatch_event(hfsm, &evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+    hfsm_destroy(&hfsm);
+}
+BENCHMARK(BM_C_Lookup)->RangeMultiplier(4)->Range(4, 254);
+
+/// Events sent by producers until the dispatcher handled all of them
+static void BM_C_Throughput(benchmark::State &state)
+{
+    const int producers = static_cast<int>(state.range(0));
+    const unsigned char queue = static_cast<unsigned char>(state.range(1));
+    BenchContext ctx;
+    hfsm_executor exec = NULL;
+    if (queue == HFSM_QUEUE_EXECUTOR) {
+        hfsm_executor_create(&exec, 2);
+    }
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {};
+    param.max_states = 1;
+    param.userdata = &ctx;
+    param.mode = HFSM_MODE_THREAD;
+    param.queue = queue;
+    param.executor = exec;
+    param.capacity = 1024;
+    param.overflow = HFSM_OVERFLOW_BLOCK;
+    hfsm_create(&hfsm, &param);
+    bench_c_state(hfsm, 1, NULL, bench_c_count);
+    hfsm_start(hfsm, 1);
+
+    uint64_t expected = 0;
+    for (auto _ : state) {
+        expected += static_cast<uint64_t>(producers) * kProducerEvents;
+        std::vector<std::thread> threads;
+        for (int p=0; p<producers; ++p) {
+            threads.emplace_back([hfsm]() {
+                event_t evt = { EVENT_ID_USER_BASE, 1, NULL };
+                for (int i=0; i<kProducerEvents; ++i) {
+                    hfsm_send_event(hfsm, &evt);
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        while (ctx.handled.load(std::memory_order_relaxed) < expected) {
+            std::this_thread::yield();
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(expected));
+    hfsm_destroy(&hfsm);
+    if (exec) {
+        hfsm_executor_destroy(&exec);
+    }
+}
+BENCHMARK(BM_C_Throughput)
+    ->ArgNames({ "producers", "queue" })
+    ->ArgsProduct({ { 1, 2, 4, 8 },
+        { HFSM_QUEUE_EVTHUB, HFSM_QUEUE_RING, HFSM_QUEUE_EXECUTOR } })
+    ->UseRealTime();
+
+/// Event of C++ benchmarks
+class BenchEvent final : public Event
+{
+  public:
+    explicit BenchEvent(uint32_t id) : id_(id) {}
+    virtual uint32_t ID() const override { return id_; }
+    virtual const char* Name() const override { return "bench"; }
+    virtual EvtPriority Priority() const override { return EvtPriority::kEvtPriMid; }
+
+  private:
+    uint32_t id_;
+};
+
+/// SM of C++ benchmarks, Handle dispatches in place on caller thread
+/// while its queue stays idle
+class BenchSM : public StateMachine
+{
+  public:
+    using BenchState = StateImpl<BenchSM>;
+    using BenchTrans = TransitionImpl<BenchSM>;
+    static constexpr uint32_t kStart = 0;
+    static constexpr uint32_t kEvent = 1;
+
+    bool Count(const SpEvent &evt)
+    {
+        handled.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    void Handle(const SpEvent &evt) { OnEvent(evt); }
+    SpState NewState(const SpState &parent, bool count)
+    {
+        BenchState::StateAction action = {};
+        if (count) {
+            action.invoke = &BenchSM::Count;
+        }
+        return std::make_shared<BenchState>(parent, action);
+    }
+    void AddTrans(const SpState &source, const SpState &target, uint32_t trigger)
+    {
+        AddTransition(std::make_shared<BenchTrans>(source, target, trigger,
+            BenchTrans::TransAction{}));
+    }
+    bool Run(const StartOption &option)
+    {
+        StartOption idle;
+        idle.queue = QueueKind::kRing;
+        if (!Start(option.executor || option.queue != QueueKind::kEventHub ? option : idle)) {
+            return false;
+        }
+        Handle(MakeEvent<BenchEvent>(kStart));
+        return true;
+    }
+
+    std::atomic<uint64_t> handled{0};
+};
+
+static void BM_Cpp_Dispatch(benchmark::State &state)
+{
+    BenchSM sm;
+    sm.AddTrans(nullptr, sm.NewState(nullptr, true), BenchSM::kStart);
+    sm.Run(StartOption());
+    SpEvent evt = MakeEvent<BenchEvent>(BenchSM::kEvent);
+    for (auto _ : state) {
+        sm.Handle(evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Cpp_Dispatch);
+
+static void BM_Cpp_TransitionDepth(benchmark::State &state)
+{
+    const int depth = static_cast<int>(state.range(0));
+    BenchSM sm;
+    SpState root = sm.NewState(nullptr, false);
+    SpState left = root, right = root;
+    for (int i = 0; i < depth; ++i) {
+        left = sm.NewState(left, false);
+        right = sm.NewState(right, false);
+    }
+    sm.AddTrans(nullptr, left, BenchSM::kStart);
+    sm.AddTrans(left, right, BenchSM::kEvent);
+    sm.AddTrans(right, left, BenchSM::kEvent);
+    sm.Run(StartOption());
+    SpEvent evt = MakeEvent<BenchEvent>(BenchSM::kEvent);
+    for (auto _ : state) {
+        sm.Handle(evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Cpp_TransitionDepth)->RangeMultiplier(2)->Range(1, 64);
+
+/// n states in a cycle, each one has n transitions indexed by trigger
+/// and the event triggers the one to the next state
+static void BM_Cpp_Lookup(benchmark::State &state)
+{
+    const int num = static_cast<int>(state.range(0));
+    BenchSM sm;
+    SpState root = sm.NewState(nullptr, false);
+    std::vector<SpState> states;
+    for (int i = 0; i < num; ++i) {
+        states.emplace_back(sm.NewState(root, false));
+    }
+    sm.AddTrans(nullptr, states[0], BenchSM::kStart);
+    for (int i = 0; i < num; ++i) {
+        for (int j = 0; j < num; ++j) {
+            uint32_t trigger = j == 0 ? BenchSM::kEvent : BenchSM::kEvent + j;
+            sm.AddTrans(states[i], states[(i + j + 1) % num], trigger);
+        }
+    }
+    sm.Run(StartOption());
+    SpEvent evt = MakeEvent<BenchEvent>(BenchSM::kEvent);
+    for (auto _ : state) {
+        sm.Handle(evt);
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Cpp_Lookup)->RangeMultiplier(4)->Range(4, 256);
+
+/// queue: 0 EventHub, 1 ring, 2 executor
+static void BM_Cpp_Throughput(benchmark::State &state)
+{
+    const int producers = static_cast<int>(state.range(0));
+    const int queue = static_cast<int>(state.range(1));
+    std::unique_ptr<Executor> exec;
+    StartOption option;
+    option.capacity = 1024;
+    option.overflow = OverflowPolicy::kBlock;
+    if (queue == 1) {
+        option.queue = QueueKind::kRing;
+    } else if (queue == 2) {
+        exec.reset(new Executor(2));
+        option.executor = exec.get();
+    }
+    std::unique_ptr<BenchSM> sm(new BenchSM);
+    sm->AddTrans(nullptr, sm->NewState(nullptr, true), BenchSM::kStart);
+    sm->Start(option);
+    sm->SendEvent(MakeEvent<BenchEvent>(BenchSM::kStart));
+
+    uint64_t expected = 0;
+    for (auto _ : state) {
+        expected += static_cast<uint64_t>(producers) * kProducerEvents;
+        std::vector<std::thread> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.emplace_back([&sm]() {
+                for (int i = 0; i < kProducerEvents; ++i) {
+                    sm->SendEvent(MakeEvent<BenchEvent>(BenchSM::kEvent));
+                }
+            });
+        }
+        for (auto &t : threads) {
+            t.join();
+        }
+        while (sm->handled.load(std::memory_order_relaxed) < expected) {
+            std::this_thread::yield();
+        }
+    }
+    state.SetItemsProcessed(static_cast<int64_t>(expected));
+    /// SM is destroyed before its executor
+    sm.reset();
+}
+BENCHMARK(BM_Cpp_Throughput)
+    ->ArgNames({ "producers", "queue" })
+    ->ArgsProduct({ { 1, 2, 4, 8 }, { 0, 1, 2 } })
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
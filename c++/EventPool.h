@@ -0,0 +1,205 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_EVENT_POOL_H
+#define _HFSM_CPP_EVENT_POOL_H
+
+#include <new>
+#include <mutex>
+#include <memory>
+#include <cstddef>
+#include <utility>
+
+namespace utils {
+namespace hfsm {
+
+/// Free lists of fixed size blocks, one pool for each block size.
+/// Every thread caches blocks locally and exchanges them with the shared
+/// list in batches, so events allocated by producers and released by
+/// the dispatcher circulate without touching malloc once warmed up.
+/// Blocks are never returned to the system.
+template <size_t Size, size_t Align>
+class BlockPool
+{
+  public:
+    static void* Alloc()
+    {
+        Cache &cache = LocalCache();
+        if (cache.head == nullptr) {
+            Refill(cache);
+        }
+        Block *block = cache.head;
+        cache.head = block->next;
+        --cache.num;
+        return block;
+    }
+
+    static void Free(void *p)
+    {
+        Cache &cache = LocalCache();
+        Block *block = static_cast<Block*>(p);
+        block->next = cache.head;
+        cache.head = block;
+        if (++cache.num >= kBatch * 2) {
+            Flush(cache, kBatch);
+        }
+    }
+
+  private:
+    static constexpr size_t kBatch = 64;
+
+    union Block {
+        Block *next;
+        alignas(Align) unsigned char data[Size];
+    };
+    struct Cache {
+        Block *head = nullptr;
+        size_t num = 0;
+        ~Cache() { Flush(*this, num); }
+    };
+    struct Shared {
+        std::mutex lock;
+        Block *head = nullptr;
+        size_t num = 0;
+    };
+
+    static Cache& LocalCache()
+    {
+        static thread_local Cache cache;
+        return cache;
+    }
+
+    static Shared& SharedList()
+    {
+        /// never destroyed, thread caches may be flushed at exit
+        static Shared *shared = new Shared;
+        return *shared;
+    }
+
+    static void Refill(Cache &cache)
+    {
+        Shared &shared = SharedList();
+        {
+            std::lock_guard<std::mutex> lock(shared.lock);
+            while (shared.head != nullptr && cache.num < kBatch) {
+                Block *block = shared.head;
+                shared.head = block->next;
+                --shared.num;
+                block->next = cache.head;
+                cache.head = block;
+                ++cache.num;
+            }
+        }
+        if (cache.head == nullptr) {
+            Block *blocks = NewBatch();
+            for (size_t i = 0; i < kBatch; ++i) {
+                blocks[i].next = cache.head;
+                cache.head = &blocks[i];
+            }
+            cache.num = kBatch;
+        }
+    }
+
+    /// Blocks of a batch keep alignment of Align as Block is a multiple of it
+    static Block* NewBatch()
+    {
+#ifdef __cpp_aligned_new
+        return static_cast<Block*>(::operator new(sizeof(Block) * kBatch,
+            std::align_val_t(alignof(Block))));
+#else
+        static_assert(alignof(Block) <= alignof(std::max_align_t),
+            "over-aligned blocks need aligned new of C++17");
+        return static_cast<Block*>(::operator new(sizeof(Block) * kBatch));
+#endif
+    }
+
+    static void Flush(Cache &cache, size_t n)
+    {
+        if (n == 0) {
+            return;
+        }
+        Block *first = cache.head;
+        Block *last = first;
+        for (size_t i = 1; i < n; ++i) {
+            last = last->next;
+        }
+        cache.head = last->next;
+        cache.num -= n;
+
+        Shared &shared = SharedList();
+        std::lock_guard<std::mutex> lock(shared.lock);
+        last->next = shared.head;
+        shared.head = first;
+        shared.num += n;
+    }
+};
+
+/// Allocator of std::allocate_shared backed by BlockPool, the object and
+/// its reference counts share one pooled block.
+template <typename T>
+class PoolAllocator
+{
+  public:
+    using value_type = T;
+
+    PoolAllocator() noexcept {}
+    template <typename U>
+    PoolAllocator(const PoolAllocator<U>&) noexcept {}
+
+    T* allocate(size_t n)
+    {
+        if (n != 1) {
+            return static_cast<T*>(::operator new(n * sizeof(T)));
+        }
+        return static_cast<T*>(BlockPool<sizeof(T), alignof(T)>::Alloc());
+    }
+
+    void deallocate(T *p, size_t n) noexcept
+    {
+        if (n != 1) {
+            ::operator delete(p);
+            return;
+        }
+        BlockPool<sizeof(T), alignof(T)>::Free(p);
+    }
+
+    template <typename U>
+    bool operator==(const PoolAllocator<U>&) const noexcept { return true; }
+    template <typename U>
+    bool operator!=(const PoolAllocator<U>&) const noexcept { return false; }
+};
+
+/**
+ * @brief Create an event from the pool of its type, it is recycled
+ *        when the last reference drops.
+ *
+ * @param[in] args: arguments of constructor of T
+ * @return shared pointer of T, convertible to SpEvent.
+ */
+template <typename T, typename... Args>
+std::shared_ptr<T> MakeEvent(Args&&... args)
+{
+    return std::allocate_shared<T>(PoolAllocator<T>(), std::forward<Args>(args)...);
+}
+
+}
+}
+
+#endif // _HFSM_CPP_EVENT_POOL_H
@@ -0,0 +1,391 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "EventQueue.h"
+#include "EventPool.h"
+
+namespace utils {
+namespace hfsm {
+
+bool HubEventQueue::Send(const SpEvent &evt)
+{
+    return hub_.Send(evt);
+}
+
+bool HubEventQueue::SendBatch(const SpEvent *evts, size_t n, uint64_t sent)
+{
+    if (n == 1 && sent == 0) {
+        return hub_.Send(evts[0]);
+    }
+    /// EventHub sends one by one and has no room for stamp, so queue
+    /// them as one event
+    auto batch = MakeEvent<BatchEvent>(evts[0]->Priority());
+    batch->events.assign(evts, evts + n);
+    batch->sent = sent;
+    return hub_.Send(batch);
+}
+
+EventRing::EventRing(size_t max)
+  : capacity_(max)
+{
+    size_t cap = 1;
+    while (cap < max) {
+        cap <<= 1;
+    }
+    for (auto &ring : bands_) {
+        ring.mask = cap - 1;
+        ring.slots.reset(new Slot[cap]);
+        for (size_t i = 0; i < cap; ++i) {
+            ring.slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool EventRing::Push(const SpEvent *evts, size_t n, bool pinned, uint64_t sent)
+{
+    size_t pos;
+    Ring &ring = bands_[Band(evts[0]->Priority())];
+    if (!Admit(n)) {
+        return false;
+    }
+    if (!Reserve(ring, n, pos)) {
+        /// slots are still held by events being popped
+        count_.fetch_sub(n);
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        Slot &slot = ring.slots[(pos + i) & ring.mask];
+        slot.evt = evts[i];
+        slot.sent = sent;
+        slot.pinned.store(pinned, std::memory_order_relaxed);
+        slot.seq.store(pos + i + 1, std::memory_order_release);
+    }
+    return true;
+}
+
+bool EventRing::Pop(SpEvent &evt, uint64_t *sent)
+{
+    /// always look for the highest band first
+    for (size_t band = kBandNum; band > 0; --band) {
+        if (Pop(bands_[band - 1], evt, sent)) {
+            count_.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EventRing::Drop(OverflowPolicy policy, EvtPriority pri)
+{
+    if (policy != OverflowPolicy::kDropOldest && policy != OverflowPolicy::kDropLowest) {
+        return false;
+    }
+    SpEvent evt;
+    size_t band = Band(pri);
+    size_t lowest = policy == OverflowPolicy::kDropLowest ? 0 : band;
+    /// never drop events of higher bands than the new one
+    for (size_t i = lowest; i <= band; ++i) {
+        if (Pop(bands_[i], evt, nullptr, true)) {
+            count_.fetch_sub(1);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EventRing::Ready() const
+{
+    for (const auto &ring : bands_) {
+        if (Ready(ring)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+size_t EventRing::Band(EvtPriority pri) const
+{
+    size_t band = static_cast<size_t>(pri);
+    return band < kBandNum ? band : kBandNum - 1;
+}
+
+bool EventRing::Admit(size_t n)
+{
+    size_t count = count_.load(std::memory_order_relaxed);
+    do {
+        if (count + n > capacity_) {
+            return false;
+        }
+    } while (!count_.compare_exchange_weak(count, count + n));
+    return true;
+}
+
+/// Reserve n continuous positions, slots are freed by consumers out of
+/// order, so every slot of them is checked.
+bool EventRing::Reserve(Ring &ring, size_t n, size_t &pos)
+{
+    if (n > ring.mask + 1) {
+        return false;
+    }
+    size_t p = ring.tail.load(std::memory_order_relaxed);
+    for (;;) {
+        intptr_t diff = 0;
+        for (size_t i = 0; i < n && diff == 0; ++i) {
+            Slot &slot = ring.slots[(p + i) & ring.mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(p + i);
+        }
+        if (diff == 0) {
+            if (ring.tail.compare_exchange_weak(p, p + n, std::memory_order_relaxed)) {
+                pos = p;
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;   /// full
+        } else {
+            p = ring.tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool EventRing::Pop(Ring &ring, SpEvent &evt, uint64_t *sent, bool drop)
+{
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot &slot = ring.slots[head & ring.mask];
+        size_t seq = slot.seq.load(std::memory_order_acquire);
+        intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(head + 1);
+        if (diff == 0) {
+            /// stored before seq, it is stable until head moves
+            if (drop && slot.pinned.load(std::memory_order_relaxed)) {
+                return false;
+            }
+            if (ring.head.compare_exchange_weak(head, head + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;   /// empty
+        } else {
+            head = ring.head.load(std::memory_order_relaxed);
+        }
+    }
+    Slot &slot = ring.slots[head & ring.mask];
+    evt = std::move(slot.evt);
+    if (sent != nullptr) {
+        *sent = slot.sent;
+    }
+    slot.seq.store(head + ring.mask + 1, std::memory_order_release);
+    return true;
+}
+
+bool EventRing::Ready(const Ring &ring)
+{
+    size_t head = ring.head.load(std::memory_order_relaxed);
+    const Slot &slot = ring.slots[head & ring.mask];
+    return slot.seq.load() == head + 1;
+}
+
+RingEventQueue::RingEventQueue(const Dispatcher &dispatcher, size_t max)
+  : core_(std::make_shared<Core>(max))
+{
+    core_->dispatcher = dispatcher;
+    thread_ = std::thread(&RingEventQueue::Loop, core_);
+}
+
+RingEventQueue::~RingEventQueue()
+{
+    {
+        std::lock_guard<std::mutex> lock(core_->lock);
+        core_->stop = true;
+    }
+    core_->cond.notify_one();
+    if (thread_.get_id() == std::this_thread::get_id()) {
+        /// Core is released by dispatcher after the current event
+        thread_.detach();
+    } else {
+        thread_.join();
+    }
+}
+
+bool RingEventQueue::Send(const SpEvent &evt)
+{
+    return SendBatch(&evt, 1);
+}
+
+bool RingEventQueue::SendBatch(const SpEvent *evts, size_t n, uint64_t sent)
+{
+    if (n == 0) {
+        return true;
+    }
+    if (!core_->ring.Push(evts, n, false, sent)) {
+        return false;
+    }
+    Wakeup(*core_);
+    return true;
+}
+
+bool RingEventQueue::SendPinned(const SpEvent &evt)
+{
+    if (!core_->ring.Push(&evt, 1, true)) {
+        return false;
+    }
+    Wakeup(*core_);
+    return true;
+}
+
+bool RingEventQueue::Drop(OverflowPolicy policy, EvtPriority pri)
+{
+    return core_->ring.Drop(policy, pri);
+}
+
+void RingEventQueue::Wakeup(Core &core)
+{
+    /// pairs with the fence in Sleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (!core.sleeping.load(std::memory_order_relaxed)) {
+        return;     /// fast path, dispatcher is running
+    }
+    {
+        std::lock_guard<std::mutex> lock(core.lock);
+        core.sleeping = false;
+    }
+    core.cond.notify_one();
+}
+
+void RingEventQueue::Sleep(Core &core)
+{
+    core.sleeping = true;
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (core.ring.Ready()) {
+        core.sleeping = false;
+        return;
+    }
+    std::unique_lock<std::mutex> lock(core.lock);
+    core.cond.wait(lock, [&core] { return !core.sleeping || core.stop; });
+}
+
+void RingEventQueue::Loop(std::shared_ptr<Core> core)
+{
+    SpEvent evt;
+    uint64_t sent;
+    while (!core->stop.load(std::memory_order_relaxed)) {
+        if (!core->ring.Pop(evt, &sent)) {
+            Sleep(*core);
+            continue;
+        }
+        core->dispatcher(evt, sent);
+        evt.reset();
+    }
+}
+
+ExecutorEventQueue::ExecutorEventQueue(Executor &executor,
+    const Dispatcher &dispatcher, size_t max)
+  : mailbox_(std::make_shared<Mailbox>(executor, dispatcher, max))
+{
+}
+
+ExecutorEventQueue::~ExecutorEventQueue()
+{
+    /// pairs with increasing active in Run
+    mailbox_->closed = true;
+    if (Executor::Current() == mailbox_.get()) {
+        return;     /// mailbox is kept by the running task
+    }
+    /// a run on another thread may be dispatching, it checks closed
+    /// before the next event. A queued task is never waited for, so a
+    /// worker may destroy a queue whose task is behind its own, the
+    /// task keeps mailbox until it runs
+    while (mailbox_->active.load() > 0) {
+        std::this_thread::yield();
+    }
+}
+
+bool ExecutorEventQueue::Send(const SpEvent &evt)
+{
+    return SendBatch(&evt, 1);
+}
+
+bool ExecutorEventQueue::SendBatch(const SpEvent *evts, size_t n, uint64_t sent)
+{
+    if (n == 0) {
+        return true;
+    }
+    if (!mailbox_->ring.Push(evts, n, false, sent)) {
+        return false;
+    }
+    mailbox_->Schedule();
+    return true;
+}
+
+bool ExecutorEventQueue::SendPinned(const SpEvent &evt)
+{
+    if (!mailbox_->ring.Push(&evt, 1, true)) {
+        return false;
+    }
+    mailbox_->Schedule();
+    return true;
+}
+
+bool ExecutorEventQueue::Drop(OverflowPolicy policy, EvtPriority pri)
+{
+    return mailbox_->ring.Drop(policy, pri);
+}
+
+void ExecutorEventQueue::Mailbox::Schedule()
+{
+    /// pairs with the fence in Run
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (scheduled.load(std::memory_order_relaxed)) {
+        return;     /// fast path, task will see the event
+    }
+    if (!scheduled.exchange(true)) {
+        executor.Submit(shared_from_this());
+    }
+}
+
+void ExecutorEventQueue::Mailbox::Run()
+{
+    SpEvent evt;
+    uint64_t sent;
+    size_t num = 0;
+    active.fetch_add(1);
+    /// dispatch a limited number of events so that other SMs are not starved
+    while (num < kBudget && !closed.load() && ring.Pop(evt, &sent)) {
+        dispatcher(evt, sent);
+        evt.reset();
+        ++num;
+    }
+    if (closed.load()) {
+        /// stays scheduled, never submitted again
+    } else if (num == kBudget) {
+        executor.Submit(shared_from_this());
+    } else {
+        scheduled = false;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!closed.load() && ring.Ready() && !scheduled.exchange(true)) {
+            executor.Submit(shared_from_this());
+        }
+    }
+    active.fetch_sub(1);
+}
+
+}
+}
@@ -0,0 +1,284 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_EVENT_QUEUE_H
+#define _HFSM_CPP_EVENT_QUEUE_H
+
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <functional>
+#include <condition_variable>
+#include <EventHub.h>
+#include "Executor.h"
+
+namespace utils {
+namespace hfsm {
+
+/// What to do on sending to a full queue
+enum class OverflowPolicy {
+    kReject,        /// fail to send
+    kBlock,         /// wait for room up to a timeout
+    kDropOldest,    /// discard the oldest event of the same priority band
+    kDropLowest,    /// discard the oldest event of the lowest band not
+                    /// higher than the new one
+};
+
+/// Events queued as one by EventQueue::SendBatch, ID of it is reserved
+class BatchEvent : public Event
+{
+  public:
+    static constexpr uint32_t kID = UINT32_MAX;
+    BatchEvent(EvtPriority pri) : pri_(pri) {}
+    virtual ~BatchEvent() {}
+    virtual uint32_t ID() const override { return kID; }
+    virtual const char* Name() const override { return "batch"; }
+    virtual EvtPriority Priority() const override { return pri_; }
+    std::vector<SpEvent> events;
+    uint64_t sent = 0;      /// time of sending, 0 if not stamped
+
+  private:
+    EvtPriority pri_;
+};
+
+/// Abstract basic class for backends that queue events for SM
+/// and dispatch them on their own thread.
+class EventQueue
+{
+  public:
+    virtual ~EventQueue() {}
+    /**
+     * @brief Send an event.
+     *
+     * @param[in] evt: event object
+     * @return true if success.
+     */
+    virtual bool Send(const SpEvent &evt) = 0;
+    /**
+     * @brief Send events with the same priority at once.
+     *        Events are dispatched one by one or wrapped by a BatchEvent.
+     *
+     * @param[in] evts: array of event objects
+     * @param[in] n: number of events
+     * @param[in] sent: time of sending kept with events, 0 if not stamped
+     * @return true if success.
+     */
+    virtual bool SendBatch(const SpEvent *evts, size_t n, uint64_t sent = 0) = 0;
+    /**
+     * @brief Send an internal event of SM, such as a timer expiry.
+     *        Drop never discards it.
+     *
+     * @param[in] evt: event object
+     * @return true if success.
+     */
+    virtual bool SendPinned(const SpEvent &evt) { return Send(evt); }
+    /**
+     * @brief Discard a queued event to make room for a new one.
+     *        Only events sent by Send or SendBatch are discarded.
+     *
+     * @param[in] policy: kDropOldest or kDropLowest
+     * @param[in] pri: priority of the new event
+     * @return false if nothing can be discarded or it is not supported.
+     */
+    virtual bool Drop(OverflowPolicy policy, EvtPriority pri)
+    {
+        (void)policy;
+        (void)pri;
+        return false;
+    }
+};
+
+/// Backend of EventHub
+class HubEventQueue final : public EventQueue
+{
+  public:
+    HubEventQueue(EventHandler *handler, size_t max)
+      : hub_(handler, max) {}
+    virtual ~HubEventQueue() {}
+    virtual bool Send(const SpEvent &evt) override;
+    /// Events stamped are wrapped by a BatchEvent holding the stamp
+    virtual bool SendBatch(const SpEvent *evts, size_t n, uint64_t sent = 0) override;
+
+  private:
+    EventHub hub_;
+};
+
+/// Bounded lock-free multi-producer/multi-consumer rings, one ring for
+/// each priority band, band of higher EvtPriority value is popped first,
+/// events in the same band are in FIFO order. All bands share one
+/// capacity, producers may pop to drop events when it is full, but
+/// a band is not dropped from while its first event is pinned.
+/// Every band has room for the whole capacity so that one band can
+/// take all of it. A slot only holds a sequence, a reference and the
+/// time of sending of the event, 40 bytes, events themselves are not
+/// copied into bands, so the unused bands cost 120 bytes for each event
+/// of capacity.
+class EventRing
+{
+  public:
+    /**
+     * @brief Constructor
+     *
+     * @param[in] max: capacity of all bands
+     */
+    explicit EventRing(size_t max);
+    /**
+     * @brief Push events of the same priority at once.
+     *
+     * @param[in] evts: array of event objects
+     * @param[in] n: number of events
+     * @param[in] pinned: events are never dropped
+     * @param[in] sent: time of sending returned by Pop
+     * @return false if the queue is full.
+     */
+    bool Push(const SpEvent *evts, size_t n, bool pinned = false, uint64_t sent = 0);
+    /// Pop the first event of the highest non-empty band
+    bool Pop(SpEvent &evt, uint64_t *sent = nullptr);
+    /// Discard an event by policy for a new event of priority pri
+    bool Drop(OverflowPolicy policy, EvtPriority pri);
+    /// Whether any event can be popped
+    bool Ready() const;
+
+  private:
+    static constexpr size_t kBandNum = 4;
+    static constexpr size_t kCacheLine = 64;
+
+    struct Slot {
+        std::atomic<size_t> seq;    /// position the slot is ready for
+        std::atomic<bool> pinned{false};
+        uint64_t sent = 0;
+        SpEvent evt;
+    };
+    struct Ring {
+        alignas(kCacheLine) std::atomic<size_t> tail{0};
+        alignas(kCacheLine) std::atomic<size_t> head{0};
+        size_t mask = 0;
+        std::unique_ptr<Slot[]> slots;
+    };
+
+    static bool Reserve(Ring &ring, size_t n, size_t &pos);
+    static bool Pop(Ring &ring, SpEvent &evt, uint64_t *sent, bool drop = false);
+    static bool Ready(const Ring &ring);
+    size_t Band(EvtPriority pri) const;
+    bool Admit(size_t n);
+
+  private:
+    Ring bands_[kBandNum];
+    alignas(kCacheLine) std::atomic<size_t> count_{0};  /// admitted events
+    size_t capacity_;
+};
+
+/// Backend of EventRing with a dispatcher thread.
+/// Producers wake dispatcher up only if it is sleeping.
+class RingEventQueue final : public EventQueue
+{
+  public:
+    using Dispatcher = std::function<void(const SpEvent &evt, uint64_t sent)>;
+    /**
+     * @brief Constructor, start dispatcher thread.
+     *
+     * @param[in] dispatcher: invoked on dispatcher thread for every event
+     *                        with its time of sending
+     * @param[in] max: capacity of all bands
+     */
+    RingEventQueue(const Dispatcher &dispatcher, size_t max);
+    /// Unprocessed events will be discarded
+    virtual ~RingEventQueue();
+    virtual bool Send(const SpEvent &evt) override;
+    virtual bool SendBatch(const SpEvent *evts, size_t n, uint64_t sent = 0) override;
+    virtual bool SendPinned(const SpEvent &evt) override;
+    virtual bool Drop(OverflowPolicy policy, EvtPriority pri) override;
+
+  private:
+    /// Shared with dispatcher thread, it may outlive the queue object
+    /// if the queue is destroyed on dispatcher thread.
+    struct Core {
+        explicit Core(size_t max) : ring(max) {}
+        EventRing ring;
+        Dispatcher dispatcher;
+        alignas(64) std::atomic<bool> sleeping{false};
+        std::atomic<bool> stop{false};
+        std::mutex lock;
+        std::condition_variable cond;
+    };
+
+    static void Loop(std::shared_ptr<Core> core);
+    static void Sleep(Core &core);
+    static void Wakeup(Core &core);
+
+  private:
+    std::shared_ptr<Core> core_;
+    std::thread thread_;
+};
+
+/// Backend of EventRing served by a shared Executor, the ring is drained
+/// by a task scheduled on the first event. The task is queued or running
+/// at most once at a time, so events are dispatched in order by one
+/// worker at a time, and it yields the worker after a budget of events.
+class ExecutorEventQueue final : public EventQueue
+{
+  public:
+    using Dispatcher = std::function<void(const SpEvent &evt, uint64_t sent)>;
+    /**
+     * @brief Constructor
+     *
+     * @param[in] executor: executor running dispatcher, must outlive queue
+     * @param[in] dispatcher: invoked on a worker for every event with
+     *                        its time of sending
+     * @param[in] max: capacity of all bands
+     */
+    ExecutorEventQueue(Executor &executor, const Dispatcher &dispatcher,
+        size_t max);
+    /// Unprocessed events will be discarded, it waits for the running
+    /// dispatcher unless it is called by the dispatcher, but never for
+    /// the task queued, so it may be called on any worker.
+    virtual ~ExecutorEventQueue();
+    virtual bool Send(const SpEvent &evt) override;
+    virtual bool SendBatch(const SpEvent *evts, size_t n, uint64_t sent = 0) override;
+    virtual bool SendPinned(const SpEvent &evt) override;
+    virtual bool Drop(OverflowPolicy policy, EvtPriority pri) override;
+
+  private:
+    static constexpr size_t kBudget = 64;
+
+    struct Mailbox : public Executor::Task,
+                     public std::enable_shared_from_this<Mailbox> {
+        Mailbox(Executor &exec, const Dispatcher &disp, size_t max)
+          : executor(exec), dispatcher(disp), ring(max) {}
+        virtual void Run() override;
+        void Schedule();
+        Executor &executor;
+        Dispatcher dispatcher;
+        EventRing ring;
+        alignas(64) std::atomic<bool> scheduled{false};
+        std::atomic<int> active{0};     /// runs still accessing mailbox
+        std::atomic<bool> closed{false};
+    };
+
+  private:
+    std::shared_ptr<Mailbox> mailbox_;
+};
+
+}
+}
+
+#endif // _HFSM_CPP_EVENT_QUEUE_H
@@ -0,0 +1,129 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include "Executor.h"
+
+namespace utils {
+namespace hfsm {
+
+namespace {
+thread_local const Executor *tls_executor = nullptr;
+thread_local size_t tls_worker = 0;
+thread_local Executor::Task *tls_task = nullptr;
+}
+
+Executor::Executor(size_t workers)
+{
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        workers_.emplace_back(new Worker);
+    }
+    for (size_t i = 0; i < workers; ++i) {
+        workers_[i]->thread = std::thread(&Executor::Loop, this, i);
+    }
+}
+
+Executor::~Executor()
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    for (auto &w : workers_) {
+        w->thread.join();
+    }
+}
+
+void Executor::Submit(const SpTask &task)
+{
+    size_t index = tls_executor == this
+        ? tls_worker : next_.fetch_add(1) % workers_.size();
+    {
+        Worker &w = *workers_[index];
+        std::lock_guard<std::mutex> lock(w.lock);
+        w.tasks.push_back(task);
+    }
+    /// pairs with the check of pending_ in Idle
+    pending_.fetch_add(1);
+    if (idle_.load() > 0) {
+        std::lock_guard<std::mutex> lock(lock_);
+        cond_.notify_one();
+    }
+}
+
+Executor::Task* Executor::Current()
+{
+    return tls_task;
+}
+
+bool Executor::Pop(size_t index, SpTask &task)
+{
+    /// own tasks first, then steal from the others
+    for (size_t i = 0; i < workers_.size(); ++i) {
+        Worker &w = *workers_[(index + i) % workers_.size()];
+        std::lock_guard<std::mutex> lock(w.lock);
+        if (!w.tasks.empty()) {
+            if (i == 0) {
+                task = std::move(w.tasks.front());
+                w.tasks.pop_front();
+            } else {
+                task = std::move(w.tasks.back());
+                w.tasks.pop_back();
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+void Executor::Idle()
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    idle_.fetch_add(1);
+    cond_.wait(lock, [this] { return pending_.load() > 0 || stop_; });
+    idle_.fetch_sub(1);
+}
+
+void Executor::Loop(size_t index)
+{
+    SpTask task;
+    tls_executor = this;
+    tls_worker = index;
+    while (!stop_.load(std::memory_order_relaxed)) {
+        if (!Pop(index, task)) {
+            Idle();
+            continue;
+        }
+        pending_.fetch_sub(1);
+        tls_task = task.get();
+        task->Run();
+        tls_task = nullptr;
+        task.reset();
+    }
+    tls_executor = nullptr;
+}
+
+}
+}
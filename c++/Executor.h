@@ -0,0 +1,101 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_EXECUTOR_H
+#define _HFSM_CPP_EXECUTOR_H
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <condition_variable>
+#include "TimerWheel.h"
+
+namespace utils {
+namespace hfsm {
+
+/// Fixed pool of worker threads shared by many state machines.
+/// Tasks submitted on a worker are queued to that worker, others are
+/// queued to workers in turn, idle workers steal from the others.
+class Executor
+{
+  public:
+    class Task
+    {
+      public:
+        virtual ~Task() {}
+        virtual void Run() = 0;
+    };
+    using SpTask = std::shared_ptr<Task>;
+
+    /**
+     * @brief Constructor, start worker threads.
+     *
+     * @param[in] workers: number of worker threads, 0 for number of cores
+     */
+    explicit Executor(size_t workers = 0);
+    /// Join workers, SMs started with the executor must be stopped before.
+    ~Executor();
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+
+    /**
+     * @brief Submit a task, it must not be submitted again before it runs.
+     *
+     * @param[in] task: task to run
+     */
+    void Submit(const SpTask &task);
+    /**
+     * @brief Task running on caller thread.
+     *
+     * @return nullptr if caller is not a worker or it is idle.
+     */
+    static Task* Current();
+    /// Timing wheel driving timers of SMs on this executor
+    TimerWheel& Wheel() { return wheel_; }
+
+  private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<SpTask> tasks;   /// popped from front, stolen from back
+        std::thread thread;
+    };
+
+    void Loop(size_t index);
+    bool Pop(size_t index, SpTask &task);
+    void Idle();
+
+  private:
+    TimerWheel wheel_;
+    std::vector<std::unique_ptr<Worker>> workers_;
+    std::atomic<size_t> next_{0};
+    std::atomic<long> pending_{0};
+    std::atomic<int> idle_{0};
+    std::atomic<bool> stop_{false};
+    std::mutex lock_;
+    std::condition_variable cond_;
+};
+
+}
+}
+
+#endif // _HFSM_CPP_EXECUTOR_H
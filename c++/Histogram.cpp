@@ -0,0 +1,179 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <new>
+#include "Histogram.h"
+
+namespace utils {
+namespace hfsm {
+
+size_t LatencyHistogram::Index(uint64_t v)
+{
+    if (v < kSub) {
+        return v;
+    }
+    if (v >> kMaxBits) {
+        v = (1ull << kMaxBits) - 1;
+    }
+    int e = 63 - __builtin_clzll(v);
+    return (e - kSubBits + 1) * kSub + ((v >> (e - kSubBits)) & (kSub - 1));
+}
+
+/// Highest value counted by a bucket
+uint64_t LatencyHistogram::Upper(size_t index)
+{
+    if (index < kSub) {
+        return index;
+    }
+    int shift = static_cast<int>(index / kSub) - 1;
+    return ((kSub + index % kSub) << shift) + (1ull << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns)
+{
+    Add(buckets_[Index(ns)], 1);
+    Add(count_, 1);
+    Add(sum_, ns);
+    if (ns > max_.load(std::memory_order_relaxed)) {
+        max_.store(ns, std::memory_order_relaxed);
+    }
+}
+
+LatencyStats LatencyHistogram::Read() const
+{
+    LatencyStats stats;
+    std::array<uint64_t, kBuckets> buckets;
+    uint64_t total = 0;
+    /// percentiles come from buckets copied, other fields may be a few
+    /// records apart from them
+    for (size_t i = 0; i < kBuckets; ++i) {
+        buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        total += buckets[i];
+    }
+    if (total == 0) {
+        return stats;
+    }
+    stats.count = total;
+    stats.max_ns = max_.load(std::memory_order_relaxed);
+    uint64_t count = count_.load(std::memory_order_relaxed);
+    stats.mean_ns = count ? sum_.load(std::memory_order_relaxed) / count : 0;
+
+    const uint64_t per_mille[] = { 500, 990, 999 };
+    uint64_t *values[] = { &stats.p50_ns, &stats.p99_ns, &stats.p999_ns };
+    uint64_t seen = 0;
+    size_t q = 0;
+    for (size_t i = 0; i < kBuckets && q < 3; ++i) {
+        seen += buckets[i];
+        /// the first bucket reaching the rank, at least 1
+        while (q < 3 && seen * 1000 >= total * per_mille[q]) {
+            *values[q++] = std::min(Upper(i), stats.max_ns);
+        }
+    }
+    return stats;
+}
+
+LatencyTable::~LatencyTable()
+{
+    size_t num = num_.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < num; ++i) {
+        delete slots_[i].load(std::memory_order_relaxed);
+    }
+}
+
+void LatencyTable::Track(size_t events)
+{
+    if (num_.load(std::memory_order_relaxed) != 0) {
+        return;
+    }
+    events = events ? events : kEvents;
+    slots_.reset(new std::atomic<Slot*>[events]());
+    num_.store(events, std::memory_order_release);
+}
+
+uint64_t LatencyTable::Now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void LatencyTable::Record(Histograms &hists, uint64_t sent, uint64_t begin, uint64_t end)
+{
+    hists[static_cast<size_t>(LatencyKind::kHandle)].Record(end - begin);
+    if (sent != 0) {
+        hists[static_cast<size_t>(LatencyKind::kWait)].Record(begin - sent);
+        hists[static_cast<size_t>(LatencyKind::kTotal)].Record(end - sent);
+    }
+}
+
+void LatencyTable::Record(uint32_t id, uint64_t sent, uint64_t begin, uint64_t end)
+{
+    Record(all_, sent, begin, end);
+    /// only the recording thread claims slots, an ID is left without
+    /// histograms of its own if they cannot be allocated
+    size_t num = num_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num; ++i) {
+        std::atomic<Slot*> &slot = slots_[(id + i) % num];
+        Slot *s = slot.load(std::memory_order_relaxed);
+        if (s == nullptr) {
+            s = new (std::nothrow) Slot(id);
+            if (s == nullptr) {
+                return;
+            }
+            slot.store(s, std::memory_order_release);
+        }
+        if (s->id == id) {
+            Record(s->hists, sent, begin, end);
+            return;
+        }
+    }
+}
+
+const LatencyTable::Slot* LatencyTable::Find(uint32_t id) const
+{
+    size_t num = num_.load(std::memory_order_acquire);
+    for (size_t i = 0; i < num; ++i) {
+        const Slot *s = slots_[(id + i) % num].load(std::memory_order_acquire);
+        if (s == nullptr || s->id == id) {
+            return s;
+        }
+    }
+    return nullptr;
+}
+
+LatencyStats LatencyTable::Read(LatencyKind kind) const
+{
+    return all_[static_cast<size_t>(kind)].Read();
+}
+
+bool LatencyTable::Read(uint32_t id, LatencyKind kind, LatencyStats &stats) const
+{
+    const Slot *slot = Find(id);
+    if (slot == nullptr) {
+        return false;
+    }
+    stats = slot->hists[static_cast<size_t>(kind)].Read();
+    return true;
+}
+
+}
+}
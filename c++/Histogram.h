@@ -0,0 +1,118 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_HISTOGRAM_H
+#define _HFSM_CPP_HISTOGRAM_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+
+namespace utils {
+namespace hfsm {
+
+/// Intervals of handling an event, wait and total only for queued events
+enum class LatencyKind {
+    kWait,      /// from sending to dispatch start
+    kHandle,    /// from dispatch start to end
+    kTotal,     /// from sending to dispatch end
+};
+
+/// Percentiles of a latency histogram, all 0 if nothing recorded
+struct LatencyStats {
+    uint64_t count = 0;
+    uint64_t mean_ns = 0;
+    uint64_t max_ns = 0;
+    uint64_t p50_ns = 0;
+    uint64_t p99_ns = 0;
+    uint64_t p999_ns = 0;
+};
+
+/// Log-linear histogram in the way of HdrHistogram, values under kSub are
+/// exact and every power of 2 above is split into kSub buckets, so a
+/// bucket is within 1/kSub of its values. Written by one thread at a
+/// time, read by any.
+class LatencyHistogram
+{
+  public:
+    void Record(uint64_t ns);
+    LatencyStats Read() const;
+
+  private:
+    static constexpr int kSubBits = 3;
+    static constexpr uint64_t kSub = 1ull << kSubBits;
+    static constexpr int kMaxBits = 40;     /// larger values count as 2^40-1
+    static constexpr size_t kBuckets = (kMaxBits - kSubBits + 1) * kSub;
+    static size_t Index(uint64_t v);
+    static uint64_t Upper(size_t index);
+    static void Add(std::atomic<uint64_t> &counter, uint64_t n)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n,
+            std::memory_order_relaxed);
+    }
+    std::atomic<uint64_t> count_{0};
+    std::atomic<uint64_t> sum_{0};
+    std::atomic<uint64_t> max_{0};
+    std::array<std::atomic<uint64_t>, kBuckets> buckets_{};
+};
+
+/// Histograms of an SM, overall and for the first event IDs seen
+class LatencyTable
+{
+  public:
+    static constexpr size_t kEvents = 8;    /// default of IDs kept apart
+    LatencyTable() = default;
+    ~LatencyTable();
+    LatencyTable(const LatencyTable&) = delete;
+    LatencyTable& operator=(const LatencyTable&) = delete;
+    /// Slots of IDs kept apart, taken once before anything is recorded.
+    /// Histograms of an ID are allocated when it is first recorded,
+    /// a slot costs a pointer until then.
+    void Track(size_t events);
+    /// Called by one thread at a time, sent is 0 if event was not queued
+    void Record(uint32_t id, uint64_t sent, uint64_t begin, uint64_t end);
+    LatencyStats Read(LatencyKind kind) const;
+    /// false if id has no histogram of its own
+    bool Read(uint32_t id, LatencyKind kind, LatencyStats &stats) const;
+    /// Monotonic clock in nanoseconds
+    static uint64_t Now();
+
+  private:
+    static constexpr size_t kKinds = 3;
+    using Histograms = std::array<LatencyHistogram, kKinds>;
+    struct Slot {
+        explicit Slot(uint32_t i) : id(i) {}
+        uint32_t id;
+        Histograms hists;
+    };
+    static void Record(Histograms &hists, uint64_t sent, uint64_t begin, uint64_t end);
+    const Slot* Find(uint32_t id) const;
+    Histograms all_;
+    /// probed from id, allocated by the recording thread and published
+    /// with release, as is num_ by Track
+    std::unique_ptr<std::atomic<Slot*>[]> slots_;
+    std::atomic<size_t> num_{0};
+};
+
+}
+}
+
+#endif //_HFSM_CPP_HISTOGRAM_H
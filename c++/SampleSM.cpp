@@ -22,7 +22,6 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <cstdio>
-#include <string>
 
 #include "log.h"
 #include "StateMachine.h"
@@ -112,13 +111,6 @@ class SampleSM : public StateMachine
         LOGD("%s() evt = %s", __FUNCTION__, evt->Name());
         return false;
     }
-    bool s2_trans_to_s3_triggered(const SpEvent &evt) {
-        if (evt->ID() == 2) {
-            LOGD("%s() trigger evt = %s", __FUNCTION__, evt->Name());
-            return true;
-        }
-        return false;
-    }
     void s2_trans_to_s3_effect()
     {
         LOGD("%s()", __FUNCTION__);
@@ -197,13 +189,12 @@ class SampleSM : public StateMachine
         auto trans_1_2 = std::make_shared<TransitionImpl<SampleSM>>(s1, s2, trans_1_to_2_act);
 
         /// configure transition form state2 to state3.
-        /// trigger: event2
+        /// trigger: event2 (declarative, dispatched by event ID)
         /// guard: no guard
         TransitionImpl<SampleSM>::TransAction trans_2_to_3_act = {
-            .effect = &SampleSM::s2_trans_to_s3_effect,
-            .triggered = &SampleSM::s2_trans_to_s3_triggered
+            .effect = &SampleSM::s2_trans_to_s3_effect
         };
-        auto trans_2_3 = std::make_shared<TransitionImpl<SampleSM>>(s2, s3, trans_2_to_3_act);
+        auto trans_2_3 = std::make_shared<TransitionImpl<SampleSM>>(s2, s3, 2, trans_2_to_3_act);
 
         /// configure transition form state3 to exit.
         /// trigger: event3
@@ -228,17 +219,18 @@ class SampleSM : public StateMachine
 class SampleEvent : public Event
 {
   public:
+    /// name must be a literal or outlive the event
     SampleEvent(uint32_t id, const char *name, EvtPriority pri)
       : id_(id), name_(name), pri_(pri) {}
     virtual ~SampleEvent() {}
 
     virtual uint32_t ID() const{ return id_;}
-    virtual const char* Name() const { return name_.c_str(); }
+    virtual const char* Name() const { return name_; }
     virtual EvtPriority Priority() const { return pri_; }
 
   private:
     uint32_t id_;
-    std::string name_;
+    const char *name_;
     EvtPriority pri_;
 };
 
@@ -246,10 +238,10 @@ int main(int argc, char **argv)
 {
     SampleSM sm;
 
-    SpEvent evt0(new SampleEvent(0, "event0", EvtPriority::kEvtPriMid));
-    SpEvent evt1(new SampleEvent(1, "event1", EvtPriority::kEvtPriMid));
-    SpEvent evt2(new SampleEvent(2, "event2", EvtPriority::kEvtPriMid));
-    SpEvent evt3(new SampleEvent(3, "event3", EvtPriority::kEvtPriMid));
+    SpEvent evt0 = MakeEvent<SampleEvent>(0, "event0", EvtPriority::kEvtPriMid);
+    SpEvent evt1 = MakeEvent<SampleEvent>(1, "event1", EvtPriority::kEvtPriMid);
+    SpEvent evt2 = MakeEvent<SampleEvent>(2, "event2", EvtPriority::kEvtPriMid);
+    SpEvent evt3 = MakeEvent<SampleEvent>(3, "event3", EvtPriority::kEvtPriMid);
 
     /// enter initial state(1)
     sm.Setup();
@@ -262,14 +254,13 @@ int main(int argc, char **argv)
     sm.SendEvent(evt1);
 
     /// set guard to true and retrigger to transit to state(2)
-    evt1.reset(new SampleEvent(1, "event1", EvtPriority::kEvtPriMid));
+    evt1 = MakeEvent<SampleEvent>(1, "event1", EvtPriority::kEvtPriMid);
     sm.SendEvent(evt1);
 
-    /// triggered transiton from state(2) to state(3)
-    sm.SendEvent(evt2);
-
-    /// exit state(3)
-    sm.SendEvent(evt3);
+    /// triggered transiton from state(2) to state(3),
+    /// then exit state(3), both are sent in one go
+    SpEvent evts[] = { evt2, evt3 };
+    sm.SendEvents(std::begin(evts), std::end(evts));
 
     while(1)
     usleep(1000);
@@ -278,7 +269,7 @@ int main(int argc, char **argv)
     return 0;
 }
 
-void hfsm_trace(const char *format, ...) {
+void hfsm_log(int level, const char *format, ...) {
     int n;
     char buf[4096];
     
@@ -0,0 +1,139 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <cstring>
+#include "Snapshot.h"
+
+namespace utils {
+namespace hfsm {
+
+namespace {
+
+const char kMagic[4] = { 'H', 'F', 'S', 'N' };
+
+size_t EncodeVarint(uint64_t v, char *bytes)
+{
+    size_t n = 0;
+    do {
+        bytes[n] = static_cast<char>(v & 0x7F);
+        v >>= 7;
+        bytes[n++] |= v ? 0x80 : 0;
+    } while (v);
+    return n;
+}
+
+}
+
+bool SnapshotFrame::Write(std::ostream &out, const std::string &body)
+{
+    char header[sizeof(kMagic) + 2 + 10];
+    memcpy(header, kMagic, sizeof(kMagic));
+    header[4] = static_cast<char>(kVersion);
+    header[5] = static_cast<char>(kEngine);
+    size_t n = 6 + EncodeVarint(body.size(), header + 6);
+    out.write(header, n);
+    out.write(body.data(), body.size());
+    return static_cast<bool>(out);
+}
+
+bool SnapshotFrame::Read(std::istream &in, std::string &body)
+{
+    char header[6];
+    if (!in.read(header, sizeof(header)) || memcmp(header, kMagic, sizeof(kMagic))
+        || header[4] != kVersion || header[5] != kEngine) {
+        return false;
+    }
+    uint64_t size = 0;
+    int shift = 0;
+    for (; shift < 64; shift += 7) {
+        int c = in.get();
+        if (c == std::istream::traits_type::eof()) {
+            return false;
+        }
+        size |= static_cast<uint64_t>(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            break;
+        }
+    }
+    if (shift >= 64 || size > kMaxBody) {
+        return false;
+    }
+    body.resize(size);
+    return size == 0 || static_cast<bool>(in.read(&body[0], size));
+}
+
+void SnapshotWriter::PutVarint(uint64_t v)
+{
+    char bytes[10];
+    body_.append(bytes, EncodeVarint(v, bytes));
+}
+
+SnapshotWriter::int_type SnapshotWriter::overflow(int_type c)
+{
+    if (!traits_type::eq_int_type(c, traits_type::eof())) {
+        body_.push_back(traits_type::to_char_type(c));
+    }
+    return traits_type::not_eof(c);
+}
+
+std::streamsize SnapshotWriter::xsputn(const char *s, std::streamsize n)
+{
+    body_.append(s, n);
+    return n;
+}
+
+SnapshotReader::SnapshotReader(const char *data, size_t size)
+  : std::istream(this)
+{
+    char *begin = const_cast<char*>(data);
+    setg(begin, begin, begin + size);
+}
+
+uint64_t SnapshotReader::GetVarint()
+{
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int_type c = sbumpc();
+        if (traits_type::eq_int_type(c, traits_type::eof())) {
+            break;
+        }
+        v |= static_cast<uint64_t>(c & 0x7F) << shift;
+        if (!(c & 0x80)) {
+            return v;
+        }
+    }
+    setstate(std::ios::failbit);
+    return 0;
+}
+
+const char* SnapshotReader::Take(size_t n)
+{
+    const char *p = gptr();
+    if (static_cast<size_t>(egptr() - p) < n) {
+        setstate(std::ios::failbit);
+        return nullptr;
+    }
+    setg(eback(), gptr() + n, egptr());
+    return p;
+}
+
+}
+}
@@ -0,0 +1,78 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_SNAPSHOT_H
+#define _HFSM_CPP_SNAPSHOT_H
+
+#include <cstdint>
+#include <string>
+#include <istream>
+#include <ostream>
+
+namespace utils {
+namespace hfsm {
+
+/// Frame of a snapshot, the same header as frames of the C API
+/// (see HFSM_SNAPSHOT_MAGIC of hfsm.h) with engine 1:
+///     magic "HFSN", u8 version, u8 engine, varint size, body.
+/// Varints are LEB128, 7 bits a byte from the lowest.
+struct SnapshotFrame {
+    static constexpr uint8_t kVersion = 1;
+    static constexpr uint8_t kEngine = 1;
+    static constexpr uint64_t kMaxBody = 1ull << 26;   /// larger is malformed
+    static bool Write(std::ostream &out, const std::string &body);
+    /// Body is replaced, its capacity is reused
+    static bool Read(std::istream &in, std::string &body);
+};
+
+/// Body of a snapshot being built, user hooks write into it as an ostream
+class SnapshotWriter : private std::streambuf, public std::ostream
+{
+  public:
+    using int_type = std::streambuf::int_type;
+    using traits_type = std::streambuf::traits_type;
+    SnapshotWriter() : std::ostream(this) {}
+    void PutVarint(uint64_t v);
+    std::string& Body() { return body_; }
+
+  protected:
+    virtual int_type overflow(int_type c) override;
+    virtual std::streamsize xsputn(const char *s, std::streamsize n) override;
+
+  private:
+    std::string body_;
+};
+
+/// Bytes of a body being parsed without copying, reads beyond them fail
+class SnapshotReader : private std::streambuf, public std::istream
+{
+  public:
+    using int_type = std::streambuf::int_type;
+    using traits_type = std::streambuf::traits_type;
+    SnapshotReader(const char *data, size_t size);
+    uint64_t GetVarint();
+    /// Skip n bytes, nullptr if fewer are left
+    const char* Take(size_t n);
+};
+
+}
+}
+
+#endif // _HFSM_CPP_SNAPSHOT_H
@@ -21,6 +21,9 @@
 #ifndef _CPP_STATE_H
 #define _CPP_STATE_H
 
+#include <vector>
+#include <algorithm>
+
 namespace utils {
 namespace hfsm {
 
@@ -29,6 +32,13 @@ class Transition;
 class StateMachine;
 using SpState = std::shared_ptr<State>;
 
+/// History of a composite state, recorded by SM when it exits
+enum class History {
+    kNone,
+    kShallow,   /// restore the last active child
+    kDeep,      /// restore the last active descendant
+};
+
 /// Abstract basic class for state
 class State
 {
@@ -38,11 +48,65 @@ class State
   public:
     /// Constructor
     State() {}
-    State(const SpState &parent) : parent_(parent) {}
+    State(const SpState &parent) : parent_(parent) { UpdateDepth(); }
     /// Deconstructor
     virtual ~State() {}
-    void SetParent(const SpState &parent) { parent_ = parent; }
+    void SetParent(const SpState &parent) { parent_ = parent; UpdateDepth(); }
     const SpState& Parent() const { return parent_; }
+    /// Number of parents of this state, 0 for a root state.
+    size_t Depth() const { return depth_; }
+    /**
+     * @brief Defer events with the ID while this state or any of its
+     *        sub-states is current. Deferred events are parked by SM and
+     *        invoked again once, in order, after the next transition.
+     *        Do not call this on SM running.
+     *
+     * @param[in] id: ID of event to defer
+     */
+    void Defer(uint32_t id)
+    {
+        if (!Defers(id)) {
+            defers_.emplace_back(id);
+        }
+    }
+    /// Whether events with the ID are deferred by this state itself
+    bool Defers(uint32_t id) const
+    {
+        return std::find(defers_.begin(), defers_.end(), id) != defers_.end();
+    }
+    /**
+     * @brief Add an orthogonal region to this composite state, the region
+     *        is the sub-tree of the child leading to initial. Entering this
+     *        state enters initial of every region, an event is offered to
+     *        every region and then to this state only if no region took it.
+     *        A transition to a state out of its region exits all regions,
+     *        it is taken after every region took the event, only the first
+     *        one in order of regions is taken, parallel or not.
+     *        Regions can not be nested. Do not call this on SM running.
+     *        Initial is held weakly as it refers back to this state as
+     *        its parent. An SM holds it once a transition of this state
+     *        or of its descendants is added, caller keeps it until then.
+     *
+     * @param[in] initial: descendant of this state entered with it
+     */
+    void AddRegion(const SpState &initial) { regions_.emplace_back(initial); }
+    /**
+     * @brief Dispatch events to regions in parallel on workers of the
+     *        executor of SM, joined before the next event. Actions of
+     *        regions must not share data. Ignored if SM has no executor.
+     *        Do not call this on SM running.
+     */
+    void SetParallel(bool parallel) { parallel_ = parallel; }
+    /**
+     * @brief Restore the last active sub-state when a transition targets
+     *        this state from out of it, states down to the restored one
+     *        are entered in order. Shallow history restores the child,
+     *        which restores its own history if it has one. Deep history
+     *        restores the state that was current. Each SM records its
+     *        own history. Do not call this on SM running.
+     */
+    void SetHistory(History history) { history_ = history; }
+    History GetHistory() const { return history_; }
 
   protected:
     /**
@@ -74,12 +138,37 @@ class State
      *         it will not be continue to invoked by the parent state.
      */
     virtual bool Invoke(const SpEvent &evt, StateMachine *sm) = 0;
+    /**
+     * @brief Invoked once while SM is starting, before any action.
+     *        The type of SM could be checked here, then actions
+     *        needn't check it again.
+     *
+     * @param[in] sm  Base class of state machine.
+     * @return false if the state can't be run by this SM.
+     */
+    virtual bool Bind(StateMachine *sm) { return true; }
+
+  private:
+    /// Parents may get their own parents later, SM updates depth again on starting.
+    void UpdateDepth()
+    {
+        depth_ = 0;
+        for (State *s = parent_.get(); s; s = s->parent_.get()) {
+            ++depth_;
+        }
+    }
 
   private:
     SpState parent_;
+    size_t depth_ = 0;
+    std::vector<uint32_t> defers_;
+    std::vector<std::weak_ptr<State>> regions_;    /// initial states of regions
+    bool parallel_ = false;
+    History history_ = History::kNone;
 };
 
-/// State template that can bind actions of state to derived class of SM
+/// State template that can bind actions of state to derived class of SM.
+/// The type of SM is checked by Bind, so actions are called directly.
 template <typename SM>
 class StateImpl final : public State
 {
@@ -106,6 +195,7 @@ class StateImpl final : public State
     virtual void Entry(StateMachine *sm) override;
     virtual void Exit(StateMachine *sm) override;
     virtual bool Invoke(const SpEvent &evt, StateMachine *sm) override;
+    virtual bool Bind(StateMachine *sm) override;
 
   private:
     StateAction action_ = {};
@@ -137,7 +227,7 @@ template <typename SM>
 void StateImpl<SM>::Entry(StateMachine *sm)
 {
     if (action_.enter) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         (obj->*action_.enter)();
     }
 }
@@ -146,7 +236,7 @@ template <typename SM>
 void StateImpl<SM>::Exit(StateMachine *sm)
 {
     if (action_.exit) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         (obj->*action_.exit)();
     }
 }
@@ -155,12 +245,18 @@ template <typename SM>
 bool StateImpl<SM>::Invoke(const SpEvent &evt, StateMachine *sm)
 {
     if (action_.invoke) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         return (obj->*action_.invoke)(evt);
     }
     return false;
 }
 
+template <typename SM>
+bool StateImpl<SM>::Bind(StateMachine *sm)
+{
+    return dynamic_cast<SM*>(sm) != nullptr;
+}
+
 }
 }
 
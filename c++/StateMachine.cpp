@@ -20,33 +20,200 @@
  */
 
 #include <algorithm> // for find_if
+#include <chrono>
+#include <future>
 
 #include "StateMachine.h"
+#include "Snapshot.h"
 #include "log.h"
+#include "probe.h"
 
 namespace utils {
 namespace hfsm {
 
+/// Expiry of a timer queued by wheel, ID of it is reserved
+class StateMachine::TimerEvent final : public Event
+{
+  public:
+    static constexpr uint32_t kID = UINT32_MAX - 1;
+    TimerEvent(Timer *t, uint64_t g, EvtPriority pri)
+      : timer(t), gen(g), pri_(pri) {}
+    virtual uint32_t ID() const override { return kID; }
+    virtual const char* Name() const override { return "timer"; }
+    virtual EvtPriority Priority() const override { return pri_; }
+    Timer *timer;
+    uint64_t gen;
+
+  private:
+    EvtPriority pri_;
+};
+
+/// Request of a snapshot queued behind events sent, ID of it is reserved.
+/// Body is empty if capture failed.
+class StateMachine::SnapshotEvent final : public Event
+{
+  public:
+    static constexpr uint32_t kID = UINT32_MAX - 3;
+    virtual uint32_t ID() const override { return kID; }
+    virtual const char* Name() const override { return "snapshot"; }
+    virtual EvtPriority Priority() const override { return EvtPriority::kEvtPriLow; }
+    void Take(const StateMachine &sm)
+    {
+        std::string body;
+        done.set_value(sm.Capture(body) ? std::move(body) : std::string());
+    }
+    std::promise<std::string> done;
+};
+
+namespace {
+
+/// State whose action is running on this thread, regions of an SM may
+/// run on several threads
+struct Acting {
+    const StateMachine *sm;
+    State *state;
+};
+thread_local Acting acting = { nullptr, nullptr };
+
+class ActingScope
+{
+  public:
+    ActingScope(const StateMachine *sm, State *state) : prev_(acting)
+    {
+        acting = { sm, state };
+    }
+    ~ActingScope() { acting = prev_; }
+
+  private:
+    Acting prev_;
+};
+
+/// Whether state is root or one of its descendants
+bool Within(const State *state, const State *root)
+{
+    for (; state; state = state->Parent().get()) {
+        if (state == root) {
+            return true;
+        }
+    }
+    return false;
+}
+
+}
+
 /// Constructor
 StateMachine::StateMachine()
 {
+#ifdef HFSM_STATS
+    latency_.reset(new LatencyTable);
+#endif
 }
 
 /// Deconstructor
 StateMachine::~StateMachine()
 {
+    /// timers must not fire into queue being destroyed, and dispatcher
+    /// must stop before timers are released
+    CloseTimers();
+    evt_queue_.reset();
+    /// helpers of parallel regions may still be leaving
+    for (const auto &helper : helpers_) {
+        while (helper->busy.load(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+    }
 }
 
-void StateMachine::Start(EventHub* evthub)
+bool StateMachine::Prepare()
 {
     if (running_) {
         LOGE("%s failed: SM is running!", __func__);
-        return;
+        return false;
+    }
+    if (!Bind()) {
+        LOGE("%s failed: type of SM mismatched or initial of region released!", __func__);
+        return false;
+    }
+    if (!BuildRegions()) {
+        LOGE("%s failed: region is not in its composite!", __func__);
+        return false;
+    }
+    BuildTransIndex();
+#ifdef HFSM_STATS
+    ResetStats();
+#endif
+    orth_ = nullptr;
+    executor_ = nullptr;
+    helpers_.clear();
+    return true;
+}
+
+bool StateMachine::Start(EventHub* evthub)
+{
+    if (evthub == nullptr) {
+        return Start(StartOption());
+    }
+    if (!Prepare()) {
+        return false;
+    }
+    evthub->Subscribe(this);
+    wheel_ = nullptr;
+    running_ = true;
+    return true;
+}
+
+bool StateMachine::Start(const StartOption &option)
+{
+    if (!Supported(option) || !Prepare()) {
+        return false;
+    }
+    Open(option);
+    return true;
+}
+
+bool StateMachine::Supported(const StartOption &option) const
+{
+    bool hub = option.executor == nullptr && option.queue == QueueKind::kEventHub;
+    if (hub && (option.overflow == OverflowPolicy::kDropOldest
+        || option.overflow == OverflowPolicy::kDropLowest)) {
+        LOGE("%s failed: overflow policy is not supported by EventHub!", __func__);
+        return false;
+    }
+    return true;
+}
+
+void StateMachine::Open(const StartOption &option)
+{
+    capacity_ = option.capacity ? option.capacity : MAX_EVENT_NUM;
+    wheel_ = option.executor ? &option.executor->Wheel() : &TimerWheel::Default();
+    overflow_ = option.overflow;
+    timeout_ms_ = option.timeout_ms;
+    executor_ = option.executor;
+#ifdef HFSM_STATS
+    latency_->Track(option.latency_events);
+#endif
+    if (executor_ != nullptr) {
+        /// helpers for the widest composite running regions in parallel
+        size_t num = 0;
+        for (const auto &it : regions_) {
+            if (it.second.parallel) {
+                num = std::max(num, it.second.list.size() - 1);
+            }
+        }
+        for (size_t i = 0; i < num; ++i) {
+            helpers_.emplace_back(std::make_shared<Helper>(this));
+        }
     }
-    if (evthub) {
-        evthub->Subscribe(this);
+    if (option.executor != nullptr) {
+        evt_queue_.reset(new ExecutorEventQueue(*option.executor,
+            [this](const SpEvent &evt, uint64_t sent) { Receive(evt, sent); },
+            capacity_));
+    } else if (option.queue == QueueKind::kRing) {
+        evt_queue_.reset(new RingEventQueue(
+            [this](const SpEvent &evt, uint64_t sent) { Receive(evt, sent); },
+            capacity_));
     } else {
-        evt_hub_.reset(new EventHub(this, MAX_EVENT_NUM));
+        evt_queue_.reset(new HubEventQueue(this, capacity_));
     }
     running_ = true;
 }
@@ -63,54 +230,1009 @@ bool StateMachine::AddTransition(const SpTrans &trans)
         });
     if (it == trans_list_.end()) {
         trans_list_.emplace_back(trans);
+        HoldRegions(trans->src_.get());
+        HoldRegions(trans->tar_.get());
         return true;
     }
     LOGE("%s duplicated transition", __func__);
     return false;
 }
 
+void StateMachine::HoldRegions(const State *state)
+{
+    for (; state; state = state->parent_.get()) {
+        for (const auto &weak : state->regions_) {
+            SpState initial = weak.lock();
+            if (initial && std::find(initials_.begin(), initials_.end(),
+                    initial) == initials_.end()) {
+                initials_.emplace_back(initial);
+            }
+        }
+    }
+}
+
 void StateMachine::OnEvent(const SpEvent evt)
+{
+    Receive(evt, 0);
+}
+
+void StateMachine::Receive(const SpEvent &evt, uint64_t sent)
 {
     if (evt == nullptr) return;
-    if (TransActivated(evt)) {
-        /// Transition occerred
-        if (!cur_state_) {
-            trans_list_.clear();
-            running_ = false;
+    if (evt->ID() == BatchEvent::kID) {
+        const auto &batch = static_cast<const BatchEvent&>(*evt);
+        for (const auto &e : batch.events) {
+            Handle(e, batch.sent);
         }
+    } else if (evt->ID() == TimerEvent::kID) {
+        Expire(static_cast<const TimerEvent&>(*evt));
+    } else if (evt->ID() == SnapshotEvent::kID) {
+        static_cast<SnapshotEvent&>(*evt).Take(*this);
+    } else {
+        Handle(evt, sent);
+    }
+    /// pairs with increasing waiters_ before retrying in WaitForRoom
+    if (waiters_.load() > 0) {
+        std::lock_guard<std::mutex> lock(space_lock_);
+        space_cond_.notify_all();
+    }
+}
+
+void StateMachine::Handle(const SpEvent &evt, uint64_t sent)
+{
+    HFSM_PROBE3(dispatch_begin, this, evt->ID(), cur_state_);
+#ifdef HFSM_STATS
+    uint64_t begin = LatencyTable::Now();
+    Dispatch(evt);
+    latency_->Record(evt->ID(), sent, begin, LatencyTable::Now());
+#else
+    (void)sent;
+    Dispatch(evt);
+#endif
+    HFSM_PROBE3(dispatch_end, this, evt->ID(), cur_state_);
+}
+
+void StateMachine::Dispatch(const SpEvent &evt)
+{
+    if (Deferred(evt)) {
+        deferred_.emplace_back(evt);
+        return;
+    }
+    if (orth_ != nullptr && InvokeRegions(evt)) {
+        /// Taken by regions
+    } else if (Transition *trans = Enabled(cur_state_, evt)) {
+        /// Transition occerred
+        Transit(trans);
     } else {
         /// Invoke event on current state and parents.
-        auto cur = cur_state_;
         /// continue if event invoked not done.
-        while (cur && !cur->Invoke(evt, this)) {
-            cur = cur->Parent();
+        for (State *cur = cur_state_; cur; cur = cur->parent_.get()) {
+            if (InvokeState(cur, evt)) {
+                break;
+            }
+        }
+    }
+    if (transited_) {
+        Recall();
+    }
+}
+
+void StateMachine::Transit(Transition *trans)
+{
+    State *from = trans->src_.get();
+    bool entered = !Within(from ? from : cur_state_, trans->tar_.get());
+    if (orth_ != nullptr && trans->src_ != trans->tar_) {
+        /// leave regions from the composite
+        ExitRegions();
+        from = cur_state_;
+    }
+    cur_state_ = trans->Transit(this, from);
+    if (!cur_state_) {
+        /// final state, trans is released
+        trans_index_.clear();
+        trans_list_.clear();
+        regions_.clear();
+        states_.clear();
+        deferred_.clear();
+        running_ = false;
+        return;
+    }
+    if (entered) {
+        cur_state_ = Restore(cur_state_);
+    }
+    EnterRegions(cur_state_);
+    transited_ = true;
+}
+
+bool StateMachine::InvokeState(State *state, const SpEvent &evt)
+{
+    ActingScope scope(this, state);
+#ifdef HFSM_STATS
+    StateCounters &stats = state_stats_.at(state);
+    CallbackTimer timer(stats.callback_ns);
+    bool handled = state->Invoke(evt, this);
+    stats.invokes.Add(1);
+    stats.handled.Add(handled);
+    return handled;
+#else
+    return state->Invoke(evt, this);
+#endif
+}
+
+void StateMachine::EnterRegions(State *state)
+{
+    if (regions_.empty()) {
+        return;
+    }
+    for (State *c = state; c; c = c->parent_.get()) {
+        auto it = regions_.find(c);
+        if (it == regions_.end()) {
+            continue;
+        }
+        /// composite holding regions is current, state may be in one of them
+        cur_state_ = c;
+        orth_ = &it->second;
+        for (Region &r : orth_->list) {
+            if (Within(state, r.root)) {
+                r.leaf = state;
+            } else {
+                Transition::Enter(c, r.initial, this);
+                r.leaf = r.initial;
+            }
+        }
+        return;
+    }
+}
+
+void StateMachine::ExitRegions()
+{
+    for (Region &r : orth_->list) {
+        State *child = nullptr;
+        for (State *s = r.leaf; s != orth_->composite; child = s, s = s->parent_.get()) {
+            ExitState(s, child, r.leaf);
+        }
+        r.leaf = nullptr;
+    }
+    orth_ = nullptr;
+}
+
+void StateMachine::StepRegion(Region &region, const SpEvent &evt)
+{
+    region.handled = false;
+    region.transited = false;
+    region.escape = nullptr;
+    if (Transition *trans = Enabled(region.leaf, evt)) {
+        region.handled = true;
+        if (Within(trans->tar_.get(), region.root)) {
+            bool entered = !Within(region.leaf, trans->tar_.get());
+            region.leaf = trans->Transit(this, region.leaf);
+            if (entered) {
+                region.leaf = Restore(region.leaf);
+            }
+            region.transited = true;
+        } else {
+            region.escape = trans;
+        }
+        return;
+    }
+    for (State *s = region.leaf; s != orth_->composite; s = s->parent_.get()) {
+        if (InvokeState(s, evt)) {
+            region.handled = true;
+            return;
+        }
+    }
+}
+
+/// All regions take the event first, then the escape of the first region
+/// escaping is taken, the same with regions run in parallel
+bool StateMachine::InvokeRegions(const SpEvent &evt)
+{
+    bool handled = false;
+    Transition *escape = nullptr;
+    bool parallel = orth_->parallel && !helpers_.empty() && orth_->list.size() > 1;
+    if (parallel) {
+        RunParallel(evt);
+    }
+    for (Region &r : orth_->list) {
+        if (!parallel) {
+            StepRegion(r, evt);
+        }
+        handled = handled || r.handled;
+        transited_ = transited_ || r.transited;
+        if (escape == nullptr) {
+            escape = r.escape;
+        }
+    }
+    if (escape != nullptr) {
+        Transit(escape);
+        return true;
+    }
+    return handled;
+}
+
+void StateMachine::RunParallel(const SpEvent &evt)
+{
+    size_t num = orth_->list.size();
+    job_evt_ = &evt;
+    job_left_.store(static_cast<int>(num), std::memory_order_relaxed);
+    job_claim_.store(static_cast<uint32_t>(num), std::memory_order_release);
+    for (size_t i = 0; i + 1 < num && i < helpers_.size(); ++i) {
+        if (!helpers_[i]->busy.exchange(true, std::memory_order_acq_rel)) {
+            executor_->Submit(helpers_[i]);
+        }
+    }
+    /// dispatcher takes part, so regions never wait for a worker blocked
+    /// by the dispatcher itself
+    WorkRegions();
+    while (job_left_.load(std::memory_order_acquire) > 0) {
+        std::this_thread::yield();
+    }
+}
+
+void StateMachine::WorkRegions()
+{
+    uint32_t claim = job_claim_.load(std::memory_order_acquire);
+    for (;;) {
+        uint32_t next = claim >> 16;
+        if (next >= (claim & 0xFFFF)) {
+            return;
+        }
+        if (!job_claim_.compare_exchange_weak(claim, claim + (1u << 16),
+                std::memory_order_acq_rel, std::memory_order_acquire)) {
+            continue;
+        }
+        StepRegion(orth_->list[next], *job_evt_);
+        job_left_.fetch_sub(1, std::memory_order_release);
+        claim = job_claim_.load(std::memory_order_acquire);
+    }
+}
+
+void StateMachine::Helper::Run()
+{
+    sm->WorkRegions();
+    busy.store(false, std::memory_order_release);
+}
+
+bool StateMachine::Deferred(const SpEvent &evt) const
+{
+    if (!has_defers_) {
+        return false;
+    }
+    if (orth_ != nullptr) {
+        for (const Region &r : orth_->list) {
+            for (State *s = r.leaf; s != orth_->composite; s = s->parent_.get()) {
+                if (s->Defers(evt->ID())) {
+                    return true;
+                }
+            }
+        }
+    }
+    for (State *s = cur_state_; s; s = s->parent_.get()) {
+        if (s->Defers(evt->ID())) {
+            return true;
         }
     }
+    return false;
+}
+
+void StateMachine::Recall()
+{
+    /// transitions made by recalled events are handled by the outer loop
+    if (recalling_) {
+        return;
+    }
+    recalling_ = true;
+    while (transited_ && !deferred_.empty()) {
+        transited_ = false;
+        /// every parked event is recalled once, and parked again
+        /// if the new state still defers it
+        std::deque<SpEvent> recall;
+        recall.swap(deferred_);
+        for (const auto &e : recall) {
+            Dispatch(e);
+        }
+    }
+    transited_ = false;
+    recalling_ = false;
+}
+
+void StateMachine::EnterState(State *state)
+{
+    HFSM_PROBE2(entry, this, state);
+    ActingScope scope(this, state);
+#ifdef HFSM_STATS
+    StateCounters &stats = state_stats_.at(state);
+    CallbackTimer timer(stats.callback_ns);
+    stats.entries.Add(1);
+#endif
+    state->Entry(this);
+}
+
+void StateMachine::ExitState(State *state, State *child, State *leaf)
+{
+    HFSM_PROBE2(exit, this, state);
+    {
+        ActingScope scope(this, state);
+#ifdef HFSM_STATS
+        StateCounters &stats = state_stats_.at(state);
+        CallbackTimer timer(stats.callback_ns);
+        stats.exits.Add(1);
+#endif
+        state->Exit(this);
+    }
+    CancelTimers(state);
+    if (state->history_ != History::kNone) {
+        /// child is nullptr if state itself was current
+        histories_[state] = state->history_ == History::kShallow || child == nullptr
+            ? child : leaf;
+    }
+}
+
+State* StateMachine::Restore(State *target)
+{
+    /// bounded by depth, a child restored by shallow history may
+    /// restore its own
+    while (target->history_ != History::kNone) {
+        State *last = histories_[target];
+        if (last == nullptr) {
+            break;
+        }
+        Transition::Enter(target, last, this);
+        if (target->history_ == History::kDeep) {
+            return last;
+        }
+        target = last;
+    }
+    return target;
+}
+
+bool StateMachine::StartTimer(const SpEvent &evt, uint32_t ms)
+{
+    State *owner = acting.sm == this ? acting.state : nullptr;
+    if (evt == nullptr || owner == nullptr
+        || wheel_ == nullptr || evt_queue_ == nullptr) {
+        return false;
+    }
+    auto owned = state_timers_.find(owner);
+    if (owned == state_timers_.end()) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(wheel_->Mutex());
+    Timer *timer = nullptr;
+    if (!timer_free_.empty()) {
+        timer = timer_free_.back();
+        timer_free_.pop_back();
+    } else {
+        timers_.emplace_back(new Timer);
+        timer = timers_.back().get();
+        timer->sm = this;
+    }
+    timer->owner = owner;
+    timer->evt = evt;
+    if (timer_closed_ || !wheel_->Add(*timer, ms)) {
+        timer->evt.reset();
+        timer_free_.emplace_back(timer);
+        return false;
+    }
+    owned->second.emplace_back(timer);
+    return true;
+}
+
+bool StateMachine::Timer::Fire()
+{
+    if (sm->timer_closed_) {
+        return true;
+    }
+    fired = true;
+    if (!sm->evt_queue_->SendPinned(MakeEvent<TimerEvent>(this, gen, evt->Priority()))) {
+        fired = false;
+        return false;
+    }
+    return true;
 }
 
-bool StateMachine::TransActivated(const SpEvent &evt)
+void StateMachine::Expire(const TimerEvent &expiry)
 {
-    /// Check if transition is happened on currrent state.
+    Timer *timer = expiry.timer;
+    {
+        std::lock_guard<std::mutex> lock(wheel_->Mutex());
+        /// stale if owner exited after it fired
+        if (timer->gen != expiry.gen || !timer->fired) {
+            return;
+        }
+        timer->fired = false;
+        ++timer->gen;
+    }
+    SpEvent evt = std::move(timer->evt);
+    auto &owned = state_timers_[timer->owner];
+    owned.erase(std::find(owned.begin(), owned.end(), timer));
+    {
+        std::lock_guard<std::mutex> lock(wheel_->Mutex());
+        timer_free_.emplace_back(timer);
+    }
+    Dispatch(evt);
+}
+
+void StateMachine::CancelTimers(const State *state)
+{
+    auto it = state_timers_.find(state);
+    if (it == state_timers_.end() || it->second.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(wheel_->Mutex());
+    for (Timer *timer : it->second) {
+        wheel_->Remove(*timer);
+        timer->fired = false;
+        ++timer->gen;
+        timer->evt.reset();
+        timer_free_.emplace_back(timer);
+    }
+    it->second.clear();
+}
+
+void StateMachine::CloseTimers()
+{
+    if (wheel_ == nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(wheel_->Mutex());
+    timer_closed_ = true;
+    for (auto &timer : timers_) {
+        wheel_->Remove(*timer);
+    }
+}
+
+Transition* StateMachine::Enabled(State *source, const SpEvent &evt)
+{
+    /// Check if transition is happened on source state.
     /// An event can trigger only one transition.
-    for (const auto &trans : trans_list_) {
-        /// Check transition(source, trigger and guard)
-        if (cur_state_ == trans->Source()
-            && trans->Triggered(evt, this)
-            && trans->Guard(this)) {
+    auto idx = trans_index_.find(source);
+    if (idx == trans_index_.end()) {
+        return nullptr;
+    }
+
+    static const TransEntries kNone;
+    const TransEntries *triggered = &kNone;
+    const TransEntries &fallback = idx->second.fallback;
+    auto it = idx->second.triggered.find(evt->ID());
+    if (it != idx->second.triggered.end()) {
+        triggered = &it->second;
+    }
+
+    /// Merge both candidates by the order transitions were added
+    size_t i = 0, j = 0;
+    while (i < triggered->size() || j < fallback.size()) {
+        Transition *trans;
+        if (j == fallback.size()
+            || (i < triggered->size() && (*triggered)[i].order < fallback[j].order)) {
+            trans = (*triggered)[i++].trans;
+        } else {
+            trans = fallback[j++].trans;
+            /// Check trigger by user code
+            if (Accepted(trans, &evt)) {
+                return trans;
+            }
+            continue;
+        }
+        if (Accepted(trans, nullptr)) {
             /// Transition happened
-            cur_state_ = trans->Transit(this);
-            return true;
+            return trans;
         }
     }
+    return nullptr;
+}
+
+bool StateMachine::Accepted(Transition *trans, const SpEvent *evt)
+{
+#ifdef HFSM_STATS
+    TransCounters &stats = trans_stats_.at(trans);
+    CallbackTimer timer(stats.callback_ns);
+#endif
+    /// evt is set if trigger is checked by user code
+    if (evt && !trans->Triggered(*evt, this)) {
+        return false;
+    }
+    if (trans->Guard(this)) {
+        return true;
+    }
+#ifdef HFSM_STATS
+    stats.rejected.Add(1);
+#endif
     return false;
 }
 
+void StateMachine::Effect(Transition *trans)
+{
+    HFSM_PROBE3(effect, this, trans->src_.get(), trans->tar_.get());
+#ifdef HFSM_STATS
+    TransCounters &stats = trans_stats_.at(trans);
+    CallbackTimer timer(stats.callback_ns);
+    stats.fired.Add(1);
+#endif
+    trans->Effect(this);
+}
+
+bool StateMachine::Bind()
+{
+    std::set<State*> bound;
+    auto bind_state = [this, &bound](const SpState *s) -> bool {
+        /// Bind and hold state and all parents of it only once
+        for (; *s && bound.insert(s->get()).second; s = &(*s)->parent_) {
+            (*s)->UpdateDepth();
+            has_defers_ = has_defers_ || !(*s)->defers_.empty();
+            if (!(*s)->Bind(this)) {
+                return false;
+            }
+            states_.emplace_back(*s);
+        }
+        return true;
+    };
+
+    states_.clear();
+    deferred_.clear();
+    has_defers_ = false;
+    for (const auto &trans : trans_list_) {
+        if (!trans->Bind(this)
+            || !bind_state(&trans->src_)
+            || !bind_state(&trans->tar_)) {
+            states_.clear();
+            return false;
+        }
+    }
+    /// initial states of regions, states_ grows while binding them
+    for (size_t i = 0; i < states_.size(); ++i) {
+        State *s = states_[i].get();
+        for (const auto &weak : s->regions_) {
+            SpState initial = weak.lock();
+            if (!initial || !bind_state(&initial)) {
+                states_.clear();
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+bool StateMachine::BuildRegions()
+{
+    regions_.clear();
+    for (const auto &s : states_) {
+        /// keys are fixed while running, see StartTimer
+        state_timers_[s.get()];
+        if (s->history_ != History::kNone) {
+            histories_[s.get()] = nullptr;
+        }
+        if (s->regions_.empty()) {
+            continue;
+        }
+        Regions &regions = regions_[s.get()];
+        regions.composite = s.get();
+        regions.parallel = s->parallel_;
+        for (const auto &weak : s->regions_) {
+            /// root of region is the child of composite leading to initial,
+            /// initial is held by states_ since Bind
+            State *initial = weak.lock().get();
+            State *root = initial;
+            while (root && root->parent_.get() != s.get()) {
+                root = root->parent_.get();
+            }
+            for (const Region &r : regions.list) {
+                if (r.root == root) {
+                    root = nullptr;
+                }
+            }
+            if (root == nullptr || regions.list.size() >= 0xFFFF) {
+                regions_.clear();
+                return false;
+            }
+            Region region;
+            region.root = root;
+            region.initial = initial;
+            regions.list.emplace_back(region);
+        }
+    }
+    return true;
+}
+
+void StateMachine::BuildTransIndex()
+{
+    size_t order = 0;
+    trans_index_.clear();
+    for (const auto &trans : trans_list_) {
+        auto &idx = trans_index_[trans->src_.get()];
+        TransEntry entry = { order++, trans.get() };
+        if (trans->HasTrigger()) {
+            idx.triggered[trans->Trigger()].emplace_back(entry);
+        } else {
+            idx.fallback.emplace_back(entry);
+        }
+    }
+}
+
 bool StateMachine::SendEvent(const SpEvent &evt)
 {
-    if (evt_hub_ == nullptr)
+    if (evt_queue_ == nullptr)
         return false;
 
-    return evt_hub_->Send(evt);
+    return Enqueue(&evt, 1);
+}
+
+QueueStats StateMachine::GetQueueStats() const
+{
+    QueueStats stats;
+    stats.rejected = stats_.rejected.load(std::memory_order_relaxed);
+    stats.dropped = stats_.dropped.load(std::memory_order_relaxed);
+    stats.blocked = stats_.blocked.load(std::memory_order_relaxed);
+    stats.timeouts = stats_.timeouts.load(std::memory_order_relaxed);
+    return stats;
+}
+
+bool StateMachine::GetStateStats(const SpState &state, StateStats &stats) const
+{
+#ifdef HFSM_STATS
+    auto it = state_stats_.find(state.get());
+    if (it == state_stats_.end()) {
+        return false;
+    }
+    stats.entries = it->second.entries.Load();
+    stats.exits = it->second.exits.Load();
+    stats.invokes = it->second.invokes.Load();
+    stats.handled = it->second.handled.Load();
+    stats.callback_ns = it->second.callback_ns.Load();
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool StateMachine::GetTransStats(const SpTrans &trans, TransStats &stats) const
+{
+#ifdef HFSM_STATS
+    auto it = trans_stats_.find(trans.get());
+    if (it == trans_stats_.end()) {
+        return false;
+    }
+    stats.fired = it->second.fired.Load();
+    stats.rejected = it->second.rejected.Load();
+    stats.callback_ns = it->second.callback_ns.Load();
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool StateMachine::GetLatency(LatencyKind kind, LatencyStats &stats) const
+{
+#ifdef HFSM_STATS
+    stats = latency_->Read(kind);
+    return true;
+#else
+    return false;
+#endif
+}
+
+bool StateMachine::GetEventLatency(uint32_t id, LatencyKind kind, LatencyStats &stats) const
+{
+#ifdef HFSM_STATS
+    return latency_->Read(id, kind, stats);
+#else
+    return false;
+#endif
+}
+
+#ifdef HFSM_STATS
+void StateMachine::ResetStats()
+{
+    state_stats_.clear();
+    trans_stats_.clear();
+    for (const auto &s : states_) {
+        state_stats_[s.get()];
+    }
+    for (const auto &trans : trans_list_) {
+        trans_stats_[trans.get()];
+    }
+}
+#endif
+
+bool StateMachine::Enqueue(const SpEvent *evts, size_t n)
+{
+    for (size_t i = 0; i < n; ++i) {
+        HFSM_PROBE3(send, this, evts[i]->ID(), static_cast<int>(evts[i]->Priority()));
+    }
+    uint64_t sent = 0;
+#ifdef HFSM_STATS
+    /// stamped once and kept by the queue, time blocked for room counts
+    /// as waiting
+    sent = LatencyTable::Now();
+#endif
+    if (evt_queue_->SendBatch(evts, n, sent)) {
+        return true;
+    }
+    switch (overflow_) {
+    case OverflowPolicy::kBlock:
+        return WaitForRoom(evts, n, sent);
+    case OverflowPolicy::kDropOldest:
+    case OverflowPolicy::kDropLowest:
+        /// bounded since other senders may take the room, nothing to drop
+        /// may also be transient while room is reserved by other senders
+        for (size_t i = 0; i < capacity_ + n; ++i) {
+            if (evt_queue_->Drop(overflow_, evts[0]->Priority())) {
+                stats_.dropped.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                std::this_thread::yield();
+            }
+            if (evt_queue_->SendBatch(evts, n, sent)) {
+                return true;
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    stats_.rejected.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+bool StateMachine::WaitForRoom(const SpEvent *evts, size_t n, uint64_t sent)
+{
+    using Clock = std::chrono::steady_clock;
+    auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms_);
+    bool done;
+
+    stats_.blocked.fetch_add(1, std::memory_order_relaxed);
+    std::unique_lock<std::mutex> lock(space_lock_);
+    waiters_.fetch_add(1);
+    while (!(done = evt_queue_->SendBatch(evts, n, sent))) {
+        auto now = Clock::now();
+        if (timeout_ms_ != 0 && now >= deadline) {
+            break;
+        }
+        /// wake up periodically in case room is freed after OnEvent checks
+        auto wake = now + std::chrono::milliseconds(BLOCK_POLL_MS);
+        space_cond_.wait_until(lock, timeout_ms_ != 0 ? std::min(wake, deadline) : wake);
+    }
+    waiters_.fetch_sub(1);
+    if (!done) {
+        stats_.timeouts.fetch_add(1, std::memory_order_relaxed);
+    }
+    return done;
+}
+
+bool StateMachine::Snapshot(std::ostream &out)
+{
+    StateMachine *sm = this;
+    return SnapshotAll(&sm, 1, out);
+}
+
+bool StateMachine::RequestSnapshot(const std::shared_ptr<SnapshotEvent> &req,
+    std::chrono::steady_clock::time_point deadline)
+{
+    if (evt_queue_ == nullptr) {
+        /// events come from EventHub of caller, caller serializes with them
+        req->Take(*this);
+        return true;
+    }
+    /// the lowest priority, events queued before are dispatched first.
+    /// It is never dropped and is retried while queue is full
+    SpEvent evt = req;
+    while (!evt_queue_->SendPinned(evt)) {
+        if (!running_ || std::chrono::steady_clock::now() >= deadline) {
+            return false;
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(BLOCK_POLL_MS));
+    }
+    return true;
+}
+
+bool StateMachine::SnapshotAll(StateMachine *const *sms, size_t n, std::ostream &out)
+{
+    if (acting.sm != nullptr) {
+        LOGE("%s failed: called from actions!", __func__);
+        return false;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        if (sms[i] == nullptr || !sms[i]->running_) {
+            return false;
+        }
+    }
+    bool ok = true;
+    std::vector<std::future<std::string>> bodies;
+    for (size_t i = 0; i < n && ok; i += kSnapshotBatch) {
+        /// dispatchers capture their SMs at once, frames are written
+        /// in order as they are ready
+        bodies.clear();
+        auto deadline = std::chrono::steady_clock::now()
+            + std::chrono::milliseconds(kSnapshotTimeoutMs);
+        for (size_t j = i; j < n && j < i + kSnapshotBatch; ++j) {
+            auto req = MakeEvent<SnapshotEvent>();
+            auto body = req->done.get_future();
+            if (!sms[j]->RequestSnapshot(req, deadline)) {
+                ok = false;
+                break;
+            }
+            bodies.emplace_back(std::move(body));
+        }
+        for (auto &body : bodies) {
+            std::string frame;
+            try {
+                /// a request not taken in time is left to its dispatcher
+                if (body.wait_until(deadline) == std::future_status::ready) {
+                    frame = body.get();
+                }
+            } catch (const std::future_error&) {
+                /// request was discarded with the queue
+            }
+            ok = ok && !frame.empty() && SnapshotFrame::Write(out, frame);
+        }
+    }
+    return ok;
+}
+
+bool StateMachine::Capture(std::string &body) const
+{
+    if (!running_) {
+        /// final state reached before the request
+        return false;
+    }
+    std::unordered_map<const State*, uint64_t> index;
+    for (size_t i = 0; i < states_.size(); ++i) {
+        index[states_[i].get()] = i;
+    }
+    SnapshotWriter w;
+    w.PutVarint(states_.size());
+    w.PutVarint(cur_state_ ? index.at(cur_state_) + 1 : 0);
+    w.PutVarint(orth_ ? orth_->list.size() : 0);
+    for (size_t i = 0; orth_ && i < orth_->list.size(); ++i) {
+        w.PutVarint(index.at(orth_->list[i].leaf));
+    }
+    size_t num = 0;
+    for (const auto &it : histories_) {
+        num += it.second != nullptr;
+    }
+    w.PutVarint(num);
+    for (const auto &it : histories_) {
+        if (it.second != nullptr) {
+            w.PutVarint(index.at(it.first));
+            w.PutVarint(index.at(it.second));
+        }
+    }
+    /// events are prefixed by their size, the ones not taken are left out
+    SnapshotWriter events, evt_out;
+    num = 0;
+    for (const auto &evt : deferred_) {
+        evt_out.Body().clear();
+        evt_out.clear();
+        if (SaveEvent(evt, evt_out) && evt_out) {
+            events.PutVarint(evt_out.Body().size());
+            events.Body().append(evt_out.Body());
+            ++num;
+        }
+    }
+    w.PutVarint(num);
+    w.Body().append(events.Body());
+    if (!SaveUserData(w) || !w) {
+        return false;
+    }
+    body = std::move(w.Body());
+    return true;
+}
+
+bool StateMachine::Load(const std::string &body)
+{
+    SnapshotReader in(body.data(), body.size());
+    auto state = [this](uint64_t i) -> State* {
+        return i < states_.size() ? states_[i].get() : nullptr;
+    };
+    if (in.GetVarint() != states_.size()) {
+        return false;
+    }
+    uint64_t cur = in.GetVarint();
+    State *cur_state = cur ? state(cur - 1) : nullptr;
+    if (!in || (cur && cur_state == nullptr)) {
+        return false;
+    }
+    Regions *orth = nullptr;
+    std::vector<State*> leaves;
+    uint64_t num = in.GetVarint();
+    if (num) {
+        auto it = regions_.find(cur_state);
+        if (it == regions_.end() || it->second.list.size() != num) {
+            return false;
+        }
+        orth = &it->second;
+        for (const Region &r : orth->list) {
+            State *leaf = state(in.GetVarint());
+            if (leaf == nullptr || !Within(leaf, r.root)) {
+                return false;
+            }
+            leaves.emplace_back(leaf);
+        }
+    } else {
+        /// a state in regions is always captured with its composite
+        for (State *s = cur_state; s; s = s->parent_.get()) {
+            if (regions_.count(s)) {
+                return false;
+            }
+        }
+    }
+
+    std::vector<std::pair<State*, State*>> histories;
+    num = in.GetVarint();
+    if (!in || num > states_.size()) {
+        return false;
+    }
+    for (uint64_t i = 0; i < num; ++i) {
+        State *composite = state(in.GetVarint());
+        State *last = state(in.GetVarint());
+        if (composite == nullptr || last == nullptr || composite == last
+            || composite->history_ == History::kNone || !Within(last, composite)) {
+            return false;
+        }
+        histories.emplace_back(composite, last);
+    }
+
+    /// reading stops at the end of body if num is corrupted
+    std::deque<SpEvent> deferred;
+    num = in.GetVarint();
+    for (uint64_t i = 0; i < num && in; ++i) {
+        size_t size = in.GetVarint();
+        const char *data = in.Take(size);
+        if (data == nullptr) {
+            return false;
+        }
+        SnapshotReader evt_in(data, size);
+        SpEvent evt = LoadEvent(evt_in);
+        if (evt == nullptr) {
+            return false;
+        }
+        deferred.emplace_back(std::move(evt));
+    }
+    if (!in || !LoadUserData(in)) {
+        return false;
+    }
+
+    cur_state_ = cur_state;
+    orth_ = orth;
+    for (size_t i = 0; i < leaves.size(); ++i) {
+        orth->list[i].leaf = leaves[i];
+    }
+    for (const auto &it : histories) {
+        histories_[it.first] = it.second;
+    }
+    deferred_.swap(deferred);
+    return true;
+}
+
+bool StateMachine::Resume(const std::string &body, const StartOption &option)
+{
+    if (!Supported(option) || !Prepare()) {
+        return false;
+    }
+    if (!Load(body)) {
+        LOGE("%s failed: snapshot mismatched!", __func__);
+        return false;
+    }
+    Open(option);
+    return true;
+}
+
+bool StateMachine::Restore(std::istream &in, const StartOption &option)
+{
+    StateMachine *sm = this;
+    return RestoreAll(&sm, 1, in, option);
+}
+
+bool StateMachine::RestoreAll(StateMachine *const *sms, size_t n, std::istream &in,
+    const StartOption &option)
+{
+    std::string body;
+    for (size_t i = 0; i < n; ++i) {
+        if (sms[i] == nullptr || !SnapshotFrame::Read(in, body)
+            || !sms[i]->Resume(body, option)) {
+            return false;
+        }
+    }
+    return true;
 }
 
 }
@@ -23,19 +23,35 @@
 #define _CPP_HIERARCHICAL_FINITE_STATE_MACHINE_H
 
 #include <set>
+#include <cstdint>
 #include <list>
+#include <deque>
+#include <chrono>
+#include <vector>
+#include <mutex>
 #include <atomic>
+#include <condition_variable>
+#include <unordered_map>
 #include <functional>
+#include <istream>
+#include <ostream>
 #include <EventHub.h>
 
 #include "State.h"
 #include "Transition.h"
+#include "EventQueue.h"
+#include "EventPool.h"
+#include "TimerWheel.h"
+#include "Histogram.h"
 
 namespace utils {
 namespace hfsm {
 
 /// All state objects will be hold by transition,
-/// and all transition objects will be hold by State Machine
+/// and all transition objects will be hold by State Machine.
+/// SM also holds every state of its transitions (parents included)
+/// while running, so dispatching only uses raw pointers and never
+/// touches reference counts of states shared with other SMs.
 
 /// Initial transition which is transiting from initial to a state,
 /// must be created by Transition::CreateInitialTransition and it
@@ -70,9 +86,96 @@ namespace hfsm {
 /// 4, T1->Effect
 /// Below is continue if transition is NOT occerred.
 /// 4, S1->Invoke
+///
+/// Transitions are indexed by source state when SM starts. Transitions
+/// with a declarative trigger are further indexed by event ID, so an event
+/// only checks the transitions of current state that may be triggered by it.
+/// Candidates are still checked in the order they were added.
+///
+/// Events deferred by current state or its parents (see State::Defer)
+/// are parked in a side queue instead of being invoked, and invoked again
+/// in order after the next transition.
+///
+/// Timers armed by StartTimer are owned by the state whose action is
+/// running and cancelled when it exits. They are driven by the timing
+/// wheel of the executor, or a shared one for SMs with their own thread.
+///
+/// A composite state with regions (see State::AddRegion) keeps one active
+/// state in every region while it is current. Events are offered to every
+/// region, by transitions from its active state and then invoking it and
+/// its parents below the composite, and to the composite only if no
+/// region took it. Transitions out of a region are made after the others
+/// got the event, the first one by order of regions wins.
+///
+/// History of a composite (see State::SetHistory) is recorded by SM when
+/// the composite exits, and resolved in O(1) when it is entered again.
+///
+/// Built with HFSM_STATS, SM counts calls and time of actions of every
+/// state and transition, see GetStateStats and GetTransStats. Counters
+/// are written without locks by the thread running the action.
+/// Events sent through internal queue are also stamped, latency of them
+/// is kept in histograms, see GetLatency and GetEventLatency.
+///
+/// Snapshot writes active states, histories, deferred events and user
+/// data of SM in a compact binary frame, and Restore starts an SM of the
+/// same transitions from it without running entry actions. States are
+/// identified by their order of binding, so transitions must be added
+/// in the same order. SnapshotAll and RestoreAll handle many SMs at once.
+
+/// Backend of internal event queue
+enum class QueueKind {
+    kEventHub,      /// EventHub
+    kRing,          /// lock-free rings, see RingEventQueue
+};
+
+/// Options of starting SM with an internal event queue
+struct StartOption {
+    QueueKind queue = QueueKind::kEventHub;
+    /// Shared executor, events are dispatched by its workers instead of
+    /// a thread of SM if it is set, queue is ignored then.
+    /// SM must be stopped or destroyed before executor.
+    Executor *executor = nullptr;
+    /// Events in queue, 0 for default (64)
+    size_t capacity = 0;
+    /// Drop policies are not supported by kEventHub
+    OverflowPolicy overflow = OverflowPolicy::kReject;
+    /// For kBlock, 0 waits forever. Sending from state actions to
+    /// a full queue of the same SM waits until timeout.
+    uint32_t timeout_ms = 0;
+    /// Event IDs with latency histograms of their own, HFSM_STATS only,
+    /// 0 for default (8). Taken from the first start, as histograms are
+    /// kept since SM created.
+    size_t latency_events = 0;
+};
+
+/// Counters of queue overflow since SM created
+struct QueueStats {
+    uint64_t rejected = 0;  /// sends failed for full queue
+    uint64_t dropped = 0;   /// queued events discarded for new ones
+    uint64_t blocked = 0;   /// sends waited for room
+    uint64_t timeouts = 0;  /// blocked sends timed out
+};
+
+/// Counters of a state since SM started, kept only with HFSM_STATS
+struct StateStats {
+    uint64_t entries = 0;
+    uint64_t exits = 0;
+    uint64_t invokes = 0;       /// Invoke called
+    uint64_t handled = 0;       /// Invoke returned true
+    uint64_t callback_ns = 0;   /// time spent in Entry, Exit and Invoke
+};
+
+/// Counters of a transition since SM started, kept only with HFSM_STATS
+struct TransStats {
+    uint64_t fired = 0;
+    uint64_t rejected = 0;      /// triggered but Guard returned false
+    uint64_t callback_ns = 0;   /// time spent in Triggered, Guard and Effect
+};
 
 class StateMachine : public EventHandler
 {
+  friend Transition;
+
   public:
     StateMachine();
     virtual ~StateMachine();
@@ -82,9 +185,18 @@ class StateMachine : public EventHandler
      * @param[in] evthub: event hub object
      *    if evthub is null, SM will create an internal event hub,
      *    and "SendEvent" method will be valid.
-     * @return None.
+     * @return false if SM is running or any state or transition
+     *    is not bound to this SM.
+     */
+    bool Start(EventHub* evthub = nullptr);
+    /**
+     * @brief Start SM with an internal event queue
+     *
+     * @param[in] option: options of internal event queue
+     * @return false if SM is running, any state or transition
+     *    is not bound to this SM, or overflow is not supported by queue.
      */
-    void Start(EventHub* evthub = nullptr);
+    bool Start(const StartOption &option);
     /**
      * @brief  Add transition to SM
      *         Do not call this on SM running
@@ -100,19 +212,316 @@ class StateMachine : public EventHandler
      * @return true if success.
      */
     bool SendEvent(const SpEvent &evt);
+    /**
+     * @brief Send events to SM in order.
+     *        Consecutive events with the same priority are queued
+     *        as one event and handled together. A run longer than
+     *        capacity of the queue is sent in parts of capacity, so
+     *        overflow policy applies to every part.
+     *
+     * @param[in] first, last: range of event objects
+     * @return true if success, events before the failed priority
+     *         run may have been sent.
+     */
+    template <typename InputIt>
+    bool SendEvents(InputIt first, InputIt last);
+    /// Read counters of queue overflow
+    QueueStats GetQueueStats() const;
+    /**
+     * @brief Read counters of a state, it may be called from any thread
+     *        while SM is running.
+     *
+     * @param[in] state: state of SM
+     * @param[out] stats: counters since SM started
+     * @return false if SM is built without HFSM_STATS, or state is
+     *         not held by SM.
+     */
+    bool GetStateStats(const SpState &state, StateStats &stats) const;
+    /**
+     * @brief Read counters of a transition, it may be called from any
+     *        thread while SM is running.
+     *
+     * @param[in] trans: transition added to SM
+     * @param[out] stats: counters since SM started
+     * @return false if SM is built without HFSM_STATS, or transition
+     *         is not added to SM.
+     */
+    bool GetTransStats(const SpTrans &trans, TransStats &stats) const;
+    /**
+     * @brief Read latency percentiles of all events, it may be called
+     *        from any thread while SM is running. Wait and total are
+     *        kept only for events sent by SendEvent or SendEvents.
+     *
+     * @param[in] kind: interval measured
+     * @param[out] stats: percentiles since SM created
+     * @return false if SM is built without HFSM_STATS.
+     */
+    bool GetLatency(LatencyKind kind, LatencyStats &stats) const;
+    /**
+     * @brief Read latency percentiles of an event ID, the first
+     *        StartOption::latency_events IDs handled are kept apart.
+     *
+     * @param[in] id: ID of event
+     * @param[in] kind: interval measured
+     * @param[out] stats: percentiles since SM created
+     * @return false if SM is built without HFSM_STATS, or id has no
+     *         histogram of its own.
+     */
+    bool GetEventLatency(uint32_t id, LatencyKind kind, LatencyStats &stats) const;
+    /**
+     * @brief Arm a timer owned by the state whose action is running.
+     *        Event is sent to SM after ms unless the owner exits before
+     *        it is dispatched, so timers armed in Entry need no cancelling.
+     *        Expiry bypasses overflow policy and is retried every tick
+     *        while queue is full. Call this only from actions of states.
+     *
+     * @param[in] evt: event to send on expiry
+     * @param[in] ms: delay in milliseconds
+     * @return false if no state action is running, or SM is not started
+     *         with an internal event queue.
+     */
+    bool StartTimer(const SpEvent &evt, uint32_t ms);
+    /**
+     * @brief Write a frame of the state of SM: active states, regions,
+     *        histories, deferred events taken by SaveEvent and user data
+     *        by SaveUserData. Queued events are drained, not captured:
+     *        the request is queued at the lowest priority and events
+     *        queued before it are dispatched first, timers are not
+     *        captured. SM with an internal queue is captured by its
+     *        dispatcher, otherwise caller must not call it while an
+     *        event is dispatched.
+     *
+     * @param[out] out: stream written
+     * @return false if SM is not running, it is called from actions,
+     *         SaveUserData failed, stream failed, or the dispatcher has
+     *         not taken the request in 5 seconds.
+     */
+    bool Snapshot(std::ostream &out);
+    /**
+     * @brief Capture SMs at once by their dispatchers, frames are
+     *        written in order of sms. SMs must not be destroyed before
+     *        it returns.
+     *
+     * @return the same as Snapshot, frames before the failed SM
+     *         may have been written.
+     */
+    static bool SnapshotAll(StateMachine *const *sms, size_t n, std::ostream &out);
+    /**
+     * @brief Start SM with an internal event queue in the state read from
+     *        a frame instead of the initial transition, no entry action
+     *        is run. Deferred events are kept until the next transition.
+     *
+     * @param[in] in: stream positioned at a frame written by Snapshot
+     * @param[in] option: options of internal event queue
+     * @return false if SM can not start with option, the frame does not
+     *         match states of SM, or LoadEvent or LoadUserData failed.
+     */
+    bool Restore(std::istream &in, const StartOption &option = StartOption());
+    /**
+     * @brief Restore SMs from frames in order with one buffer reused,
+     *        so memory does not grow with n.
+     *
+     * @return the same as Restore, SMs before the failed one are restored.
+     */
+    static bool RestoreAll(StateMachine *const *sms, size_t n, std::istream &in,
+        const StartOption &option = StartOption());
 
   protected:
     virtual void OnEvent(const SpEvent evt) override final;
+    /**
+     * @brief Write a deferred event into a snapshot, called by the thread
+     *        dispatching events. Events are left out by default.
+     *
+     * @return false to leave the event out.
+     */
+    virtual bool SaveEvent(const SpEvent &evt, std::ostream &out) const { return false; }
+    /**
+     * @brief Read an event written by SaveEvent, reads beyond it fail.
+     *
+     * @return nullptr to fail Restore.
+     */
+    virtual SpEvent LoadEvent(std::istream &in) { return nullptr; }
+    /// Write user data into a snapshot, false fails Snapshot
+    virtual bool SaveUserData(std::ostream &out) const { return true; }
+    /// Read what SaveUserData wrote, reads beyond it fail
+    virtual bool LoadUserData(std::istream &in) { return true; }
+
+  private:
+    bool Prepare();
+    bool Supported(const StartOption &option) const;
+    void Open(const StartOption &option);
+    bool Resume(const std::string &body, const StartOption &option);
+    bool Capture(std::string &body) const;
+    bool Load(const std::string &body);
+    void Receive(const SpEvent &evt, uint64_t sent);
+    void Handle(const SpEvent &evt, uint64_t sent);
+    void Dispatch(const SpEvent &evt);
+    bool Deferred(const SpEvent &evt) const;
+    void Recall();
+    Transition* Enabled(State *source, const SpEvent &evt);
+    bool Accepted(Transition *trans, const SpEvent *evt);
+    void Effect(Transition *trans);
+    void Transit(Transition *trans);
+    bool InvokeState(State *state, const SpEvent &evt);
+    void BuildTransIndex();
+    void HoldRegions(const State *state);
+    bool Bind();
+    bool BuildRegions();
+    bool Enqueue(const SpEvent *evts, size_t n);
+    void EnterState(State *state);
+    void ExitState(State *state, State *child, State *leaf);
+    State* Restore(State *target);
+    void CancelTimers(const State *state);
+    void CloseTimers();
+    void EnterRegions(State *state);
+    void ExitRegions();
+    bool InvokeRegions(const SpEvent &evt);
+    void RunParallel(const SpEvent &evt);
+    void WorkRegions();
+    bool WaitForRoom(const SpEvent *evts, size_t n, uint64_t sent);
 
   private:
-    bool TransActivated(const SpEvent &evt);
+    /// Transition with its position in trans_list_
+    struct TransEntry {
+        size_t order;
+        Transition *trans;
+    };
+    using TransEntries = std::vector<TransEntry>;
+    /// Transitions from one source state
+    struct TransIndex {
+        std::unordered_map<uint32_t, TransEntries> triggered;
+        TransEntries fallback;
+    };
+    /// Timer armed by StartTimer, recycled after expiry or cancelling.
+    /// gen and fired are guarded by mutex of wheel, gen changes on
+    /// recycling so that queued expiry of a cancelled timer is ignored.
+    struct Timer : public TimerWheel::Node {
+        virtual bool Fire() override;
+        StateMachine *sm = nullptr;
+        State *owner = nullptr;
+        SpEvent evt;
+        uint64_t gen = 0;
+        bool fired = false;
+    };
+    class TimerEvent;
+    class SnapshotEvent;
+    bool RequestSnapshot(const std::shared_ptr<SnapshotEvent> &req,
+        std::chrono::steady_clock::time_point deadline);
+    void Expire(const TimerEvent &expiry);
+    /// Orthogonal region, result fields are written by the thread
+    /// stepping it and read by dispatcher after joining
+    struct Region {
+        State *root;                /// child of composite holding the region
+        State *initial;
+        State *leaf = nullptr;      /// active state while composite is current
+        bool handled = false;
+        bool transited = false;
+        Transition *escape = nullptr;   /// transition out of region
+    };
+    struct Regions {
+        State *composite;
+        bool parallel;
+        std::vector<Region> list;
+    };
+    void StepRegion(Region &region, const SpEvent &evt);
+    /// Persistent task helping to step regions in parallel, it may run
+    /// late and take part in the job of a later event
+    struct Helper : public Executor::Task {
+        explicit Helper(StateMachine *s) : sm(s) {}
+        virtual void Run() override;
+        StateMachine *sm;
+        std::atomic<bool> busy{false};
+    };
 
   private:
     const size_t  MAX_EVENT_NUM = 64;
-    std::unique_ptr<EventHub> evt_hub_;
-    SpState cur_state_ = nullptr;
+    const uint32_t BLOCK_POLL_MS = 10;
+    static constexpr size_t kSnapshotBatch = 64;    /// SMs captured at once
+    static constexpr int kSnapshotTimeoutMs = 5000; /// bound of a capture
+    std::unique_ptr<EventQueue> evt_queue_;
+    size_t capacity_ = 0;
+    OverflowPolicy overflow_ = OverflowPolicy::kReject;
+    uint32_t timeout_ms_ = 0;
+    std::atomic<int> waiters_{0};
+    std::mutex space_lock_;
+    std::condition_variable space_cond_;
+    struct {
+        std::atomic<uint64_t> rejected{0};
+        std::atomic<uint64_t> dropped{0};
+        std::atomic<uint64_t> blocked{0};
+        std::atomic<uint64_t> timeouts{0};
+    } stats_;
+    State *cur_state_ = nullptr;
     std::atomic<bool> running_{false};
     TransList trans_list_;
+    /// initials of regions of states given by transitions, held here as
+    /// states only refer to them weakly
+    std::vector<SpState> initials_;
+    std::vector<SpState> states_;
+    std::unordered_map<const State*, TransIndex> trans_index_;
+    /// Deferred events, touched only by dispatcher
+    bool has_defers_ = false;
+    bool transited_ = false;
+    bool recalling_ = false;
+    std::deque<SpEvent> deferred_;
+    /// Timers, keys of state_timers_ are fixed on starting and timers
+    /// of a state are touched only by thread running its actions
+    TimerWheel *wheel_ = nullptr;
+    std::vector<std::unique_ptr<Timer>> timers_;    /// guarded by wheel
+    bool timer_closed_ = false;                     /// guarded by wheel
+    std::vector<Timer*> timer_free_;                /// guarded by wheel
+    std::unordered_map<const State*, std::vector<Timer*>> state_timers_;
+    /// Regions by composite, orth_ is set while cur_state_ holds regions
+    std::unordered_map<const State*, Regions> regions_;
+    Regions *orth_ = nullptr;
+    /// Last active sub-state by composite with history, keys are fixed
+    /// on starting and a value is touched only by thread running it
+    std::unordered_map<const State*, State*> histories_;
+    /// Parallel regions, job of the event is published by job_claim_
+    Executor *executor_ = nullptr;
+    std::vector<std::shared_ptr<Helper>> helpers_;
+    const SpEvent *job_evt_ = nullptr;
+    std::atomic<uint32_t> job_claim_{0};    /// next region << 16 | regions
+    std::atomic<int> job_left_{0};          /// regions not finished
+#ifdef HFSM_STATS
+    /// Counter written by one thread at a time, read by any
+    struct Counter {
+        void Add(uint64_t n)
+        {
+            value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+        }
+        uint64_t Load() const { return value.load(std::memory_order_relaxed); }
+        std::atomic<uint64_t> value{0};
+    };
+    /// Adds time of its scope to a counter
+    class CallbackTimer
+    {
+      public:
+        explicit CallbackTimer(Counter &ns)
+          : ns_(ns), begin_(std::chrono::steady_clock::now()) {}
+        ~CallbackTimer()
+        {
+            ns_.Add(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - begin_).count());
+        }
+
+      private:
+        Counter &ns_;
+        std::chrono::steady_clock::time_point begin_;
+    };
+    struct StateCounters {
+        Counter entries, exits, invokes, handled, callback_ns;
+    };
+    struct TransCounters {
+        Counter fired, rejected, callback_ns;
+    };
+    void ResetStats();
+    /// Keys are fixed on starting, kept after final state for readers
+    std::unordered_map<const State*, StateCounters> state_stats_;
+    std::unordered_map<const Transition*, TransCounters> trans_stats_;
+    std::unique_ptr<LatencyTable> latency_;
+#endif
 
   private:
     /// Disallow the copy constructor
@@ -121,6 +530,34 @@ class StateMachine : public EventHandler
     void operator=(const StateMachine &) = delete;
 };
 
+template <typename InputIt>
+bool StateMachine::SendEvents(InputIt first, InputIt last)
+{
+    if (evt_queue_ == nullptr)
+        return false;
+
+    std::vector<SpEvent> run;
+    while (first != last) {
+        /// queue consecutive events with the same priority at once,
+        /// a run longer than capacity is split so that every part may fit
+        run.clear();
+        for (; first != last; ++first) {
+            if (*first == nullptr) {
+                continue;
+            }
+            if (!run.empty() && ((*first)->Priority() != run.front()->Priority()
+                || run.size() == capacity_)) {
+                break;
+            }
+            run.emplace_back(*first);
+        }
+        if (!run.empty() && !Enqueue(run.data(), run.size())) {
+            return false;
+        }
+    }
+    return true;
+}
+
 }
 }
 
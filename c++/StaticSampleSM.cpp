@@ -0,0 +1,153 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++ templates, topology is fixed at compile time
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdarg.h>
+#include <cstdio>
+
+#include "log.h"
+#include "StaticStateMachine.h"
+
+using namespace utils;
+using namespace hfsm;
+
+///   ------
+///  |  S0  |------|-------------|--------------|
+///   ------       |             |              |
+///                |             |              |
+///             ------         ------         ------
+/// Start----->|  S1  |--E1-->|  S2  |--E2-->|  S3  |--E3-->Exit
+///             ------         ------         ------
+
+enum SampleEvent : uint32_t {
+    kEvent0 = 0,
+    kEvent1,
+    kEvent2,
+    kEvent3,
+};
+
+struct S0 : StaticState<>
+{
+    template <typename SM>
+    static void Entry(SM &sm) { LOGD("%s()", __FUNCTION__); }
+    template <typename SM>
+    static void Exit(SM &sm) { LOGD("%s()", __FUNCTION__); }
+    template <typename SM>
+    static bool Invoke(uint32_t evt, SM &sm)
+    {
+        LOGD("%s() evt = %u", __FUNCTION__, evt);
+        return true;
+    }
+};
+
+struct S1 : StaticState<S0>
+{
+    template <typename SM>
+    static void Entry(SM &sm) { LOGD("%s()", __FUNCTION__); }
+    template <typename SM>
+    static void Exit(SM &sm) { LOGD("%s()", __FUNCTION__); }
+};
+
+struct S2 : StaticState<S0>
+{
+    template <typename SM>
+    static void Entry(SM &sm) { LOGD("%s()", __FUNCTION__); }
+    template <typename SM>
+    static void Exit(SM &sm) { LOGD("%s()", __FUNCTION__); }
+};
+
+struct S3 : StaticState<S0>
+{
+    template <typename SM>
+    static void Entry(SM &sm) { LOGD("%s()", __FUNCTION__); }
+    template <typename SM>
+    static void Exit(SM &sm) { LOGD("%s()", __FUNCTION__); }
+};
+
+/// transition form state1 to state2, guard flips on every trigger.
+struct T12 : StaticTransition<S1, S2, kEvent1>
+{
+    template <typename SM>
+    static bool Guard(SM &sm) { return sm.FlipGuard(); }
+    template <typename SM>
+    static void Effect(SM &sm) { LOGD("%s()", __FUNCTION__); }
+};
+
+struct T23 : StaticTransition<S2, S3, kEvent2> {};
+
+/// transition form state3 to exit.
+struct T3 : StaticTransition<S3, void, kEvent3> {};
+
+class StaticSampleSM : public StaticStateMachine<StaticSampleSM,
+    StateList<S0, S1, S2, S3>, TransitionList<T12, T23, T3>>
+{
+  public:
+    bool FlipGuard()
+    {
+        LOGD("%s() guard = %d", __FUNCTION__, guard_);
+        bool ret = guard_;
+        guard_ = !guard_;
+        return ret;
+    }
+
+  private:
+    bool guard_ = false;
+};
+
+int main(int argc, char **argv)
+{
+    StaticSampleSM sm;
+
+    /// enter initial state(1)
+    sm.Start<S1>();
+
+    /// invoke event(0) on state(1) and state(0)
+    sm.Dispatch(kEvent0);
+
+    /// triggered transiton from state(1) to state(2)
+    /// but failed due to guard is false
+    sm.Dispatch(kEvent1);
+
+    /// guard is true now, retrigger to transit to state(2)
+    sm.Dispatch(kEvent1);
+
+    /// triggered transiton from state(2) to state(3)
+    sm.Dispatch(kEvent2);
+
+    /// exit state(3)
+    sm.Dispatch(kEvent3);
+
+    printf("running = %d\n", sm.Running());
+    return 0;
+}
+
+void hfsm_log(int level, const char *format, ...) {
+    int n;
+    char buf[4096];
+
+    va_list ap;
+    va_start(ap, format);
+
+    n = vsnprintf(buf, sizeof(buf)-1, format, ap);
+    if (n > 0 && n < (int)(sizeof(buf)-1)) {
+        fprintf(stderr, "%s\n" RST, buf);
+    }
+    va_end (ap);
+}
@@ -0,0 +1,307 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++ templates, topology is fixed at compile time
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_STATIC_STATE_MACHINE_H
+#define _HFSM_CPP_STATIC_STATE_MACHINE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+namespace utils {
+namespace hfsm {
+
+/// Header-only state machine whose states, transitions and triggers are
+/// declared as types (requires C++17). The state index, the dispatch table
+/// of each state and the exit/entry sequence of each transition are all
+/// generated by the compiler, so nothing is allocated and no virtual
+/// function is called. Actions are static functions of states and
+/// transitions and can be inlined.
+///
+/// It follows the run-time sequence of StateMachine:
+/// transitions from current state are checked in the order of
+/// TransitionList, if none of them is activated, event is invoked on
+/// current state and its parents until one returns true.
+///
+/// Example (S1 and S2 are both sub-states of S0):
+///
+///   struct S0 : StaticState<> {};
+///   struct S1 : StaticState<S0> {
+///       static void Entry(MySM &sm) { ... }
+///   };
+///   struct S2 : StaticState<S0> {};
+///   struct T12 : StaticTransition<S1, S2, kEvent1> {
+///       static bool Guard(MySM &sm) { ... }
+///   };
+///   class MySM : public StaticStateMachine<MySM,
+///       StateList<S0, S1, S2>, TransitionList<T12>> {};
+///
+///   MySM sm;
+///   sm.Start<S1>();        // S0->Entry, S1->Entry
+///   sm.Dispatch(kEvent1);  // S1->Exit, T12->Effect, S2->Entry
+
+/// Basic class for states, Parent is void for a root state.
+/// Derived states hide the default actions below by their own.
+template <typename Parent = void>
+struct StaticState
+{
+    using ParentState = Parent;
+
+    /// Invoked while entering this state.
+    template <typename SM>
+    static void Entry(SM &sm) {}
+    /// Invoked while exiting this state.
+    template <typename SM>
+    static void Exit(SM &sm) {}
+    /**
+     * @brief Invoked while receiving event on this state.
+     *
+     * @return false if user expects event to continue to be invoked by the parent state,
+     *         otherwise return true.
+     */
+    template <typename Evt, typename SM>
+    static bool Invoke(const Evt &evt, SM &sm) { return false; }
+};
+
+/// Basic class for transitions triggered by event ID Trigger.
+/// Target is void if the transition reaches final state.
+template <typename Source, typename Target, uint32_t Trigger>
+struct StaticTransition
+{
+    using SourceState = Source;
+    using TargetState = Target;
+    static constexpr uint32_t kTrigger = Trigger;
+
+    /// As a condition of transition activated.
+    template <typename SM>
+    static bool Guard(SM &sm) { return true; }
+    /// Action after transition.
+    template <typename SM>
+    static void Effect(SM &sm) {}
+};
+
+template <typename... States>
+struct StateList {};
+
+template <typename... Transitions>
+struct TransitionList {};
+
+template <typename Derived, typename States, typename Transitions>
+class StaticStateMachine;
+
+template <typename Derived, typename... States, typename... Transitions>
+class StaticStateMachine<Derived, StateList<States...>, TransitionList<Transitions...>>
+{
+  public:
+    static constexpr size_t kStateNum = sizeof...(States);
+    /// Index of none state, SM is not started or reached final state.
+    static constexpr size_t kNoState = kStateNum;
+
+    /**
+     * @brief get index of state in StateList.
+     *
+     * @return index of state, kNoState if it is not in StateList.
+     */
+    template <typename S>
+    static constexpr size_t IndexOf()
+    {
+        constexpr bool matched[] = { std::is_same<S, States>::value..., false };
+        for (size_t i = 0; i < kStateNum; ++i) {
+            if (matched[i]) return i;
+        }
+        return kNoState;
+    }
+
+    /**
+     * @brief Start SM, enter initial state and all parents of it.
+     *
+     * @return None.
+     */
+    template <typename Init>
+    void Start()
+    {
+        static_assert(IndexOf<Init>() != kNoState, "initial state is not in StateList");
+        EnterFrom<void, Init>(Self());
+        cur_ = IndexOf<Init>();
+    }
+
+    /**
+     * @brief Dispatch an event on current state synchronously.
+     *
+     * @param[in] evt: event ID, or event object that has "ID()" method.
+     * @return true if a transition occurred or event is invoked done.
+     */
+    template <typename Evt>
+    bool Dispatch(const Evt &evt)
+    {
+        using Handler = bool (*)(Derived&, const Evt&);
+        static constexpr Handler kHandlers[] = { &OnEvent<States, Evt>... };
+        if (cur_ == kNoState) {
+            return false;
+        }
+        return kHandlers[cur_](Self(), evt);
+    }
+
+    /// Index of current state in StateList.
+    size_t Current() const { return cur_; }
+    /// SM is started and not reached final state.
+    bool Running() const { return cur_ != kNoState; }
+    /// Current state is S or a sub-state of S.
+    template <typename S>
+    bool IsIn() const
+    {
+        constexpr bool within[] = { Contains<S, States>()..., false };
+        return within[cur_];
+    }
+
+  private:
+    /// Ancestor is D itself or any parent of D.
+    template <typename Ancestor, typename D>
+    static constexpr bool Contains()
+    {
+        if constexpr (std::is_void<D>::value) {
+            return false;
+        } else if constexpr (std::is_same<Ancestor, D>::value) {
+            return true;
+        } else {
+            return Contains<Ancestor, typename D::ParentState>();
+        }
+    }
+
+    /// Least common ancestor of A and B, void if they have no common ancestor.
+    template <typename A, typename B, typename = void>
+    struct Lca
+    {
+        using type = typename std::conditional<Contains<A, B>(), A,
+            typename Lca<typename A::ParentState, B>::type>::type;
+    };
+    template <typename A, typename B>
+    struct Lca<A, B, typename std::enable_if<std::is_void<A>::value>::type>
+    {
+        using type = void;
+    };
+
+    static_assert(kStateNum > 0, "StateList is empty");
+
+    template <typename S>
+    static constexpr bool Declared()
+    {
+        return std::is_void<S>::value || IndexOf<S>() != kNoState;
+    }
+    static_assert((Declared<typename States::ParentState>() && ...),
+        "parent state is not in StateList");
+    static_assert(((IndexOf<typename Transitions::SourceState>() != kNoState) && ...),
+        "source state of transition is not in StateList");
+    static_assert((Declared<typename Transitions::TargetState>() && ...),
+        "target state of transition is not in StateList");
+
+    template <typename Evt>
+    static uint32_t EventID(const Evt &evt)
+    {
+        if constexpr (std::is_integral<Evt>::value || std::is_enum<Evt>::value) {
+            return static_cast<uint32_t>(evt);
+        } else {
+            return evt.ID();
+        }
+    }
+
+    /// Exit from S up to Stop (exclusive).
+    template <typename Stop, typename S>
+    static void ExitTo(Derived &sm)
+    {
+        if constexpr (!std::is_void<S>::value && !std::is_same<Stop, S>::value) {
+            S::Exit(sm);
+            ExitTo<Stop, typename S::ParentState>(sm);
+        }
+    }
+
+    /// Enter from Stop (exclusive) down to S.
+    template <typename Stop, typename S>
+    static void EnterFrom(Derived &sm)
+    {
+        if constexpr (!std::is_void<S>::value && !std::is_same<Stop, S>::value) {
+            EnterFrom<Stop, typename S::ParentState>(sm);
+            S::Entry(sm);
+        }
+    }
+
+    template <typename T>
+    static void Transit(Derived &sm)
+    {
+        using Source = typename T::SourceState;
+        using Target = typename T::TargetState;
+        if constexpr (std::is_same<Source, Target>::value) {
+            /// State self-transition
+            T::Effect(sm);
+        } else {
+            using Common = typename Lca<Source, Target>::type;
+            ExitTo<Common, Source>(sm);
+            T::Effect(sm);
+            EnterFrom<Common, Target>(sm);
+        }
+        Base(sm).cur_ = IndexOf<Target>();
+    }
+
+    template <typename S, typename T>
+    static bool TryTransit(Derived &sm, uint32_t id)
+    {
+        if constexpr (std::is_same<S, typename T::SourceState>::value) {
+            if (id == T::kTrigger && T::Guard(sm)) {
+                Transit<T>(sm);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /// Invoke event on S and its parents until one is done.
+    template <typename S, typename Evt>
+    static bool InvokeFrom(Derived &sm, const Evt &evt)
+    {
+        if constexpr (std::is_void<S>::value) {
+            return false;
+        } else {
+            return S::Invoke(evt, sm)
+                || InvokeFrom<typename S::ParentState>(sm, evt);
+        }
+    }
+
+    template <typename S, typename Evt>
+    static bool OnEvent(Derived &sm, const Evt &evt)
+    {
+        const uint32_t id = EventID(evt);
+        /// An event can trigger only one transition.
+        if ((TryTransit<S, Transitions>(sm, id) || ...)) {
+            return true;
+        }
+        return InvokeFrom<S>(sm, evt);
+    }
+
+    static StaticStateMachine& Base(Derived &sm) { return sm; }
+    Derived& Self() { return static_cast<Derived&>(*this); }
+
+  private:
+    size_t cur_ = kNoState;
+};
+
+}
+}
+
+#endif // _HFSM_CPP_STATIC_STATE_MACHINE_H
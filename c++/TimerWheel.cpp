@@ -0,0 +1,205 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <system_error>
+#include "TimerWheel.h"
+
+namespace utils {
+namespace hfsm {
+
+TimerWheel::TimerWheel()
+  : base_(std::chrono::steady_clock::now())
+{
+    for (auto &level : slots_) {
+        for (auto &slot : level) {
+            slot.prev = slot.next = &slot;
+        }
+    }
+}
+
+TimerWheel::~TimerWheel()
+{
+    {
+        std::lock_guard<std::mutex> lock(lock_);
+        stop_ = true;
+    }
+    cond_.notify_one();
+    if (thread_.joinable()) {
+        thread_.join();
+    }
+}
+
+TimerWheel& TimerWheel::Default()
+{
+    /// never destroyed, SMs may be destroyed at exit
+    static TimerWheel *wheel = new TimerWheel;
+    return *wheel;
+}
+
+bool TimerWheel::Add(Node &node, uint32_t ms)
+{
+    if (!thread_.joinable()) {
+        try {
+            thread_ = std::thread(&TimerWheel::Loop, this);
+        } catch (const std::system_error&) {
+            return false;
+        }
+    }
+    if (num_ == 0) {
+        /// all slots are empty, skip ticks passed while idle
+        now_ = Clock();
+    }
+    /// by clock rather than processed ticks, so a late wheel never
+    /// fires timers early
+    uint64_t ticks = (ms + kTickMs - 1) / kTickMs;
+    node.expire_ = Clock() + (ticks ? ticks : 1);
+    Place(node);
+    /// thread sleeps until the next tick with work, wake it up earlier
+    if (num_++ == 0 || node.expire_ < wake_) {
+        cond_.notify_one();
+    }
+    return true;
+}
+
+void TimerWheel::Remove(Node &node)
+{
+    if (node.Armed()) {
+        Unlink(node);
+        --num_;
+    }
+}
+
+uint64_t TimerWheel::Clock() const
+{
+    auto elapsed = std::chrono::steady_clock::now() - base_;
+    return std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / kTickMs;
+}
+
+void TimerWheel::Place(Node &node)
+{
+    uint64_t expire = node.expire_ < now_ ? now_ : node.expire_;
+    uint64_t delta = expire - now_;
+    if (delta >= kRange) {
+        delta = kRange - 1;
+        expire = now_ + delta;
+    }
+    int level = 0;
+    while (delta >> (kBits * (level + 1))) {
+        ++level;
+    }
+    Link &slot = slots_[level][(expire >> (kBits * level)) & kMask];
+    Link &link = node;
+    link.next = &slot;
+    link.prev = slot.prev;
+    slot.prev->next = &link;
+    slot.prev = &link;
+}
+
+void TimerWheel::Unlink(Link &link)
+{
+    link.prev->next = link.next;
+    link.next->prev = link.prev;
+    link.prev = link.next = nullptr;
+}
+
+void TimerWheel::Take(Link &dst, Link &src)
+{
+    if (src.next == &src) {
+        dst.prev = dst.next = &dst;
+        return;
+    }
+    dst.next = src.next;
+    dst.prev = src.prev;
+    dst.next->prev = &dst;
+    dst.prev->next = &dst;
+    src.prev = src.next = &src;
+}
+
+void TimerWheel::Tick(uint64_t retry)
+{
+    Link list;
+    /// cascade higher levels whose slot begins at this tick, the highest
+    /// first so that timers moved down are cascaded again at once
+    for (int level = kLevels - 1; level > 0; --level) {
+        if (now_ & ((1ull << (kBits * level)) - 1)) {
+            continue;
+        }
+        Take(list, slots_[level][(now_ >> (kBits * level)) & kMask]);
+        while (list.next != &list) {
+            Node &node = static_cast<Node&>(*list.next);
+            Unlink(node);
+            Place(node);
+        }
+    }
+
+    Take(list, slots_[0][now_ & kMask]);
+    while (list.next != &list) {
+        Node &node = static_cast<Node&>(*list.next);
+        Unlink(node);
+        if (node.expire_ > now_) {
+            /// beyond range of wheel when it was placed
+            Place(node);
+            continue;
+        }
+        --num_;
+        if (!node.Fire()) {
+            node.expire_ = retry;
+            Place(node);
+            ++num_;
+        }
+    }
+}
+
+uint64_t TimerWheel::Next() const
+{
+    /// slots of level 0 beyond the cascade are looked at after it
+    uint64_t tick = now_ + 1;
+    while ((tick & kMask) && slots_[0][tick & kMask].next == &slots_[0][tick & kMask]) {
+        ++tick;
+    }
+    return tick;
+}
+
+void TimerWheel::Loop()
+{
+    std::unique_lock<std::mutex> lock(lock_);
+    while (!stop_) {
+        if (num_ == 0) {
+            cond_.wait(lock);
+            continue;
+        }
+        /// catch up if thread was delayed, timers failing to fire are
+        /// retried on the next tick by clock rather than at every tick
+        /// caught up, so a full queue never keeps thread busy with lock
+        uint64_t target = Clock();
+        while (now_ < target && num_ > 0) {
+            ++now_;
+            Tick(target + 1);
+        }
+        if (num_ > 0) {
+            wake_ = Next();
+            cond_.wait_until(lock, base_ + std::chrono::milliseconds(wake_ * kTickMs));
+        }
+    }
+}
+
+}
+}
@@ -0,0 +1,116 @@
+/*
+ * Hierarchical finite state machine
+ * Implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _HFSM_CPP_TIMER_WHEEL_H
+#define _HFSM_CPP_TIMER_WHEEL_H
+
+#include <mutex>
+#include <chrono>
+#include <thread>
+#include <cstdint>
+#include <condition_variable>
+
+namespace utils {
+namespace hfsm {
+
+/// Hierarchical timing wheel, 4 levels of 64 slots, a slot of level n
+/// spans 64^n ticks. Timers are armed and cancelled in O(1) and expire
+/// on the thread of wheel, which starts on the first timer and sleeps
+/// through empty ticks.
+/// All operations must hold Mutex(), callbacks are called with it held.
+class TimerWheel
+{
+  private:
+    struct Link {
+        Link *prev = nullptr;
+        Link *next = nullptr;   /// nullptr if unlinked
+    };
+
+  public:
+    static constexpr uint32_t kTickMs = 1;
+
+    /// Timer linked in a slot of wheel while it is armed
+    class Node : private Link
+    {
+      public:
+        virtual ~Node() {}
+        bool Armed() const { return next != nullptr; }
+        /// Expiry callback, return false to retry on next tick
+        virtual bool Fire() = 0;
+
+      private:
+        friend TimerWheel;
+        uint64_t expire_ = 0;
+    };
+
+    TimerWheel();
+    /// Stop thread of wheel, armed timers are dropped
+    ~TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    /// Wheel shared by SMs not running on an executor, never destroyed
+    static TimerWheel& Default();
+    std::mutex& Mutex() { return lock_; }
+    /**
+     * @brief Arm an unarmed timer.
+     *
+     * @param[in] node: timer
+     * @param[in] ms: expires after ms, at least one tick
+     * @return false if thread of wheel can not start.
+     */
+    bool Add(Node &node, uint32_t ms);
+    /// Cancel a timer, nothing is done if it is not armed
+    void Remove(Node &node);
+
+  private:
+    static constexpr int kBits = 6;
+    static constexpr int kLevels = 4;
+    static constexpr size_t kSlots = 1 << kBits;
+    static constexpr uint64_t kMask = kSlots - 1;
+    /// ticks covered by all levels, farther timers are placed again on cascading
+    static constexpr uint64_t kRange = 1ull << (kBits * kLevels);
+
+    uint64_t Clock() const;
+    /// The next tick with work, an occupied slot of level 0 or a cascade
+    uint64_t Next() const;
+    void Place(Node &node);
+    /// Process tick now_, timers failing to fire are retried at tick retry
+    void Tick(uint64_t retry);
+    void Loop();
+    static void Unlink(Link &link);
+    static void Take(Link &dst, Link &src);
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cond_;
+    std::thread thread_;
+    bool stop_ = false;
+    uint64_t now_ = 0;                              /// ticks processed
+    uint64_t wake_ = 0;                             /// tick thread sleeps until
+    std::chrono::steady_clock::time_point base_;    /// time of tick 0
+    size_t num_ = 0;                                /// armed timers
+    Link slots_[kLevels][kSlots];
+};
+
+}
+}
+
+#endif // _HFSM_CPP_TIMER_WHEEL_H
@@ -23,8 +23,10 @@
 #include <EventHub.h>
 
 #include "log.h"
+#include "probe.h"
 #include "State.h"
 #include "Transition.h"
+#include "StateMachine.h"
 
 namespace utils {
 namespace hfsm {
@@ -34,6 +36,11 @@ Transition::Transition(const SpState &source, const SpState &target)
 {
 }
 
+Transition::Transition(const SpState &source, const SpState &target, uint32_t trigger)
+  : src_(source), tar_(target), has_trigger_(true), trigger_(trigger)
+{
+}
+
 Transition::~Transition()
 {
 }
@@ -41,66 +48,68 @@ Transition::~Transition()
 bool Transition::operator==(const Transition& other) const
 {
     return (src_ == other.src_)
-        && (tar_ == other.tar_);
+        && (tar_ == other.tar_)
+        && (has_trigger_ == other.has_trigger_)
+        && (trigger_ == other.trigger_);
 }
 
-SpState Transition::Source() const
+const SpState& Transition::Source() const
 {
     return src_;
 }
 
-SpState Transition::Target() const
+const SpState& Transition::Target() const
 {
     return tar_;
 }
 
-SpState Transition::Transit(StateMachine *sm)
+State* Transition::Transit(StateMachine *sm, State *source)
 {
+    HFSM_PROBE3(transit, sm, source, tar_.get());
     /*! State self-transition */
     if (src_ == tar_) {
-        Effect(sm);
-        return tar_;
+        sm->Effect(this);
+        return tar_.get();
     }
 
-    /*! fetch all parents of current state */
-    std::list<SpState> from_list;
-    auto cur = src_;
-    while (cur) {
-        from_list.push_back(cur);
-        cur = cur->Parent();
+    /*! find the common parent of both states by depth */
+    State *from = source, *to = tar_.get();
+    size_t from_level = from ? from->depth_ + 1 : 0;
+    size_t to_level = to ? to->depth_ + 1 : 0;
+    for (; from_level > to_level; --from_level) {
+        from = from->parent_.get();
     }
-
-    /*! fetch all parents of target state */
-    std::list<SpState> to_list;
-    cur = tar_;
-    while (cur) {
-        to_list.push_back(cur);
-        cur = cur->Parent();
+    for (; to_level > from_level; --to_level) {
+        to = to->parent_.get();
     }
-
-    /*! remove the common tail */
-    while (from_list.size() && to_list.size()
-        && from_list.back() == to_list.back()) {
-        from_list.pop_back();
-        to_list.pop_back();
+    while (from != to) {
+        from = from->parent_.get();
+        to = to->parent_.get();
     }
 
     /*! invoke exit action */
-    for (auto it = from_list.begin();
-            it != from_list.end(); ++it) {
-        (*it)->Exit(sm);
+    State *child = nullptr;
+    for (State *cur = source; cur != from; child = cur, cur = cur->parent_.get()) {
+        sm->ExitState(cur, child, source);
     }
 
     /*! invoke effect action */
-    Effect(sm);
+    sm->Effect(this);
 
     /*! invoke entry action */
-    for (auto it = to_list.rbegin();
-            it != to_list.rend(); ++it) {
-        (*it)->Entry(sm);
-    }
+    Enter(from, tar_.get(), sm);
 
-    return tar_;
+    return tar_.get();
+}
+
+void Transition::Enter(State *from, State *to, StateMachine *sm)
+{
+    /*! enter from the outermost state, depth is bounded by hierarchy */
+    if (to == from) {
+        return;
+    }
+    Enter(from, to->parent_.get(), sm);
+    sm->EnterState(to);
 }
 
 }
@@ -39,6 +39,12 @@ class Transition
 
   public:
     Transition(const SpState &source, const SpState &target);
+    /**
+     * @brief create transition with a declarative trigger.
+     *        it is triggered by any event whose ID equals trigger,
+     *        and Triggered will not be called.
+     */
+    Transition(const SpState &source, const SpState &target, uint32_t trigger);
     virtual ~Transition();
     bool operator==(const Transition& other) const;
     /**
@@ -47,14 +53,28 @@ class Transition
      * @param none.
      * @return source state.
      */
-    SpState Source() const;
+    const SpState& Source() const;
     /**
      * @brief get destination state of transition.
      *
      * @param none.
      * @return destination state.
      */
-    SpState Target() const;
+    const SpState& Target() const;
+    /**
+     * @brief transition has a declarative trigger or not.
+     *
+     * @param none.
+     * @return true if it is triggered by event ID.
+     */
+    bool HasTrigger() const { return has_trigger_; }
+    /**
+     * @brief get event ID that triggers this transition.
+     *
+     * @param none.
+     * @return event ID, valid only if HasTrigger.
+     */
+    uint32_t Trigger() const { return trigger_; }
 
   public:
     /**
@@ -91,16 +111,28 @@ class Transition
      * @return true if event triggered this transtion.
      */
     virtual bool Triggered(const SpEvent &evt, StateMachine *sm) = 0;
+    /**
+     * @brief Invoked once while SM is starting, before any action.
+     *
+     * @param[in] sm: base class of state machine.
+     * @return false if the transition can't be run by this SM.
+     */
+    virtual bool Bind(StateMachine *sm) { return true; }
 
   private:
-    SpState Transit(StateMachine *sm);
+    /// exit from source, the source state or a composite holding it
+    State* Transit(StateMachine *sm, State *source);
+    static void Enter(State *from, State *to, StateMachine *sm);
 
   private:
     SpState src_;
     SpState tar_;
+    bool has_trigger_ = false;
+    uint32_t trigger_ = 0;
 };
 
-/// Transition template that can bind actions of transition to derived class of SM
+/// Transition template that can bind actions of transition to derived class of SM.
+/// The type of SM is checked by Bind, so actions are called directly.
 template <typename SM>
 class TransitionImpl final : public Transition
 {
@@ -116,12 +148,15 @@ class TransitionImpl final : public Transition
 
   public:
     TransitionImpl(const SpState &source, const SpState &target, TransAction &action);
+    TransitionImpl(const SpState &source, const SpState &target, uint32_t trigger,
+        const TransAction &action);
     virtual ~TransitionImpl();
 
   protected:
     virtual bool Guard(StateMachine *sm) override;
     virtual void Effect(StateMachine *sm) override;
     virtual bool Triggered(const SpEvent &evt, StateMachine *sm) override;
+    virtual bool Bind(StateMachine *sm) override;
 
   private:
     TransAction action_ = {};
@@ -133,6 +168,13 @@ TransitionImpl<SM>::TransitionImpl(const SpState &source, const SpState &target,
 {
 }
 
+template <typename SM>
+TransitionImpl<SM>::TransitionImpl(const SpState &source, const SpState &target,
+    uint32_t trigger, const TransAction &action)
+  : Transition(source, target, trigger), action_(action)
+{
+}
+
 template <typename SM>
 TransitionImpl<SM>::~TransitionImpl() {}
 
@@ -140,7 +182,7 @@ template <typename SM>
 bool TransitionImpl<SM>::Guard(StateMachine *sm)
 {
     if (action_.guard) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         return (obj->*action_.guard)();
     }
     return true;
@@ -150,7 +192,7 @@ template <typename SM>
 void TransitionImpl<SM>::Effect(StateMachine *sm)
 {
     if (action_.effect) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         (obj->*action_.effect)();
     }
 }
@@ -159,12 +201,18 @@ template <typename SM>
 bool TransitionImpl<SM>::Triggered(const SpEvent &evt, StateMachine *sm)
 {
     if (action_.triggered) {
-        SM *obj = dynamic_cast<SM*>(sm);
+        SM *obj = static_cast<SM*>(sm);
         return (obj->*action_.triggered)(evt);
     }
     return false;
 }
 
+template <typename SM>
+bool TransitionImpl<SM>::Bind(StateMachine *sm)
+{
+    return dynamic_cast<SM*>(sm) != nullptr;
+}
+
 }
 }
 
@@ -21,6 +21,7 @@
 #ifndef HIERARCHICAL_FINITE_STATE_MACHINE_H
 #define HIERARCHICAL_FINITE_STATE_MACHINE_H
 
+#include <stdio.h>
 #include "state.h"
 
 #ifdef __cplusplus
@@ -28,6 +29,7 @@ extern "C" {
 #endif /* __cplusplus */
 
 #define HFSM_EVENT_USR_BASE EVENT_ID_USER_BASE
+#define HFSM_MSG_DATA_SIZE  (48)    /*!< size of inline payload of message */
 
 enum error_code {
     HFSM_SUCC           = UTILS_SUCC,
@@ -36,22 +38,222 @@ enum error_code {
     HFSM_ERR_ALLOCATOR,
     HFSM_ERR_NO_STATE,
     HFSM_ERR_EVTHUB,
+    HFSM_ERR_DUP_STATE,
+    HFSM_ERR_MODE,
+    HFSM_ERR_EXECUTOR,
+    HFSM_ERR_MSG_SIZE,
+    HFSM_ERR_OVERFLOW,          /*!< policy is not supported by queue */
+    HFSM_ERR_TIMER,
+    HFSM_ERR_REGION,            /*!< state is not in a new region */
+    HFSM_ERR_HISTORY,           /*!< unknown kind of history */
+    HFSM_ERR_STATS,             /*!< built without HFSM_STATS */
+    HFSM_ERR_TRACE,             /*!< trace is disabled or file failed */
+    HFSM_ERR_SNAPSHOT,          /*!< stream failed or snapshot mismatched */
+};
+
+enum hfsm_mode {
+    HFSM_MODE_THREAD    = 0,    /*!< events are handled by evthub thread */
+    HFSM_MODE_INLINE,           /*!< events are handled by caller thread */
+};
+
+enum hfsm_history {
+    HFSM_HISTORY_NONE = 0,
+    HFSM_HISTORY_SHALLOW,       /*!< restore the last active child */
+    HFSM_HISTORY_DEEP,          /*!< restore the last active descendant */
+};
+
+enum hfsm_queue_type {
+    HFSM_QUEUE_EVTHUB   = 0,    /*!< EventHub in priority mode */
+    HFSM_QUEUE_RING,            /*!< lock-free rings per priority band */
+    HFSM_QUEUE_EXECUTOR,        /*!< rings served by a shared executor */
+};
+
+/*! what to do on sending to a full queue, only events sent by users are
+    dropped, a band whose oldest event is internal to HFSM (start, timer
+    expiry or snapshot request) is not dropped from until it is handled */
+enum hfsm_overflow {
+    HFSM_OVERFLOW_REJECT = 0,   /*!< fail to send */
+    HFSM_OVERFLOW_BLOCK,        /*!< wait for room up to timeout_ms */
+    /*! discard the oldest event of the same priority band, ring and
+        executor queues only */
+    HFSM_OVERFLOW_DROP_OLDEST,
+    /*! discard the oldest event of the lowest band not higher than the
+        new one, ring and executor queues only */
+    HFSM_OVERFLOW_DROP_LOWEST,
 };
 
 typedef void* hfsm_handle;
+typedef void* hfsm_executor;
+
+/*! refcounted buffer passed by reference, embedded in caller's buffer */
+typedef struct hfsm_payload {
+    void *data;
+    size_t size;
+    /*! called on the thread dropping the last reference */
+    void (*release)(struct hfsm_payload *payload);
+    int refs;                   /*!< managed by hfsm_payload_* */
+} hfsm_payload;
+
+/*! event carrying a payload, inline data is copied into the queue */
+typedef struct {
+    event_t evt;                /*!< id and priority, param is set by HFSM */
+    hfsm_payload *payload;      /*!< large payload referenced until handled */
+    unsigned char size;         /*!< bytes used in data */
+    unsigned char data[HFSM_MSG_DATA_SIZE];
+} hfsm_msg_t;
+
+/*! byte stream of snapshots, read and write transfer all size bytes
+    and return 0, or return non-zero */
+typedef struct {
+    void *ctx;
+    int (*write)(void *ctx, const void *data, size_t size);
+    int (*read)(void *ctx, void *data, size_t size);
+} hfsm_stream;
 
 typedef struct {
     unsigned char max_states;
     void *userdata;
+    unsigned char mode;         /*!< enum hfsm_mode */
+    unsigned char queue;        /*!< enum hfsm_queue_type, HFSM_MODE_THREAD only */
+    hfsm_executor executor;     /*!< HFSM_QUEUE_EXECUTOR or parallel regions */
+    unsigned int capacity;      /*!< events in queue, 0 for default (64) */
+    unsigned char overflow;     /*!< enum hfsm_overflow */
+    /*! for HFSM_OVERFLOW_BLOCK, 0 waits forever. Sending from state
+        actions to a full queue of the same HFSM waits until timeout */
+    unsigned int timeout_ms;
+    /*! records kept in binary trace ring, rounded up to a power of 2,
+        0 disables tracing */
+    unsigned int trace_records;
+    /*! write userdata into a snapshot, called by the thread handling
+        events, may be NULL */
+    int (*save)(void *userdata, const hfsm_stream *out);
+    /*! read back what save wrote, reads beyond it fail, may be NULL */
+    int (*load)(void *userdata, const hfsm_stream *in);
+    /*! event IDs with latency histograms of their own, HFSM_STATS only,
+        0 for default (8). Histograms are allocated as IDs are first
+        handled, a slot of table costs a pointer until then */
+    unsigned int latency_events;
 } hfsm_param;
 
+/*! counters of overflow, read by hfsm_get_queue_stats */
+typedef struct {
+    unsigned long rejected;     /*!< sends failed for full queue */
+    unsigned long dropped;      /*!< queued events discarded for new ones */
+    unsigned long blocked;      /*!< sends waited for room */
+    unsigned long timeouts;     /*!< blocked sends timed out */
+} hfsm_queue_stats;
+
+/*! counters of a state, kept only if HFSM is built with HFSM_STATS,
+    read by hfsm_get_state_stats */
+typedef struct {
+    unsigned long entries;
+    unsigned long exits;
+    unsigned long invokes;      /*!< process called */
+    unsigned long handled;      /*!< process returned true */
+    unsigned long transits;     /*!< transitions to other states by process */
+    unsigned long callback_ns;  /*!< time spent in entry, exit and process */
+} hfsm_state_stats;
+
+enum hfsm_latency_kind {
+    HFSM_LATENCY_WAIT   = 0,    /*!< from sent to handling, queued events only */
+    HFSM_LATENCY_HANDLE,        /*!< handling by states */
+    HFSM_LATENCY_TOTAL,         /*!< from sent to handled, queued events only */
+    HFSM_LATENCY_KINDS
+};
+
+/*! latency of events in nanoseconds, kept only if HFSM is built with
+    HFSM_STATS, read by hfsm_get_latency. Percentiles are upper bounds of
+    histogram buckets within 1/8 of the value, never above max_ns. */
+typedef struct {
+    unsigned long count;
+    unsigned long mean_ns;
+    unsigned long max_ns;
+    unsigned long p50_ns;
+    unsigned long p99_ns;
+    unsigned long p999_ns;
+} hfsm_latency;
+
+enum hfsm_trace_kind {
+    HFSM_TRACE_HANDLED  = 0,    /*!< processed by handler */
+    HFSM_TRACE_UNHANDLED,       /*!< no state processed it */
+    HFSM_TRACE_DEFERRED,        /*!< parked until a transition */
+};
+
+/*! record of binary trace, handler and target are the same as source
+    unless kind is HFSM_TRACE_HANDLED */
+typedef struct {
+    uint64_t seq;               /*!< position in ring from 1 */
+    uint64_t ns;                /*!< CLOCK_MONOTONIC */
+    uint32_t event;
+    state_id source;            /*!< active state offered the event */
+    state_id handler;           /*!< state processing the event */
+    state_id target;            /*!< state requested by handler */
+    unsigned char kind;         /*!< enum hfsm_trace_kind */
+} hfsm_trace_record;
+
+#define HFSM_TRACE_MAGIC    "HFSMTRC1"
+
+/*! header of trace file written by hfsm_dump_trace, followed by count
+    records from the oldest, all in byte order of the writer */
+typedef struct {
+    char magic[8];              /*!< HFSM_TRACE_MAGIC without '\0' */
+    uint32_t record_size;       /*!< sizeof(hfsm_trace_record) */
+    uint32_t count;
+    uint64_t written;           /*!< records since created, older ones
+                                     are overwritten */
+} hfsm_trace_header;
+
+#define HFSM_SNAPSHOT_MAGIC     "HFSN"
+#define HFSM_SNAPSHOT_VERSION   (1)
+#ifndef HFSM_SNAPSHOT_TIMEOUT_MS
+/*! bound of waiting for dispatchers to take snapshot requests */
+#define HFSM_SNAPSHOT_TIMEOUT_MS    (5000)
+#endif
+
+/*! frame of a snapshot written by hfsm_snapshot, integers marked varint
+    are LEB128, 7 bits a byte from the lowest:
+        magic[4]            HFSM_SNAPSHOT_MAGIC without '\0'
+        u8 version          HFSM_SNAPSHOT_VERSION
+        u8 engine           0 for this API, 1 for C++ StateMachine
+        varint size         bytes of body below
+        u8 state            current state, composite holding regions
+        u8 regions          followed by the active state of each region
+        varint histories    followed by pairs of u8 composite, u8 state
+        varint deferred     followed by deferred events of
+                                varint id, u8 priority, u8 message,
+                                u8 size and data if message is 1
+        user data           the rest, written by save of hfsm_param */
+
+/**
+  *    @brief create executor
+  *
+  *    create a fixed pool of worker threads shared by HFSMs created
+  *    with HFSM_QUEUE_EXECUTOR, events of one HFSM are handled by one
+  *    worker at a time in order, idle workers steal from busy ones.
+  *    @param[out] exec: point of executor handle
+  *    @param[in]  workers: number of worker threads
+  *    @return     0 success, non-zero error code
+  */
+int hfsm_executor_create(hfsm_executor *exec, unsigned int workers);
+
+/**
+  *    @brief destroy executor
+  *
+  *    stop and join worker threads, HFSMs using the executor must be
+  *    destroyed before, and it must not be called on a worker thread.
+  *    @param[in]  exec: point of executor handle
+  *    @return     0 success, non-zero error code
+  */
+int hfsm_executor_destroy(hfsm_executor *exec);
+
 /**
   *    @brief create HFSM
   *
   *    create HFSM
   *    @param[in]  param: attribute of HFSM
   *    @param[out] hfsm: point of FHSM handle
-  *    @return     0 success, non-zero error code
+  *    @return     0 success, HFSM_ERR_OVERFLOW if overflow policy is
+  *                not supported by queue, other non-zero error code
   */
 int hfsm_create(hfsm_handle *hfsm, hfsm_param *param);
 
@@ -67,34 +269,346 @@ int hfsm_destroy(hfsm_handle *hfsm);
 /**
   *    @brief start HFSM
   *
-  *    start HFSM
+  *    start HFSM, initial state is entered on caller thread
+  *    if HFSM is created in HFSM_MODE_INLINE
   *    @param[in]  hfsm handle
   *    @param[in]  id initial state identifier
-  *    @return     0 success, non-zero error code
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is started or
+  *                restored already, other non-zero error code
   */
 int hfsm_start(hfsm_handle hfsm, state_id id);
 
 /**
   *    @brief add state
   *
-  *    add state for HFSM
+  *    add state for HFSM, parent of the state must not be changed
+  *    after HFSM started since transition paths are cached.
   *    @param[in]  hfsm: point of FHSM handle
   *    @param[in]  state: state to add
   *    @param[in]  parent: parent of state to add
-  *    @return     0 success, non-zero error code
+  *    @return     0 success, HFSM_ERR_DUP_STATE if the identifier
+  *                is already added, other non-zero error code
   */
 int hfsm_add_state(hfsm_handle hfsm, state_t *s);
 
+/**
+  *    @brief defer an event in a state
+  *
+  *    event with the identifier is parked instead of processed while the
+  *    state or any of its sub-states is current. Parked events are handled
+  *    again once, in order, after the next transition, and parked again
+  *    if the new state still defers them. Messages are parked with their
+  *    payload. Do not call it after HFSM started.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  s: state allocated by hfsm_new_state
+  *    @param[in]  id: identifier of event to defer
+  *    @return     0 success, non-zero error code
+  */
+int hfsm_defer_event(hfsm_handle hfsm, state_t *s, uint32_t id);
+
+/**
+  *    @brief add an orthogonal region to a composite state
+  *
+  *    the region is the sub-tree of the child of composite leading to
+  *    initial. While composite is current every region has an active
+  *    state, entering composite enters initial of every region. An event
+  *    is offered to every region, from its active state up to the child
+  *    of composite, and then to composite and its parents only if no
+  *    region processed it. A transition to a state of the same region
+  *    stays in it, any other one exits all regions first, a target in
+  *    another region re-enters the composite with it. Such a transition
+  *    is taken after every region processed the event, only the first
+  *    one in order of regions is taken, with or without parallel regions.
+  *    Regions can not be nested. Do not call it after HFSM started.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  composite: state holding regions
+  *    @param[in]  initial: descendant of composite entered with it
+  *    @return     0 success, HFSM_ERR_REGION if initial is not a descendant
+  *                of composite or its region is added, other non-zero
+  *                error code
+  */
+int hfsm_add_region(hfsm_handle hfsm, state_t *composite, state_t *initial);
+
+/**
+  *    @brief dispatch an event to regions of composite in parallel
+  *
+  *    regions process an event on workers of executor of HFSM and join
+  *    before the next event, so their actions must not share data. A
+  *    transition leaving a region is made after the join, the first one
+  *    by order of regions wins. Do not call it after HFSM started.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  composite: state holding regions
+  *    @param[in]  parallel: true to run regions in parallel
+  *    @return     0 success, HFSM_ERR_EXECUTOR if HFSM has no executor,
+  *                other non-zero error code
+  */
+int hfsm_set_parallel(hfsm_handle hfsm, state_t *composite, bool parallel);
+
+/**
+  *    @brief set history of a composite state
+  *
+  *    the last active sub-state is recorded when composite exits, and
+  *    restored in O(1) when a transition targets composite from out of
+  *    it, states from composite down to the restored one are entered in
+  *    order. Shallow history restores the child, which restores its own
+  *    history if it has one, deep history restores the state that was
+  *    current. Regions are entered at their initial states again.
+  *    Do not call it after HFSM started.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  composite: state allocated by hfsm_new_state
+  *    @param[in]  history: enum hfsm_history
+  *    @return     0 success, HFSM_ERR_HISTORY if history is unknown,
+  *                other non-zero error code
+  */
+int hfsm_set_history(hfsm_handle hfsm, state_t *composite, unsigned char history);
+
+/**
+  *    @brief arm a timer owned by the state whose action is running
+  *
+  *    event is sent to HFSM after ms unless the owner state exits before
+  *    the event is handled, so timers armed in entry need no cancelling.
+  *    Expiry events bypass overflow policy and are retried every tick
+  *    while queue is full. Timers are driven by the timing wheel of the
+  *    executor for HFSM_QUEUE_EXECUTOR, otherwise by a shared one.
+  *    Call it only from state actions of the HFSM.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  e: event to send on expiry
+  *    @param[in]  ms: delay in milliseconds
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is in HFSM_MODE_INLINE,
+  *                HFSM_ERR_NO_STATE if no state action is running,
+  *                other non-zero error code
+  */
+int hfsm_start_timer(hfsm_handle hfsm, const event_t *e, unsigned int ms);
+
 /**
   *    @brief send an asynchronous message
   *
   *    send an asynchronous message to HFSM
   *    @param[in]  hfsm: point of FHSM handle
   *    @param[in]  msg: message point to send
-  *    @return     0 success, non-zero error code
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is in HFSM_MODE_INLINE,
+  *                other non-zero error code
   */
 int hfsm_send_event(hfsm_handle hfsm, event_t *e);
 
+/**
+  *    @brief send asynchronous messages in one go
+  *
+  *    send messages to HFSM in order, consecutive messages with the same
+  *    priority take one slot of the queue and are handled together. A run
+  *    longer than capacity of the queue is sent in parts of capacity, so
+  *    overflow policy applies to every part.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  events: array of messages to send
+  *    @param[in]  n: number of messages
+  *    @return     0 success, non-zero error code, messages before the
+  *                failed priority run may have been sent.
+  */
+int hfsm_send_events(hfsm_handle hfsm, const event_t *events, size_t n);
+
+/**
+  *    @brief dispatch an event synchronously
+  *
+  *    handle event on caller thread before returning, HFSM must be
+  *    created in HFSM_MODE_INLINE. Caller must serialize calls on the
+  *    same HFSM, and must not call it from state actions of the HFSM.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  e: event to handle
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is in HFSM_MODE_THREAD,
+  *                other non-zero error code
+  */
+int hfsm_dispatch_event(hfsm_handle hfsm, const event_t *e);
+
+/**
+  *    @brief initialize payload with one reference held by caller
+  *
+  *    @param[in]  payload: payload to initialize
+  *    @param[in]  data: buffer of payload
+  *    @param[in]  size: size of buffer
+  *    @param[in]  release: called when the last reference drops, may be NULL
+  *    @return     none
+  */
+void hfsm_payload_init(hfsm_payload *payload, void *data, size_t size,
+    void (*release)(hfsm_payload*));
+
+/**
+  *    @brief add a reference to payload
+  *    @param[in]  payload: payload
+  *    @return     none
+  */
+void hfsm_payload_ref(hfsm_payload *payload);
+
+/**
+  *    @brief drop a reference of payload, release it if it is the last
+  *    @param[in]  payload: payload
+  *    @return     none
+  */
+void hfsm_payload_unref(hfsm_payload *payload);
+
+/**
+  *    @brief message carried by an event being handled
+  *
+  *    @param[in]  e: event passed to state actions
+  *    @return     message, NULL if the event is not sent as a message
+  */
+static inline const hfsm_msg_t* hfsm_event_msg(const event_t *e)
+{
+    /*! param of a message event refers to the message itself */
+    return e->param == (const void*)e ? (const hfsm_msg_t*)e : NULL;
+}
+
+/**
+  *    @brief send an asynchronous message
+  *
+  *    message is copied with size bytes of inline data, HFSM holds a
+  *    reference of payload until the message is handled or discarded,
+  *    so caller may drop its own reference after sending. Ring and
+  *    executor queues carry message in their slots without allocation.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  msg: message to send
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is in HFSM_MODE_INLINE,
+  *                HFSM_ERR_MSG_SIZE if size exceeds HFSM_MSG_DATA_SIZE,
+  *                other non-zero error code
+  */
+int hfsm_send_msg(hfsm_handle hfsm, const hfsm_msg_t *msg);
+
+/**
+  *    @brief dispatch a message synchronously
+  *
+  *    the same as hfsm_dispatch_event but for message.
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  msg: message to handle
+  *    @return     0 success, HFSM_ERR_MODE if HFSM is in HFSM_MODE_THREAD,
+  *                other non-zero error code
+  */
+int hfsm_dispatch_msg(hfsm_handle hfsm, const hfsm_msg_t *msg);
+
+/**
+  *    @brief read counters of queue overflow
+  *
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[out] stats: counters since HFSM created
+  *    @return     0 success, non-zero error code
+  */
+int hfsm_get_queue_stats(hfsm_handle hfsm, hfsm_queue_stats *stats);
+
+/**
+  *    @brief read counters of a state, it may be called from any thread
+  *           while HFSM is running
+  *
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  id: identifier of state
+  *    @param[out] stats: counters since state added
+  *    @return     0 success, HFSM_ERR_STATS if HFSM is built without
+  *                HFSM_STATS, HFSM_ERR_NO_STATE if state is not added,
+  *                other non-zero error code
+  */
+int hfsm_get_state_stats(hfsm_handle hfsm, state_id id, hfsm_state_stats *stats);
+
+/**
+  *    @brief read latency of all events sent or dispatched, it may be called
+  *           from any thread while HFSM is running. Events are stamped on
+  *           sending, timer expiries are not recorded.
+  *
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  kind: enum hfsm_latency_kind
+  *    @param[out] latency: percentiles since HFSM created
+  *    @return     0 success, HFSM_ERR_STATS if HFSM is built without
+  *                HFSM_STATS or kind is unknown, other non-zero error code
+  */
+int hfsm_get_latency(hfsm_handle hfsm, unsigned char kind, hfsm_latency *latency);
+
+/**
+  *    @brief read latency of events with an ID, the first latency_events
+  *           IDs handled are kept by their own, count of others is always 0
+  *
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  id: ID of events
+  *    @param[in]  kind: enum hfsm_latency_kind
+  *    @param[out] latency: percentiles since HFSM created
+  *    @return     the same as hfsm_get_latency
+  */
+int hfsm_get_event_latency(hfsm_handle hfsm, uint32_t id, unsigned char kind,
+    hfsm_latency *latency);
+
+/**
+  *    @brief write records in trace ring to a file, it may be called from
+  *           any thread while HFSM is running, records being overwritten
+  *           are left out
+  *
+  *    @param[in]  hfsm: point of FHSM handle
+  *    @param[in]  path: file to create or truncate
+  *    @return     0 success, HFSM_ERR_TRACE if trace_records is 0 or the
+  *                file failed, other non-zero error code
+  */
+int hfsm_dump_trace(hfsm_handle hfsm, const char *path);
+
+/**
+  *    @brief write the state of HFSMs to a stream, one frame by HFSM
+  *
+  *    captured are active states, regions, histories, deferred events
+  *    and user data by save of hfsm_param. Queued events are drained,
+  *    not captured: the request is queued at the lowest priority behind
+  *    them, so they are handled before HFSM is captured, and it waits
+  *    while events of higher priorities keep coming. Params of events
+  *    are left out and timers are not captured, a deferred message with
+  *    a payload fails the snapshot as the payload can not be captured.
+  *    HFSMs in HFSM_MODE_THREAD are captured by their dispatchers at once.
+  *    It must not be called from state actions, nor while an HFSM is
+  *    being destroyed.
+  *    @param[in]  hfsms: HFSMs started or restored
+  *    @param[in]  n: number of HFSMs
+  *    @param[in]  out: stream written in order of hfsms
+  *    @return     0 success, HFSM_ERR_NO_STATE if an HFSM is not started,
+  *                HFSM_ERR_MODE if called from state actions,
+  *                HFSM_ERR_EVTHUB if a dispatcher has not taken the
+  *                request in HFSM_SNAPSHOT_TIMEOUT_MS,
+  *                HFSM_ERR_SNAPSHOT if stream or save failed or a
+  *                deferred message has a payload, other non-zero error code
+  */
+int hfsm_snapshot_all(hfsm_handle *hfsms, size_t n, const hfsm_stream *out);
+
+/**
+  *    @brief write the state of an HFSM to a stream
+  *    @param[in]  hfsm: HFSM started or restored
+  *    @param[in]  out: stream
+  *    @return     the same as hfsm_snapshot_all
+  */
+int hfsm_snapshot(hfsm_handle hfsm, const hfsm_stream *out);
+
+/**
+  *    @brief start HFSMs in the state read from a stream
+  *
+  *    instead of hfsm_start, which fails on HFSMs restored, states and
+  *    settings must be added the same as HFSMs captured. No entry action is run, deferred events are kept
+  *    until the next transition. Frames are read one by one with a buffer
+  *    reused, so memory does not grow with n.
+  *    @param[in]  hfsms: HFSMs not started
+  *    @param[in]  n: number of HFSMs
+  *    @param[in]  in: stream read in order of hfsms
+  *    @return     0 success, HFSM_ERR_MODE if an HFSM is started,
+  *                HFSM_ERR_SNAPSHOT if stream or load failed or a frame
+  *                does not match its HFSM, other non-zero error code.
+  *                HFSMs before the failed one are restored.
+  */
+int hfsm_restore_all(hfsm_handle *hfsms, size_t n, const hfsm_stream *in);
+
+/**
+  *    @brief start an HFSM in the state read from a stream
+  *    @param[in]  hfsm: HFSM not started
+  *    @param[in]  in: stream
+  *    @return     the same as hfsm_restore_all
+  */
+int hfsm_restore(hfsm_handle hfsm, const hfsm_stream *in);
+
+/**
+  *    @brief stream over a file opened by caller
+  *    @param[out] stream: stream
+  *    @param[in]  fp: file
+  *    @return     none
+  */
+void hfsm_stream_file(hfsm_stream *stream, FILE *fp);
+
 /**
   *    @brief allocate a new state by HFSM
   *
@@ -0,0 +1,216 @@
+/*
+ * Worker pool shared by HFSMs
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "executor.h"
+#include "timer.h"
+
+struct worker_t {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    struct listnode tasks;      /*!< popped from head, stolen from tail */
+    struct executor_t *exec;
+    unsigned int index;
+};
+
+struct executor_t {
+    unsigned int num;
+    unsigned int started;
+    atomic_uint next;           /*!< worker for tasks from other threads */
+    atomic_long pending;        /*!< tasks queued in all workers */
+    atomic_int idle;            /*!< workers waiting for tasks */
+    atomic_int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct timer_wheel_t *wheel;    /*!< timers of HFSMs on the executor */
+    struct worker_t workers[];
+};
+
+static _Thread_local struct worker_t *cur_worker = NULL;
+static _Thread_local struct hfsm_task *cur_task = NULL;
+
+static struct hfsm_task* worker_pop(struct worker_t *w, bool steal)
+{
+    struct hfsm_task *task = NULL;
+    pthread_mutex_lock(&w->lock);
+    if (!list_empty(&w->tasks)) {
+        struct listnode *n = steal ? w->tasks.prev : w->tasks.next;
+        list_remove(n);
+        task = list_entry(n, struct hfsm_task, node);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return task;
+}
+
+static struct hfsm_task* executor_steal(struct executor_t *e,
+    struct worker_t *w)
+{
+    struct hfsm_task *task = NULL;
+    for (unsigned int i=1; i<e->num && !task; ++i) {
+        task = worker_pop(&e->workers[(w->index + i) % e->num], true);
+    }
+    return task;
+}
+
+static void executor_idle(struct executor_t *e)
+{
+    pthread_mutex_lock(&e->lock);
+    atomic_fetch_add(&e->idle, 1);
+    while (atomic_load(&e->pending) == 0 && !atomic_load(&e->stop)) {
+        pthread_cond_wait(&e->cond, &e->lock);
+    }
+    atomic_fetch_sub(&e->idle, 1);
+    pthread_mutex_unlock(&e->lock);
+}
+
+static void* worker_loop(void *arg)
+{
+    struct hfsm_task *task;
+    struct worker_t *w = (struct worker_t*)arg;
+    struct executor_t *e = w->exec;
+
+    cur_worker = w;
+    while (!atomic_load_explicit(&e->stop, memory_order_relaxed)) {
+        task = worker_pop(w, false);
+        if (task == NULL) {
+            task = executor_steal(e, w);
+        }
+        if (task == NULL) {
+            executor_idle(e);
+            continue;
+        }
+        atomic_fetch_sub(&e->pending, 1);
+        cur_task = task;
+        task->run(task);
+        cur_task = NULL;
+    }
+    cur_worker = NULL;
+    return NULL;
+}
+
+void hfsm_executor_submit(hfsm_executor exec, struct hfsm_task *task)
+{
+    struct worker_t *w;
+    struct executor_t *e = (struct executor_t*)exec;
+
+    w = cur_worker;
+    if (w == NULL || w->exec != e) {
+        w = &e->workers[atomic_fetch_add(&e->next, 1) % e->num];
+    }
+    pthread_mutex_lock(&w->lock);
+    list_add_tail(&w->tasks, &task->node);
+    pthread_mutex_unlock(&w->lock);
+
+    /*! pairs with the check of pending in executor_idle */
+    atomic_fetch_add(&e->pending, 1);
+    if (atomic_load(&e->idle) > 0) {
+        pthread_mutex_lock(&e->lock);
+        pthread_cond_signal(&e->cond);
+        pthread_mutex_unlock(&e->lock);
+    }
+}
+
+struct hfsm_task* hfsm_executor_current(void)
+{
+    return cur_task;
+}
+
+struct timer_wheel_t* hfsm_executor_wheel(hfsm_executor exec)
+{
+    return ((struct executor_t*)exec)->wheel;
+}
+
+int hfsm_executor_destroy(hfsm_executor *exec)
+{
+    struct executor_t *e;
+    RETURN_IF_NULL(exec, HFSM_ERR_NULLPTR);
+    e = (struct executor_t*)*exec;
+    RETURN_IF_NULL(e, HFSM_ERR_NULLPTR);
+
+    pthread_mutex_lock(&e->lock);
+    atomic_store(&e->stop, 1);
+    pthread_cond_broadcast(&e->cond);
+    pthread_mutex_unlock(&e->lock);
+    for (unsigned int i=0; i<e->started; ++i) {
+        pthread_join(e->workers[i].thread, NULL);
+    }
+    /*! run tasks left once more, queues of HFSMs destroyed release
+        themselves as their tasks run */
+    for (unsigned int i=0; i<e->num; ++i) {
+        struct hfsm_task *task;
+        while ((task = worker_pop(&e->workers[i], false)) != NULL) {
+            atomic_fetch_sub(&e->pending, 1);
+            cur_task = task;
+            task->run(task);
+            cur_task = NULL;
+        }
+    }
+    for (unsigned int i=0; i<e->num; ++i) {
+        pthread_mutex_destroy(&e->workers[i].lock);
+    }
+    timer_wheel_destroy(e->wheel);
+    pthread_cond_destroy(&e->cond);
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+    *exec = NULL;
+    return HFSM_SUCC;
+}
+
+int hfsm_executor_create(hfsm_executor *exec, unsigned int workers)
+{
+    struct executor_t *e;
+    RETURN_IF_NULL(exec, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(workers == 0, HFSM_ERR_EXECUTOR);
+
+    e = (struct executor_t*)calloc(1, sizeof(struct executor_t)
+        + workers * sizeof(struct worker_t));
+    RETURN_IF_NULL(e, HFSM_ERR_MALLOC);
+    e->wheel = timer_wheel_create();
+    if (e->wheel == NULL) {
+        free(e);
+        return HFSM_ERR_MALLOC;
+    }
+    e->num = workers;
+    atomic_init(&e->next, 0);
+    atomic_init(&e->pending, 0);
+    atomic_init(&e->idle, 0);
+    atomic_init(&e->stop, 0);
+    pthread_mutex_init(&e->lock, NULL);
+    pthread_cond_init(&e->cond, NULL);
+    for (unsigned int i=0; i<workers; ++i) {
+        struct worker_t *w = &e->workers[i];
+        pthread_mutex_init(&w->lock, NULL);
+        list_init(&w->tasks);
+        w->exec = e;
+        w->index = i;
+    }
+    *exec = (hfsm_executor)e;
+
+    for (; e->started<workers; ++e->started) {
+        struct worker_t *w = &e->workers[e->started];
+        if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            hfsm_executor_destroy(exec);
+            return HFSM_ERR_EXECUTOR;
+        }
+    }
+    return HFSM_SUCC;
+}
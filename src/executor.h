@@ -0,0 +1,67 @@
+/*
+ * Worker pool shared by HFSMs
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_EXECUTOR_H
+#define _HFSM_EXECUTOR_H
+
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct timer_wheel_t;
+
+/*! unit of work run by a worker, it must not be submitted again before run */
+struct hfsm_task {
+    struct listnode node;
+    void (*run)(struct hfsm_task *task);
+};
+
+/**
+  *    @brief submit a task to executor
+  *
+  *    task is queued to the worker of caller thread if caller is a worker,
+  *    otherwise it is queued to workers in turn, idle workers steal tasks
+  *    from others.
+  *    @param[in]  exec: executor
+  *    @param[in]  task: task to run
+  *    @return     none
+  */
+void hfsm_executor_submit(hfsm_executor exec, struct hfsm_task *task);
+
+/**
+  *    @brief task running on caller thread
+  *    @return     task, NULL if caller is not a worker or it is idle
+  */
+struct hfsm_task* hfsm_executor_current(void);
+
+/**
+  *    @brief timing wheel driving timers of HFSMs on executor
+  *    @param[in]  exec: executor
+  *    @return     wheel
+  */
+struct timer_wheel_t* hfsm_executor_wheel(hfsm_executor exec);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_EXECUTOR_H */
@@ -18,19 +18,64 @@
  * limitations under the License.
  */
 
+#include <time.h>
+#include <sched.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
 #include <allocator.h>
 #include <event_hub.h>
 
 #include "log.h"
 #include "hfsm.h"
+#include "queue.h"
+#include "probe.h"
+#include "timer.h"
+#include "trace.h"
+#include "latency.h"
+#include "executor.h"
+#include "snapshot.h"
 
 
 
 #define MAX_MESSAGE_NUM     (64)
+#define MAX_STATE_NUM       (256)   /*!< every value of state_id */
+#define MAX_LEVEL           (64)    /*!< max depth of state hierarchy */
+#define BLOCK_POLL_MS       (10)    /*!< recheck period of blocked sends */
+#define SNAPSHOT_BATCH      (64)    /*!< HFSMs captured at once */
+
+#define STATS_INC(handle, counter) \
+    __atomic_add_fetch(&(handle)->stats.counter, 1, __ATOMIC_RELAXED)
+
+/*! counters of a state are compiled out without HFSM_STATS */
+#ifdef HFSM_STATS
+#define STATE_STAT_ADD(s, counter, n) \
+    hfsm_stat_add(&hfsm_info(s)->stats.counter, (n))
+#define STATE_STAT_NS()     latency_now()
+#else
+#define STATE_STAT_ADD(s, counter, n)   ((void)(n))
+#define STATE_STAT_NS()     (0UL)
+#endif
+
+/*! a branch only while tracing is disabled */
+#define TRACE_WRITE(handle, ...) do { \
+    if ((handle)->trace) { trace_ring_write((handle)->trace, __VA_ARGS__); } \
+} while (0)
 
 enum hfsm_msg_e {
     HFSM_SYS_START  = EVENT_ID_SYS_BASE+1,
     HFSM_SYS_STOP   = EVENT_ID_SYS_BASE+2,
+    HFSM_SYS_BATCH  = EVENT_ID_SYS_BASE+3,
+    HFSM_SYS_MSG    = EVENT_ID_SYS_BASE+4,
+    HFSM_SYS_TIMER  = EVENT_ID_SYS_BASE+5,
+    HFSM_SYS_SNAPSHOT = EVENT_ID_SYS_BASE+6,
+};
+
+enum hfsm_timer_e {
+    TIMER_IDLE = 0,
+    TIMER_ARMED,                /*!< linked in wheel */
+    TIMER_FIRED,                /*!< expiry event is queued */
+    TIMER_CANCELLED,            /*!< owner exited after it fired */
 };
 
 struct hfsm_sys_t {
@@ -39,232 +84,2104 @@ struct hfsm_sys_t {
     int arg2;
 };
 
+/*! exit and entry sequence of a transition, compiled once per (from, to) */
+struct transit_path_t {
+    state_id to;                /*!< target, key of the path */
+    unsigned char num;          /*!< number of states in the path */
+    unsigned char exit_num;     /*!< leading states to exit, others to enter */
+    state_t *states[];
+};
+
+/*! events with the same priority queued as one message */
+struct hfsm_batch_t {
+    struct listnode node;
+    size_t num;
+#ifdef HFSM_STATS
+    unsigned long sent;         /*!< by latency_now */
+#endif
+    event_t events[];
+};
+
+/*! message copied for queues unable to carry it by value */
+struct hfsm_msg_node_t {
+    struct listnode node;
+    hfsm_msg_t msg;
+    bool plain;                 /*!< event alone, its param is kept as sent */
+#ifdef HFSM_STATS
+    unsigned long sent;         /*!< by latency_now */
+#endif
+};
+
+/*! event parked by a state deferring it, message is kept with payload */
+struct hfsm_defer_t {
+    struct listnode node;
+    hfsm_msg_t msg;
+};
+
+/*! timer owned by a state, status is guarded by lock of wheel */
+struct hfsm_timer_t {
+    struct timer_node wheel;
+    struct listnode node;       /*!< in timers of owner or free list */
+    struct listnode all;        /*!< in all timers of HFSM */
+    struct hfsm_t *handle;
+    event_t evt;
+    unsigned char status;
+};
+
+/*! snapshot taken by dispatcher for a caller waiting on it */
+struct hfsm_snap_req_t {
+    struct listnode node;       /*!< in snap_list of HFSM once abandoned */
+    struct snap_buf_t body;
+    bool done;
+    bool abandoned;             /*!< caller timed out, dispatcher releases it */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+/*! orthogonal region of a composite state */
+struct hfsm_region_t {
+    state_t *root;              /*!< child of composite holding the region */
+    state_t *initial;
+    state_t *leaf;              /*!< active state while composite is current */
+    /*! result of the event being dispatched */
+    bool handled;
+    bool transited;
+    state_t *escape;            /*!< target out of region, applied after join */
+};
+
+/*! persistent task helping to run regions in parallel */
+struct hfsm_helper_t {
+    struct hfsm_task task;
+    struct hfsm_t *handle;
+    int busy;                   /*!< submitted and not finished */
+};
+
 struct state_info_t {
     struct listnode node;
+    struct listnode timers;         /*!< armed or fired timers owned */
     struct state_t state;
+    struct transit_path_t **paths;  /*!< paths from this state sorted by target */
+    size_t path_num;
+    size_t path_cap;
+    uint32_t *defers;               /*!< identifiers of deferred events */
+    size_t defer_num;
+    struct hfsm_region_t *regions;
+    size_t region_num;
+    bool parallel;
+    unsigned char history_type;     /*!< enum hfsm_history */
+    state_t *history;               /*!< recorded on exit, NULL if none */
+#ifdef HFSM_STATS
+    hfsm_state_stats stats;         /*!< written by thread running state */
+#endif
 };
 
 ALLOCATOR_DECLARE(state, struct state_info_t);
 ALLOCATOR_IMPLEMENT(state, struct state_info_t);
 
 struct hfsm_t {
-    evthub_t evthub;
+    unsigned char mode;
+    const struct hfsm_queue_ops *queue_ops;
+    hfsm_queue queue;
+    hfsm_executor executor;
     void *user_data;
     struct state_t *cur_state;
     struct listnode state_list;
     ALLOCATOR_DEFINE(state, pool);
+    /*! states indexed by identifier, filled by hfsm_add_state */
+    struct state_t *state_table[MAX_STATE_NUM];
+    /*! batches and messages not handled yet, released on destroying */
+    pthread_mutex_t batch_lock;
+    struct listnode batch_list;
+    struct listnode msg_list;
+    struct listnode msg_free;   /*!< handled messages for reuse */
+    struct listnode snap_list;  /*!< snapshot requests abandoned by callers */
+    /*! overflow handling */
+    unsigned int capacity;
+    unsigned char overflow;
+    unsigned int timeout_ms;
+    int waiters;                /*!< blocked senders */
+    pthread_mutex_t space_lock;
+    pthread_cond_t space_cond;
+    hfsm_queue_stats stats;
+    /*! deferred events, touched only by dispatcher */
+    size_t defer_num;           /*!< deferrals declared by all states */
+    struct listnode defer_list;
+    struct listnode defer_free; /*!< recalled nodes for reuse */
+    bool transited;             /*!< state changed since last recall */
+    bool recalling;
+    /*! timers, lists of owners touched only by thread running the owner */
+    struct timer_wheel_t *wheel;
+    struct listnode timer_all;  /*!< under lock of wheel */
+    struct listnode timer_free; /*!< under lock of wheel */
+    bool timer_closed;          /*!< under lock of wheel */
+    /*! orthogonal regions, cur_state is the composite while it is set */
+    state_t *orth;
+    /*! parallel regions, job of the event is published by claim */
+    struct hfsm_helper_t *helpers;
+    size_t helper_num;
+    const event_t *job_evt;
+    unsigned int job_claim;     /*!< next region << 16 | number of regions */
+    int job_left;               /*!< regions not finished */
+    struct trace_ring_t *trace; /*!< NULL if tracing is disabled */
+    int (*save)(void *userdata, const hfsm_stream *out);
+    int (*load)(void *userdata, const hfsm_stream *in);
+#ifdef HFSM_STATS
+    struct latency_table_t *latency;
+    unsigned long sent;         /*!< stamp of event being notified */
+#endif
+};
+
+/*! state whose action is running on this thread, regions of an HFSM may
+    run on several threads */
+struct hfsm_acting_t {
+    struct hfsm_t *handle;
+    state_t *state;
 };
 
-static state_t* hfsm_find_state(struct hfsm_t *handle, state_id id)
+static __thread struct hfsm_acting_t hfsm_acting;
+
+static inline struct hfsm_acting_t hfsm_act(struct hfsm_t *handle, state_t *s)
 {
-    state_t* s = NULL;
-    struct listnode *n;
-    struct state_info_t *info;
-    list_for_each(n, &handle->state_list) {
-        info = list_entry(n, struct state_info_t, node);
-        if (info->state.id == id) {
-            s = &info->state;
-            break;
-        }
+    struct hfsm_acting_t prev = hfsm_acting;
+    hfsm_acting.handle = handle;
+    hfsm_acting.state = s;
+    return prev;
+}
+
+static inline struct state_info_t* hfsm_info(state_t *s)
+{
+    return container_of(s, struct state_info_t, state);
+}
+
+#ifdef HFSM_STATS
+/*! a state runs on one thread at a time, so counters need no locked
+    instruction, relaxed atomics only keep readers from tearing them */
+static inline void hfsm_stat_add(unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+        __ATOMIC_RELAXED);
+}
+#endif
+
+/*! invoke entry action of s */
+static void hfsm_state_entry(struct hfsm_t *handle, state_t *s)
+{
+    unsigned long begin;
+    struct hfsm_acting_t prev = hfsm_act(handle, s);
+
+    HFSM_PROBE2(entry, handle, s->id);
+    STATE_STAT_ADD(s, entries, 1);
+    if (s->action.entry) {
+        begin = STATE_STAT_NS();
+        s->action.entry(handle->user_data);
+        STATE_STAT_ADD(s, callback_ns, STATE_STAT_NS() - begin);
     }
+    hfsm_acting = prev;
+}
 
-    return s;
+/*! invoke exit action of s */
+static void hfsm_state_exit(struct hfsm_t *handle, state_t *s)
+{
+    unsigned long begin;
+    struct hfsm_acting_t prev = hfsm_act(handle, s);
+
+    HFSM_PROBE2(exit, handle, s->id);
+    STATE_STAT_ADD(s, exits, 1);
+    if (s->action.exit) {
+        begin = STATE_STAT_NS();
+        s->action.exit(handle->user_data);
+        STATE_STAT_ADD(s, callback_ns, STATE_STAT_NS() - begin);
+    }
+    hfsm_acting = prev;
 }
 
-static void hfsm_state_transit(struct hfsm_t *handle, state_id id)
+/*! whether s is root or one of its descendants */
+static bool hfsm_state_within(state_t *s, state_t *root)
 {
-    const int MAX_LEVEL = 64;
-    state_t *from[MAX_LEVEL], *to[MAX_LEVEL], *tmp, *target = NULL;
-    int from_sum = 0, to_sum = 0;
+    for (; s; s = s->parent) {
+        RETURN_IF_TRUE(s == root, true);
+    }
+    return false;
+}
 
-    RETURN_IF_TRUE(id == handle->cur_state->id,);
+static inline state_t* hfsm_find_state(struct hfsm_t *handle, state_id id)
+{
+    return handle->state_table[id];
+}
 
-    /*! find target state information */
-    target = hfsm_find_state(handle, id);
-    RETURN_IF_NULL(target,);
+static int hfsm_compile_path(state_t *from, state_t *to,
+    state_t **path, int *exit_num)
+{
+    state_t *up[MAX_LEVEL], *down[MAX_LEVEL], *tmp;
+    int up_sum = 0, down_sum = 0, num = 0;
 
     /*! fetch all parents of current state */
-    tmp = handle->cur_state;
-    while (tmp) {
-        from[from_sum++] = tmp;
+    tmp = from;
+    while (tmp && up_sum < MAX_LEVEL) {
+        up[up_sum++] = tmp;
         tmp = tmp->parent;
     }
 
     /*! fetch all parents of target state */
-    tmp = target;
-    while (tmp) {
-        to[to_sum++] = tmp;
+    tmp = to;
+    while (tmp && down_sum < MAX_LEVEL) {
+        down[down_sum++] = tmp;
         tmp = tmp->parent;
     }
 
     /*! remove the common tail */
-    while (from_sum > 0 && to_sum > 0
-        && from[from_sum-1] == to[to_sum-1]) {
-        --from_sum;
-        --to_sum;
+    while (up_sum > 0 && down_sum > 0
+        && up[up_sum-1] == down[down_sum-1]) {
+        --up_sum;
+        --down_sum;
     }
 
-    /*! invoke exit action */
-    for (int i=0; i<from_sum; ++i) {
-        if (from[i]->action.exit) {
-            from[i]->action.exit(handle->user_data);
-        }
+    /*! exit from the innermost state, enter from the outermost state */
+    for (int i=0; i<up_sum; ++i) {
+        path[num++] = up[i];
+    }
+    for (int i=down_sum; i>0; --i) {
+        path[num++] = down[i-1];
     }
 
-    /*! invoke entry action */
-    for (int i=to_sum; i>0; --i) {
-        if (to[i-1]->action.entry) {
-            to[i-1]->action.entry(handle->user_data);
+    *exit_num = up_sum;
+    return num;
+}
+
+/*! index of the first cached path to target id or above */
+static size_t hfsm_path_search(const struct state_info_t *info, state_id id)
+{
+    size_t lo = 0, hi = info->path_num, mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if (info->paths[mid]->to < id) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
         }
     }
+    return lo;
+}
 
-    /*! state transition */
-    handle->cur_state = target;
+static struct transit_path_t* hfsm_transit_path(state_t *from, state_t *to)
+{
+    state_t *path[MAX_LEVEL*2];
+    struct transit_path_t *p, **paths;
+    struct state_info_t *info;
+    int num, exit_num;
+    size_t i, cap;
+
+    /*! a state reaches few targets, they are kept sorted in a small array */
+    info = container_of(from, struct state_info_t, state);
+    i = hfsm_path_search(info, to->id);
+    if (i < info->path_num && info->paths[i]->to == to->id) {
+        return info->paths[i];
+    }
+    if (info->path_num == info->path_cap) {
+        cap = info->path_cap ? info->path_cap * 2 : 4;
+        paths = (struct transit_path_t**)realloc(info->paths,
+            cap * sizeof(struct transit_path_t*));
+        RETURN_IF_NULL(paths, NULL);
+        info->paths = paths;
+        info->path_cap = cap;
+    }
+    num = hfsm_compile_path(from, to, path, &exit_num);
+    p = (struct transit_path_t*)malloc(sizeof(struct transit_path_t)
+        + num * sizeof(state_t*));
+    RETURN_IF_NULL(p, NULL);
+    p->to = to->id;
+    p->num = (unsigned char)num;
+    p->exit_num = (unsigned char)exit_num;
+    memcpy(p->states, path, num * sizeof(state_t*));
+    memmove(info->paths + i + 1, info->paths + i,
+        (info->path_num - i) * sizeof(struct transit_path_t*));
+    info->paths[i] = p;
+    ++info->path_num;
+
+    return p;
 }
 
-static void hfsm_event_invoke(const event_t *evt, void *userdata)
+static void hfsm_event_handle(struct hfsm_t *handle, const event_t *evt);
+
+/*! expiry on thread of wheel, the event is queued regardless of overflow
+    policy and retried on next tick if queue is full */
+static bool hfsm_timer_fire(struct timer_node *t)
 {
-    struct hfsm_t *handle = (struct hfsm_t*)userdata;
-    RETURN_IF_NULL(evt,);
-    RETURN_IF_NULL(userdata,);
+    struct hfsm_timer_t *timer = container_of(t, struct hfsm_timer_t, wheel);
+    struct hfsm_t *handle = timer->handle;
+    event_t evt = {
+        .id = HFSM_SYS_TIMER,
+        .priority = timer->evt.priority,
+        .param = (void*)timer
+    };
 
-    if (evt->id == HFSM_SYS_START) {
-        handle->cur_state = (state_t*)evt->param;
-        if (handle->cur_state->action.entry) {
-            handle->cur_state->action.entry(handle->user_data);
+    RETURN_IF_TRUE(handle->timer_closed, true);
+    RETURN_IF_TRUE(handle->queue_ops->send(handle->queue, &evt) != HFSM_SUCC, false);
+    timer->status = TIMER_FIRED;
+    return true;
+}
+
+/*! handle expiry event, it is stale if owner exited after firing */
+static void hfsm_timer_expire(struct hfsm_t *handle, struct hfsm_timer_t *timer)
+{
+    unsigned char status;
+    event_t evt = timer->evt;
+
+    timer_wheel_lock(handle->wheel);
+    status = timer->status;
+    timer->status = TIMER_IDLE;
+    if (status == TIMER_FIRED) {
+        list_remove(&timer->node);
+    }
+    list_add_tail(&handle->timer_free, &timer->node);
+    timer_wheel_unlock(handle->wheel);
+    if (status == TIMER_FIRED) {
+        hfsm_event_handle(handle, &evt);
+    }
+}
+
+/*! cancel timers owned by an exited state */
+static void hfsm_timer_cancel(struct hfsm_t *handle, state_t *s)
+{
+    struct listnode *c, *n;
+    struct hfsm_timer_t *timer;
+    struct state_info_t *info = container_of(s, struct state_info_t, state);
+
+    RETURN_IF_TRUE(list_empty(&info->timers),);
+    timer_wheel_lock(handle->wheel);
+    list_for_each_safe(c, n, &info->timers) {
+        timer = list_entry(c, struct hfsm_timer_t, node);
+        list_remove(c);
+        if (timer->status == TIMER_ARMED) {
+            timer_wheel_del(handle->wheel, &timer->wheel);
+            timer->status = TIMER_IDLE;
+            list_add_tail(&handle->timer_free, c);
+        } else {
+            /*! recycled when its expiry event is handled */
+            timer->status = TIMER_CANCELLED;
         }
+    }
+    timer_wheel_unlock(handle->wheel);
+}
+
+/*! record history of states[i] being exited, states before it in the
+    exit sequence are its descendants from the innermost one */
+static inline void hfsm_history_record(state_t **states, int i)
+{
+    struct state_info_t *info = hfsm_info(states[i]);
+    RETURN_IF_TRUE(info->history_type == HFSM_HISTORY_NONE,);
+    if (i == 0) {
+        info->history = NULL;
     } else {
-        state_t *s = handle->cur_state;
-        while (s) {
-            if (s->action.process) {
-                state_id id = handle->cur_state->id;
-                bool done = s->action.process(evt, handle->user_data, &id);
-                if (done) {
-                    if (id != handle->cur_state->id) {
-                        hfsm_state_transit(handle, id);
-                    }
-                    break;
-                }
-            }
-            s = s->parent;
-        }
+        info->history = info->history_type == HFSM_HISTORY_SHALLOW
+            ? states[i-1] : states[0];
     }
 }
 
-state_t* hfsm_new_state(hfsm_handle hfsm)
+/*! state restored by history of target entered from out of it */
+static state_t* hfsm_history_target(state_t *target)
 {
-    struct hfsm_t *handle;
     struct state_info_t *info;
+    for (int i=0; i<MAX_LEVEL; ++i) {
+        info = hfsm_info(target);
+        RETURN_IF_NULL(info->history, target);
+        target = info->history;
+        /*! child restored by shallow history may restore its own */
+        RETURN_IF_TRUE(info->history_type == HFSM_HISTORY_DEEP, target);
+    }
+    return target;
+}
 
-    RETURN_IF_NULL(hfsm, NULL);
-    handle = (struct hfsm_t*)hfsm;
+/*! run exit and entry actions from one state to another */
+static void hfsm_transit_states(struct hfsm_t *handle, state_t *from, state_t *to)
+{
+    state_t *path[MAX_LEVEL*2], **states;
+    struct transit_path_t *p;
+    int num, exit_num;
 
-    info = ALLOCATOR_ALLOC(state, &handle->pool);
-    RETURN_IF_NULL(info, NULL);
-    return &info->state;
+    HFSM_PROBE3(transit, handle, from->id, to->id);
+    /*! run the cached path, compile it in place if it can not be cached */
+    p = hfsm_transit_path(from, to);
+    if (p) {
+        states = p->states;
+        num = p->num;
+        exit_num = p->exit_num;
+    } else {
+        LOGW("%s() path of %u->%u is not cached", __FUNCTION__,
+            from->id, to->id);
+        num = hfsm_compile_path(from, to, path, &exit_num);
+        states = path;
+    }
+
+    /*! invoke exit action */
+    for (int i=0; i<exit_num; ++i) {
+        hfsm_state_exit(handle, states[i]);
+        hfsm_timer_cancel(handle, states[i]);
+        hfsm_history_record(states, i);
+    }
+
+    /*! invoke entry action */
+    for (int i=exit_num; i<num; ++i) {
+        hfsm_state_entry(handle, states[i]);
+    }
 }
 
-int hfsm_create(hfsm_handle *hfsm, hfsm_param *param)
+/*! enter regions if s is a composite holding them or in one of them */
+static void hfsm_regions_enter(struct hfsm_t *handle, state_t *s)
 {
-    int s;
-    struct hfsm_t *handle;
-    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
-    RETURN_IF_NULL(param, HFSM_ERR_NULLPTR);
-    handle = (struct hfsm_t*)malloc(sizeof(struct hfsm_t));
-    RETURN_IF_NULL(handle, HFSM_ERR_MALLOC);
+    state_t *c;
+    struct state_info_t *info = NULL;
+    struct hfsm_region_t *r;
 
-    s = ALLOCATOR_CREATE(state, &handle->pool, param->max_states);
-    RETURN_IF_FAIL(s, HFSM_ERR_ALLOCATOR);
+    for (c = s; c; c = c->parent) {
+        info = hfsm_info(c);
+        if (info->region_num) {
+            break;
+        }
+    }
+    RETURN_IF_NULL(c,);
+    handle->cur_state = c;
+    handle->orth = c;
+    for (size_t i=0; i<info->region_num; ++i) {
+        r = &info->regions[i];
+        if (hfsm_state_within(s, r->root)) {
+            r->leaf = s;
+        } else {
+            hfsm_transit_states(handle, c, r->initial);
+            r->leaf = r->initial;
+        }
+    }
+}
 
-    handle->user_data = param->userdata;
-    handle->cur_state = NULL;
-    list_init(&handle->state_list);
-    *hfsm = (hfsm_handle)handle;
-    return HFSM_SUCC;
+/*! exit active states of all regions, composite becomes current */
+static void hfsm_regions_exit(struct hfsm_t *handle)
+{
+    struct hfsm_region_t *r;
+    struct state_info_t *info = hfsm_info(handle->orth);
+
+    for (size_t i=0; i<info->region_num; ++i) {
+        r = &info->regions[i];
+        hfsm_transit_states(handle, r->leaf, handle->orth);
+        r->leaf = NULL;
+    }
+    handle->orth = NULL;
 }
 
-int hfsm_destroy(hfsm_handle *hfsm)
+static void hfsm_state_transit(struct hfsm_t *handle, state_id id)
 {
-    struct hfsm_t *handle;
-    struct listnode *c, *n;
+    state_t *target;
+
+    /*! find target state information */
+    target = hfsm_find_state(handle, id);
+    RETURN_IF_NULL(target,);
+
+    if (!hfsm_state_within(handle->cur_state, target)) {
+        target = hfsm_history_target(target);
+    }
+    if (handle->orth) {
+        /*! leaving regions, composite is re-entered if it is the target */
+        hfsm_regions_exit(handle);
+    } else {
+        RETURN_IF_TRUE(target == handle->cur_state,);
+    }
+    hfsm_transit_states(handle, handle->cur_state, target);
+
+    /*! state transition */
+    handle->cur_state = target;
+    hfsm_regions_enter(handle, target);
+    handle->transited = true;
+}
+
+/*! process event from s up to but excluding top, id is set to the target
+    by the action processing it */
+static bool hfsm_process_chain(struct hfsm_t *handle, state_t *s,
+    state_t *top, const event_t *evt, state_id *id)
+{
+    bool done;
+    unsigned long begin;
+    state_id from = *id;
+    state_t *leaf = s;
+    struct hfsm_acting_t prev;
+
+    for (; s != top; s = s->parent) {
+        if (s->action.process) {
+            prev = hfsm_act(handle, s);
+            begin = STATE_STAT_NS();
+            done = s->action.process(evt, handle->user_data, id);
+            STATE_STAT_ADD(s, callback_ns, STATE_STAT_NS() - begin);
+            STATE_STAT_ADD(s, invokes, 1);
+            hfsm_acting = prev;
+            if (done) {
+                STATE_STAT_ADD(s, handled, 1);
+                STATE_STAT_ADD(s, transits, *id != from);
+                TRACE_WRITE(handle, evt->id, leaf->id, s->id, *id,
+                    HFSM_TRACE_HANDLED);
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*! process event in a region, a transition out of it is left to caller */
+static void hfsm_region_step(struct hfsm_t *handle, struct hfsm_region_t *r,
+    const event_t *evt)
+{
+    state_t *target;
+    state_id id = r->leaf->id;
+
+    r->transited = false;
+    r->escape = NULL;
+    r->handled = hfsm_process_chain(handle, r->leaf, handle->orth, evt, &id);
+    RETURN_IF_TRUE(!r->handled || id == r->leaf->id,);
+    target = hfsm_find_state(handle, id);
+    RETURN_IF_NULL(target,);
+    if (!hfsm_state_within(target, r->root)) {
+        r->escape = target;
+        return;
+    }
+    if (!hfsm_state_within(r->leaf, target)) {
+        target = hfsm_history_target(target);
+    }
+    hfsm_transit_states(handle, r->leaf, target);
+    r->leaf = target;
+    r->transited = true;
+}
+
+/*! claim and run regions of the job until all are claimed */
+static void hfsm_region_work(struct hfsm_t *handle)
+{
+    unsigned int claim, next;
     struct state_info_t *info;
-    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
-    handle = (struct hfsm_t*)(*hfsm);
-    RETURN_IF_NULL(handle, HFSM_ERR_NULLPTR);
 
-    /*! Recycled all state into pool (not necessary) */
-    list_for_each_safe(c, n, &handle->state_list) {
-        info = list_entry(c, struct state_info_t, node);
-        list_remove(c);
-        ALLOCATOR_FREE(state, &handle->pool, info);
+    claim = __atomic_load_n(&handle->job_claim, __ATOMIC_ACQUIRE);
+    for (;;) {
+        next = claim >> 16;
+        RETURN_IF_TRUE(next >= (claim & 0xFFFF),);
+        if (!__atomic_compare_exchange_n(&handle->job_claim, &claim,
+                claim + (1 << 16), false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        info = hfsm_info(handle->orth);
+        hfsm_region_step(handle, &info->regions[next], handle->job_evt);
+        __atomic_sub_fetch(&handle->job_left, 1, __ATOMIC_RELEASE);
+        claim = __atomic_load_n(&handle->job_claim, __ATOMIC_ACQUIRE);
     }
+}
 
-    /*! Destory allocator of state */
-    ALLOCATOR_DESTORY(state, &handle->pool);
-    /*! Destory evthub */
-    if (handle->evthub) {
-        evthub_destory(&handle->evthub);
+/*! helper may run late and take part in the job of a later event */
+static void hfsm_helper_run(struct hfsm_task *task)
+{
+    struct hfsm_helper_t *helper = container_of(task, struct hfsm_helper_t, task);
+    hfsm_region_work(helper->handle);
+    __atomic_store_n(&helper->busy, 0, __ATOMIC_RELEASE);
+}
+
+/*! dispatcher takes part in the job, so regions never wait for a worker
+    blocked by the dispatcher itself */
+static void hfsm_regions_parallel(struct hfsm_t *handle, const event_t *evt,
+    size_t num)
+{
+    handle->job_evt = evt;
+    __atomic_store_n(&handle->job_left, (int)num, __ATOMIC_RELAXED);
+    __atomic_store_n(&handle->job_claim, (unsigned int)num, __ATOMIC_RELEASE);
+    for (size_t i=0; i+1<num && i<handle->helper_num; ++i) {
+        if (!__atomic_exchange_n(&handle->helpers[i].busy, 1, __ATOMIC_ACQ_REL)) {
+            hfsm_executor_submit(handle->executor, &handle->helpers[i].task);
+        }
     }
-    /*! Destory hfsm */
-    free(*hfsm);
-    *hfsm = NULL;
+    hfsm_region_work(handle);
+    /*! the rest are running on other threads */
+    while (__atomic_load_n(&handle->job_left, __ATOMIC_ACQUIRE) > 0) {
+        sched_yield();
+    }
+}
 
-    return HFSM_SUCC;
+/*! offer event to every region, true if any of them processed it. All
+    regions take the event first, then the escape of the first region
+    escaping is taken, the same with regions run in parallel */
+static bool hfsm_regions_process(struct hfsm_t *handle, const event_t *evt)
+{
+    bool handled = false;
+    state_t *escape = NULL;
+    struct hfsm_region_t *r;
+    struct state_info_t *info = hfsm_info(handle->orth);
+    bool parallel = info->parallel && info->region_num > 1;
+
+    if (parallel) {
+        hfsm_regions_parallel(handle, evt, info->region_num);
+    }
+    for (size_t i=0; i<info->region_num; ++i) {
+        r = &info->regions[i];
+        if (!parallel) {
+            hfsm_region_step(handle, r, evt);
+        }
+        handled = handled || r->handled;
+        if (r->transited) {
+            handle->transited = true;
+        }
+        if (escape == NULL) {
+            escape = r->escape;
+        }
+    }
+    if (escape) {
+        hfsm_state_transit(handle, escape->id);
+        return true;
+    }
+    return handled;
 }
 
-int hfsm_start(hfsm_handle hfsm, state_id id)
+static void hfsm_event_process(struct hfsm_t *handle, const event_t *evt)
 {
-    int s;
-    state_t *p;
-    struct hfsm_t *handle;
-    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
-    handle = (struct hfsm_t*)hfsm;
+    state_id id;
 
-    evthub_parm param = {
-        .max = MAX_MESSAGE_NUM,
-        .mode = EVENT_HUB_MODE_PRIORITY,
-        .user_data = (void*)handle,
-        .notifier = hfsm_event_invoke
-    };
-    p = hfsm_find_state(handle, id);
-    RETURN_IF_NULL(p, HFSM_ERR_NO_STATE);
-    s = evthub_create(&handle->evthub, &param);
-    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
-    event_t evt = {
-        .id = HFSM_SYS_START,
-        .priority = 0xFF,
-        .param = (void*)p
-    };
-    s = evthub_send(handle->evthub, &evt);
-    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
-    return HFSM_SUCC;
+    RETURN_IF_TRUE(handle->orth && hfsm_regions_process(handle, evt),);
+    id = handle->cur_state->id;
+    if (!hfsm_process_chain(handle, handle->cur_state, NULL, evt, &id)) {
+        id = handle->cur_state->id;
+        TRACE_WRITE(handle, evt->id, id, id, id, HFSM_TRACE_UNHANDLED);
+    } else if (id != handle->cur_state->id) {
+        hfsm_state_transit(handle, id);
+    }
 }
 
-int hfsm_add_state(hfsm_handle hfsm, state_t *s)
+static bool hfsm_state_defers(state_t *s, uint32_t id)
 {
-    struct hfsm_t *handle;
-    struct state_info_t *info;
-    RETURN_IF_NULL(s, HFSM_ERR_NULLPTR);
-    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
-    handle = (struct hfsm_t*)hfsm;
+    struct state_info_t *info = hfsm_info(s);
+    for (size_t i=0; i<info->defer_num; ++i) {
+        RETURN_IF_TRUE(info->defers[i] == id, true);
+    }
+    return false;
+}
 
-    info = container_of(s, struct state_info_t, state);
-    RETURN_IF_NULL(info, HFSM_ERR_ALLOCATOR);
-    list_add_tail(&handle->state_list, &info->node);
-    return HFSM_SUCC;
+static bool hfsm_event_deferred(struct hfsm_t *handle, const event_t *evt)
+{
+    struct state_info_t *info;
+    RETURN_IF_TRUE(handle->defer_num == 0, false);
+    /*! deferred while the state or any of its sub-states is active */
+    if (handle->orth) {
+        info = hfsm_info(handle->orth);
+        for (size_t i=0; i<info->region_num; ++i) {
+            for (state_t *s = info->regions[i].leaf; s != handle->orth; s = s->parent) {
+                RETURN_IF_TRUE(hfsm_state_defers(s, evt->id), true);
+            }
+        }
+    }
+    for (state_t *s = handle->cur_state; s; s = s->parent) {
+        RETURN_IF_TRUE(hfsm_state_defers(s, evt->id), true);
+    }
+    return false;
 }
 
-int hfsm_send_event(hfsm_handle hfsm, event_t *e)
+/*! park event or message, the reference of payload moves to the node */
+static bool hfsm_event_park(struct hfsm_t *handle, const event_t *evt)
 {
-    int s;
-    struct hfsm_t *handle;;
-    RETURN_IF_NULL(e, HFSM_ERR_NULLPTR);
-    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    struct hfsm_defer_t *node = NULL;
+    const hfsm_msg_t *msg = hfsm_event_msg(evt);
 
-    handle = (struct hfsm_t*)hfsm;
-    s = evthub_send(handle->evthub, e);
-    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
-    return HFSM_SUCC;
+    if (!list_empty(&handle->defer_free)) {
+        node = list_entry(list_head(&handle->defer_free),
+            struct hfsm_defer_t, node);
+        list_remove(&node->node);
+    } else {
+        node = (struct hfsm_defer_t*)malloc(sizeof(struct hfsm_defer_t));
+        RETURN_IF_NULL(node, false);
+    }
+    if (msg) {
+        node->msg.evt = msg->evt;
+        node->msg.evt.param = &node->msg;
+        node->msg.payload = msg->payload;
+        node->msg.size = msg->size;
+        memcpy(node->msg.data, msg->data, msg->size);
+    } else {
+        node->msg.evt = *evt;
+        node->msg.payload = NULL;
+        node->msg.size = 0;
+    }
+    list_add_tail(&handle->defer_list, &node->node);
+    return true;
 }
 
+/*! handle parked events again in order after a transition */
+static void hfsm_event_recall(struct hfsm_t *handle)
+{
+    struct listnode recall, *c, *n;
+    struct hfsm_defer_t *node;
 
+    /*! transitions made by recalled events are handled by the outer loop */
+    RETURN_IF_TRUE(handle->recalling,);
+    handle->recalling = true;
+    while (handle->transited && !list_empty(&handle->defer_list)) {
+        handle->transited = false;
+        /*! every parked event is recalled once, deferred again if the
+            new state still defers it */
+        list_init(&recall);
+        list_for_each_safe(c, n, &handle->defer_list) {
+            list_remove(c);
+            list_add_tail(&recall, c);
+        }
+        list_for_each_safe(c, n, &recall) {
+            node = list_entry(c, struct hfsm_defer_t, node);
+            list_remove(c);
+            hfsm_event_handle(handle, &node->msg.evt);
+            list_add_tail(&handle->defer_free, c);
+        }
+    }
+    handle->transited = false;
+    handle->recalling = false;
+}
+
+/*! process an event unless it is deferred, the reference of payload of
+    a message is released after processing */
+static void hfsm_event_handle(struct hfsm_t *handle, const event_t *evt)
+{
+    const hfsm_msg_t *msg = hfsm_event_msg(evt);
+    if (hfsm_event_deferred(handle, evt)) {
+        if (hfsm_event_park(handle, evt)) {
+            TRACE_WRITE(handle, evt->id, handle->cur_state->id,
+                handle->cur_state->id, handle->cur_state->id, HFSM_TRACE_DEFERRED);
+            return;
+        }
+        LOGE("%s() failed to defer event %u", __FUNCTION__, evt->id);
+    }
+    hfsm_event_process(handle, evt);
+    if (msg && msg->payload) {
+        hfsm_payload_unref(msg->payload);
+    }
+    hfsm_event_recall(handle);
+}
+
+/*! handle an event sent by user, its latency is recorded with HFSM_STATS,
+    sent is 0 if it was not queued */
+static void hfsm_event_timed(struct hfsm_t *handle, const event_t *evt,
+    unsigned long sent)
+{
+    HFSM_PROBE3(dispatch_begin, handle, evt->id, handle->cur_state->id);
+#ifdef HFSM_STATS
+    unsigned long begin = latency_now();
+    hfsm_event_handle(handle, evt);
+    latency_table_record(handle->latency, evt->id, sent, begin, latency_now());
+#else
+    (void)sent;
+    hfsm_event_handle(handle, evt);
+#endif
+    HFSM_PROBE3(dispatch_end, handle, evt->id, handle->cur_state->id);
+}
+
+/*! capture states, histories, deferred events and user data into body,
+    called by the thread handling events */
+static void hfsm_snapshot_body(struct hfsm_t *handle, struct snap_buf_t *b)
+{
+    size_t num = 0;
+    struct listnode *c;
+    struct hfsm_defer_t *node;
+    struct state_info_t *info;
+    hfsm_stream stream;
+    bool msg;
+
+    snap_put_u8(b, handle->cur_state->id);
+    info = handle->orth ? hfsm_info(handle->orth) : NULL;
+    snap_put_u8(b, info ? (unsigned char)info->region_num : 0);
+    for (size_t i=0; info && i<info->region_num; ++i) {
+        snap_put_u8(b, info->regions[i].leaf->id);
+    }
+    for (int i=0; i<MAX_STATE_NUM; ++i) {
+        if (handle->state_table[i] && hfsm_info(handle->state_table[i])->history) {
+            ++num;
+        }
+    }
+    snap_put_varint(b, num);
+    for (int i=0; i<MAX_STATE_NUM; ++i) {
+        if (handle->state_table[i] && hfsm_info(handle->state_table[i])->history) {
+            snap_put_u8(b, (unsigned char)i);
+            snap_put_u8(b, hfsm_info(handle->state_table[i])->history->id);
+        }
+    }
+    /*! a payload is referenced by the message, it can not be captured */
+    num = 0;
+    list_for_each(c, &handle->defer_list) {
+        node = list_entry(c, struct hfsm_defer_t, node);
+        if (node->msg.evt.param == &node->msg && node->msg.payload) {
+            b->error = HFSM_ERR_SNAPSHOT;
+            return;
+        }
+        ++num;
+    }
+    snap_put_varint(b, num);
+    list_for_each(c, &handle->defer_list) {
+        node = list_entry(c, struct hfsm_defer_t, node);
+        msg = node->msg.evt.param == &node->msg;
+        snap_put_varint(b, node->msg.evt.id);
+        snap_put_u8(b, node->msg.evt.priority);
+        snap_put_u8(b, msg);
+        if (msg) {
+            snap_put_u8(b, node->msg.size);
+            snap_put(b, node->msg.data, node->msg.size);
+        }
+    }
+    RETURN_IF_TRUE(handle->save == NULL || b->error,);
+    snap_buf_stream(b, &stream);
+    if (handle->save(handle->user_data, &stream) != HFSM_SUCC && !b->error) {
+        b->error = HFSM_ERR_SNAPSHOT;
+    }
+}
+
+static struct hfsm_snap_req_t* hfsm_snap_req_new(void)
+{
+    struct hfsm_snap_req_t *req;
+    req = (struct hfsm_snap_req_t*)calloc(1, sizeof(struct hfsm_snap_req_t));
+    RETURN_IF_NULL(req, NULL);
+    snap_buf_init(&req->body);
+    pthread_mutex_init(&req->lock, NULL);
+    pthread_cond_init(&req->cond, NULL);
+    return req;
+}
+
+static void hfsm_snap_req_free(struct hfsm_snap_req_t *req)
+{
+    snap_buf_free(&req->body);
+    pthread_cond_destroy(&req->cond);
+    pthread_mutex_destroy(&req->lock);
+    free(req);
+}
+
+static void hfsm_snapshot_take(struct hfsm_t *handle, struct hfsm_snap_req_t *req)
+{
+    bool abandoned;
+    hfsm_snapshot_body(handle, &req->body);
+    pthread_mutex_lock(&req->lock);
+    abandoned = req->abandoned;
+    req->done = true;
+    pthread_cond_signal(&req->cond);
+    pthread_mutex_unlock(&req->lock);
+    if (abandoned) {
+        pthread_mutex_lock(&handle->batch_lock);
+        list_remove(&req->node);
+        pthread_mutex_unlock(&handle->batch_lock);
+        hfsm_snap_req_free(req);
+    }
+}
+
+static void hfsm_event_invoke(const event_t *evt, void *userdata)
+{
+    unsigned long sent = 0;
+    struct hfsm_t *handle = (struct hfsm_t*)userdata;
+    RETURN_IF_NULL(evt,);
+    RETURN_IF_NULL(userdata,);
+#ifdef HFSM_STATS
+    sent = handle->sent;
+    handle->sent = 0;
+#endif
+
+    if (evt->id == HFSM_SYS_START) {
+        state_t *s = (state_t*)evt->param;
+        handle->cur_state = s;
+        hfsm_state_entry(handle, s);
+        hfsm_regions_enter(handle, s);
+    } else if (evt->id == HFSM_SYS_BATCH) {
+        struct hfsm_batch_t *batch = (struct hfsm_batch_t*)evt->param;
+#ifdef HFSM_STATS
+        sent = batch->sent;
+#endif
+        for (size_t i=0; i<batch->num; ++i) {
+            hfsm_event_timed(handle, &batch->events[i], sent);
+        }
+        pthread_mutex_lock(&handle->batch_lock);
+        list_remove(&batch->node);
+        pthread_mutex_unlock(&handle->batch_lock);
+        free(batch);
+    } else if (evt->id == HFSM_SYS_TIMER) {
+        hfsm_timer_expire(handle, (struct hfsm_timer_t*)evt->param);
+    } else if (evt->id == HFSM_SYS_SNAPSHOT) {
+        hfsm_snapshot_take(handle, (struct hfsm_snap_req_t*)evt->param);
+    } else if (evt->id == HFSM_SYS_MSG) {
+        struct hfsm_msg_node_t *node = (struct hfsm_msg_node_t*)evt->param;
+#ifdef HFSM_STATS
+        sent = node->sent;
+#endif
+        if (node->plain) {
+            hfsm_event_timed(handle, &node->msg.evt, sent);
+        } else {
+            node->msg.evt.param = &node->msg;
+#ifdef HFSM_STATS
+            handle->sent = sent;
+#endif
+            hfsm_event_invoke(&node->msg.evt, handle);
+        }
+        pthread_mutex_lock(&handle->batch_lock);
+        list_remove(&node->node);
+        list_add_tail(&handle->msg_free, &node->node);
+        pthread_mutex_unlock(&handle->batch_lock);
+    } else {
+        hfsm_event_timed(handle, evt, sent);
+    }
+}
+
+static int hfsm_send_batch(struct hfsm_t *handle, const event_t *events, size_t n)
+{
+    int s;
+    struct hfsm_batch_t *batch;
+
+    batch = (struct hfsm_batch_t*)malloc(sizeof(struct hfsm_batch_t)
+        + n * sizeof(event_t));
+    RETURN_IF_NULL(batch, HFSM_ERR_MALLOC);
+    batch->num = n;
+    memcpy(batch->events, events, n * sizeof(event_t));
+#ifdef HFSM_STATS
+    batch->sent = latency_now();
+#endif
+
+    event_t evt = {
+        .id = HFSM_SYS_BATCH,
+        .priority = events[0].priority,
+        .param = (void*)batch
+    };
+    pthread_mutex_lock(&handle->batch_lock);
+    list_add_tail(&handle->batch_list, &batch->node);
+    pthread_mutex_unlock(&handle->batch_lock);
+
+    s = handle->queue_ops->send(handle->queue, &evt);
+    if (s != HFSM_SUCC) {
+        /*! never seen by queue, nobody else refers to it */
+        pthread_mutex_lock(&handle->batch_lock);
+        list_remove(&batch->node);
+        pthread_mutex_unlock(&handle->batch_lock);
+        free(batch);
+    }
+    return s;
+}
+
+/*! queue a message in a recycled node, or an event alone if plain */
+static int hfsm_send_msg_node(struct hfsm_t *handle, const hfsm_msg_t *msg,
+    bool plain)
+{
+    int s;
+    struct hfsm_msg_node_t *node = NULL;
+
+    pthread_mutex_lock(&handle->batch_lock);
+    if (!list_empty(&handle->msg_free)) {
+        node = list_entry(list_head(&handle->msg_free),
+            struct hfsm_msg_node_t, node);
+        list_remove(&node->node);
+    }
+    pthread_mutex_unlock(&handle->batch_lock);
+    if (node == NULL) {
+        node = (struct hfsm_msg_node_t*)malloc(sizeof(struct hfsm_msg_node_t));
+        RETURN_IF_NULL(node, HFSM_ERR_MALLOC);
+    }
+    node->msg.evt = msg->evt;
+    node->msg.payload = msg->payload;
+    node->msg.size = msg->size;
+    memcpy(node->msg.data, msg->data, msg->size);
+    node->plain = plain;
+#ifdef HFSM_STATS
+    node->sent = latency_now();
+#endif
+
+    event_t evt = {
+        .id = HFSM_SYS_MSG,
+        .priority = msg->evt.priority,
+        .param = (void*)node
+    };
+    pthread_mutex_lock(&handle->batch_lock);
+    list_add_tail(&handle->msg_list, &node->node);
+    pthread_mutex_unlock(&handle->batch_lock);
+
+    s = handle->queue_ops->send(handle->queue, &evt);
+    if (s != HFSM_SUCC) {
+        pthread_mutex_lock(&handle->batch_lock);
+        list_remove(&node->node);
+        list_add_tail(&handle->msg_free, &node->node);
+        pthread_mutex_unlock(&handle->batch_lock);
+    }
+    return s;
+}
+
+/*! queue events once, or message if msg is not NULL */
+static int hfsm_queue_try(struct hfsm_t *handle, const event_t *events,
+    size_t n, const hfsm_msg_t *msg)
+{
+    const struct hfsm_queue_ops *ops = handle->queue_ops;
+    if (msg) {
+        return ops->send_msg ? ops->send_msg(handle->queue, msg)
+            : hfsm_send_msg_node(handle, msg, false);
+    }
+    if (n == 1) {
+#ifdef HFSM_STATS
+        /*! EventHub carries event_t only, a recycled node carries the stamp */
+        if (!ops->send_batch) {
+            hfsm_msg_t alone = { .evt = events[0], .payload = NULL, .size = 0 };
+            return hfsm_send_msg_node(handle, &alone, true);
+        }
+#endif
+        return ops->send(handle->queue, events);
+    }
+    return ops->send_batch ? ops->send_batch(handle->queue, events, n)
+        : hfsm_send_batch(handle, events, n);
+}
+
+static void timespec_add_ms(struct timespec *ts, unsigned int ms)
+{
+    ts->tv_sec += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000;
+    if (ts->tv_nsec >= 1000000000) {
+        ts->tv_sec += 1;
+        ts->tv_nsec -= 1000000000;
+    }
+}
+
+static inline bool timespec_reached(const struct timespec *now,
+    const struct timespec *deadline)
+{
+    return now->tv_sec > deadline->tv_sec || (now->tv_sec == deadline->tv_sec
+        && now->tv_nsec >= deadline->tv_nsec);
+}
+
+/*! wait for room until timeout, woken by hfsm_event_notify */
+static int hfsm_queue_wait(struct hfsm_t *handle, const event_t *events,
+    size_t n, const hfsm_msg_t *msg)
+{
+    int s;
+    struct timespec now, deadline, wake;
+
+    STATS_INC(handle, blocked);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    timespec_add_ms(&deadline, handle->timeout_ms);
+
+    pthread_mutex_lock(&handle->space_lock);
+    __atomic_add_fetch(&handle->waiters, 1, __ATOMIC_SEQ_CST);
+    while ((s = hfsm_queue_try(handle, events, n, msg)) == HFSM_QUEUE_ERR_FULL) {
+        /*! wake up periodically in case the queue frees room after
+            notifier returns */
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (handle->timeout_ms && timespec_reached(&now, &deadline)) {
+            break;
+        }
+        wake = now;
+        timespec_add_ms(&wake, BLOCK_POLL_MS);
+        pthread_cond_timedwait(&handle->space_cond, &handle->space_lock, &wake);
+    }
+    __atomic_sub_fetch(&handle->waiters, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&handle->space_lock);
+    if (s == HFSM_QUEUE_ERR_FULL) {
+        STATS_INC(handle, timeouts);
+    }
+    return s;
+}
+
+/*! queue events or message by overflow policy of HFSM */
+static int hfsm_queue_push(struct hfsm_t *handle, const event_t *events,
+    size_t n, const hfsm_msg_t *msg)
+{
+    int s;
+    unsigned char priority = msg ? msg->evt.priority : events[0].priority;
+
+    if (msg) {
+        HFSM_PROBE3(send, handle, msg->evt.id, priority);
+    }
+    for (size_t i=0; events && i<n; ++i) {
+        HFSM_PROBE3(send, handle, events[i].id, events[i].priority);
+    }
+    s = hfsm_queue_try(handle, events, n, msg);
+
+    if (s == HFSM_QUEUE_ERR_FULL) {
+        switch (handle->overflow) {
+        case HFSM_OVERFLOW_BLOCK:
+            s = hfsm_queue_wait(handle, events, n, msg);
+            break;
+        case HFSM_OVERFLOW_DROP_OLDEST:
+        case HFSM_OVERFLOW_DROP_LOWEST:
+            /*! bounded since other senders may take the room, nothing
+                to drop may also be transient while room is reserved by
+                senders not yet finished */
+            for (size_t i=0; s == HFSM_QUEUE_ERR_FULL
+                && i < handle->capacity + n; ++i) {
+                if (handle->queue_ops->drop(handle->queue,
+                        handle->overflow, priority) == HFSM_SUCC) {
+                    STATS_INC(handle, dropped);
+                } else {
+                    sched_yield();
+                }
+                s = hfsm_queue_try(handle, events, n, msg);
+            }
+            if (s == HFSM_QUEUE_ERR_FULL) {
+                STATS_INC(handle, rejected);
+            }
+            break;
+        default:
+            STATS_INC(handle, rejected);
+            break;
+        }
+    }
+    if (s == HFSM_SUCC || s == HFSM_ERR_MALLOC) {
+        return s;
+    }
+    return HFSM_ERR_EVTHUB;
+}
+
+#ifdef HFSM_STATS
+/*! stamp of the event about to be notified */
+static void hfsm_event_stamped(unsigned long sent, void *userdata)
+{
+    ((struct hfsm_t*)userdata)->sent = sent;
+}
+#endif
+
+/*! notifier of queues, wakes blocked senders up after every event */
+static void hfsm_event_notify(const event_t *evt, void *userdata)
+{
+    struct hfsm_t *handle = (struct hfsm_t*)userdata;
+    hfsm_event_invoke(evt, userdata);
+    /*! pairs with increasing waiters before retrying in hfsm_queue_wait */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&handle->waiters, __ATOMIC_RELAXED) > 0) {
+        pthread_mutex_lock(&handle->space_lock);
+        pthread_cond_broadcast(&handle->space_cond);
+        pthread_mutex_unlock(&handle->space_lock);
+    }
+}
+
+static void hfsm_free_paths(struct state_info_t *info)
+{
+    for (size_t i=0; i<info->path_num; ++i) {
+        free(info->paths[i]);
+    }
+    free(info->paths);
+    info->paths = NULL;
+    info->path_num = 0;
+    info->path_cap = 0;
+}
+
+state_t* hfsm_new_state(hfsm_handle hfsm)
+{
+    struct hfsm_t *handle;
+    struct state_info_t *info;
+
+    RETURN_IF_NULL(hfsm, NULL);
+    handle = (struct hfsm_t*)hfsm;
+
+    info = ALLOCATOR_ALLOC(state, &handle->pool);
+    RETURN_IF_NULL(info, NULL);
+    info->paths = NULL;
+    info->path_num = 0;
+    info->path_cap = 0;
+    info->defers = NULL;
+    info->defer_num = 0;
+    info->regions = NULL;
+    info->region_num = 0;
+    info->parallel = false;
+    info->history_type = HFSM_HISTORY_NONE;
+    info->history = NULL;
+#ifdef HFSM_STATS
+    memset(&info->stats, 0, sizeof(info->stats));
+#endif
+    list_init(&info->timers);
+    return &info->state;
+}
+
+/*! release what hfsm_create allocated after state pool in reverse order,
+    fields not allocated yet are NULL */
+static void hfsm_create_undo(struct hfsm_t *handle)
+{
+    trace_ring_destroy(handle->trace);
+#ifdef HFSM_STATS
+    latency_table_destroy(handle->latency);
+#endif
+    ALLOCATOR_DESTORY(state, &handle->pool);
+    free(handle);
+}
+
+int hfsm_create(hfsm_handle *hfsm, hfsm_param *param)
+{
+    int s;
+    struct hfsm_t *handle;
+    const struct hfsm_queue_ops *ops;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(param, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(param->queue == HFSM_QUEUE_EXECUTOR
+        && param->executor == NULL, HFSM_ERR_EXECUTOR);
+    switch (param->queue) {
+    case HFSM_QUEUE_RING:
+        ops = &hfsm_ring_ops;
+        break;
+    case HFSM_QUEUE_EXECUTOR:
+        ops = &hfsm_executor_ops;
+        break;
+    default:
+        ops = &hfsm_evthub_ops;
+        break;
+    }
+    RETURN_IF_TRUE(param->overflow > HFSM_OVERFLOW_DROP_LOWEST, HFSM_ERR_OVERFLOW);
+    RETURN_IF_TRUE(param->overflow >= HFSM_OVERFLOW_DROP_OLDEST
+        && ops->drop == NULL, HFSM_ERR_OVERFLOW);
+    handle = (struct hfsm_t*)malloc(sizeof(struct hfsm_t));
+    RETURN_IF_NULL(handle, HFSM_ERR_MALLOC);
+
+    s = ALLOCATOR_CREATE(state, &handle->pool, param->max_states);
+    if (s != 0) {
+        free(handle);
+        return HFSM_ERR_ALLOCATOR;
+    }
+    handle->trace = NULL;
+#ifdef HFSM_STATS
+    handle->latency = latency_table_create(param->latency_events
+        ? param->latency_events : LATENCY_EVENT_NUM);
+    if (handle->latency == NULL) {
+        hfsm_create_undo(handle);
+        return HFSM_ERR_MALLOC;
+    }
+    handle->sent = 0;
+#endif
+    handle->save = param->save;
+    handle->load = param->load;
+    if (param->trace_records) {
+        handle->trace = trace_ring_create(param->trace_records);
+        if (handle->trace == NULL) {
+            hfsm_create_undo(handle);
+            return HFSM_ERR_MALLOC;
+        }
+    }
+
+    handle->mode = param->mode;
+    handle->queue_ops = ops;
+    handle->capacity = param->capacity ? param->capacity : MAX_MESSAGE_NUM;
+    handle->overflow = param->overflow;
+    handle->timeout_ms = param->timeout_ms;
+    handle->waiters = 0;
+    pthread_mutex_init(&handle->space_lock, NULL);
+    pthread_cond_init(&handle->space_cond, NULL);
+    memset(&handle->stats, 0, sizeof(handle->stats));
+    handle->executor = param->executor;
+    handle->queue = NULL;
+    handle->user_data = param->userdata;
+    handle->cur_state = NULL;
+    list_init(&handle->state_list);
+    memset(handle->state_table, 0, sizeof(handle->state_table));
+    pthread_mutex_init(&handle->batch_lock, NULL);
+    list_init(&handle->batch_list);
+    list_init(&handle->msg_list);
+    list_init(&handle->msg_free);
+    list_init(&handle->snap_list);
+    handle->defer_num = 0;
+    list_init(&handle->defer_list);
+    list_init(&handle->defer_free);
+    handle->transited = false;
+    handle->recalling = false;
+    handle->wheel = NULL;
+    if (handle->mode != HFSM_MODE_INLINE) {
+        handle->wheel = param->queue == HFSM_QUEUE_EXECUTOR
+            ? hfsm_executor_wheel(param->executor) : timer_wheel_default();
+    }
+    list_init(&handle->timer_all);
+    list_init(&handle->timer_free);
+    handle->timer_closed = false;
+    handle->orth = NULL;
+    handle->helpers = NULL;
+    handle->helper_num = 0;
+    handle->job_evt = NULL;
+    handle->job_claim = 0;
+    handle->job_left = 0;
+    *hfsm = (hfsm_handle)handle;
+    return HFSM_SUCC;
+}
+
+int hfsm_destroy(hfsm_handle *hfsm)
+{
+    struct hfsm_t *handle;
+    struct listnode *c, *n;
+    struct state_info_t *info;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    handle = (struct hfsm_t*)(*hfsm);
+    RETURN_IF_NULL(handle, HFSM_ERR_NULLPTR);
+
+    /*! Stop timers sending to queue being destroyed */
+    if (handle->wheel) {
+        timer_wheel_lock(handle->wheel);
+        handle->timer_closed = true;
+        timer_wheel_unlock(handle->wheel);
+    }
+    /*! Destory queue first, states may be in use by dispatcher */
+    if (handle->queue) {
+        handle->queue_ops->destroy(&handle->queue);
+    }
+    /*! Wait for helpers of parallel regions, dispatcher is stopped */
+    for (size_t i=0; i<handle->helper_num; ++i) {
+        while (__atomic_load_n(&handle->helpers[i].busy, __ATOMIC_ACQUIRE)) {
+            sched_yield();
+        }
+    }
+    free(handle->helpers);
+    /*! Release timers */
+    if (handle->wheel) {
+        timer_wheel_lock(handle->wheel);
+        list_for_each(c, &handle->timer_all) {
+            timer_wheel_del(handle->wheel,
+                &list_entry(c, struct hfsm_timer_t, all)->wheel);
+        }
+        timer_wheel_unlock(handle->wheel);
+    }
+    list_for_each_safe(c, n, &handle->timer_all) {
+        list_remove(c);
+        free(list_entry(c, struct hfsm_timer_t, all));
+    }
+    /*! Recycled all state into pool (not necessary) */
+    list_for_each_safe(c, n, &handle->state_list) {
+        info = list_entry(c, struct state_info_t, node);
+        list_remove(c);
+        hfsm_free_paths(info);
+        free(info->defers);
+        free(info->regions);
+        ALLOCATOR_FREE(state, &handle->pool, info);
+    }
+
+    /*! Destory allocator of state */
+    ALLOCATOR_DESTORY(state, &handle->pool);
+    /*! Release batches discarded by queue */
+    list_for_each_safe(c, n, &handle->batch_list) {
+        list_remove(c);
+        free(list_entry(c, struct hfsm_batch_t, node));
+    }
+    /*! Release messages discarded by queue and recycled ones */
+    list_for_each_safe(c, n, &handle->msg_list) {
+        struct hfsm_msg_node_t *node = list_entry(c, struct hfsm_msg_node_t, node);
+        list_remove(c);
+        if (node->msg.payload) {
+            hfsm_payload_unref(node->msg.payload);
+        }
+        free(node);
+    }
+    list_for_each_safe(c, n, &handle->msg_free) {
+        list_remove(c);
+        free(list_entry(c, struct hfsm_msg_node_t, node));
+    }
+    /*! Release snapshot requests discarded by queue */
+    list_for_each_safe(c, n, &handle->snap_list) {
+        list_remove(c);
+        hfsm_snap_req_free(list_entry(c, struct hfsm_snap_req_t, node));
+    }
+    /*! Release deferred events never recalled */
+    list_for_each_safe(c, n, &handle->defer_list) {
+        struct hfsm_defer_t *node = list_entry(c, struct hfsm_defer_t, node);
+        list_remove(c);
+        if (node->msg.payload) {
+            hfsm_payload_unref(node->msg.payload);
+        }
+        free(node);
+    }
+    list_for_each_safe(c, n, &handle->defer_free) {
+        list_remove(c);
+        free(list_entry(c, struct hfsm_defer_t, node));
+    }
+    pthread_mutex_destroy(&handle->batch_lock);
+    pthread_cond_destroy(&handle->space_cond);
+    pthread_mutex_destroy(&handle->space_lock);
+#ifdef HFSM_STATS
+    latency_table_destroy(handle->latency);
+#endif
+    trace_ring_destroy(handle->trace);
+    /*! Destory hfsm */
+    free(*hfsm);
+    *hfsm = NULL;
+
+    return HFSM_SUCC;
+}
+
+/*! helpers for the widest composite running regions in parallel */
+static int hfsm_helpers_create(struct hfsm_t *handle)
+{
+    size_t num = 0;
+    struct listnode *c;
+    struct state_info_t *info;
+
+    list_for_each(c, &handle->state_list) {
+        info = list_entry(c, struct state_info_t, node);
+        if (info->parallel && info->region_num > num + 1) {
+            num = info->region_num - 1;
+        }
+    }
+    RETURN_IF_TRUE(num == 0 || handle->helpers, HFSM_SUCC);
+    handle->helpers = (struct hfsm_helper_t*)calloc(num, sizeof(struct hfsm_helper_t));
+    RETURN_IF_NULL(handle->helpers, HFSM_ERR_MALLOC);
+    for (size_t i=0; i<num; ++i) {
+        handle->helpers[i].task.run = hfsm_helper_run;
+        handle->helpers[i].handle = handle;
+    }
+    handle->helper_num = num;
+    return HFSM_SUCC;
+}
+
+/*! create queue of HFSM_MODE_THREAD, events are handled from now on */
+static int hfsm_queue_open(struct hfsm_t *handle)
+{
+    int s;
+    hfsm_queue_parm param = {
+        .max = handle->capacity,
+        .user_data = (void*)handle,
+        .notifier = hfsm_event_notify,
+        .executor = handle->executor,
+#ifdef HFSM_STATS
+        .stamped = hfsm_event_stamped,
+#endif
+    };
+    s = handle->queue_ops->create(&handle->queue, &param);
+    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
+    return HFSM_SUCC;
+}
+
+int hfsm_start(hfsm_handle hfsm, state_id id)
+{
+    int s;
+    state_t *p;
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    handle = (struct hfsm_t*)hfsm;
+    /*! queue is checked first, current state is set by its dispatcher */
+    RETURN_IF_TRUE(handle->queue || handle->cur_state, HFSM_ERR_MODE);
+
+    p = hfsm_find_state(handle, id);
+    RETURN_IF_NULL(p, HFSM_ERR_NO_STATE);
+    s = hfsm_helpers_create(handle);
+    RETURN_IF_FAIL(s, s);
+    event_t evt = {
+        .id = HFSM_SYS_START,
+        .priority = 0xFF,
+        .param = (void*)p
+    };
+    if (handle->mode == HFSM_MODE_INLINE) {
+        hfsm_event_invoke(&evt, handle);
+        return HFSM_SUCC;
+    }
+    s = hfsm_queue_open(handle);
+    RETURN_IF_FAIL(s, s);
+    s = handle->queue_ops->send(handle->queue, &evt);
+    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
+    return HFSM_SUCC;
+}
+
+int hfsm_add_state(hfsm_handle hfsm, state_t *s)
+{
+    struct hfsm_t *handle;
+    struct state_info_t *info;
+    RETURN_IF_NULL(s, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    handle = (struct hfsm_t*)hfsm;
+
+    RETURN_IF_TRUE(handle->state_table[s->id], HFSM_ERR_DUP_STATE);
+
+    info = container_of(s, struct state_info_t, state);
+    RETURN_IF_NULL(info, HFSM_ERR_ALLOCATOR);
+    list_add_tail(&handle->state_list, &info->node);
+    handle->state_table[s->id] = s;
+    return HFSM_SUCC;
+}
+
+int hfsm_defer_event(hfsm_handle hfsm, state_t *s, uint32_t id)
+{
+    uint32_t *defers;
+    struct hfsm_t *handle;
+    struct state_info_t *info;
+    RETURN_IF_NULL(s, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    handle = (struct hfsm_t*)hfsm;
+
+    info = container_of(s, struct state_info_t, state);
+    for (size_t i=0; i<info->defer_num; ++i) {
+        RETURN_IF_TRUE(info->defers[i] == id, HFSM_SUCC);
+    }
+    defers = (uint32_t*)realloc(info->defers,
+        (info->defer_num + 1) * sizeof(uint32_t));
+    RETURN_IF_NULL(defers, HFSM_ERR_MALLOC);
+    defers[info->defer_num++] = id;
+    info->defers = defers;
+    ++handle->defer_num;
+    return HFSM_SUCC;
+}
+
+int hfsm_add_region(hfsm_handle hfsm, state_t *composite, state_t *initial)
+{
+    state_t *root;
+    struct hfsm_region_t *regions;
+    struct state_info_t *info;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(composite, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(initial, HFSM_ERR_NULLPTR);
+
+    /*! root of region is the child of composite leading to initial */
+    for (root = initial; root && root->parent != composite; root = root->parent);
+    RETURN_IF_NULL(root, HFSM_ERR_REGION);
+    info = hfsm_info(composite);
+    RETURN_IF_TRUE(info->region_num >= 0xFFFF, HFSM_ERR_REGION);
+    for (size_t i=0; i<info->region_num; ++i) {
+        RETURN_IF_TRUE(info->regions[i].root == root, HFSM_ERR_REGION);
+    }
+    regions = (struct hfsm_region_t*)realloc(info->regions,
+        (info->region_num + 1) * sizeof(struct hfsm_region_t));
+    RETURN_IF_NULL(regions, HFSM_ERR_MALLOC);
+    memset(&regions[info->region_num], 0, sizeof(struct hfsm_region_t));
+    regions[info->region_num].root = root;
+    regions[info->region_num].initial = initial;
+    info->regions = regions;
+    ++info->region_num;
+    return HFSM_SUCC;
+}
+
+int hfsm_set_parallel(hfsm_handle hfsm, state_t *composite, bool parallel)
+{
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(composite, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(parallel && handle->executor == NULL, HFSM_ERR_EXECUTOR);
+    hfsm_info(composite)->parallel = parallel;
+    return HFSM_SUCC;
+}
+
+int hfsm_set_history(hfsm_handle hfsm, state_t *composite, unsigned char history)
+{
+    struct state_info_t *info;
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(composite, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(history > HFSM_HISTORY_DEEP, HFSM_ERR_HISTORY);
+
+    info = hfsm_info(composite);
+    info->history_type = history;
+    info->history = NULL;
+    return HFSM_SUCC;
+}
+
+int hfsm_start_timer(hfsm_handle hfsm, const event_t *e, unsigned int ms)
+{
+    int s;
+    struct hfsm_t *handle;
+    struct hfsm_timer_t *timer;
+    struct state_info_t *info;
+    RETURN_IF_NULL(e, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode == HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    RETURN_IF_NULL(handle->wheel, HFSM_ERR_MALLOC);
+    RETURN_IF_TRUE(hfsm_acting.handle != handle || hfsm_acting.state == NULL,
+        HFSM_ERR_NO_STATE);
+
+    timer = NULL;
+    timer_wheel_lock(handle->wheel);
+    if (!list_empty(&handle->timer_free)) {
+        timer = list_entry(list_head(&handle->timer_free),
+            struct hfsm_timer_t, node);
+        list_remove(&timer->node);
+    }
+    timer_wheel_unlock(handle->wheel);
+    if (timer == NULL) {
+        timer = (struct hfsm_timer_t*)malloc(sizeof(struct hfsm_timer_t));
+        RETURN_IF_NULL(timer, HFSM_ERR_MALLOC);
+        timer_node_init(&timer->wheel, hfsm_timer_fire);
+        timer->handle = handle;
+        timer->status = TIMER_IDLE;
+        list_init(&timer->all);
+    }
+    timer->evt = *e;
+
+    timer_wheel_lock(handle->wheel);
+    if (list_empty(&timer->all)) {
+        list_add_tail(&handle->timer_all, &timer->all);
+    }
+    s = handle->timer_closed ? HFSM_ERR_NO_STATE
+        : timer_wheel_add(handle->wheel, &timer->wheel, ms);
+    if (s == HFSM_SUCC) {
+        timer->status = TIMER_ARMED;
+    }
+    if (s != HFSM_SUCC) {
+        list_add_tail(&handle->timer_free, &timer->node);
+    }
+    timer_wheel_unlock(handle->wheel);
+    RETURN_IF_FAIL(s, s);
+    info = hfsm_info(hfsm_acting.state);
+    list_add_tail(&info->timers, &timer->node);
+    return HFSM_SUCC;
+}
+
+int hfsm_send_event(hfsm_handle hfsm, event_t *e)
+{
+    int s;
+    struct hfsm_t *handle;;
+    RETURN_IF_NULL(e, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode == HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    s = hfsm_queue_push(handle, e, 1, NULL);
+    RETURN_IF_FAIL(s, s);
+    return HFSM_SUCC;
+}
+
+int hfsm_send_events(hfsm_handle hfsm, const event_t *events, size_t n)
+{
+    int s;
+    size_t run;
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(events, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode == HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    while (n > 0) {
+        /*! queue consecutive events with the same priority as one, a run
+            longer than capacity is split so that every part may fit */
+        for (run=1; run<n && run<handle->capacity
+            && events[run].priority == events[0].priority; ++run);
+        s = hfsm_queue_push(handle, events, run, NULL);
+        RETURN_IF_FAIL(s, s);
+        events += run;
+        n -= run;
+    }
+    return HFSM_SUCC;
+}
+
+int hfsm_dispatch_event(hfsm_handle hfsm, const event_t *e)
+{
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(e, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode != HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    RETURN_IF_NULL(handle->cur_state, HFSM_ERR_NO_STATE);
+    hfsm_event_invoke(e, handle);
+    return HFSM_SUCC;
+}
+
+void hfsm_payload_init(hfsm_payload *payload, void *data, size_t size,
+    void (*release)(hfsm_payload*))
+{
+    RETURN_IF_NULL(payload,);
+    payload->data = data;
+    payload->size = size;
+    payload->release = release;
+    payload->refs = 1;
+}
+
+void hfsm_payload_ref(hfsm_payload *payload)
+{
+    RETURN_IF_NULL(payload,);
+    __atomic_add_fetch(&payload->refs, 1, __ATOMIC_RELAXED);
+}
+
+void hfsm_payload_unref(hfsm_payload *payload)
+{
+    RETURN_IF_NULL(payload,);
+    if (__atomic_sub_fetch(&payload->refs, 1, __ATOMIC_ACQ_REL) == 0
+        && payload->release) {
+        payload->release(payload);
+    }
+}
+
+int hfsm_send_msg(hfsm_handle hfsm, const hfsm_msg_t *msg)
+{
+    int s;
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(msg, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(msg->size > HFSM_MSG_DATA_SIZE, HFSM_ERR_MSG_SIZE);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode == HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    if (msg->payload) {
+        hfsm_payload_ref(msg->payload);
+    }
+    s = hfsm_queue_push(handle, NULL, 1, msg);
+    if (s != HFSM_SUCC && msg->payload) {
+        hfsm_payload_unref(msg->payload);
+    }
+    return s;
+}
+
+int hfsm_dispatch_msg(hfsm_handle hfsm, const hfsm_msg_t *msg)
+{
+    hfsm_msg_t m;
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(msg, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(msg->size > HFSM_MSG_DATA_SIZE, HFSM_ERR_MSG_SIZE);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_TRUE(handle->mode != HFSM_MODE_INLINE, HFSM_ERR_MODE);
+    RETURN_IF_NULL(handle->cur_state, HFSM_ERR_NO_STATE);
+    /*! message is handled in place, take a reference as queues do */
+    m.evt = msg->evt;
+    m.evt.param = &m;
+    m.payload = msg->payload;
+    m.size = msg->size;
+    memcpy(m.data, msg->data, msg->size);
+    if (m.payload) {
+        hfsm_payload_ref(m.payload);
+    }
+    hfsm_event_invoke(&m.evt, handle);
+    return HFSM_SUCC;
+}
+
+int hfsm_get_queue_stats(hfsm_handle hfsm, hfsm_queue_stats *stats)
+{
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(stats, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    stats->rejected = __atomic_load_n(&handle->stats.rejected, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&handle->stats.dropped, __ATOMIC_RELAXED);
+    stats->blocked = __atomic_load_n(&handle->stats.blocked, __ATOMIC_RELAXED);
+    stats->timeouts = __atomic_load_n(&handle->stats.timeouts, __ATOMIC_RELAXED);
+    return HFSM_SUCC;
+}
+
+int hfsm_get_state_stats(hfsm_handle hfsm, state_id id, hfsm_state_stats *stats)
+{
+#ifdef HFSM_STATS
+    state_t *s;
+    hfsm_state_stats *counters;
+    RETURN_IF_NULL(stats, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    s = hfsm_find_state((struct hfsm_t*)hfsm, id);
+    RETURN_IF_NULL(s, HFSM_ERR_NO_STATE);
+    counters = &hfsm_info(s)->stats;
+    stats->entries = __atomic_load_n(&counters->entries, __ATOMIC_RELAXED);
+    stats->exits = __atomic_load_n(&counters->exits, __ATOMIC_RELAXED);
+    stats->invokes = __atomic_load_n(&counters->invokes, __ATOMIC_RELAXED);
+    stats->handled = __atomic_load_n(&counters->handled, __ATOMIC_RELAXED);
+    stats->transits = __atomic_load_n(&counters->transits, __ATOMIC_RELAXED);
+    stats->callback_ns = __atomic_load_n(&counters->callback_ns, __ATOMIC_RELAXED);
+    return HFSM_SUCC;
+#else
+    RETURN_IF_NULL(stats, HFSM_ERR_NULLPTR);
+    memset(stats, 0, sizeof(*stats));
+    return HFSM_ERR_STATS;
+#endif
+}
+
+int hfsm_get_latency(hfsm_handle hfsm, unsigned char kind, hfsm_latency *latency)
+{
+    RETURN_IF_NULL(latency, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    memset(latency, 0, sizeof(*latency));
+#ifdef HFSM_STATS
+    RETURN_IF_TRUE(kind >= HFSM_LATENCY_KINDS, HFSM_ERR_STATS);
+    latency_table_read(((struct hfsm_t*)hfsm)->latency, true, 0, kind, latency);
+    return HFSM_SUCC;
+#else
+    return HFSM_ERR_STATS;
+#endif
+}
+
+int hfsm_get_event_latency(hfsm_handle hfsm, uint32_t id, unsigned char kind,
+    hfsm_latency *latency)
+{
+    RETURN_IF_NULL(latency, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    memset(latency, 0, sizeof(*latency));
+#ifdef HFSM_STATS
+    RETURN_IF_TRUE(kind >= HFSM_LATENCY_KINDS, HFSM_ERR_STATS);
+    latency_table_read(((struct hfsm_t*)hfsm)->latency, false, id, kind, latency);
+    return HFSM_SUCC;
+#else
+    return HFSM_ERR_STATS;
+#endif
+}
+
+int hfsm_dump_trace(hfsm_handle hfsm, const char *path)
+{
+    struct hfsm_t *handle;
+    RETURN_IF_NULL(path, HFSM_ERR_NULLPTR);
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+
+    handle = (struct hfsm_t*)hfsm;
+    RETURN_IF_NULL(handle->trace, HFSM_ERR_TRACE);
+    return trace_ring_dump(handle->trace, path);
+}
+
+/*! queue a snapshot request behind events sent, or take it at once in
+    HFSM_MODE_INLINE */
+static int hfsm_snapshot_request(struct hfsm_t *handle, struct hfsm_snap_req_t *req,
+    const struct timespec *deadline)
+{
+    int s;
+    struct timespec now, poll = { 0, BLOCK_POLL_MS * 1000000L };
+
+    snap_buf_reset(&req->body);
+    req->done = false;
+    if (handle->mode == HFSM_MODE_INLINE) {
+        hfsm_snapshot_body(handle, &req->body);
+        req->done = true;
+        return HFSM_SUCC;
+    }
+    /*! the lowest priority, events queued before are handled first. It
+        is never dropped and retries while the queue is full */
+    event_t evt = {
+        .id = HFSM_SYS_SNAPSHOT,
+        .priority = 0,
+        .param = (void*)req
+    };
+    while ((s = handle->queue_ops->send(handle->queue, &evt)) == HFSM_QUEUE_ERR_FULL) {
+        clock_gettime(CLOCK_REALTIME, &now);
+        if (timespec_reached(&now, deadline)) {
+            break;
+        }
+        nanosleep(&poll, NULL);
+    }
+    RETURN_IF_FAIL(s, HFSM_ERR_EVTHUB);
+    return HFSM_SUCC;
+}
+
+/*! wait for request taken until deadline, a request timed out is left
+    to dispatcher, it is released when taken or the HFSM is destroyed */
+static int hfsm_snapshot_wait(struct hfsm_t *handle, struct hfsm_snap_req_t *req,
+    const struct timespec *deadline)
+{
+    int s = HFSM_SUCC;
+    pthread_mutex_lock(&req->lock);
+    while (!req->done) {
+        if (pthread_cond_timedwait(&req->cond, &req->lock, deadline) == ETIMEDOUT
+            && !req->done) {
+            req->abandoned = true;
+            pthread_mutex_lock(&handle->batch_lock);
+            list_add_tail(&handle->snap_list, &req->node);
+            pthread_mutex_unlock(&handle->batch_lock);
+            s = HFSM_ERR_EVTHUB;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&req->lock);
+    return s;
+}
+
+int hfsm_snapshot_all(hfsm_handle *hfsms, size_t n, const hfsm_stream *out)
+{
+    int s = HFSM_SUCC, w;
+    size_t num, sent, req_num;
+    struct hfsm_t *handle;
+    struct hfsm_snap_req_t **reqs;
+    struct timespec deadline;
+    RETURN_IF_NULL(out, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(n && hfsms == NULL, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(hfsm_acting.handle, HFSM_ERR_MODE);
+    for (size_t i=0; i<n; ++i) {
+        handle = (struct hfsm_t*)hfsms[i];
+        RETURN_IF_NULL(handle, HFSM_ERR_NULLPTR);
+        RETURN_IF_TRUE(handle->mode == HFSM_MODE_INLINE
+            ? handle->cur_state == NULL : handle->queue == NULL, HFSM_ERR_NO_STATE);
+    }
+    RETURN_IF_TRUE(n == 0, HFSM_SUCC);
+
+    req_num = n < SNAPSHOT_BATCH ? n : SNAPSHOT_BATCH;
+    reqs = (struct hfsm_snap_req_t**)calloc(req_num, sizeof(struct hfsm_snap_req_t*));
+    RETURN_IF_NULL(reqs, HFSM_ERR_MALLOC);
+    for (size_t i=0; i<n && s == HFSM_SUCC; i += num) {
+        num = n - i < req_num ? n - i : req_num;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        timespec_add_ms(&deadline, HFSM_SNAPSHOT_TIMEOUT_MS);
+        /*! dispatchers capture their HFSMs at once, frames are written
+            in order as they are ready */
+        for (sent=0; sent<num; ++sent) {
+            if (reqs[sent] == NULL && (reqs[sent] = hfsm_snap_req_new()) == NULL) {
+                s = HFSM_ERR_MALLOC;
+                break;
+            }
+            s = hfsm_snapshot_request((struct hfsm_t*)hfsms[i+sent], reqs[sent],
+                &deadline);
+            if (s != HFSM_SUCC) {
+                break;
+            }
+        }
+        for (size_t j=0; j<sent; ++j) {
+            w = hfsm_snapshot_wait((struct hfsm_t*)hfsms[i+j], reqs[j], &deadline);
+            if (w != HFSM_SUCC) {
+                reqs[j] = NULL;     /*!< taken over by dispatcher */
+                s = s == HFSM_SUCC ? w : s;
+            } else if (s == HFSM_SUCC) {
+                s = snap_frame_write(out, SNAP_ENGINE_C, &reqs[j]->body);
+            }
+        }
+    }
+    for (size_t i=0; i<req_num; ++i) {
+        if (reqs[i]) {
+            hfsm_snap_req_free(reqs[i]);
+        }
+    }
+    free(reqs);
+    return s;
+}
+
+int hfsm_snapshot(hfsm_handle hfsm, const hfsm_stream *out)
+{
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    return hfsm_snapshot_all(&hfsm, 1, out);
+}
+
+static void hfsm_defer_release(struct listnode *list)
+{
+    struct listnode *c, *n;
+    list_for_each_safe(c, n, list) {
+        list_remove(c);
+        free(list_entry(c, struct hfsm_defer_t, node));
+    }
+}
+
+/*! parse body and position HFSM without entry actions, HFSM is left
+    unchanged if the body does not match its states */
+static int hfsm_restore_body(struct hfsm_t *handle, struct snap_buf_t *b)
+{
+    int s = HFSM_SUCC;
+    state_t *cur, *leaves[MAX_STATE_NUM], *pairs[MAX_STATE_NUM][2];
+    struct state_info_t *info;
+    struct hfsm_defer_t *node;
+    struct listnode defers, *c, *n;
+    size_t region_num, history_num;
+    uint64_t num;
+    hfsm_stream stream;
+
+    cur = hfsm_find_state(handle, snap_get_u8(b));
+    region_num = snap_get_u8(b);
+    RETURN_IF_TRUE(b->error || cur == NULL, HFSM_ERR_SNAPSHOT);
+    info = hfsm_info(cur);
+    if (region_num) {
+        RETURN_IF_TRUE(info->region_num != region_num, HFSM_ERR_SNAPSHOT);
+        for (size_t i=0; i<region_num; ++i) {
+            leaves[i] = hfsm_find_state(handle, snap_get_u8(b));
+            RETURN_IF_TRUE(leaves[i] == NULL
+                || !hfsm_state_within(leaves[i], info->regions[i].root),
+                HFSM_ERR_SNAPSHOT);
+        }
+    } else {
+        /*! a state in regions is always captured with its composite */
+        for (state_t *p = cur; p; p = p->parent) {
+            RETURN_IF_TRUE(hfsm_info(p)->region_num, HFSM_ERR_SNAPSHOT);
+        }
+    }
+
+    num = snap_get_varint(b);
+    RETURN_IF_TRUE(b->error || num > MAX_STATE_NUM, HFSM_ERR_SNAPSHOT);
+    history_num = (size_t)num;
+    for (size_t i=0; i<history_num; ++i) {
+        pairs[i][0] = hfsm_find_state(handle, snap_get_u8(b));
+        pairs[i][1] = hfsm_find_state(handle, snap_get_u8(b));
+        RETURN_IF_TRUE(pairs[i][0] == NULL || pairs[i][1] == NULL
+            || pairs[i][0] == pairs[i][1]
+            || hfsm_info(pairs[i][0])->history_type == HFSM_HISTORY_NONE
+            || !hfsm_state_within(pairs[i][1], pairs[i][0]), HFSM_ERR_SNAPSHOT);
+    }
+
+    /*! reading stops at the end of body if num is corrupted */
+    num = snap_get_varint(b);
+    list_init(&defers);
+    for (uint64_t i=0; i<num && !b->error; ++i) {
+        node = (struct hfsm_defer_t*)malloc(sizeof(struct hfsm_defer_t));
+        if (node == NULL) {
+            s = HFSM_ERR_MALLOC;
+            break;
+        }
+        list_add_tail(&defers, &node->node);
+        node->msg.evt.id = (uint32_t)snap_get_varint(b);
+        node->msg.evt.priority = snap_get_u8(b);
+        node->msg.evt.param = NULL;
+        node->msg.payload = NULL;
+        node->msg.size = 0;
+        if (snap_get_u8(b)) {
+            node->msg.evt.param = &node->msg;
+            node->msg.size = snap_get_u8(b);
+            if (node->msg.size > HFSM_MSG_DATA_SIZE) {
+                b->error = HFSM_ERR_SNAPSHOT;
+            } else {
+                snap_get(b, node->msg.data, node->msg.size);
+            }
+        }
+    }
+    if (s == HFSM_SUCC && b->error) {
+        s = HFSM_ERR_SNAPSHOT;
+    }
+    if (s == HFSM_SUCC && handle->load) {
+        snap_buf_stream(b, &stream);
+        if (handle->load(handle->user_data, &stream) != HFSM_SUCC) {
+            s = HFSM_ERR_SNAPSHOT;
+        }
+    }
+    if (s != HFSM_SUCC) {
+        hfsm_defer_release(&defers);
+        return s;
+    }
+
+    handle->cur_state = cur;
+    if (region_num) {
+        handle->orth = cur;
+        for (size_t i=0; i<region_num; ++i) {
+            info->regions[i].leaf = leaves[i];
+        }
+    }
+    for (size_t i=0; i<history_num; ++i) {
+        hfsm_info(pairs[i][0])->history = pairs[i][1];
+    }
+    list_for_each_safe(c, n, &defers) {
+        list_remove(c);
+        list_add_tail(&handle->defer_list, c);
+    }
+    return HFSM_SUCC;
+}
+
+int hfsm_restore_all(hfsm_handle *hfsms, size_t n, const hfsm_stream *in)
+{
+    int s = HFSM_SUCC;
+    struct hfsm_t *handle;
+    struct snap_buf_t body;
+    RETURN_IF_NULL(in, HFSM_ERR_NULLPTR);
+    RETURN_IF_TRUE(n && hfsms == NULL, HFSM_ERR_NULLPTR);
+
+    snap_buf_init(&body);
+    for (size_t i=0; i<n && s == HFSM_SUCC; ++i) {
+        handle = (struct hfsm_t*)hfsms[i];
+        if (handle == NULL) {
+            s = HFSM_ERR_NULLPTR;
+            break;
+        }
+        if (handle->queue || handle->cur_state) {
+            s = HFSM_ERR_MODE;
+            break;
+        }
+        s = snap_frame_read(in, SNAP_ENGINE_C, &body);
+        if (s == HFSM_SUCC) {
+            s = hfsm_restore_body(handle, &body);
+        }
+        if (s == HFSM_SUCC) {
+            s = hfsm_helpers_create(handle);
+        }
+        if (s == HFSM_SUCC && handle->mode != HFSM_MODE_INLINE) {
+            s = hfsm_queue_open(handle);
+        }
+    }
+    snap_buf_free(&body);
+    return s;
+}
+
+int hfsm_restore(hfsm_handle hfsm, const hfsm_stream *in)
+{
+    RETURN_IF_NULL(hfsm, HFSM_ERR_NULLPTR);
+    return hfsm_restore_all(&hfsm, 1, in);
+}
+
+static int hfsm_file_write(void *ctx, const void *data, size_t size)
+{
+    return fwrite(data, 1, size, (FILE*)ctx) == size ? HFSM_SUCC : HFSM_ERR_SNAPSHOT;
+}
+
+static int hfsm_file_read(void *ctx, void *data, size_t size)
+{
+    return fread(data, 1, size, (FILE*)ctx) == size ? HFSM_SUCC : HFSM_ERR_SNAPSHOT;
+}
+
+void hfsm_stream_file(hfsm_stream *stream, FILE *fp)
+{
+    RETURN_IF_NULL(stream,);
+    stream->ctx = (void*)fp;
+    stream->write = hfsm_file_write;
+    stream->read = hfsm_file_read;
+}
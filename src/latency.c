@@ -0,0 +1,214 @@
+/*
+ * Latency histograms of HFSM events
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "latency.h"
+
+#define HIST_SUB_BITS       (3)
+#define HIST_SUB            (1UL << HIST_SUB_BITS)
+#define HIST_MAX_BITS       (40)    /*!< larger values are counted as 2^40-1 */
+#define HIST_BUCKETS        ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/*! log-linear histogram in the way of HdrHistogram, values under HIST_SUB
+    are exact and every power of 2 above is split into HIST_SUB buckets,
+    so a bucket is within 1/HIST_SUB of its values. Written by one thread
+    at a time, relaxed atomics only keep readers from tearing counters. */
+struct latency_hist_t {
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[HIST_BUCKETS];
+};
+
+struct latency_event_t {
+    uint32_t id;
+    struct latency_hist_t hists[HFSM_LATENCY_KINDS];
+};
+
+struct latency_table_t {
+    struct latency_hist_t all[HFSM_LATENCY_KINDS];
+    size_t num;
+    /*! probed from id, allocated by the recording thread and published
+        with release */
+    struct latency_event_t *events[];
+};
+
+static inline void hist_add(unsigned long *counter, unsigned long n)
+{
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+        __ATOMIC_RELAXED);
+}
+
+static inline size_t hist_index(unsigned long v)
+{
+    int e;
+    if (v < HIST_SUB) {
+        return v;
+    }
+    if (v >> HIST_MAX_BITS) {
+        v = (1UL << HIST_MAX_BITS) - 1;
+    }
+    e = 63 - __builtin_clzl(v);
+    return (size_t)(e - HIST_SUB_BITS + 1) * HIST_SUB
+        + ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+/*! highest value counted by a bucket */
+static inline unsigned long hist_upper(size_t index)
+{
+    int shift;
+    if (index < HIST_SUB) {
+        return index;
+    }
+    shift = (int)(index / HIST_SUB) - 1;
+    return ((HIST_SUB + index % HIST_SUB) << shift) + (1UL << shift) - 1;
+}
+
+static void hist_record(struct latency_hist_t *h, unsigned long ns)
+{
+    hist_add(&h->buckets[hist_index(ns)], 1);
+    hist_add(&h->count, 1);
+    hist_add(&h->sum, ns);
+    if (ns > __atomic_load_n(&h->max, __ATOMIC_RELAXED)) {
+        __atomic_store_n(&h->max, ns, __ATOMIC_RELAXED);
+    }
+}
+
+static void hist_read(const struct latency_hist_t *h, hfsm_latency *latency)
+{
+    unsigned long buckets[HIST_BUCKETS];
+    unsigned long total = 0, seen = 0, count;
+    const unsigned long per_mille[] = { 500, 990, 999 };
+    unsigned long *values[] = {
+        &latency->p50_ns, &latency->p99_ns, &latency->p999_ns
+    };
+    size_t q = 0;
+
+    memset(latency, 0, sizeof(*latency));
+    /*! percentiles come from buckets copied, other fields may be a few
+        records apart from them */
+    for (size_t i=0; i<HIST_BUCKETS; ++i) {
+        buckets[i] = __atomic_load_n(&h->buckets[i], __ATOMIC_RELAXED);
+        total += buckets[i];
+    }
+    RETURN_IF_TRUE(total == 0,);
+    latency->count = total;
+    latency->max_ns = __atomic_load_n(&h->max, __ATOMIC_RELAXED);
+    count = __atomic_load_n(&h->count, __ATOMIC_RELAXED);
+    latency->mean_ns = count ? __atomic_load_n(&h->sum, __ATOMIC_RELAXED) / count : 0;
+    for (size_t i=0; i<HIST_BUCKETS && q < 3; ++i) {
+        seen += buckets[i];
+        /*! the first bucket reaching the rank, at least 1 */
+        while (q < 3 && seen * 1000 >= total * per_mille[q]) {
+            *values[q++] = hist_upper(i) < latency->max_ns ? hist_upper(i)
+                : latency->max_ns;
+        }
+    }
+}
+
+struct latency_table_t* latency_table_create(size_t events)
+{
+    struct latency_table_t *t;
+    t = (struct latency_table_t*)calloc(1, sizeof(struct latency_table_t)
+        + events * sizeof(struct latency_event_t*));
+    RETURN_IF_NULL(t, NULL);
+    t->num = events;
+    return t;
+}
+
+void latency_table_destroy(struct latency_table_t *t)
+{
+    RETURN_IF_NULL(t,);
+    for (size_t i=0; i<t->num; ++i) {
+        free(t->events[i]);
+    }
+    free(t);
+}
+
+static struct latency_event_t* latency_event_find(
+    const struct latency_table_t *t, uint32_t id)
+{
+    struct latency_event_t *e;
+    for (size_t i=0; i<t->num; ++i) {
+        e = __atomic_load_n(&t->events[(id + i) % t->num], __ATOMIC_ACQUIRE);
+        if (e == NULL || e->id == id) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/*! only the recording thread claims slots, an ID is left without its own
+    histograms if allocation fails */
+static struct latency_event_t* latency_event_claim(struct latency_table_t *t,
+    uint32_t id)
+{
+    struct latency_event_t *e;
+    for (size_t i=0; i<t->num; ++i) {
+        struct latency_event_t **slot = &t->events[(id + i) % t->num];
+        e = *slot;
+        if (e == NULL) {
+            e = (struct latency_event_t*)calloc(1, sizeof(*e));
+            RETURN_IF_NULL(e, NULL);
+            e->id = id;
+            __atomic_store_n(slot, e, __ATOMIC_RELEASE);
+            return e;
+        }
+        if (e->id == id) {
+            return e;
+        }
+    }
+    return NULL;
+}
+void latency_table_record(struct latency_table_t *t, uint32_t id,
+    unsigned long sent, unsigned long begin, unsigned long end)
+{
+    struct latency_event_t *e = latency_event_claim(t, id);
+
+    hist_record(&t->all[HFSM_LATENCY_HANDLE], end - begin);
+    if (e) {
+        hist_record(&e->hists[HFSM_LATENCY_HANDLE], end - begin);
+    }
+    RETURN_IF_TRUE(sent == 0,);
+    hist_record(&t->all[HFSM_LATENCY_WAIT], begin - sent);
+    hist_record(&t->all[HFSM_LATENCY_TOTAL], end - sent);
+    if (e) {
+        hist_record(&e->hists[HFSM_LATENCY_WAIT], begin - sent);
+        hist_record(&e->hists[HFSM_LATENCY_TOTAL], end - sent);
+    }
+}
+
+void latency_table_read(const struct latency_table_t *t, bool all, uint32_t id,
+    unsigned char kind, hfsm_latency *latency)
+{
+    const struct latency_event_t *e;
+
+    memset(latency, 0, sizeof(*latency));
+    if (all) {
+        hist_read(&t->all[kind], latency);
+        return;
+    }
+    e = latency_event_find(t, id);
+    if (e) {
+        hist_read(&e->hists[kind], latency);
+    }
+}
@@ -0,0 +1,85 @@
+/*
+ * Latency histograms of HFSM events
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_LATENCY_H
+#define _HFSM_LATENCY_H
+
+#include <time.h>
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LATENCY_EVENT_NUM   (8)     /*!< default of event IDs with their own histograms */
+
+/*! histograms of a machine, overall and by event ID */
+struct latency_table_t;
+
+/*! monotonic clock in nanoseconds */
+static inline unsigned long latency_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000000000UL + (unsigned long)ts.tv_nsec;
+}
+
+/**
+  *    @brief create a table with all histograms empty, histograms of an
+  *           ID are allocated when it is first recorded
+  *    @param[in]  events: event IDs with their own histograms
+  *    @return     table, NULL if failed
+  */
+struct latency_table_t* latency_table_create(size_t events);
+
+void latency_table_destroy(struct latency_table_t *t);
+
+/**
+  *    @brief record an event handled, called by one thread at a time
+  *           without locks, the first IDs seen get their own histograms
+  *           as long as slots and memory are left
+  *    @param[in]  t: table
+  *    @param[in]  id: ID of event
+  *    @param[in]  sent: time event was sent, 0 if it was not queued
+  *    @param[in]  begin: time handling started
+  *    @param[in]  end: time handling finished
+  *    @return     none
+  */
+void latency_table_record(struct latency_table_t *t, uint32_t id,
+    unsigned long sent, unsigned long begin, unsigned long end);
+
+/**
+  *    @brief read percentiles of a histogram, it may be called from any
+  *           thread while records are added
+  *    @param[in]  t: table
+  *    @param[in]  all: overall histogram if true, otherwise the one of id
+  *    @param[in]  id: ID of event
+  *    @param[in]  kind: enum hfsm_latency_kind
+  *    @param[out] latency: percentiles, count is 0 if nothing recorded
+  *    @return     none
+  */
+void latency_table_read(const struct latency_table_t *t, bool all, uint32_t id,
+    unsigned char kind, hfsm_latency *latency);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_LATENCY_H */
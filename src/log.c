@@ -19,20 +19,653 @@
  */
 
 #include <log.h>
+#include <ctype.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/types.h>
 
-void hfsm_trace(const char *format, ...) {
+#define LOG_RING_SIZE       (64 * 1024)     /*!< bytes of ring per thread */
+#define LOG_RECORD_MAX      (4096)          /*!< bytes of record with arguments */
+#define LOG_LINE_MAX        (4096)
+#define LOG_STR_MAX         (1024)          /*!< bytes of string with '\0' */
+#define LOG_OUT_SIZE        (16 * 1024)     /*!< lines written at once */
+#define LOG_ALIGN(n)        (((n) + 7) & ~(size_t)7)
+
+enum log_kind_e {
+    LOG_KIND_NONE = 0,          /*!< unsupported conversion */
+    LOG_KIND_INT,
+    LOG_KIND_UINT,
+    LOG_KIND_DOUBLE,
+    LOG_KIND_CHAR,
+    LOG_KIND_STR,
+    LOG_KIND_PTR,
+    LOG_KIND_COUNT,             /*!< %n, ignored */
+};
+
+/*! conversion in a format */
+struct log_spec_t {
+    const char *begin;          /*!< at '%' */
+    const char *length;         /*!< at length modifier */
+    const char *conv;           /*!< at conversion character */
+    const char *end;
+    bool width_arg;             /*!< width is '*' */
+    bool prec_arg;              /*!< precision is '*' */
+    unsigned char kind;         /*!< enum log_kind_e */
+};
+
+/*! argument copied in 8 bytes, a string is followed by its bytes */
+union log_arg_t {
+    long long i;
+    unsigned long long u;
+    double f;
+    const void *p;
+    size_t len;
+};
+
+/*! record in ring, followed by arguments */
+struct log_record_t {
+    uint32_t size;              /*!< bytes to the next record */
+    uint32_t args;              /*!< bytes of arguments */
+    const char *format;         /*!< NULL if record pads to end of ring */
+};
+
+/*! ring of a thread, written by it and read by writer thread only */
+struct log_ring_t {
+    /*! records of 8 bytes aligned, first to be aligned as allocated */
+    unsigned char buf[LOG_RING_SIZE];
+    struct log_ring_t *next;
+    uint64_t head;              /*!< bytes written, by owner */
+    uint64_t tail;              /*!< bytes read, by writer */
+    unsigned long dropped;      /*!< messages dropped for full ring */
+    unsigned long reported;     /*!< drops reported, by writer */
+    int closed;                 /*!< owner exited */
+};
+
+static int log_threshold = HFSM_LOG_DEBUG;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static bool log_started;
+/*! guards rings list, draining and output */
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+/*! writer waits on it while all rings are empty */
+static pthread_cond_t log_cond = PTHREAD_COND_INITIALIZER;
+static int log_sleeping;
+static struct log_ring_t *log_rings;
+static bool log_exiting;
+static char log_out[LOG_OUT_SIZE];
+static size_t log_out_len;
+static __thread struct log_ring_t *log_ring;
+
+/*! find next conversion of format from p, %% is left to literal text */
+static bool log_spec_next(const char *p, struct log_spec_t *spec)
+{
+    size_t n;
+
+    while ((p = strchr(p, '%')) != NULL) {
+        spec->begin = p++;
+        if (*p == '%') {
+            ++p;
+            continue;
+        }
+        p += strspn(p, "-+ #0'");
+        spec->width_arg = *p == '*';
+        p = spec->width_arg ? p + 1 : p + strspn(p, "0123456789");
+        spec->prec_arg = false;
+        if (*p == '.') {
+            ++p;
+            spec->prec_arg = *p == '*';
+            p = spec->prec_arg ? p + 1 : p + strspn(p, "0123456789");
+        }
+        spec->length = p;
+        p += strspn(p, "hlLqjzt");
+        spec->conv = p;
+        spec->end = *p ? p + 1 : p;
+        n = spec->conv - spec->length;
+        switch (*p) {
+        case 'd': case 'i':
+            spec->kind = LOG_KIND_INT;
+            break;
+        case 'o': case 'u': case 'x': case 'X':
+            spec->kind = LOG_KIND_UINT;
+            break;
+        case 'e': case 'E': case 'f': case 'F':
+        case 'g': case 'G': case 'a': case 'A':
+            spec->kind = LOG_KIND_DOUBLE;
+            break;
+        case 'c':
+            spec->kind = n == 0 ? LOG_KIND_CHAR : LOG_KIND_NONE;
+            break;
+        case 's':
+            spec->kind = n == 0 ? LOG_KIND_STR : LOG_KIND_NONE;
+            break;
+        case 'p':
+            spec->kind = LOG_KIND_PTR;
+            break;
+        case 'n':
+            spec->kind = LOG_KIND_COUNT;
+            break;
+        default:
+            spec->kind = LOG_KIND_NONE;
+            break;
+        }
+        return true;
+    }
+    return false;
+}
+
+/*! whether length modifier of spec is m */
+static inline bool log_length_is(const struct log_spec_t *spec, const char *m)
+{
+    size_t n = spec->conv - spec->length;
+    return n == strlen(m) && strncmp(spec->length, m, n) == 0;
+}
+
+static long long log_va_int(const struct log_spec_t *spec, va_list *ap)
+{
+    if (log_length_is(spec, "hh")) {
+        return (signed char)va_arg(*ap, int);
+    } else if (log_length_is(spec, "h")) {
+        return (short)va_arg(*ap, int);
+    } else if (log_length_is(spec, "l")) {
+        return va_arg(*ap, long);
+    } else if (log_length_is(spec, "ll") || log_length_is(spec, "q")) {
+        return va_arg(*ap, long long);
+    } else if (log_length_is(spec, "j")) {
+        return va_arg(*ap, intmax_t);
+    } else if (log_length_is(spec, "z")) {
+        return va_arg(*ap, ssize_t);
+    } else if (log_length_is(spec, "t")) {
+        return va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, int);
+}
+
+static unsigned long long log_va_uint(const struct log_spec_t *spec, va_list *ap)
+{
+    if (log_length_is(spec, "hh")) {
+        return (unsigned char)va_arg(*ap, unsigned int);
+    } else if (log_length_is(spec, "h")) {
+        return (unsigned short)va_arg(*ap, unsigned int);
+    } else if (log_length_is(spec, "l")) {
+        return va_arg(*ap, unsigned long);
+    } else if (log_length_is(spec, "ll") || log_length_is(spec, "q")) {
+        return va_arg(*ap, unsigned long long);
+    } else if (log_length_is(spec, "j")) {
+        return va_arg(*ap, uintmax_t);
+    } else if (log_length_is(spec, "z")) {
+        return va_arg(*ap, size_t);
+    } else if (log_length_is(spec, "t")) {
+        return (unsigned long long)va_arg(*ap, ptrdiff_t);
+    }
+    return va_arg(*ap, unsigned int);
+}
+
+/*! copy arguments of format into buf, stop at the first one not fitting */
+static size_t log_encode(unsigned char *buf, size_t cap, const char *format,
+    va_list *ap)
+{
+    size_t n = 0, len;
+    const char *s;
+    struct log_spec_t spec;
+    union log_arg_t arg;
+    const char *p = format;
+
+    while (log_spec_next(p, &spec) && spec.kind != LOG_KIND_NONE) {
+        p = spec.end;
+        if (spec.width_arg) {
+            if (n + sizeof(arg) > cap) {
+                return n;
+            }
+            arg.i = va_arg(*ap, int);
+            memcpy(buf + n, &arg, sizeof(arg));
+            n += sizeof(arg);
+        }
+        if (spec.prec_arg) {
+            if (n + sizeof(arg) > cap) {
+                return n;
+            }
+            arg.i = va_arg(*ap, int);
+            memcpy(buf + n, &arg, sizeof(arg));
+            n += sizeof(arg);
+        }
+        switch (spec.kind) {
+        case LOG_KIND_INT:
+            arg.i = log_va_int(&spec, ap);
+            break;
+        case LOG_KIND_UINT:
+            arg.u = log_va_uint(&spec, ap);
+            break;
+        case LOG_KIND_DOUBLE:
+            arg.f = spec.length[0] == 'L' ? (double)va_arg(*ap, long double)
+                : va_arg(*ap, double);
+            break;
+        case LOG_KIND_CHAR:
+            arg.i = va_arg(*ap, int);
+            break;
+        case LOG_KIND_PTR:
+            arg.p = va_arg(*ap, void*);
+            break;
+        case LOG_KIND_COUNT:
+            (void)va_arg(*ap, void*);
+            continue;
+        case LOG_KIND_STR:
+            s = va_arg(*ap, const char*);
+            s = s ? s : "(null)";
+            if (n + sizeof(arg) + 8 > cap) {
+                return n;
+            }
+            len = strnlen(s, LOG_STR_MAX - 1);
+            if (LOG_ALIGN(len + 1) > cap - n - sizeof(arg)) {
+                len = cap - n - sizeof(arg) - 1;
+            }
+            arg.len = len;
+            memcpy(buf + n, &arg, sizeof(arg));
+            n += sizeof(arg);
+            memcpy(buf + n, s, len);
+            buf[n + len] = '\0';
+            n += LOG_ALIGN(len + 1);
+            continue;
+        default:
+            return n;
+        }
+        if (n + sizeof(arg) > cap) {
+            return n;
+        }
+        memcpy(buf + n, &arg, sizeof(arg));
+        n += sizeof(arg);
+    }
+    return n;
+}
+
+/*! append text from begin to end, %% as % */
+static size_t log_literal(char *out, size_t cap, size_t n, const char *begin,
+    const char *end)
+{
+    for (; begin < end && n + 1 < cap; ++begin) {
+        out[n++] = *begin;
+        if (begin[0] == '%' && begin + 1 < end && begin[1] == '%') {
+            ++begin;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+/*! take the next argument, false if arguments were cut */
+static inline bool log_arg_take(const unsigned char **args, const unsigned char *end,
+    union log_arg_t *arg)
+{
+    if (*args + sizeof(*arg) > end) {
+        return false;
+    }
+    memcpy(arg, *args, sizeof(*arg));
+    *args += sizeof(*arg);
+    return true;
+}
+
+/*! format one conversion with its copied arguments */
+static int log_convert(char *out, size_t cap, const struct log_spec_t *spec,
+    const unsigned char **args, const unsigned char *end)
+{
+    char fmt[64];
+    size_t n = 0;
+    union log_arg_t arg;
+
+    for (const char *c = spec->begin; c < spec->length; ++c) {
+        if (n + 24 > sizeof(fmt)) {
+            return -1;
+        }
+        if (*c != '*') {
+            fmt[n++] = *c;
+        } else {
+            if (!log_arg_take(args, end, &arg)) {
+                return -1;
+            }
+            n += snprintf(fmt + n, sizeof(fmt) - n, "%d", (int)arg.i);
+        }
+    }
+    if (spec->kind == LOG_KIND_INT || spec->kind == LOG_KIND_UINT) {
+        fmt[n++] = 'l';
+        fmt[n++] = 'l';
+    }
+    fmt[n++] = *spec->conv;
+    fmt[n] = '\0';
+    if (spec->kind == LOG_KIND_COUNT) {
+        return 0;
+    }
+    if (!log_arg_take(args, end, &arg)) {
+        return -1;
+    }
+    switch (spec->kind) {
+    case LOG_KIND_INT:
+        return snprintf(out, cap, fmt, arg.i);
+    case LOG_KIND_UINT:
+        return snprintf(out, cap, fmt, arg.u);
+    case LOG_KIND_DOUBLE:
+        return snprintf(out, cap, fmt, arg.f);
+    case LOG_KIND_CHAR:
+        return snprintf(out, cap, fmt, (int)arg.i);
+    case LOG_KIND_PTR:
+        return snprintf(out, cap, fmt, arg.p);
+    case LOG_KIND_STR:
+        if (*args + LOG_ALIGN(arg.len + 1) > end) {
+            return -1;
+        }
+        n = snprintf(out, cap, fmt, (const char*)*args);
+        *args += LOG_ALIGN(arg.len + 1);
+        return n;
+    default:
+        return -1;
+    }
+}
+
+/*! format a record like printf, text after arguments cut is left out */
+static size_t log_format(char *out, size_t cap, const struct log_record_t *rec)
+{
+    int ret;
+    size_t n = 0;
+    struct log_spec_t spec;
+    const char *p = rec->format;
+    const unsigned char *args = (const unsigned char*)(rec + 1);
+    const unsigned char *end = args + rec->args;
+
+    out[0] = '\0';
+    while (log_spec_next(p, &spec)) {
+        n = log_literal(out, cap, n, p, spec.begin);
+        p = spec.begin;
+        if (spec.kind == LOG_KIND_NONE) {
+            break;
+        }
+        ret = log_convert(out + n, cap - n, &spec, &args, end);
+        if (ret < 0) {
+            return log_literal(out, cap, n, "...", "..." + 3);
+        }
+        n = (size_t)ret < cap - n ? n + ret : cap - 1;
+        p = spec.end;
+    }
+    return log_literal(out, cap, n, p, p + strlen(p));
+}
+
+/*! write out lines collected, called with log_lock */
+static void log_out_flush(void)
+{
+    if (log_out_len > 0) {
+        fwrite(log_out, 1, log_out_len, stderr);
+        log_out_len = 0;
+    }
+}
+
+/*! collect a line to write, called with log_lock */
+static void log_out_line(const char *line, size_t len)
+{
+    static const char tail[] = "\n" RST;
+    if (log_out_len + len + sizeof(tail) > sizeof(log_out)) {
+        log_out_flush();
+    }
+    memcpy(log_out + log_out_len, line, len);
+    memcpy(log_out + log_out_len + len, tail, sizeof(tail) - 1);
+    log_out_len += len + sizeof(tail) - 1;
+}
+
+/*! format records of a ring, called with log_lock */
+static size_t log_ring_drain(struct log_ring_t *r)
+{
+    size_t off, num = 0;
+    char line[LOG_LINE_MAX];
+    const struct log_record_t *rec;
+    unsigned long dropped;
+    uint64_t tail = r->tail;
+    uint64_t head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+
+    for (; tail != head; ++num) {
+        off = tail % LOG_RING_SIZE;
+        /*! no room for a record before end of ring */
+        if (LOG_RING_SIZE - off < sizeof(struct log_record_t)) {
+            tail += LOG_RING_SIZE - off;
+            continue;
+        }
+        rec = (const struct log_record_t*)(r->buf + off);
+        if (rec->format) {
+            log_out_line(line, log_format(line, sizeof(line), rec));
+        }
+        tail += rec->size;
+    }
+    __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+    dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    if (dropped != r->reported) {
+        snprintf(line, sizeof(line), BLU LOG_TAG "-w: %lu log messages dropped",
+            dropped - r->reported);
+        log_out_line(line, strlen(line));
+        r->reported = dropped;
+    }
+    return num;
+}
+
+/*! drain all rings and free those of exited threads */
+static size_t log_drain_all(void)
+{
+    size_t num = 0;
+    struct log_ring_t **link, *r;
+
+    pthread_mutex_lock(&log_lock);
+    for (link = &log_rings; (r = *link) != NULL;) {
+        /*! nothing is written after closed is set */
+        if (__atomic_load_n(&r->closed, __ATOMIC_ACQUIRE)) {
+            num += log_ring_drain(r);
+            *link = r->next;
+            free(r);
+            continue;
+        }
+        num += log_ring_drain(r);
+        link = &r->next;
+    }
+    log_out_flush();
+    pthread_mutex_unlock(&log_lock);
+    return num;
+}
+
+/*! whether any ring has records, called with log_lock */
+static bool log_pending(void)
+{
+    for (struct log_ring_t *r = log_rings; r; r = r->next) {
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*! wait until a record is written, pairs with log_wakeup */
+static void log_writer_sleep(void)
+{
+    __atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&log_lock);
+    while (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) && !log_exiting
+        && !log_pending()) {
+        pthread_cond_wait(&log_cond, &log_lock);
+    }
+    __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void log_wakeup(void)
+{
+    /*! pairs with the fence in log_writer_sleep */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (!__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED)) {
+        return;     /*!< fast path, writer is running */
+    }
+    pthread_mutex_lock(&log_lock);
+    __atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void* log_writer(void *arg)
+{
+    (void)arg;
+
+    for (;;) {
+        pthread_mutex_lock(&log_lock);
+        if (log_exiting) {
+            pthread_mutex_unlock(&log_lock);
+            break;
+        }
+        pthread_mutex_unlock(&log_lock);
+        if (log_drain_all() == 0) {
+            log_writer_sleep();
+        }
+    }
+    return NULL;
+}
+
+/*! ring is freed by writer thread once it is drained */
+static void log_ring_close(void *ring)
+{
+    struct log_ring_t *r = (struct log_ring_t*)ring;
+    log_ring = NULL;
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+}
+
+static void log_at_exit(void)
+{
+    hfsm_log_flush();
+    pthread_mutex_lock(&log_lock);
+    log_exiting = true;
+    pthread_cond_signal(&log_cond);
+    pthread_mutex_unlock(&log_lock);
+}
+
+static void log_init(void)
+{
+    pthread_t tid;
+
+    if (pthread_key_create(&log_key, log_ring_close) != 0) {
+        return;
+    }
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0) {
+        return;
+    }
+    pthread_detach(tid);
+    atexit(log_at_exit);
+    __atomic_store_n(&log_started, true, __ATOMIC_RELEASE);
+}
+
+/*! ring of this thread, NULL if logging is synchronous */
+static struct log_ring_t* log_ring_get(void)
+{
+    struct log_ring_t *r = log_ring;
+
+    if (r) {
+        return r;
+    }
+    pthread_once(&log_once, log_init);
+    if (!log_started) {
+        return NULL;
+    }
+    r = (struct log_ring_t*)calloc(1, sizeof(struct log_ring_t));
+    if (r == NULL) {
+        return NULL;
+    }
+    if (pthread_setspecific(log_key, r) != 0) {
+        free(r);
+        return NULL;
+    }
+    pthread_mutex_lock(&log_lock);
+    r->next = log_rings;
+    log_rings = r;
+    pthread_mutex_unlock(&log_lock);
+    log_ring = r;
+    return r;
+}
+
+static void log_sync(const char *format, va_list ap)
+{
     int n;
-    char buf[4096];
-    
-    va_list ap;
-    va_start(ap, format);
+    char buf[LOG_LINE_MAX];
 
     n = vsnprintf(buf, sizeof(buf)-1, format, ap);
     if (n > 0 && n < (int)(sizeof(buf)-1)) {
         fprintf(stderr, "%s\n" RST, buf);
     }
-    va_end (ap);
 }
 
+static void log_capture(const char *format, va_list ap)
+{
+    uint64_t rec[LOG_RECORD_MAX / sizeof(uint64_t)];
+    struct log_record_t *hdr = (struct log_record_t*)rec;
+    struct log_ring_t *r = log_ring_get();
+    uint64_t head, tail;
+    size_t off, pad = 0;
+    va_list args;
+
+    if (r == NULL) {
+        log_sync(format, ap);
+        return;
+    }
+    va_copy(args, ap);
+    hdr->format = format;
+    hdr->args = log_encode((unsigned char*)(hdr + 1),
+        sizeof(rec) - sizeof(*hdr), format, &args);
+    hdr->size = sizeof(*hdr) + hdr->args;
+    va_end(args);
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    off = head % LOG_RING_SIZE;
+    if (off + hdr->size > LOG_RING_SIZE) {
+        pad = LOG_RING_SIZE - off;
+    }
+    if (head + pad + hdr->size - tail > LOG_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (pad >= sizeof(*hdr)) {
+        struct log_record_t *skip = (struct log_record_t*)(r->buf + off);
+        skip->size = pad;
+        skip->args = 0;
+        skip->format = NULL;
+    }
+    memcpy(r->buf + (head + pad) % LOG_RING_SIZE, rec, hdr->size);
+    __atomic_store_n(&r->head, head + pad + hdr->size, __ATOMIC_RELEASE);
+    log_wakeup();
+}
+
+void hfsm_trace(const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    log_capture(format, ap);
+    va_end(ap);
+}
+
+void hfsm_log(int level, const char *format, ...)
+{
+    va_list ap;
+    if (level < __atomic_load_n(&log_threshold, __ATOMIC_RELAXED)) {
+        return;
+    }
+    va_start(ap, format);
+    log_capture(format, ap);
+    va_end(ap);
+}
+
+void hfsm_log_set_level(int level)
+{
+    __atomic_store_n(&log_threshold, level, __ATOMIC_RELAXED);
+}
+
+void hfsm_log_flush(void)
+{
+    if (__atomic_load_n(&log_started, __ATOMIC_ACQUIRE)) {
+        log_drain_all();
+    }
+}
@@ -36,12 +36,59 @@ extern "C" {
 #define MAT "\033[345"
 #define RST "\033[0m"
 
+enum hfsm_log_level {
+    HFSM_LOG_DEBUG  = 0,
+    HFSM_LOG_INFO,
+    HFSM_LOG_WARN,
+    HFSM_LOG_ERROR,
+    HFSM_LOG_NONE,
+};
+
+/*! logs below it are compiled out */
+#ifndef HFSM_LOG_LEVEL
+#define HFSM_LOG_LEVEL      HFSM_LOG_DEBUG
+#endif
+
+/**
+  *    @brief log a message without waiting for output, the format and
+  *           arguments are copied into a ring of the calling thread and
+  *           formatted by a background thread. Strings are copied up to
+  *           1023 bytes, %n is ignored and long double is printed as double.
+  *           Messages are dropped while the ring is full.
+  *    @param[in]  format: printf format, must stay valid, e.g. a literal
+  *    @return     none
+  */
 void hfsm_trace(const char *format, ...);
 
-#define LOGD(...)   ((void)hfsm_trace(BRN LOG_TAG "-d: " __VA_ARGS__))
-#define LOGI(...)   ((void)hfsm_trace(GRN LOG_TAG "-i: " __VA_ARGS__))
-#define LOGW(...)   ((void)hfsm_trace(BLU LOG_TAG "-w: " __VA_ARGS__))
-#define LOGE(...)   ((void)hfsm_trace(RED LOG_TAG "-e: " __VA_ARGS__))
+/*! hfsm_trace if level is not below the runtime threshold */
+void hfsm_log(int level, const char *format, ...);
+
+/*! set runtime threshold, HFSM_LOG_DEBUG by default */
+void hfsm_log_set_level(int level);
+
+/*! write out messages logged before, called at exit as well */
+void hfsm_log_flush(void);
+
+#if HFSM_LOG_LEVEL <= HFSM_LOG_DEBUG
+#define LOGD(...)   ((void)hfsm_log(HFSM_LOG_DEBUG, BRN LOG_TAG "-d: " __VA_ARGS__))
+#else
+#define LOGD(...)   ((void)0)
+#endif
+#if HFSM_LOG_LEVEL <= HFSM_LOG_INFO
+#define LOGI(...)   ((void)hfsm_log(HFSM_LOG_INFO, GRN LOG_TAG "-i: " __VA_ARGS__))
+#else
+#define LOGI(...)   ((void)0)
+#endif
+#if HFSM_LOG_LEVEL <= HFSM_LOG_WARN
+#define LOGW(...)   ((void)hfsm_log(HFSM_LOG_WARN, BLU LOG_TAG "-w: " __VA_ARGS__))
+#else
+#define LOGW(...)   ((void)0)
+#endif
+#if HFSM_LOG_LEVEL <= HFSM_LOG_ERROR
+#define LOGE(...)   ((void)hfsm_log(HFSM_LOG_ERROR, RED LOG_TAG "-e: " __VA_ARGS__))
+#else
+#define LOGE(...)   ((void)0)
+#endif
 
 #define LOGE_IF(condition, ...) do { if (condition) {  (void)LOGE(__VA_ARGS__); } }while(0)
 
@@ -0,0 +1,53 @@
+/*
+ * Static tracepoints of HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_PROBE_H
+#define _HFSM_PROBE_H
+
+/*! USDT probes of provider "hfsm" for perf, bpftrace and SystemTap, a
+    probe is a nop until a tracer attaches to it. They are compiled in
+    if <sys/sdt.h> is found, unless HFSM_NO_PROBES is defined, otherwise
+    arguments are only evaluated for nothing.
+
+    send            (machine, event id, priority)
+    dispatch_begin  (machine, event id, current state)
+    dispatch_end    (machine, event id, current state)
+    transit         (machine, source state, target state)
+    exit            (machine, state)
+    effect          (machine, source state, target state), C++ only
+    entry           (machine, state)
+
+    states are state_id in C and State* in C++ */
+#if !defined(HFSM_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HFSM_PROBES_ENABLED
+#endif
+#endif
+
+#ifdef HFSM_PROBES_ENABLED
+#define HFSM_PROBE2(name, a1, a2)           DTRACE_PROBE2(hfsm, name, a1, a2)
+#define HFSM_PROBE3(name, a1, a2, a3)       DTRACE_PROBE3(hfsm, name, a1, a2, a3)
+#else
+#define HFSM_PROBE2(name, a1, a2)           ((void)(a1), (void)(a2))
+#define HFSM_PROBE3(name, a1, a2, a3)       ((void)(a1), (void)(a2), (void)(a3))
+#endif
+
+#endif /*! _HFSM_PROBE_H */
@@ -0,0 +1,767 @@
+/*
+ * Event queue backends for HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "queue.h"
+#include "latency.h"
+#include "executor.h"
+
+#define RING_BAND_NUM       (4)
+#define RING_BAND_SHIFT     (6)
+#define CACHE_LINE_SIZE     (64)
+#define EXEC_QUEUE_BUDGET   (64)
+
+/*************************** EventHub backend ********************************/
+
+static int evthub_queue_create(hfsm_queue *queue, const hfsm_queue_parm *param)
+{
+    evthub_parm parm = {
+        .max = param->max,
+        .mode = EVENT_HUB_MODE_PRIORITY,
+        .user_data = param->user_data,
+        .notifier = param->notifier
+    };
+    return evthub_create((evthub_t*)queue, &parm);
+}
+
+static int evthub_queue_destroy(hfsm_queue *queue)
+{
+    return evthub_destory((evthub_t*)queue);
+}
+
+static int evthub_queue_send(hfsm_queue queue, const event_t *e)
+{
+    /*! EventHub only fails to send when it is full */
+    int s = evthub_send((evthub_t)queue, (event_t*)e);
+    return s == UTILS_SUCC ? UTILS_SUCC : HFSM_QUEUE_ERR_FULL;
+}
+
+const struct hfsm_queue_ops hfsm_evthub_ops = {
+    .create = evthub_queue_create,
+    .destroy = evthub_queue_destroy,
+    .send = evthub_queue_send,
+    .send_batch = NULL,
+    .send_msg = NULL,
+    .drop = NULL,
+};
+
+/*************************** Lock-free ring backend **************************/
+
+/*! event queued in ring bands, owned by whoever holds its index */
+struct ring_slot_t {
+    atomic_bool pinned;         /*!< internal event, never dropped */
+    bool is_msg;
+    hfsm_msg_t msg;             /*!< only evt is used by plain events */
+#ifdef HFSM_STATS
+    unsigned long sent;         /*!< by latency_now */
+#endif
+};
+
+struct ring_cell_t {
+    atomic_size_t seq;          /*!< position the cell is ready for */
+    atomic_size_t index;        /*!< slot of the event */
+};
+
+/*! bounded ring of slot indices, cell sequence scheme of D. Vyukov's
+    bounded queue. Dispatcher is the only regular consumer of a band,
+    producers may also pop to drop events on overflow. */
+struct ring_t {
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;   /*!< producers */
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;   /*!< consumers */
+    size_t mask;
+    struct ring_cell_t *cells;
+};
+
+/*! rings of all priority bands sharing one capacity, events of any
+    band are admitted while the total number is under capacity. Events
+    are kept in capacity slots shared by bands, a band only needs room
+    for capacity indices of 16 bytes. Free ring holds indices of slots
+    not queued, an admitted producer always finds enough of them. */
+struct ring_bands_t {
+    struct ring_t rings[RING_BAND_NUM];
+    struct ring_t free;
+    struct ring_slot_t *slots;
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t count;
+    size_t capacity;
+};
+
+struct ring_queue_t {
+    struct ring_bands_t bands;
+    hfsm_queue_parm param;
+    pthread_t thread;
+    bool started;
+    bool detached;              /*!< destroyed on dispatcher thread */
+    _Alignas(CACHE_LINE_SIZE) atomic_int sleeping;
+    atomic_int stop;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static int ring_init(struct ring_t *r, size_t capacity)
+{
+    size_t cap = 1;
+    while (cap < capacity) {
+        cap <<= 1;
+    }
+    r->cells = (struct ring_cell_t*)malloc(cap * sizeof(struct ring_cell_t));
+    RETURN_IF_NULL(r->cells, UTILS_ERR_MALLOC);
+    for (size_t i=0; i<cap; ++i) {
+        atomic_init(&r->cells[i].seq, i);
+        atomic_init(&r->cells[i].index, 0);
+    }
+    atomic_init(&r->tail, 0);
+    atomic_init(&r->head, 0);
+    r->mask = cap - 1;
+    return UTILS_SUCC;
+}
+
+/*! reserve n continuous positions, cells may be freed out of order
+    by concurrent consumers, so every one of them is checked */
+static bool ring_reserve(struct ring_t *r, size_t n, size_t *pos)
+{
+    size_t i;
+    size_t p = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    for (;;) {
+        intptr_t diff = 0;
+        for (i=0; i<n && diff == 0; ++i) {
+            struct ring_cell_t *cell = &r->cells[(p + i) & r->mask];
+            size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+            diff = (intptr_t)seq - (intptr_t)(p + i);
+        }
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&r->tail, &p, p + n,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *pos = p;
+                return true;
+            }
+        } else if (diff < 0) {
+            return false;   /*!< full */
+        } else {
+            p = atomic_load_explicit(&r->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static inline void ring_publish(struct ring_t *r, size_t pos, size_t index)
+{
+    struct ring_cell_t *cell = &r->cells[pos & r->mask];
+    atomic_store_explicit(&cell->index, index, memory_order_relaxed);
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+}
+
+/*! take the first index. It is left if slots is set and its slot is
+    pinned, slot of the index is owned by caller then */
+static bool ring_pop(struct ring_t *r, size_t *index,
+    const struct ring_slot_t *slots)
+{
+    struct ring_cell_t *cell;
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    for (;;) {
+        cell = &r->cells[head & r->mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(head + 1);
+        if (diff == 0) {
+            *index = atomic_load_explicit(&cell->index, memory_order_relaxed);
+            /*! published before seq, stable until head moves */
+            if (slots && atomic_load_explicit(&slots[*index].pinned,
+                    memory_order_relaxed)) {
+                return false;
+            }
+            if (atomic_compare_exchange_weak_explicit(&r->head, &head,
+                    head + 1, memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;   /*!< empty */
+        } else {
+            head = atomic_load_explicit(&r->head, memory_order_relaxed);
+        }
+    }
+    atomic_store_explicit(&cell->seq, head + r->mask + 1,
+        memory_order_release);
+    return true;
+}
+
+static inline bool ring_ready(struct ring_t *r)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    struct ring_cell_t *cell = &r->cells[head & r->mask];
+    return atomic_load(&cell->seq) == head + 1;
+}
+
+static inline void slot_fill(struct ring_slot_t *slot, const event_t *e,
+    unsigned long sent)
+{
+    slot->is_msg = false;
+    atomic_store_explicit(&slot->pinned, e->id < HFSM_EVENT_USR_BASE,
+        memory_order_relaxed);
+    slot->msg.evt = *e;
+#ifdef HFSM_STATS
+    slot->sent = sent;
+#else
+    (void)sent;
+#endif
+}
+
+static inline void slot_fill_msg(struct ring_slot_t *slot, const hfsm_msg_t *msg)
+{
+    slot->is_msg = true;
+    atomic_store_explicit(&slot->pinned, false, memory_order_relaxed);
+#ifdef HFSM_STATS
+    slot->sent = latency_now();
+#endif
+    slot->msg.evt = msg->evt;
+    slot->msg.payload = msg->payload;
+    slot->msg.size = msg->size;
+    memcpy(slot->msg.data, msg->data, msg->size);
+}
+
+/*! copy out event of slot, param of a message refers to the copy */
+static void slot_read(const struct ring_slot_t *slot, hfsm_msg_t *m,
+    unsigned long *sent)
+{
+    m->evt = slot->msg.evt;
+#ifdef HFSM_STATS
+    *sent = slot->sent;
+#else
+    *sent = 0;
+#endif
+    if (slot->is_msg) {
+        m->evt.param = m;
+        m->payload = slot->msg.payload;
+        m->size = slot->msg.size;
+        memcpy(m->data, slot->msg.data, slot->msg.size);
+    }
+}
+
+static inline void msg_discard(hfsm_msg_t *m)
+{
+    if (hfsm_event_msg(&m->evt) && m->payload) {
+        hfsm_payload_unref(m->payload);
+    }
+}
+
+/*! shared by ring and executor backends */
+static int bands_init(struct ring_bands_t *b, size_t capacity)
+{
+    int s;
+    size_t pos;
+    atomic_init(&b->count, 0);
+    b->capacity = capacity;
+    b->slots = (struct ring_slot_t*)malloc(capacity * sizeof(struct ring_slot_t));
+    RETURN_IF_NULL(b->slots, UTILS_ERR_MALLOC);
+    s = ring_init(&b->free, capacity);
+    for (int i=0; i<RING_BAND_NUM && s == UTILS_SUCC; ++i) {
+        s = ring_init(&b->rings[i], capacity);
+    }
+    RETURN_IF_TRUE(s != UTILS_SUCC, s);
+    for (size_t i=0; i<capacity; ++i) {
+        atomic_init(&b->slots[i].pinned, false);
+        ring_reserve(&b->free, 1, &pos);
+        ring_publish(&b->free, pos, i);
+    }
+    return UTILS_SUCC;
+}
+
+/*! give a slot back before count drops, so that free indices are never
+    fewer than capacity left to producers */
+static void bands_release(struct ring_bands_t *b, size_t index)
+{
+    size_t pos;
+    /*! free ring has room for all indices */
+    while (!ring_reserve(&b->free, 1, &pos)) {
+        sched_yield();
+    }
+    ring_publish(&b->free, pos, index);
+}
+
+/*! take a slot after being admitted, it is only missed while another
+    thread is between reserving and publishing a freed index */
+static size_t bands_acquire(struct ring_bands_t *b)
+{
+    size_t index;
+    while (!ring_pop(&b->free, &index, NULL)) {
+        sched_yield();
+    }
+    return index;
+}
+
+/*! release payloads of discarded messages */
+static void bands_free(struct ring_bands_t *b)
+{
+    hfsm_msg_t m;
+    unsigned long sent;
+    size_t index;
+    for (int i=0; i<RING_BAND_NUM; ++i) {
+        while (b->rings[i].cells && ring_pop(&b->rings[i], &index, NULL)) {
+            slot_read(&b->slots[index], &m, &sent);
+            msg_discard(&m);
+        }
+        free(b->rings[i].cells);
+    }
+    free(b->free.cells);
+    free(b->slots);
+}
+
+static inline int bands_index(unsigned char priority)
+{
+    int band = priority >> RING_BAND_SHIFT;
+    return band < RING_BAND_NUM ? band : RING_BAND_NUM - 1;
+}
+
+/*! take n of capacity */
+static bool bands_admit(struct ring_bands_t *b, size_t n)
+{
+    size_t c = atomic_load_explicit(&b->count, memory_order_relaxed);
+    do {
+        if (c + n > b->capacity) {
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&b->count, &c, c + n));
+    return true;
+}
+
+static int bands_send_msg(struct ring_bands_t *b, const hfsm_msg_t *msg)
+{
+    size_t pos, index;
+    struct ring_t *r = &b->rings[bands_index(msg->evt.priority)];
+    RETURN_IF_TRUE(!bands_admit(b, 1), HFSM_QUEUE_ERR_FULL);
+    if (!ring_reserve(r, 1, &pos)) {
+        atomic_fetch_sub(&b->count, 1);
+        return HFSM_QUEUE_ERR_FULL;
+    }
+    index = bands_acquire(b);
+    slot_fill_msg(&b->slots[index], msg);
+    ring_publish(r, pos, index);
+    return UTILS_SUCC;
+}
+
+static int bands_send(struct ring_bands_t *b, const event_t *events, size_t n)
+{
+    size_t pos, index;
+    unsigned long sent = 0;
+    struct ring_t *r = &b->rings[bands_index(events[0].priority)];
+
+    RETURN_IF_TRUE(n > b->capacity, HFSM_QUEUE_ERR_FULL);
+    RETURN_IF_TRUE(!bands_admit(b, n), HFSM_QUEUE_ERR_FULL);
+    if (!ring_reserve(r, n, &pos)) {
+        atomic_fetch_sub(&b->count, n);
+        return HFSM_QUEUE_ERR_FULL;
+    }
+#ifdef HFSM_STATS
+    sent = latency_now();
+#endif
+    for (size_t i=0; i<n; ++i) {
+        index = bands_acquire(b);
+        slot_fill(&b->slots[index], &events[i], sent);
+        ring_publish(r, pos + i, index);
+    }
+    return UTILS_SUCC;
+}
+
+/*! always look for the highest band first */
+static bool bands_pop(struct ring_bands_t *b, hfsm_msg_t *m, unsigned long *sent)
+{
+    size_t index;
+    for (int i=RING_BAND_NUM-1; i>=0; --i) {
+        if (ring_pop(&b->rings[i], &index, NULL)) {
+            slot_read(&b->slots[index], m, sent);
+            bands_release(b, index);
+            atomic_fetch_sub(&b->count, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool bands_ready(struct ring_bands_t *b)
+{
+    for (int i=0; i<RING_BAND_NUM; ++i) {
+        if (ring_ready(&b->rings[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/*! discard a queued event to make room for an event of priority, a band
+    is skipped while its first event is an internal one of HFSM */
+static int bands_drop(struct ring_bands_t *b, unsigned char policy,
+    unsigned char priority)
+{
+    hfsm_msg_t m;
+    unsigned long sent;
+    size_t index;
+    int band = bands_index(priority);
+    int lowest = policy == HFSM_OVERFLOW_DROP_LOWEST ? 0 : band;
+    for (int i=lowest; i<=band; ++i) {
+        if (ring_pop(&b->rings[i], &index, b->slots)) {
+            slot_read(&b->slots[index], &m, &sent);
+            bands_release(b, index);
+            atomic_fetch_sub(&b->count, 1);
+            msg_discard(&m);
+            return UTILS_SUCC;
+        }
+    }
+    return HFSM_QUEUE_ERR_FULL;
+}
+
+static void ring_queue_wakeup(struct ring_queue_t *q)
+{
+    /*! pairs with the fence in ring_queue_sleep */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&q->sleeping, memory_order_relaxed)) {
+        return;     /*!< fast path, dispatcher is running */
+    }
+    pthread_mutex_lock(&q->lock);
+    atomic_store(&q->sleeping, 0);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void ring_queue_sleep(struct ring_queue_t *q)
+{
+    atomic_store(&q->sleeping, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (bands_ready(&q->bands)) {
+        atomic_store(&q->sleeping, 0);
+        return;
+    }
+    pthread_mutex_lock(&q->lock);
+    while (atomic_load(&q->sleeping) && !atomic_load(&q->stop)) {
+        pthread_cond_wait(&q->cond, &q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+}
+
+static void ring_queue_free(struct ring_queue_t *q)
+{
+    bands_free(&q->bands);
+    pthread_cond_destroy(&q->cond);
+    pthread_mutex_destroy(&q->lock);
+    free(q);
+}
+
+static void* ring_queue_loop(void *arg)
+{
+    hfsm_msg_t m;
+    unsigned long sent;
+    struct ring_queue_t *q = (struct ring_queue_t*)arg;
+    while (!atomic_load_explicit(&q->stop, memory_order_relaxed)) {
+        if (!bands_pop(&q->bands, &m, &sent)) {
+            ring_queue_sleep(q);
+            continue;
+        }
+        if (q->param.stamped) {
+            q->param.stamped(sent, q->param.user_data);
+        }
+        q->param.notifier(&m.evt, q->param.user_data);
+    }
+    if (q->detached) {
+        ring_queue_free(q);
+    }
+    return NULL;
+}
+
+static int ring_queue_destroy(hfsm_queue *queue)
+{
+    struct ring_queue_t *q;
+    RETURN_IF_NULL(queue, UTILS_ERR_PTR);
+    q = (struct ring_queue_t*)*queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+
+    *queue = NULL;
+    if (!q->started) {
+        ring_queue_free(q);
+        return UTILS_SUCC;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    atomic_store(&q->stop, 1);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->lock);
+    if (pthread_equal(q->thread, pthread_self())) {
+        /*! released by dispatcher after the current event */
+        q->detached = true;
+        pthread_detach(q->thread);
+    } else {
+        pthread_join(q->thread, NULL);
+        ring_queue_free(q);
+    }
+    return UTILS_SUCC;
+}
+
+static int ring_queue_create(hfsm_queue *queue, const hfsm_queue_parm *param)
+{
+    int s = UTILS_SUCC;
+    struct ring_queue_t *q;
+    RETURN_IF_NULL(queue, UTILS_ERR_PTR);
+    RETURN_IF_NULL(param, UTILS_ERR_PTR);
+    RETURN_IF_NULL(param->notifier, UTILS_ERR_PTR);
+
+    q = (struct ring_queue_t*)aligned_alloc(CACHE_LINE_SIZE,
+        sizeof(struct ring_queue_t));
+    RETURN_IF_NULL(q, UTILS_ERR_MALLOC);
+    memset(q, 0, sizeof(struct ring_queue_t));
+    q->param = *param;
+    atomic_init(&q->sleeping, 0);
+    atomic_init(&q->stop, 0);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->cond, NULL);
+    *queue = (hfsm_queue)q;
+
+    s = bands_init(&q->bands, param->max);
+    if (s == UTILS_SUCC) {
+        q->started = (pthread_create(&q->thread, NULL, ring_queue_loop, q) == 0);
+        s = q->started ? UTILS_SUCC : HFSM_QUEUE_ERR_THREAD;
+    }
+    if (s != UTILS_SUCC) {
+        ring_queue_destroy(queue);
+    }
+    return s;
+}
+
+static int ring_queue_send_batch(hfsm_queue queue, const event_t *events,
+    size_t n)
+{
+    int s;
+    struct ring_queue_t *q = (struct ring_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+    RETURN_IF_TRUE(n == 0, UTILS_SUCC);
+
+    s = bands_send(&q->bands, events, n);
+    RETURN_IF_FAIL(s, s);
+    ring_queue_wakeup(q);
+    return UTILS_SUCC;
+}
+
+static int ring_queue_send(hfsm_queue queue, const event_t *e)
+{
+    return ring_queue_send_batch(queue, e, 1);
+}
+
+static int ring_queue_send_msg(hfsm_queue queue, const hfsm_msg_t *msg)
+{
+    int s;
+    struct ring_queue_t *q = (struct ring_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+
+    s = bands_send_msg(&q->bands, msg);
+    RETURN_IF_FAIL(s, s);
+    ring_queue_wakeup(q);
+    return UTILS_SUCC;
+}
+
+static int ring_queue_drop(hfsm_queue queue, unsigned char policy,
+    unsigned char priority)
+{
+    struct ring_queue_t *q = (struct ring_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+    return bands_drop(&q->bands, policy, priority);
+}
+
+const struct hfsm_queue_ops hfsm_ring_ops = {
+    .create = ring_queue_create,
+    .destroy = ring_queue_destroy,
+    .send = ring_queue_send,
+    .send_batch = ring_queue_send_batch,
+    .send_msg = ring_queue_send_msg,
+    .drop = ring_queue_drop,
+};
+
+/*************************** Executor backend ********************************/
+
+/*! rings of one HFSM, scheduled as a task of executor while not empty */
+struct exec_queue_t {
+    struct hfsm_task task;
+    struct ring_bands_t bands;
+    hfsm_queue_parm param;
+    _Alignas(CACHE_LINE_SIZE) atomic_int scheduled;  /*!< task is queued or running */
+    atomic_int active;          /*!< runs that may invoke notifier */
+    atomic_int closed;
+    atomic_int refs;            /*!< owner, and task while it is scheduled */
+};
+
+static void exec_queue_free(struct exec_queue_t *q)
+{
+    bands_free(&q->bands);
+    free(q);
+}
+
+static void exec_queue_unref(struct exec_queue_t *q)
+{
+    if (atomic_fetch_sub(&q->refs, 1) == 1) {
+        exec_queue_free(q);
+    }
+}
+
+static void exec_queue_schedule(struct exec_queue_t *q)
+{
+    /*! pairs with the fence in exec_queue_run */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&q->scheduled, memory_order_relaxed)) {
+        return;     /*!< fast path, task will see the event */
+    }
+    if (atomic_exchange(&q->scheduled, 1) == 0) {
+        atomic_fetch_add(&q->refs, 1);
+        hfsm_executor_submit(q->param.executor, &q->task);
+    }
+}
+
+static void exec_queue_run(struct hfsm_task *task)
+{
+    hfsm_msg_t m;
+    unsigned long sent;
+    unsigned int num = 0;
+    bool resubmit = false;
+    struct exec_queue_t *q = list_entry(task, struct exec_queue_t, task);
+
+    /*! pairs with closing in exec_queue_destroy */
+    atomic_fetch_add(&q->active, 1);
+    /*! handle a limited number of events so that other HFSMs are not starved */
+    while (num < EXEC_QUEUE_BUDGET && !atomic_load(&q->closed)
+        && bands_pop(&q->bands, &m, &sent)) {
+        if (q->param.stamped) {
+            q->param.stamped(sent, q->param.user_data);
+        }
+        q->param.notifier(&m.evt, q->param.user_data);
+        ++num;
+    }
+    if (atomic_load(&q->closed)) {
+        /*! stays scheduled, never submitted again */
+    } else if (num == EXEC_QUEUE_BUDGET) {
+        resubmit = true;
+    } else {
+        atomic_store(&q->scheduled, 0);
+        atomic_thread_fence(memory_order_seq_cst);
+        resubmit = !atomic_load(&q->closed) && bands_ready(&q->bands)
+            && atomic_exchange(&q->scheduled, 1) == 0;
+    }
+    atomic_fetch_sub(&q->active, 1);
+    if (resubmit) {
+        hfsm_executor_submit(q->param.executor, &q->task);
+    } else {
+        /*! the last reference if the queue is closed */
+        exec_queue_unref(q);
+    }
+}
+
+static int exec_queue_destroy(hfsm_queue *queue)
+{
+    struct exec_queue_t *q;
+    RETURN_IF_NULL(queue, UTILS_ERR_PTR);
+    q = (struct exec_queue_t*)*queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+
+    *queue = NULL;
+    atomic_store(&q->closed, 1);
+    /*! a run on another thread may be invoking notifier, it checks
+        closed before the next event. A queued task is never waited for,
+        so a worker may destroy a queue whose task is behind its own,
+        the task releases the queue when it runs */
+    if (hfsm_executor_current() != &q->task) {
+        while (atomic_load(&q->active) > 0) {
+            sched_yield();
+        }
+    }
+    exec_queue_unref(q);
+    return UTILS_SUCC;
+}
+
+static int exec_queue_create(hfsm_queue *queue, const hfsm_queue_parm *param)
+{
+    int s;
+    struct exec_queue_t *q;
+    RETURN_IF_NULL(queue, UTILS_ERR_PTR);
+    RETURN_IF_NULL(param, UTILS_ERR_PTR);
+    RETURN_IF_NULL(param->notifier, UTILS_ERR_PTR);
+    RETURN_IF_NULL(param->executor, UTILS_ERR_PTR);
+
+    q = (struct exec_queue_t*)aligned_alloc(CACHE_LINE_SIZE,
+        sizeof(struct exec_queue_t));
+    RETURN_IF_NULL(q, UTILS_ERR_MALLOC);
+    memset(q, 0, sizeof(struct exec_queue_t));
+    q->task.run = exec_queue_run;
+    q->param = *param;
+    atomic_init(&q->scheduled, 0);
+    atomic_init(&q->active, 0);
+    atomic_init(&q->closed, 0);
+    atomic_init(&q->refs, 1);
+    s = bands_init(&q->bands, param->max);
+    if (s != UTILS_SUCC) {
+        exec_queue_free(q);
+        return s;
+    }
+    *queue = (hfsm_queue)q;
+    return UTILS_SUCC;
+}
+
+static int exec_queue_send_batch(hfsm_queue queue, const event_t *events,
+    size_t n)
+{
+    int s;
+    struct exec_queue_t *q = (struct exec_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+    RETURN_IF_TRUE(n == 0, UTILS_SUCC);
+
+    s = bands_send(&q->bands, events, n);
+    RETURN_IF_FAIL(s, s);
+    exec_queue_schedule(q);
+    return UTILS_SUCC;
+}
+
+static int exec_queue_send(hfsm_queue queue, const event_t *e)
+{
+    return exec_queue_send_batch(queue, e, 1);
+}
+
+static int exec_queue_send_msg(hfsm_queue queue, const hfsm_msg_t *msg)
+{
+    int s;
+    struct exec_queue_t *q = (struct exec_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+
+    s = bands_send_msg(&q->bands, msg);
+    RETURN_IF_FAIL(s, s);
+    exec_queue_schedule(q);
+    return UTILS_SUCC;
+}
+
+static int exec_queue_drop(hfsm_queue queue, unsigned char policy,
+    unsigned char priority)
+{
+    struct exec_queue_t *q = (struct exec_queue_t*)queue;
+    RETURN_IF_NULL(q, UTILS_ERR_PTR);
+    return bands_drop(&q->bands, policy, priority);
+}
+
+const struct hfsm_queue_ops hfsm_executor_ops = {
+    .create = exec_queue_create,
+    .destroy = exec_queue_destroy,
+    .send = exec_queue_send,
+    .send_batch = exec_queue_send_batch,
+    .send_msg = exec_queue_send_msg,
+    .drop = exec_queue_drop,
+};
@@ -0,0 +1,91 @@
+/*
+ * Event queue backends for HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_QUEUE_H
+#define _HFSM_QUEUE_H
+
+#include <event_hub.h>
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef void* hfsm_queue;
+
+enum hfsm_queue_error {
+    HFSM_QUEUE_ERR_FULL     = -0x100,
+    HFSM_QUEUE_ERR_THREAD,
+};
+
+typedef struct {
+    unsigned int max;           /*!< capacity of queue, all bands included */
+    void *user_data;            /*!< passed to notifier */
+    /*! invoked on dispatcher thread for every event */
+    void (*notifier)(const event_t*, void*);
+    void *executor;             /*!< hfsm_executor, executor backend only */
+    /*! invoked on dispatcher thread right before notifier with time the
+        event was sent by latency_now, set with HFSM_STATS, optional.
+        Backends unable to carry the time never invoke it */
+    void (*stamped)(unsigned long sent, void*);
+} hfsm_queue_parm;
+
+/*! operations of a queue backend, all return 0 on success */
+struct hfsm_queue_ops {
+    int (*create)(hfsm_queue *queue, const hfsm_queue_parm *param);
+    /*! unprocessed events will be discarded */
+    int (*destroy)(hfsm_queue *queue);
+    int (*send)(hfsm_queue queue, const event_t *e);
+    /*! send events of the same priority at once, optional */
+    int (*send_batch)(hfsm_queue queue, const event_t *events, size_t n);
+    /*! send a message by value, param of it is set to the message itself
+        before notified, reference of payload is taken over, optional */
+    int (*send_msg)(hfsm_queue queue, const hfsm_msg_t *msg);
+    /*! discard a queued event to make room for an event of priority
+        by enum hfsm_overflow policy, HFSM_QUEUE_ERR_FULL if there is
+        no event to discard, optional. Internal events of HFSM, whose
+        IDs are under HFSM_EVENT_USR_BASE, are never discarded */
+    int (*drop)(hfsm_queue queue, unsigned char policy, unsigned char priority);
+};
+
+/*! queue of external EventHub in priority mode */
+extern const struct hfsm_queue_ops hfsm_evthub_ops;
+
+/**
+  *    bounded lock-free multi-producer rings, one ring per priority
+  *    band (priority >> 6) sharing the capacity, higher bands are
+  *    dispatched first, events in the same band are in FIFO order.
+  *    Producers only wake dispatcher up if it is sleeping.
+  */
+extern const struct hfsm_queue_ops hfsm_ring_ops;
+
+/**
+  *    rings of the ring backend without a dispatcher thread, they are
+  *    drained by a task of a shared executor scheduled on the first
+  *    event, the task is queued or running at most once at a time, so
+  *    events are handled in order by one worker at a time.
+  */
+extern const struct hfsm_queue_ops hfsm_executor_ops;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_QUEUE_H */
@@ -0,0 +1,194 @@
+/*
+ * Snapshot buffers of HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "snapshot.h"
+
+#define SNAP_HEADER_SIZE    (6)     /*!< magic, version and engine */
+
+void snap_buf_init(struct snap_buf_t *b)
+{
+    memset(b, 0, sizeof(*b));
+}
+
+void snap_buf_free(struct snap_buf_t *b)
+{
+    free(b->data);
+    snap_buf_init(b);
+}
+
+void snap_buf_reset(struct snap_buf_t *b)
+{
+    b->size = 0;
+    b->pos = 0;
+    b->error = HFSM_SUCC;
+}
+
+static bool snap_reserve(struct snap_buf_t *b, size_t size)
+{
+    size_t cap;
+    unsigned char *data;
+
+    RETURN_IF_TRUE(b->error, false);
+    RETURN_IF_TRUE(b->size + size <= b->cap, true);
+    cap = b->cap ? b->cap : 64;
+    while (cap < b->size + size) {
+        cap *= 2;
+    }
+    data = (unsigned char*)realloc(b->data, cap);
+    if (data == NULL) {
+        b->error = HFSM_ERR_MALLOC;
+        return false;
+    }
+    b->data = data;
+    b->cap = cap;
+    return true;
+}
+
+void snap_put(struct snap_buf_t *b, const void *data, size_t size)
+{
+    RETURN_IF_TRUE(size == 0 || !snap_reserve(b, size),);
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+void snap_put_u8(struct snap_buf_t *b, unsigned char v)
+{
+    snap_put(b, &v, 1);
+}
+
+void snap_put_varint(struct snap_buf_t *b, uint64_t v)
+{
+    unsigned char bytes[10];
+    size_t n = 0;
+    do {
+        bytes[n] = v & 0x7F;
+        v >>= 7;
+        bytes[n++] |= v ? 0x80 : 0;
+    } while (v);
+    snap_put(b, bytes, n);
+}
+
+void snap_get(struct snap_buf_t *b, void *data, size_t size)
+{
+    if (b->error || size > b->size - b->pos) {
+        b->error = HFSM_ERR_SNAPSHOT;
+        memset(data, 0, size);
+        return;
+    }
+    memcpy(data, b->data + b->pos, size);
+    b->pos += size;
+}
+
+unsigned char snap_get_u8(struct snap_buf_t *b)
+{
+    unsigned char v;
+    snap_get(b, &v, 1);
+    return v;
+}
+
+uint64_t snap_get_varint(struct snap_buf_t *b)
+{
+    uint64_t v = 0;
+    unsigned char byte;
+    for (int shift = 0; shift < 64; shift += 7) {
+        byte = snap_get_u8(b);
+        v |= (uint64_t)(byte & 0x7F) << shift;
+        RETURN_IF_TRUE(!(byte & 0x80), v);
+    }
+    b->error = HFSM_ERR_SNAPSHOT;
+    return 0;
+}
+
+static int snap_stream_write(void *ctx, const void *data, size_t size)
+{
+    struct snap_buf_t *b = (struct snap_buf_t*)ctx;
+    snap_put(b, data, size);
+    return b->error;
+}
+
+static int snap_stream_read(void *ctx, void *data, size_t size)
+{
+    struct snap_buf_t *b = (struct snap_buf_t*)ctx;
+    snap_get(b, data, size);
+    return b->error;
+}
+
+void snap_buf_stream(struct snap_buf_t *b, hfsm_stream *stream)
+{
+    stream->ctx = b;
+    stream->write = snap_stream_write;
+    stream->read = snap_stream_read;
+}
+
+int snap_frame_write(const hfsm_stream *out, unsigned char engine,
+    const struct snap_buf_t *body)
+{
+    unsigned char header[SNAP_HEADER_SIZE + 10];
+    size_t n = SNAP_HEADER_SIZE;
+    uint64_t size = body->size;
+
+    RETURN_IF_TRUE(body->error, body->error);
+    memcpy(header, HFSM_SNAPSHOT_MAGIC, 4);
+    header[4] = HFSM_SNAPSHOT_VERSION;
+    header[5] = engine;
+    do {
+        header[n] = size & 0x7F;
+        size >>= 7;
+        header[n++] |= size ? 0x80 : 0;
+    } while (size);
+    RETURN_IF_FAIL(out->write(out->ctx, header, n), HFSM_ERR_SNAPSHOT);
+    if (body->size) {
+        RETURN_IF_FAIL(out->write(out->ctx, body->data, body->size),
+            HFSM_ERR_SNAPSHOT);
+    }
+    return HFSM_SUCC;
+}
+
+int snap_frame_read(const hfsm_stream *in, unsigned char engine,
+    struct snap_buf_t *body)
+{
+    unsigned char header[SNAP_HEADER_SIZE], byte;
+    uint64_t size = 0;
+    int shift;
+
+    snap_buf_reset(body);
+    RETURN_IF_FAIL(in->read(in->ctx, header, sizeof(header)), HFSM_ERR_SNAPSHOT);
+    RETURN_IF_TRUE(memcmp(header, HFSM_SNAPSHOT_MAGIC, 4)
+        || header[4] != HFSM_SNAPSHOT_VERSION || header[5] != engine,
+        HFSM_ERR_SNAPSHOT);
+    for (shift = 0; shift < 64; shift += 7) {
+        RETURN_IF_FAIL(in->read(in->ctx, &byte, 1), HFSM_ERR_SNAPSHOT);
+        size |= (uint64_t)(byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            break;
+        }
+    }
+    RETURN_IF_TRUE(shift >= 64 || size > SNAP_MAX_BODY, HFSM_ERR_SNAPSHOT);
+    RETURN_IF_TRUE(!snap_reserve(body, (size_t)size), HFSM_ERR_MALLOC);
+    if (size) {
+        RETURN_IF_FAIL(in->read(in->ctx, body->data, (size_t)size),
+            HFSM_ERR_SNAPSHOT);
+    }
+    body->size = (size_t)size;
+    return HFSM_SUCC;
+}
@@ -0,0 +1,97 @@
+/*
+ * Snapshot buffers of HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_SNAPSHOT_H
+#define _HFSM_SNAPSHOT_H
+
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SNAP_ENGINE_C       (0)     /*!< frame written by hfsm.c */
+#define SNAP_ENGINE_CPP     (1)     /*!< frame written by StateMachine */
+#define SNAP_MAX_BODY       (1UL << 26) /*!< larger bodies are malformed */
+
+/*! body of a frame being built or parsed, error is set by the first
+    allocation failure or read beyond size and later calls do nothing */
+struct snap_buf_t {
+    unsigned char *data;
+    size_t size;
+    size_t cap;
+    size_t pos;                 /*!< next byte to read */
+    int error;
+};
+
+void snap_buf_init(struct snap_buf_t *b);
+
+void snap_buf_free(struct snap_buf_t *b);
+
+/*! empty the buffer keeping its memory */
+void snap_buf_reset(struct snap_buf_t *b);
+
+void snap_put(struct snap_buf_t *b, const void *data, size_t size);
+
+void snap_put_u8(struct snap_buf_t *b, unsigned char v);
+
+/*! LEB128, 7 bits a byte from the lowest */
+void snap_put_varint(struct snap_buf_t *b, uint64_t v);
+
+void snap_get(struct snap_buf_t *b, void *data, size_t size);
+
+unsigned char snap_get_u8(struct snap_buf_t *b);
+
+uint64_t snap_get_varint(struct snap_buf_t *b);
+
+/**
+  *    @brief stream appending to a buffer, or reading its rest
+  *    @param[in]  b: buffer
+  *    @param[out] stream: stream over b
+  *    @return     none
+  */
+void snap_buf_stream(struct snap_buf_t *b, hfsm_stream *stream);
+
+/**
+  *    @brief write header and body of a frame
+  *    @param[in]  out: stream
+  *    @param[in]  engine: SNAP_ENGINE_*
+  *    @param[in]  body: body built
+  *    @return     0 success, HFSM_ERR_SNAPSHOT if stream failed
+  */
+int snap_frame_write(const hfsm_stream *out, unsigned char engine,
+    const struct snap_buf_t *body);
+
+/**
+  *    @brief read the next frame, header is checked
+  *    @param[in]  in: stream
+  *    @param[in]  engine: SNAP_ENGINE_* expected
+  *    @param[out] body: body read from position 0, memory of it is reused
+  *    @return     0 success, HFSM_ERR_SNAPSHOT if stream failed or frame is
+  *                of another version or engine, HFSM_ERR_MALLOC if failed
+  */
+int snap_frame_read(const hfsm_stream *in, unsigned char engine,
+    struct snap_buf_t *body);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_SNAPSHOT_H */
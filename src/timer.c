@@ -0,0 +1,276 @@
+/*
+ * Hierarchical timing wheel of HFSM timers
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <time.h>
+#include <pthread.h>
+
+#include "timer.h"
+
+#define WHEEL_BITS      (6)
+#define WHEEL_SLOTS     (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SLOTS - 1)
+#define WHEEL_LEVELS    (4)
+/*! ticks covered by all levels, farther timers are re-placed on cascading */
+#define WHEEL_RANGE     ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/*! every level has 64 slots, a slot of level n spans 64^n ticks */
+struct timer_wheel_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t thread;
+    bool started;
+    bool stop;
+    uint64_t now;               /*!< ticks processed */
+    uint64_t wake;              /*!< tick thread sleeps until */
+    uint64_t base_ms;           /*!< monotonic time of tick 0 */
+    size_t num;                 /*!< armed timers */
+    struct listnode slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+static struct timer_wheel_t *default_wheel = NULL;
+
+static uint64_t timer_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/*! ticks elapsed by clock, processed ticks may fall behind it */
+static uint64_t wheel_clock(struct timer_wheel_t *w)
+{
+    return (timer_clock_ms() - w->base_ms) / TIMER_TICK_MS;
+}
+
+static void wheel_place(struct timer_wheel_t *w, struct timer_node *t)
+{
+    int level = 0;
+    uint64_t expire = t->expire < w->now ? w->now : t->expire;
+    uint64_t delta = expire - w->now;
+
+    if (delta >= WHEEL_RANGE) {
+        delta = WHEEL_RANGE - 1;
+        expire = w->now + delta;
+    }
+    while (delta >> (WHEEL_BITS * (level + 1))) {
+        ++level;
+    }
+    list_add_tail(&w->slots[level][(expire >> (WHEEL_BITS * level)) & WHEEL_MASK],
+        &t->node);
+}
+
+static void wheel_take(struct listnode *dst, struct listnode *src)
+{
+    list_init(dst);
+    if (!list_empty(src)) {
+        dst->next = src->next;
+        dst->prev = src->prev;
+        dst->next->prev = dst;
+        dst->prev->next = dst;
+        list_init(src);
+    }
+}
+
+/*! process tick now, timers failing to fire are retried at tick retry */
+static void wheel_tick(struct timer_wheel_t *w, uint64_t retry)
+{
+    struct listnode list, *c, *n;
+    struct timer_node *t;
+
+    /*! cascade higher levels whose slot begins at this tick, the highest
+        first so that timers moved down are cascaded again at once */
+    for (int level=WHEEL_LEVELS-1; level>0; --level) {
+        if (w->now & (((uint64_t)1 << (WHEEL_BITS * level)) - 1)) {
+            continue;
+        }
+        wheel_take(&list, &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK]);
+        list_for_each_safe(c, n, &list) {
+            list_remove(c);
+            wheel_place(w, list_entry(c, struct timer_node, node));
+        }
+    }
+
+    wheel_take(&list, &w->slots[0][w->now & WHEEL_MASK]);
+    list_for_each_safe(c, n, &list) {
+        t = list_entry(c, struct timer_node, node);
+        list_remove(c);
+        if (t->expire > w->now) {
+            /*! beyond range of wheel when it was placed */
+            wheel_place(w, t);
+            continue;
+        }
+        list_init(c);
+        --w->num;
+        if (!t->fire(t)) {
+            t->expire = retry;
+            wheel_place(w, t);
+            ++w->num;
+        }
+    }
+}
+
+/*! the next tick with work, an occupied slot of level 0 or a cascade,
+    so thread sleeps through empty ticks */
+static uint64_t wheel_next(struct timer_wheel_t *w)
+{
+    uint64_t tick = w->now + 1;
+
+    /*! slots of level 0 beyond the cascade are looked at after it */
+    while ((tick & WHEEL_MASK) && list_empty(&w->slots[0][tick & WHEEL_MASK])) {
+        ++tick;
+    }
+    return tick;
+}
+
+static void* wheel_loop(void *arg)
+{
+    uint64_t target, ms;
+    struct timespec deadline;
+    struct timer_wheel_t *w = (struct timer_wheel_t*)arg;
+
+    pthread_mutex_lock(&w->lock);
+    while (!w->stop) {
+        if (w->num == 0) {
+            pthread_cond_wait(&w->cond, &w->lock);
+            continue;
+        }
+        /*! catch up if thread was delayed, timers failing to fire are
+            retried on the next tick by clock rather than at every tick
+            caught up, so a full queue never keeps thread busy with lock */
+        target = wheel_clock(w);
+        while (w->now < target && w->num > 0) {
+            ++w->now;
+            wheel_tick(w, target + 1);
+        }
+        if (w->num == 0) {
+            continue;
+        }
+        w->wake = wheel_next(w);
+        ms = w->base_ms + w->wake * TIMER_TICK_MS;
+        deadline.tv_sec = (time_t)(ms / 1000);
+        deadline.tv_nsec = (long)(ms % 1000) * 1000000;
+        pthread_cond_timedwait(&w->cond, &w->lock, &deadline);
+    }
+    pthread_mutex_unlock(&w->lock);
+    return NULL;
+}
+
+struct timer_wheel_t* timer_wheel_create(void)
+{
+    pthread_condattr_t attr;
+    struct timer_wheel_t *w;
+
+    w = (struct timer_wheel_t*)malloc(sizeof(struct timer_wheel_t));
+    RETURN_IF_NULL(w, NULL);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&w->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    w->started = false;
+    w->stop = false;
+    w->now = 0;
+    w->wake = 0;
+    w->base_ms = timer_clock_ms();
+    w->num = 0;
+    for (int i=0; i<WHEEL_LEVELS; ++i) {
+        for (int j=0; j<WHEEL_SLOTS; ++j) {
+            list_init(&w->slots[i][j]);
+        }
+    }
+    return w;
+}
+
+void timer_wheel_destroy(struct timer_wheel_t *w)
+{
+    RETURN_IF_NULL(w,);
+    pthread_mutex_lock(&w->lock);
+    w->stop = true;
+    pthread_cond_signal(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    if (w->started) {
+        pthread_join(w->thread, NULL);
+    }
+    pthread_cond_destroy(&w->cond);
+    pthread_mutex_destroy(&w->lock);
+    free(w);
+}
+
+static void timer_wheel_default_init(void)
+{
+    default_wheel = timer_wheel_create();
+}
+
+struct timer_wheel_t* timer_wheel_default(void)
+{
+    pthread_once(&default_once, timer_wheel_default_init);
+    return default_wheel;
+}
+
+void timer_wheel_lock(struct timer_wheel_t *w)
+{
+    pthread_mutex_lock(&w->lock);
+}
+
+void timer_wheel_unlock(struct timer_wheel_t *w)
+{
+    pthread_mutex_unlock(&w->lock);
+}
+
+void timer_node_init(struct timer_node *t, bool (*fire)(struct timer_node*))
+{
+    list_init(&t->node);
+    t->expire = 0;
+    t->fire = fire;
+}
+
+int timer_wheel_add(struct timer_wheel_t *w, struct timer_node *t,
+    unsigned int ms)
+{
+    uint64_t ticks = (ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+
+    if (!w->started) {
+        RETURN_IF_TRUE(pthread_create(&w->thread, NULL, wheel_loop, w) != 0,
+            HFSM_ERR_TIMER);
+        w->started = true;
+    }
+    if (w->num == 0) {
+        /*! all slots are empty, skip ticks passed while idle */
+        w->now = wheel_clock(w);
+    }
+    /*! by clock rather than processed ticks, so a late wheel never fires
+        timers early */
+    t->expire = wheel_clock(w) + (ticks ? ticks : 1);
+    wheel_place(w, t);
+    /*! thread sleeps until the next tick with work, wake it up earlier */
+    if (w->num++ == 0 || t->expire < w->wake) {
+        pthread_cond_signal(&w->cond);
+    }
+    return HFSM_SUCC;
+}
+
+void timer_wheel_del(struct timer_wheel_t *w, struct timer_node *t)
+{
+    RETURN_IF_TRUE(list_empty(&t->node),);
+    list_remove(&t->node);
+    list_init(&t->node);
+    --w->num;
+}
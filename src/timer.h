@@ -0,0 +1,99 @@
+/*
+ * Hierarchical timing wheel of HFSM timers
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_TIMER_H
+#define _HFSM_TIMER_H
+
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define TIMER_TICK_MS       (1)     /*!< resolution of timers */
+
+struct timer_wheel_t;
+
+/*! timer linked in a slot of wheel, it is unlinked when not armed */
+struct timer_node {
+    struct listnode node;
+    uint64_t expire;                /*!< tick to expire */
+    /**
+      *    @brief expiry callback, called on thread of wheel with lock held
+      *    @param[in]  t: expired timer
+      *    @return     false to retry on next tick
+      */
+    bool (*fire)(struct timer_node *t);
+};
+
+/**
+  *    @brief create a wheel, its thread starts on the first timer
+  *    @return     wheel, NULL if failed
+  */
+struct timer_wheel_t* timer_wheel_create(void);
+
+/**
+  *    @brief stop thread of wheel and destroy it, armed timers are dropped
+  *    @param[in]  w: wheel
+  *    @return     none
+  */
+void timer_wheel_destroy(struct timer_wheel_t *w);
+
+/**
+  *    @brief wheel shared by HFSMs not running on an executor,
+  *           it is never destroyed
+  *    @return     wheel, NULL if failed
+  */
+struct timer_wheel_t* timer_wheel_default(void);
+
+void timer_wheel_lock(struct timer_wheel_t *w);
+void timer_wheel_unlock(struct timer_wheel_t *w);
+
+/**
+  *    @brief initialize timer as unlinked
+  *    @param[in]  t: timer
+  *    @param[in]  fire: expiry callback
+  *    @return     none
+  */
+void timer_node_init(struct timer_node *t, bool (*fire)(struct timer_node*));
+
+/**
+  *    @brief arm timer in O(1), lock of wheel must be held
+  *    @param[in]  w: wheel
+  *    @param[in]  t: unlinked timer
+  *    @param[in]  ms: expires after ms, at least one tick
+  *    @return     0 success, HFSM_ERR_TIMER if thread can not start
+  */
+int timer_wheel_add(struct timer_wheel_t *w, struct timer_node *t,
+    unsigned int ms);
+
+/**
+  *    @brief cancel timer in O(1), lock of wheel must be held
+  *    @param[in]  w: wheel
+  *    @param[in]  t: timer, nothing is done if it is unlinked
+  *    @return     none
+  */
+void timer_wheel_del(struct timer_wheel_t *w, struct timer_node *t);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_TIMER_H */
@@ -0,0 +1,123 @@
+/*
+ * Binary trace ring of HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "latency.h"
+
+struct trace_ring_t {
+    uint64_t head;              /*!< records claimed */
+    uint64_t mask;
+    hfsm_trace_record records[];
+};
+
+struct trace_ring_t* trace_ring_create(unsigned int records)
+{
+    uint64_t size = 1;
+    struct trace_ring_t *t;
+
+    while (size < records) {
+        size <<= 1;
+    }
+    t = (struct trace_ring_t*)calloc(1, sizeof(struct trace_ring_t)
+        + size * sizeof(hfsm_trace_record));
+    RETURN_IF_NULL(t, NULL);
+    t->mask = size - 1;
+    return t;
+}
+
+void trace_ring_destroy(struct trace_ring_t *t)
+{
+    free(t);
+}
+
+/*! seq of a record is cleared while it is written, like a seqlock */
+void trace_ring_write(struct trace_ring_t *t, uint32_t event, state_id source,
+    state_id handler, state_id target, unsigned char kind)
+{
+    uint64_t pos = __atomic_fetch_add(&t->head, 1, __ATOMIC_RELAXED);
+    hfsm_trace_record *r = &t->records[pos & t->mask];
+
+    __atomic_store_n(&r->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&r->ns, latency_now(), __ATOMIC_RELAXED);
+    __atomic_store_n(&r->event, event, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->source, source, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->handler, handler, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->target, target, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->kind, kind, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/*! copy record at pos, false if it is being written or overwritten */
+static bool trace_ring_read(struct trace_ring_t *t, uint64_t pos,
+    hfsm_trace_record *out)
+{
+    hfsm_trace_record *r = &t->records[pos & t->mask];
+
+    RETURN_IF_TRUE(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) != pos + 1, false);
+    out->seq = pos + 1;
+    out->ns = __atomic_load_n(&r->ns, __ATOMIC_RELAXED);
+    out->event = __atomic_load_n(&r->event, __ATOMIC_RELAXED);
+    out->source = __atomic_load_n(&r->source, __ATOMIC_RELAXED);
+    out->handler = __atomic_load_n(&r->handler, __ATOMIC_RELAXED);
+    out->target = __atomic_load_n(&r->target, __ATOMIC_RELAXED);
+    out->kind = __atomic_load_n(&r->kind, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&r->seq, __ATOMIC_RELAXED) == pos + 1;
+}
+
+int trace_ring_dump(struct trace_ring_t *t, const char *path)
+{
+    FILE *fp;
+    size_t written;
+    hfsm_trace_record *records;
+    hfsm_trace_header header;
+    uint64_t head = __atomic_load_n(&t->head, __ATOMIC_RELAXED);
+    uint64_t pos = head > t->mask ? head - t->mask - 1 : 0;
+
+    records = (hfsm_trace_record*)malloc((t->mask + 1) * sizeof(hfsm_trace_record));
+    RETURN_IF_NULL(records, HFSM_ERR_MALLOC);
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, HFSM_TRACE_MAGIC, sizeof(header.magic));
+    header.record_size = sizeof(hfsm_trace_record);
+    header.written = head;
+    for (; pos < head; ++pos) {
+        if (trace_ring_read(t, pos, &records[header.count])) {
+            ++header.count;
+        }
+    }
+
+    fp = fopen(path, "wb");
+    if (fp == NULL) {
+        free(records);
+        return HFSM_ERR_TRACE;
+    }
+    written = fwrite(&header, sizeof(header), 1, fp);
+    if (header.count > 0) {
+        written += fwrite(records, sizeof(hfsm_trace_record), header.count, fp);
+    }
+    free(records);
+    RETURN_IF_TRUE(fclose(fp) != 0, HFSM_ERR_TRACE);
+    return written == 1 + header.count ? HFSM_SUCC : HFSM_ERR_TRACE;
+}
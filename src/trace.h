@@ -0,0 +1,68 @@
+/*
+ * Binary trace ring of HFSM
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _HFSM_TRACE_H
+#define _HFSM_TRACE_H
+
+#include "hfsm.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*! ring of trace records, written without locks by dispatching threads,
+    the oldest records are overwritten */
+struct trace_ring_t;
+
+/**
+  *    @brief create a ring
+  *    @param[in]  records: capacity, rounded up to a power of 2
+  *    @return     ring, NULL if failed
+  */
+struct trace_ring_t* trace_ring_create(unsigned int records);
+
+void trace_ring_destroy(struct trace_ring_t *t);
+
+/**
+  *    @brief append a record, it may be called by several threads at once
+  *    @param[in]  t: ring
+  *    @param[in]  event: ID of event
+  *    @param[in]  source: active state offered the event
+  *    @param[in]  handler: state processing the event
+  *    @param[in]  target: state requested by handler
+  *    @param[in]  kind: enum hfsm_trace_kind
+  *    @return     none
+  */
+void trace_ring_write(struct trace_ring_t *t, uint32_t event, state_id source,
+    state_id handler, state_id target, unsigned char kind);
+
+/**
+  *    @brief write header and records from the oldest to a file
+  *    @param[in]  t: ring
+  *    @param[in]  path: file to create or truncate
+  *    @return     0 success, HFSM_ERR_TRACE if file failed
+  */
+int trace_ring_dump(struct trace_ring_t *t, const char *path);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*! _HFSM_TRACE_H */
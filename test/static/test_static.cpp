@@ -0,0 +1,163 @@
+/*
+ * Unit test for HFSM declared as types, built with C++17
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <gtest/gtest.h>
+
+#include <string>
+#include <StaticStateMachine.h>
+
+using namespace utils::hfsm;
+
+namespace {
+
+enum TestEvent : uint32_t {
+    kCross = 1,
+    kBack,
+    kSelf,
+    kUp,
+    kFirst,
+    kExit,
+    kPing,
+};
+
+/// Entry and exit are traced as "+name" and "-name"
+template <typename Self, typename Parent>
+struct TraceState : StaticState<Parent>
+{
+    template <typename SM>
+    static void Entry(SM &sm) { sm.trace += std::string("+") + Self::kName; }
+    template <typename SM>
+    static void Exit(SM &sm) { sm.trace += std::string("-") + Self::kName; }
+};
+
+/// Effect is traced as "!name", guard is allowed by SM
+template <typename Self, typename Source, typename Target, uint32_t Trigger>
+struct TraceTrans : StaticTransition<Source, Target, Trigger>
+{
+    template <typename SM>
+    static bool Guard(SM &sm) { return sm.allow; }
+    template <typename SM>
+    static void Effect(SM &sm) { sm.trace += std::string("!") + Self::kName; }
+};
+
+/// s0 { s1 { s11 s12 } s2 { s21 } }
+struct S0 : TraceState<S0, void>
+{
+    static constexpr const char *kName = "s0";
+    template <typename SM>
+    static bool Invoke(uint32_t evt, SM &sm)
+    {
+        sm.trace += "s0?" + std::to_string(evt);
+        return true;
+    }
+};
+struct S1 : TraceState<S1, S0> { static constexpr const char *kName = "s1"; };
+struct S11 : TraceState<S11, S1> { static constexpr const char *kName = "s11"; };
+struct S12 : TraceState<S12, S1> { static constexpr const char *kName = "s12"; };
+struct S2 : TraceState<S2, S0> { static constexpr const char *kName = "s2"; };
+struct S21 : TraceState<S21, S2> { static constexpr const char *kName = "s21"; };
+
+struct TCross : TraceTrans<TCross, S11, S21, kCross> { static constexpr const char *kName = "cross"; };
+struct TBack : TraceTrans<TBack, S21, S12, kBack> { static constexpr const char *kName = "back"; };
+struct TSelf : TraceTrans<TSelf, S12, S12, kSelf> { static constexpr const char *kName = "self"; };
+struct TUp : TraceTrans<TUp, S12, S1, kUp> { static constexpr const char *kName = "up"; };
+struct TFirst : TraceTrans<TFirst, S1, S11, kFirst> { static constexpr const char *kName = "first"; };
+struct TSecond : TraceTrans<TSecond, S1, S12, kFirst> { static constexpr const char *kName = "second"; };
+struct TExit : TraceTrans<TExit, S11, void, kExit> { static constexpr const char *kName = "exit"; };
+
+class TraceSM : public StaticStateMachine<TraceSM,
+    StateList<S0, S1, S11, S12, S2, S21>,
+    TransitionList<TCross, TBack, TSelf, TUp, TFirst, TSecond, TExit>>
+{
+  public:
+    std::string trace;
+    bool allow = true;
+};
+
+}
+
+TEST(statichfsm, start)
+{
+    TraceSM sm;
+    EXPECT_FALSE(sm.Running());
+    EXPECT_FALSE(sm.Dispatch(kPing));
+    sm.Start<S11>();
+    EXPECT_EQ(sm.trace, "+s0+s1+s11");
+    EXPECT_EQ(sm.Current(), TraceSM::IndexOf<S11>());
+    EXPECT_TRUE(sm.IsIn<S1>());
+    EXPECT_FALSE(sm.IsIn<S2>());
+}
+
+TEST(statichfsm, lca)
+{
+    TraceSM sm;
+    sm.Start<S11>();
+
+    /// exits up to the least common ancestor, effect, enters down from it
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kCross));
+    EXPECT_EQ(sm.trace, "-s11-s1!cross+s2+s21");
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kBack));
+    EXPECT_EQ(sm.trace, "-s21-s2!back+s1+s12");
+
+    /// self-transition runs effect only
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kSelf));
+    EXPECT_EQ(sm.trace, "!self");
+
+    /// the parent is the ancestor, it is neither exited nor entered
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kUp));
+    EXPECT_EQ(sm.trace, "-s12!up");
+    EXPECT_EQ(sm.Current(), TraceSM::IndexOf<S1>());
+}
+
+TEST(statichfsm, order)
+{
+    /// transitions are checked in order of TransitionList
+    TraceSM sm;
+    sm.Start<S1>();
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kFirst));
+    EXPECT_EQ(sm.trace, "!first+s11");
+
+    /// guard refused, event goes to the state and its parents
+    sm.allow = false;
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kCross));
+    EXPECT_EQ(sm.trace, "s0?1");
+}
+
+TEST(statichfsm, final)
+{
+    TraceSM sm;
+    sm.Start<S11>();
+    sm.trace.clear();
+    EXPECT_TRUE(sm.Dispatch(kExit));
+    EXPECT_EQ(sm.trace, "-s11-s1-s0!exit");
+    EXPECT_FALSE(sm.Running());
+    EXPECT_FALSE(sm.Dispatch(kPing));
+}
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
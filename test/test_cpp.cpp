@@ -0,0 +1,1449 @@
+/*
+ * Unit test for HFSM implemented by C++
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <gtest/gtest.h>
+
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <memory>
+#include <vector>
+#include <set>
+#include <string>
+#include <sstream>
+#include <functional>
+#include <condition_variable>
+#include <Executor.h>
+#include <EventQueue.h>
+#include <EventPool.h>
+#include <Histogram.h>
+#include <StateMachine.h>
+
+using namespace utils;
+using namespace utils::hfsm;
+
+namespace {
+
+class TestEvent : public Event
+{
+  public:
+    TestEvent(uint32_t id, EvtPriority pri, uint32_t from = 0)
+      : id_(id), pri_(pri), from_(from) {}
+    virtual uint32_t ID() const override { return id_; }
+    virtual const char* Name() const override { return "test"; }
+    virtual EvtPriority Priority() const override { return pri_; }
+    uint32_t From() const { return from_; }
+
+  private:
+    uint32_t id_;
+    EvtPriority pri_;
+    uint32_t from_;     /// producer of the event
+};
+
+SpEvent test_event(uint32_t id, EvtPriority pri = EvtPriority::kEvtPriLow,
+    uint32_t from = 0)
+{
+    return MakeEvent<TestEvent>(id, pri, from);
+}
+
+bool ring_push(EventRing &ring, uint32_t id,
+    EvtPriority pri = EvtPriority::kEvtPriLow, bool pinned = false)
+{
+    SpEvent evt = test_event(id, pri);
+    return ring.Push(&evt, 1, pinned);
+}
+
+/// ID of the next event popped, 0 if empty
+uint32_t ring_pop(EventRing &ring)
+{
+    SpEvent evt;
+    return ring.Pop(evt) ? evt->ID() : 0;
+}
+
+class FuncTask : public Executor::Task
+{
+  public:
+    explicit FuncTask(const std::function<void()> &func) : func_(func) {}
+    virtual void Run() override { func_(); }
+
+  private:
+    std::function<void()> func_;
+};
+
+/// Flag waited for by other threads, false if it is not set in time
+class Latch
+{
+  public:
+    void Reset()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        set_ = false;
+    }
+    void Set()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        set_ = true;
+        cond_.notify_all();
+    }
+    bool Wait()
+    {
+        std::unique_lock<std::mutex> guard(lock_);
+        return cond_.wait_for(guard, std::chrono::seconds(60), [this] { return set_; });
+    }
+
+  private:
+    std::mutex lock_;
+    std::condition_variable cond_;
+    bool set_ = false;
+};
+
+/// Occupy the only worker of executor until the latch is set
+void exec_block(Executor &exec, Latch &release)
+{
+    Latch running;
+    exec.Submit(std::make_shared<FuncTask>([&running, &release] {
+        running.Set();
+        release.Wait();
+    }));
+    running.Wait();
+}
+
+}
+
+namespace {
+
+/// Over-aligned event, its block must keep the alignment
+class alignas(64) AlignedEvent : public TestEvent
+{
+  public:
+    AlignedEvent(uint32_t id) : TestEvent(id, EvtPriority::kEvtPriLow) {}
+};
+
+}
+
+TEST(cpphfsm, pool_recycle)
+{
+    /// the block released last is allocated first
+    using Pool = BlockPool<1008, 8>;
+    void *p = Pool::Alloc();
+    Pool::Free(p);
+    EXPECT_EQ(Pool::Alloc(), p);
+    Pool::Free(p);
+
+    /// event and its reference counts share one recycled block
+    const Event *evt = test_event(1).get();
+    EXPECT_EQ(test_event(2).get(), evt);
+}
+
+TEST(cpphfsm, pool_cross_thread)
+{
+    /// a multiple of batch, so the cache of this thread is left empty
+    constexpr size_t kBlocks = 256;
+    using Pool = BlockPool<1000, 8>;     /// used by no event
+    std::set<void*> blocks;
+    for (size_t i = 0; i < kBlocks; ++i) {
+        blocks.insert(Pool::Alloc());
+    }
+    ASSERT_EQ(blocks.size(), kBlocks);
+
+    /// blocks freed by another thread go back by its cache, the rest of
+    /// which is flushed on its exit
+    std::thread consumer([&blocks] {
+        for (void *p : blocks) {
+            Pool::Free(p);
+        }
+    });
+    consumer.join();
+    for (size_t i = 0; i < kBlocks; ++i) {
+        EXPECT_EQ(blocks.count(Pool::Alloc()), 1u);
+    }
+    for (void *p : blocks) {
+        Pool::Free(p);
+    }
+}
+
+TEST(cpphfsm, pool_alignment)
+{
+    /// every block of a batch, not only the first one
+    using Pool = BlockPool<64, 64>;
+    std::vector<void*> blocks;
+    for (int i = 0; i < 200; ++i) {
+        blocks.emplace_back(Pool::Alloc());
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(blocks.back()) % 64, 0u);
+    }
+    for (void *p : blocks) {
+        Pool::Free(p);
+    }
+    std::vector<std::shared_ptr<AlignedEvent>> evts;
+    for (uint32_t i = 0; i < 200; ++i) {
+        evts.emplace_back(MakeEvent<AlignedEvent>(i));
+        EXPECT_EQ(reinterpret_cast<uintptr_t>(evts.back().get()) % 64, 0u);
+    }
+}
+
+TEST(cpphfsm, ring_fifo)
+{
+    EventRing ring(8);
+    EXPECT_FALSE(ring.Ready());
+    for (uint32_t id = 1; id <= 4; ++id) {
+        ASSERT_TRUE(ring_push(ring, id, EvtPriority::kEvtPriMid));
+    }
+    SpEvent batch[] = {
+        test_event(5, EvtPriority::kEvtPriMid),
+        test_event(6, EvtPriority::kEvtPriMid)
+    };
+    ASSERT_TRUE(ring.Push(batch, 2));
+    EXPECT_TRUE(ring.Ready());
+    for (uint32_t id = 1; id <= 6; ++id) {
+        EXPECT_EQ(ring_pop(ring), id);
+    }
+    EXPECT_EQ(ring_pop(ring), 0u);
+    EXPECT_FALSE(ring.Ready());
+
+    /// time of sending is kept by slots
+    SpEvent evt;
+    uint64_t sent = 0;
+    ASSERT_TRUE(ring.Push(batch, 2, false, 42));
+    for (uint32_t id = 5; id <= 6; ++id) {
+        ASSERT_TRUE(ring.Pop(evt, &sent));
+        EXPECT_EQ(evt->ID(), id);
+        EXPECT_EQ(sent, 42u);
+    }
+}
+
+TEST(cpphfsm, ring_priority)
+{
+    EventRing ring(8);
+    ASSERT_TRUE(ring_push(ring, 1, EvtPriority::kEvtPriLow));
+    ASSERT_TRUE(ring_push(ring, 2, EvtPriority::kEvtPriHigh));
+    ASSERT_TRUE(ring_push(ring, 3, EvtPriority::kEvtPriMid));
+    ASSERT_TRUE(ring_push(ring, 4, EvtPriority::kEvtPriLow));
+    ASSERT_TRUE(ring_push(ring, 5, EvtPriority::kEvtPriHigh));
+    /// higher bands first, FIFO in a band
+    EXPECT_EQ(ring_pop(ring), 2u);
+    EXPECT_EQ(ring_pop(ring), 5u);
+    EXPECT_EQ(ring_pop(ring), 3u);
+    EXPECT_EQ(ring_pop(ring), 1u);
+    EXPECT_EQ(ring_pop(ring), 4u);
+    EXPECT_EQ(ring_pop(ring), 0u);
+}
+
+TEST(cpphfsm, ring_capacity)
+{
+    EventRing ring(4);
+    ASSERT_TRUE(ring_push(ring, 1, EvtPriority::kEvtPriLow));
+    ASSERT_TRUE(ring_push(ring, 2, EvtPriority::kEvtPriHigh));
+    ASSERT_TRUE(ring_push(ring, 3, EvtPriority::kEvtPriMid));
+    /// one slot is left for all bands, a batch is admitted as a whole
+    SpEvent batch[] = {
+        test_event(4, EvtPriority::kEvtPriLow),
+        test_event(5, EvtPriority::kEvtPriLow)
+    };
+    EXPECT_FALSE(ring.Push(batch, 2));
+    ASSERT_TRUE(ring_push(ring, 4, EvtPriority::kEvtPriHigh));
+    EXPECT_FALSE(ring_push(ring, 5, EvtPriority::kEvtPriLow));
+    EXPECT_FALSE(ring_push(ring, 5, EvtPriority::kEvtPriMid));
+    EXPECT_FALSE(ring_push(ring, 5, EvtPriority::kEvtPriHigh));
+
+    /// room made by popping any band is shared again
+    EXPECT_EQ(ring_pop(ring), 2u);
+    ASSERT_TRUE(ring_push(ring, 5, EvtPriority::kEvtPriLow));
+    EXPECT_FALSE(ring_push(ring, 6, EvtPriority::kEvtPriLow));
+    EXPECT_EQ(ring_pop(ring), 4u);
+    EXPECT_EQ(ring_pop(ring), 3u);
+    EXPECT_EQ(ring_pop(ring), 1u);
+    EXPECT_EQ(ring_pop(ring), 5u);
+    EXPECT_EQ(ring_pop(ring), 0u);
+}
+
+TEST(cpphfsm, ring_drop)
+{
+    EventRing ring(4);
+    ASSERT_TRUE(ring_push(ring, 1, EvtPriority::kEvtPriLow));
+    ASSERT_TRUE(ring_push(ring, 2, EvtPriority::kEvtPriMid));
+    ASSERT_TRUE(ring_push(ring, 3, EvtPriority::kEvtPriHigh));
+    EXPECT_FALSE(ring.Drop(OverflowPolicy::kReject, EvtPriority::kEvtPriHigh));
+    /// the oldest of the same band, or of the lowest band not above
+    EXPECT_TRUE(ring.Drop(OverflowPolicy::kDropOldest, EvtPriority::kEvtPriMid));
+    EXPECT_TRUE(ring.Drop(OverflowPolicy::kDropLowest, EvtPriority::kEvtPriHigh));
+    EXPECT_FALSE(ring.Drop(OverflowPolicy::kDropLowest, EvtPriority::kEvtPriMid));
+    EXPECT_EQ(ring_pop(ring), 3u);
+    EXPECT_EQ(ring_pop(ring), 0u);
+}
+
+TEST(cpphfsm, ring_drop_pinned)
+{
+    EventRing ring(4);
+    ASSERT_TRUE(ring_push(ring, 1, EvtPriority::kEvtPriLow, true));
+    ASSERT_TRUE(ring_push(ring, 2, EvtPriority::kEvtPriLow));
+    ASSERT_TRUE(ring_push(ring, 3, EvtPriority::kEvtPriMid));
+    /// band behind a pinned event is not dropped from, the next one is
+    EXPECT_FALSE(ring.Drop(OverflowPolicy::kDropOldest, EvtPriority::kEvtPriLow));
+    EXPECT_TRUE(ring.Drop(OverflowPolicy::kDropLowest, EvtPriority::kEvtPriMid));
+    EXPECT_FALSE(ring.Drop(OverflowPolicy::kDropLowest, EvtPriority::kEvtPriHigh));
+    EXPECT_EQ(ring_pop(ring), 1u);
+    /// dropped again once the pinned one is dispatched
+    EXPECT_TRUE(ring.Drop(OverflowPolicy::kDropOldest, EvtPriority::kEvtPriLow));
+    EXPECT_EQ(ring_pop(ring), 0u);
+}
+
+TEST(cpphfsm, ring_queue_producers)
+{
+    constexpr uint32_t kProducers = 4;
+    constexpr uint32_t kEvents = 20000;
+    std::mutex lock;
+    std::condition_variable cond;
+    std::vector<uint32_t> next(kProducers, 1);
+    std::atomic<uint32_t> done{0};
+    bool ordered = true;
+
+    /// dispatcher sleeps whenever the ring is drained, so a lost wakeup
+    /// leaves events behind
+    RingEventQueue queue([&](const SpEvent &evt, uint64_t) {
+        auto *e = static_cast<const TestEvent*>(evt.get());
+        ordered = ordered && e->ID() == next[e->From()];
+        next[e->From()] = e->ID() + 1;
+        if (done.fetch_add(1) + 1 == kProducers * kEvents) {
+            std::lock_guard<std::mutex> guard(lock);
+            cond.notify_one();
+        }
+    }, 16);
+
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&queue, p] {
+            for (uint32_t id = 1; id <= kEvents; ++id) {
+                SpEvent evt = test_event(id, EvtPriority::kEvtPriMid, p);
+                while (!queue.Send(evt)) {
+                    std::this_thread::yield();
+                }
+                if (id % 1000 == 0) {
+                    /// let dispatcher run dry and go to sleep
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));
+                }
+            }
+        });
+    }
+    for (auto &t : producers) {
+        t.join();
+    }
+    std::unique_lock<std::mutex> guard(lock);
+    EXPECT_TRUE(cond.wait_for(guard, std::chrono::seconds(10),
+        [&] { return done.load() == kProducers * kEvents; }));
+    EXPECT_TRUE(ordered);
+}
+
+TEST(cpphfsm, exec_run_to_completion)
+{
+    constexpr uint32_t kQueues = 8;
+    constexpr uint32_t kProducers = 4;
+    constexpr uint32_t kEvents = 2000;
+    struct Box {
+        std::atomic<int> inside{0};
+        std::vector<uint32_t> next = std::vector<uint32_t>(kProducers, 1);
+        bool ok = true;
+        std::unique_ptr<ExecutorEventQueue> queue;
+    };
+    Executor exec(4);
+    Latch finished;
+    std::atomic<uint32_t> done{0};
+    std::vector<Box> boxes(kQueues);
+    for (auto &box : boxes) {
+        /// events of a queue are dispatched by one worker at a time, in order
+        box.queue.reset(new ExecutorEventQueue(exec, [&box, &done, &finished](const SpEvent &evt, uint64_t) {
+            auto *e = static_cast<const TestEvent*>(evt.get());
+            box.ok = box.ok && box.inside.fetch_add(1) == 0
+                && e->ID() == box.next[e->From()];
+            box.next[e->From()] = e->ID() + 1;
+            std::this_thread::yield();
+            box.inside.fetch_sub(1);
+            if (done.fetch_add(1) + 1 == kQueues * kProducers * kEvents) {
+                finished.Set();
+            }
+        }, 32));
+    }
+
+    std::vector<std::thread> producers;
+    for (uint32_t p = 0; p < kProducers; ++p) {
+        producers.emplace_back([&boxes, p] {
+            for (uint32_t id = 1; id <= kEvents; ++id) {
+                for (auto &box : boxes) {
+                    SpEvent evt = test_event(id, EvtPriority::kEvtPriMid, p);
+                    while (!box.queue->Send(evt)) {
+                        std::this_thread::yield();
+                    }
+                }
+            }
+        });
+    }
+    for (auto &t : producers) {
+        t.join();
+    }
+    ASSERT_TRUE(finished.Wait());
+    for (auto &box : boxes) {
+        EXPECT_TRUE(box.ok);
+        box.queue.reset();
+    }
+}
+
+TEST(cpphfsm, exec_budget)
+{
+    constexpr uint32_t kBudget = 64;
+    constexpr uint32_t kEvents = kBudget * 3;
+    Executor exec(1);
+    Latch release, finished;
+    std::vector<uint32_t> order;
+    auto record = [&order, &finished](const SpEvent &evt, uint64_t) {
+        order.emplace_back(evt->ID());
+        if (order.size() == kEvents + 1) {
+            finished.Set();
+        }
+    };
+    ExecutorEventQueue a(exec, record, kEvents);
+    ExecutorEventQueue b(exec, record, 1);
+
+    /// both tasks are queued behind the blocker, a first
+    exec_block(exec, release);
+    for (uint32_t id = 1; id <= kEvents; ++id) {
+        ASSERT_TRUE(a.Send(test_event(id)));
+    }
+    ASSERT_TRUE(b.Send(test_event(0)));
+    release.Set();
+    ASSERT_TRUE(finished.Wait());
+
+    /// a yields the worker after its budget, b runs before the rest of a
+    ASSERT_EQ(order.size(), kEvents + 1);
+    for (uint32_t i = 0, id = 1; i < order.size(); ++i) {
+        if (i == kBudget) {
+            EXPECT_EQ(order[i], 0u);
+        } else {
+            EXPECT_EQ(order[i], id++);
+        }
+    }
+}
+
+TEST(cpphfsm, exec_steal)
+{
+    Executor exec(2);
+    Latch ran, finished;
+    std::thread::id owner, thief;
+    bool stolen = false;
+
+    /// a task submitted on a worker is queued to it, the worker is busy
+    /// waiting for it, so only the other one can run it
+    exec.Submit(std::make_shared<FuncTask>([&] {
+        owner = std::this_thread::get_id();
+        exec.Submit(std::make_shared<FuncTask>([&] {
+            thief = std::this_thread::get_id();
+            ran.Set();
+        }));
+        stolen = ran.Wait();
+        finished.Set();
+    }));
+    ASSERT_TRUE(finished.Wait());
+    EXPECT_TRUE(stolen);
+    EXPECT_NE(owner, thief);
+}
+
+TEST(cpphfsm, exec_destroy_from_worker)
+{
+    Executor exec(1);
+    Latch release, finished;
+    std::atomic<int> b_events{0};
+    std::unique_ptr<ExecutorEventQueue> b(new ExecutorEventQueue(exec,
+        [&b_events](const SpEvent&, uint64_t) { b_events.fetch_add(1); }, 4));
+
+    /// the task of b is queued behind the one of a on the only worker,
+    /// destroying b from a must not wait for it
+    ExecutorEventQueue a(exec, [&b, &finished](const SpEvent&, uint64_t) {
+        EXPECT_TRUE(b->Send(test_event(2)));
+        b.reset();
+        finished.Set();
+    }, 4);
+    exec_block(exec, release);
+    ASSERT_TRUE(a.Send(test_event(1)));
+    release.Set();
+    ASSERT_TRUE(finished.Wait());
+
+    /// the orphan task of b runs after and dispatches nothing
+    Latch drained;
+    exec.Submit(std::make_shared<FuncTask>([&drained] { drained.Set(); }));
+    ASSERT_TRUE(drained.Wait());
+    EXPECT_EQ(b_events.load(), 0);
+}
+
+namespace {
+
+/// Arms timers on entering s1, the ones of odd SMs are cut short by
+/// the transition to s2 on the middle timer, which cancels the rest
+class TimerSM : public StateMachine
+{
+  public:
+    using S = StateImpl<TimerSM>;
+    using T = TransitionImpl<TimerSM>;
+    static constexpr uint32_t kStart = 0;     /// triggers initial transition
+    static constexpr uint32_t kTimers = 100;
+    static constexpr uint32_t kMaxMs = 150;
+
+    TimerSM(uint32_t seed, bool cut, std::atomic<uint32_t> &done, Latch &finished,
+        uint32_t sms)
+      : seed_(seed), cut_(cut), done_(done), finished_(finished), sms_(sms)
+    {
+        S::StateAction a1 = {};
+        a1.enter = &TimerSM::Entry1;
+        a1.invoke = &TimerSM::Invoke1;
+        S::StateAction a2 = {};
+        a2.enter = &TimerSM::Entry2;
+        a2.invoke = &TimerSM::Invoke2;
+        auto s1 = std::make_shared<S>(nullptr, a1);
+        auto s2 = std::make_shared<S>(nullptr, a2);
+        T::TransAction ta = {};
+        AddTransition(std::make_shared<T>(nullptr, s1, kStart, ta));
+        if (cut_) {
+            AddTransition(std::make_shared<T>(s1, s2, kTimers / 2, ta));
+        }
+    }
+    uint32_t fired = 0;     /// timers dispatched in s1
+    uint32_t early = 0;     /// timers dispatched a tick or more early
+    uint32_t stale = 0;     /// timers dispatched after s1 exited
+
+  private:
+    uint32_t Delay(uint32_t id) const { return 1 + (id * 37 + seed_) % kMaxMs; }
+    void Entry1()
+    {
+        begin_ = std::chrono::steady_clock::now();
+        for (uint32_t id = 1; id <= kTimers; ++id) {
+            StartTimer(test_event(id), Delay(id));
+        }
+    }
+    bool Invoke1(const SpEvent &evt)
+    {
+        auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - begin_).count();
+        early += ms + TimerWheel::kTickMs < Delay(evt->ID());
+        if (++fired == kTimers) {
+            Done();
+        }
+        return true;
+    }
+    void Entry2() { Done(); }
+    bool Invoke2(const SpEvent&)
+    {
+        ++stale;
+        return true;
+    }
+    void Done()
+    {
+        if (done_.fetch_add(1) + 1 == sms_) {
+            finished_.Set();
+        }
+    }
+
+  private:
+    uint32_t seed_;
+    bool cut_;
+    std::atomic<uint32_t> &done_;
+    Latch &finished_;
+    uint32_t sms_;
+    std::chrono::steady_clock::time_point begin_;
+};
+
+}
+
+TEST(cpphfsm, timer_many)
+{
+    constexpr uint32_t kSMs = 1000;
+    Executor exec(4);
+    Latch finished;
+    std::atomic<uint32_t> done{0};
+    std::vector<std::unique_ptr<TimerSM>> sms;
+    StartOption option;
+    option.executor = &exec;
+    option.capacity = 32;   /// expiries are retried while queue is full
+    for (uint32_t i = 0; i < kSMs; ++i) {
+        sms.emplace_back(new TimerSM(i, i % 2, done, finished, kSMs));
+        ASSERT_TRUE(sms.back()->Start(option));
+        ASSERT_TRUE(sms.back()->SendEvent(test_event(TimerSM::kStart)));
+    }
+    ASSERT_TRUE(finished.Wait());
+
+    /// cancelled timers would have fired by now, their expiry is ignored
+    std::this_thread::sleep_for(std::chrono::milliseconds(TimerSM::kMaxMs + 50));
+    /// every SM is synchronized with by its last event
+    std::stringstream sync;
+    std::vector<StateMachine*> all;
+    for (auto &sm : sms) {
+        all.emplace_back(sm.get());
+    }
+    ASSERT_TRUE(StateMachine::SnapshotAll(all.data(), all.size(), sync));
+    for (uint32_t i = 0; i < kSMs; ++i) {
+        EXPECT_EQ(sms[i]->early, 0u);
+        EXPECT_EQ(sms[i]->stale, 0u);
+        if (i % 2) {
+            EXPECT_LT(sms[i]->fired, TimerSM::kTimers);
+        } else {
+            EXPECT_EQ(sms[i]->fired, TimerSM::kTimers);
+        }
+    }
+    sms.clear();
+}
+
+namespace {
+
+constexpr uint32_t kStart = 0;
+constexpr uint32_t kDone = 1000;    /// handled by root of tree, sets latch
+
+/// SM of TraceState and TraceTrans, trace is written by dispatcher
+class TraceSM : public StateMachine
+{
+  public:
+    std::string trace;
+    Latch done;
+};
+
+class TraceState : public State
+{
+  public:
+    TraceState(const std::string &name, const SpState &parent = nullptr,
+        std::set<uint32_t> handles = {})
+      : name_(name), handles_(handles)
+    {
+        if (parent) {
+            SetParent(parent);
+        }
+    }
+
+  protected:
+    virtual void Entry(StateMachine *sm) override { Trace(sm) += "+" + name_; }
+    virtual void Exit(StateMachine *sm) override { Trace(sm) += "-" + name_; }
+    virtual bool Invoke(const SpEvent &evt, StateMachine *sm) override
+    {
+        if (evt->ID() == kDone && Parent() == nullptr) {
+            static_cast<TraceSM*>(sm)->done.Set();
+            return true;
+        }
+        if (handles_.count(evt->ID()) == 0) {
+            return false;
+        }
+        Trace(sm) += name_ + "?" + std::to_string(evt->ID());
+        if (uint32_t from = static_cast<const TestEvent*>(evt.get())->From()) {
+            Trace(sm) += ":" + std::to_string(from);
+        }
+        return true;
+    }
+
+  private:
+    static std::string& Trace(StateMachine *sm) { return static_cast<TraceSM*>(sm)->trace; }
+    std::string name_;
+    std::set<uint32_t> handles_;
+};
+
+class TraceTrans : public Transition
+{
+  public:
+    TraceTrans(const SpState &source, const SpState &target, uint32_t trigger)
+      : Transition(source, target, trigger) {}
+
+  protected:
+    virtual void Effect(StateMachine*) override {}
+    virtual bool Triggered(const SpEvent&, StateMachine*) override { return false; }
+};
+
+void trace_trans(StateMachine &sm, const SpState &source, const SpState &target,
+    uint32_t trigger)
+{
+    sm.AddTransition(std::make_shared<TraceTrans>(source, target, trigger));
+}
+
+/// Send events and wait until they are dispatched
+bool trace_send(TraceSM &sm, std::initializer_list<uint32_t> ids)
+{
+    sm.done.Reset();
+    for (uint32_t id : ids) {
+        if (!sm.SendEvent(test_event(id))) {
+            return false;
+        }
+    }
+    return sm.SendEvent(test_event(kDone)) && sm.done.Wait();
+}
+
+}
+
+namespace {
+
+/// Transition triggered by ID declared or checked by Triggered, its guard
+/// is traced as "name?" and returns allow
+class GuardTrans : public Transition
+{
+  public:
+    /// trigger declared
+    GuardTrans(const SpState &source, const SpState &target, uint32_t trigger,
+        const std::string &name, bool allow)
+      : Transition(source, target, trigger), id_(trigger), name_(name), allow_(allow) {}
+    /// id checked by Triggered
+    GuardTrans(const SpState &source, const SpState &target, const std::string &name,
+        bool allow, uint32_t id)
+      : Transition(source, target), id_(id), name_(name), allow_(allow) {}
+
+  protected:
+    virtual bool Guard(StateMachine *sm) override
+    {
+        static_cast<TraceSM*>(sm)->trace += name_ + "?";
+        return allow_;
+    }
+    virtual void Effect(StateMachine *sm) override
+    {
+        static_cast<TraceSM*>(sm)->trace += "!" + name_;
+    }
+    virtual bool Triggered(const SpEvent &evt, StateMachine*) override
+    {
+        return evt->ID() == id_;
+    }
+
+  private:
+    uint32_t id_;
+    std::string name_;
+    bool allow_;
+};
+
+void guard_trans(StateMachine &sm, const SpState &source, const SpState &target,
+    uint32_t trigger, bool declared, const std::string &name, bool allow = true)
+{
+    if (declared) {
+        sm.AddTransition(std::make_shared<GuardTrans>(source, target, trigger, name, allow));
+    } else {
+        sm.AddTransition(std::make_shared<GuardTrans>(source, target, name, allow, trigger));
+    }
+}
+
+}
+
+TEST(cpphfsm, trans_order)
+{
+    /// r { s t1 t2 t3 }
+    TraceSM sm;
+    auto r = std::make_shared<TraceState>("r");
+    auto s = std::make_shared<TraceState>("s", r);
+    auto t1 = std::make_shared<TraceState>("t1", r);
+    auto t2 = std::make_shared<TraceState>("t2", r);
+    auto t3 = std::make_shared<TraceState>("t3", r);
+    trace_trans(sm, nullptr, s, kStart);
+    guard_trans(sm, t1, t2, 1, true, "x");      /// not from s, never looked up
+    guard_trans(sm, s, t2, 1, false, "a", false);
+    guard_trans(sm, s, t1, 1, true, "b");
+    guard_trans(sm, s, t2, 1, true, "c");
+    guard_trans(sm, s, t2, 2, true, "d", false);
+    guard_trans(sm, s, t3, 2, false, "e");
+    guard_trans(sm, s, t3, 3, true, "f", false);
+    for (const auto &t : { t1, t2, t3 }) {
+        trace_trans(sm, t, s, 9);
+    }
+    ASSERT_TRUE(sm.Start(StartOption()));
+    ASSERT_TRUE(trace_send(sm, { kStart }));
+
+    /// candidates of the ID and the ones checked by Triggered are taken
+    /// in order of adding, the first one accepted wins
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 1 }));
+    EXPECT_EQ(sm.trace, "a?b?-s!b+t1");
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 9, 2 }));
+    EXPECT_EQ(sm.trace, "-t1+sd?e?-s!e+t3");
+
+    /// no candidate of other IDs is looked at
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 9, 4, 3 }));
+    EXPECT_EQ(sm.trace, "-t3+sf?");
+}
+
+namespace {
+
+/// SM binding actions of StateImpl and TransitionImpl
+class BindSM : public TraceSM
+{
+  public:
+    void Enter() { trace += "+bound"; }
+    void Effect() { trace += "!bound"; }
+};
+
+}
+
+TEST(cpphfsm, bind_type)
+{
+    using BindState = StateImpl<BindSM>;
+    using BindTrans = TransitionImpl<BindSM>;
+    BindState::StateAction action = { &BindSM::Enter, nullptr, nullptr };
+    BindTrans::TransAction effect = { nullptr, &BindSM::Effect, nullptr };
+    auto r = std::make_shared<TraceState>("r");
+    auto s = std::make_shared<BindState>(r, action);
+    auto t = std::make_shared<TraceState>("t", r);
+
+    /// actions are called on the type they are bound to
+    BindSM bound;
+    trace_trans(bound, nullptr, s, kStart);
+    bound.AddTransition(std::make_shared<BindTrans>(s, t, 1, effect));
+    ASSERT_TRUE(bound.Start(StartOption()));
+    ASSERT_TRUE(trace_send(bound, { kStart, 1 }));
+    EXPECT_EQ(bound.trace, "+r+bound!bound+t");
+
+    /// a state of another type of SM is rejected before any action
+    TraceSM state_sm;
+    trace_trans(state_sm, nullptr, s, kStart);
+    EXPECT_FALSE(state_sm.Start(StartOption()));
+    EXPECT_FALSE(state_sm.SendEvent(test_event(kStart)));
+    EXPECT_EQ(state_sm.trace, "");
+
+    /// so is a transition
+    TraceSM trans_sm;
+    trace_trans(trans_sm, nullptr, t, kStart);
+    trans_sm.AddTransition(std::make_shared<BindTrans>(t, r, 1, effect));
+    EXPECT_FALSE(trans_sm.Start(StartOption()));
+    EXPECT_EQ(trans_sm.trace, "");
+}
+
+TEST(cpphfsm, defer_recall)
+{
+    /// r { a { a1 } b c }, a defers 2 and 3, b defers 3
+    TraceSM sm;
+    auto r = std::make_shared<TraceState>("r");
+    auto a = std::make_shared<TraceState>("a", r);
+    auto a1 = std::make_shared<TraceState>("a1", a, std::set<uint32_t>{ 2 });
+    auto b = std::make_shared<TraceState>("b", r, std::set<uint32_t>{ 2 });
+    auto c = std::make_shared<TraceState>("c", r, std::set<uint32_t>{ 3 });
+    a->Defer(2);
+    a->Defer(3);
+    b->Defer(3);
+    trace_trans(sm, nullptr, a1, kStart);
+    trace_trans(sm, a1, b, 1);
+    trace_trans(sm, b, c, 4);
+    ASSERT_TRUE(sm.Start(StartOption()));
+    ASSERT_TRUE(trace_send(sm, { kStart }));
+
+    /// deferred by the parent, even if the current state handles them
+    sm.trace.clear();
+    for (uint32_t from = 1; from <= 3; ++from) {
+        ASSERT_TRUE(sm.SendEvent(test_event(from == 2 ? 3 : 2,
+            EvtPriority::kEvtPriLow, from)));
+    }
+    ASSERT_TRUE(trace_send(sm, {}));
+    EXPECT_EQ(sm.trace, "");
+
+    /// recalled in order after the transition, parked again if the new
+    /// state still defers them
+    ASSERT_TRUE(trace_send(sm, { 1 }));
+    EXPECT_EQ(sm.trace, "-a1-a+bb?2:1b?2:3");
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 4, 3 }));
+    EXPECT_EQ(sm.trace, "-b+cc?3:2c?3");
+}
+
+TEST(cpphfsm, history)
+{
+    struct Case {
+        History h;
+        History p;
+        const char *restored;
+        const char *left;       /// trace of leaving by 5 then
+    };
+    const Case cases[] = {
+        { History::kDeep, History::kNone, "-x+h+p+p2", "-p2-p-h+x" },
+        { History::kShallow, History::kNone, "-x+h+p", "" },
+        /// shallow history of the child restored goes on down
+        { History::kShallow, History::kShallow, "-x+h+p+p2", "-p2-p-h+x" },
+    };
+    for (const Case &c : cases) {
+        /// r { h { p { p1 p2 } } x }
+        TraceSM sm;
+        auto r = std::make_shared<TraceState>("r");
+        auto h = std::make_shared<TraceState>("h", r);
+        auto p = std::make_shared<TraceState>("p", h);
+        auto p1 = std::make_shared<TraceState>("p1", p);
+        auto p2 = std::make_shared<TraceState>("p2", p);
+        auto x = std::make_shared<TraceState>("x", r);
+        h->SetHistory(c.h);
+        p->SetHistory(c.p);
+        trace_trans(sm, nullptr, x, kStart);
+        trace_trans(sm, x, h, 6);
+        trace_trans(sm, h, p1, 7);
+        trace_trans(sm, p1, p2, 1);
+        trace_trans(sm, p2, x, 5);
+        ASSERT_TRUE(sm.Start(StartOption()));
+        ASSERT_TRUE(trace_send(sm, { kStart }));
+
+        /// nothing to restore before the composite exits
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 6 }));
+        EXPECT_EQ(sm.trace, "-x+h");
+
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 7, 1, 5 }));
+        EXPECT_EQ(sm.trace, "+p+p1-p1+p2-p2-p-h+x");
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 6 }));
+        EXPECT_EQ(sm.trace, c.restored);
+
+        /// the state restored is current
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 5 }));
+        EXPECT_EQ(sm.trace, c.left);
+    }
+}
+
+TEST(cpphfsm, action_stats)
+{
+    /// r { a b c }, the first transition of 1 is refused by its guard
+    TraceSM sm;
+    auto r = std::make_shared<TraceState>("r");
+    auto a = std::make_shared<TraceState>("a", r, std::set<uint32_t>{ 2 });
+    auto b = std::make_shared<TraceState>("b", r);
+    auto c = std::make_shared<TraceState>("c", r);
+    auto start = std::make_shared<TraceTrans>(nullptr, a, kStart);
+    auto refused = std::make_shared<GuardTrans>(a, b, 1, "refused", false);
+    auto taken = std::make_shared<GuardTrans>(a, c, 1, "taken", true);
+    sm.AddTransition(start);
+    sm.AddTransition(refused);
+    sm.AddTransition(taken);
+    ASSERT_TRUE(sm.Start(StartOption()));
+    for (uint32_t id : { kStart, 2u, 3u, 1u }) {
+        ASSERT_TRUE(sm.SendEvent(test_event(id)));
+    }
+    ASSERT_TRUE(trace_send(sm, {}));
+    EXPECT_EQ(sm.trace, "+r+aa?2refused?taken?-a!taken+c");
+
+    StateStats state;
+    TransStats trans;
+#ifdef HFSM_STATS
+    /// kDone is still being handled by r, c has been invoked with it
+    ASSERT_TRUE(sm.GetStateStats(a, state));
+    EXPECT_EQ(state.entries, 1u);
+    EXPECT_EQ(state.exits, 1u);
+    EXPECT_EQ(state.invokes, 2u);
+    EXPECT_EQ(state.handled, 1u);
+    ASSERT_TRUE(sm.GetStateStats(b, state));
+    EXPECT_EQ(state.entries, 0u);
+    EXPECT_EQ(state.invokes, 0u);
+    ASSERT_TRUE(sm.GetStateStats(c, state));
+    EXPECT_EQ(state.entries, 1u);
+    EXPECT_EQ(state.exits, 0u);
+    EXPECT_EQ(state.invokes, 1u);
+    EXPECT_EQ(state.handled, 0u);
+
+    ASSERT_TRUE(sm.GetTransStats(start, trans));
+    EXPECT_EQ(trans.fired, 1u);
+    ASSERT_TRUE(sm.GetTransStats(refused, trans));
+    EXPECT_EQ(trans.fired, 0u);
+    EXPECT_EQ(trans.rejected, 1u);
+    ASSERT_TRUE(sm.GetTransStats(taken, trans));
+    EXPECT_EQ(trans.fired, 1u);
+    EXPECT_EQ(trans.rejected, 0u);
+
+    /// only states and transitions of the SM are counted
+    EXPECT_FALSE(sm.GetStateStats(std::make_shared<TraceState>("y"), state));
+    EXPECT_FALSE(sm.GetTransStats(std::make_shared<TraceTrans>(a, b, 9), trans));
+#else
+    EXPECT_FALSE(sm.GetStateStats(a, state));
+    EXPECT_FALSE(sm.GetTransStats(start, trans));
+#endif
+}
+
+TEST(cpphfsm, latency_stamped)
+{
+    Executor exec(1);
+    const QueueKind queues[] = { QueueKind::kEventHub, QueueKind::kRing, QueueKind::kRing };
+    for (size_t i = 0; i < 3; ++i) {
+        TraceSM sm;
+        auto r = std::make_shared<TraceState>("r", nullptr, std::set<uint32_t>{ 1, 2, 3 });
+        trace_trans(sm, nullptr, r, kStart);
+        StartOption option;
+        option.queue = queues[i];
+        option.executor = i == 2 ? &exec : nullptr;
+        ASSERT_TRUE(sm.Start(option));
+        ASSERT_TRUE(trace_send(sm, { kStart }));
+        SpEvent evts[] = { test_event(1), test_event(2) };
+        ASSERT_TRUE(sm.SendEvents(evts, evts + 2));
+        ASSERT_TRUE(trace_send(sm, { 3 }));
+        EXPECT_EQ(sm.trace, "+rr?1r?2r?3");
+
+        /// every event sent keeps its time of sending through the queue,
+        /// kDone may not be recorded yet
+        LatencyStats stats;
+#ifdef HFSM_STATS
+        for (uint32_t id = 1; id <= 3; ++id) {
+            ASSERT_TRUE(sm.GetEventLatency(id, LatencyKind::kWait, stats));
+            EXPECT_EQ(stats.count, 1u);
+            ASSERT_TRUE(sm.GetEventLatency(id, LatencyKind::kTotal, stats));
+            EXPECT_EQ(stats.count, 1u);
+        }
+#else
+        EXPECT_FALSE(sm.GetLatency(LatencyKind::kWait, stats));
+#endif
+    }
+}
+
+namespace {
+
+/// Event tagged 'a' holds dispatcher until released, tags are traced
+class HoldState : public State
+{
+  public:
+    HoldState(Latch &held, Latch &release, size_t expect)
+      : held_(held), release_(release), expect_(expect) {}
+    std::string trace;
+    Latch done;     /// trace has expected number of tags
+
+  protected:
+    virtual void Entry(StateMachine*) override {}
+    virtual void Exit(StateMachine*) override {}
+    virtual bool Invoke(const SpEvent &evt, StateMachine*) override
+    {
+        char tag = static_cast<char>(static_cast<const TestEvent*>(evt.get())->From());
+        if (tag == 'a') {
+            held_.Set();
+            release_.Wait();
+        }
+        trace += tag;
+        if (trace.size() == expect_) {
+            done.Set();
+        }
+        return true;
+    }
+
+  private:
+    Latch &held_;
+    Latch &release_;
+    size_t expect_;
+};
+
+}
+
+TEST(cpphfsm, send_events_long_run)
+{
+    const OverflowPolicy policies[] = {
+        OverflowPolicy::kReject, OverflowPolicy::kDropOldest,
+        OverflowPolicy::kDropLowest, OverflowPolicy::kBlock
+    };
+    const std::string traces[] = { "abc", "aef", "aef", "abcdef" };
+    for (size_t p = 0; p < 4; ++p) {
+        Latch held, release;
+        auto s = std::make_shared<HoldState>(held, release, traces[p].size());
+        StateMachine sm;
+        trace_trans(sm, nullptr, s, kStart);
+        StartOption option;
+        option.queue = QueueKind::kRing;
+        option.capacity = 2;
+        option.overflow = policies[p];
+        ASSERT_TRUE(sm.Start(option));
+        ASSERT_TRUE(sm.SendEvent(test_event(kStart)));
+        ASSERT_TRUE(sm.SendEvent(test_event(1, EvtPriority::kEvtPriLow, 'a')));
+        ASSERT_TRUE(held.Wait());
+
+        /// a run of 5 is sent in parts of capacity 2, 'b' and 'c' fit
+        std::vector<SpEvent> run;
+        for (char tag = 'b'; tag <= 'f'; ++tag) {
+            run.emplace_back(test_event(1, EvtPriority::kEvtPriLow, tag));
+        }
+        std::thread releaser([&release] {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            release.Set();
+        });
+        EXPECT_EQ(sm.SendEvents(run.begin(), run.end()),
+            policies[p] != OverflowPolicy::kReject);
+        releaser.join();
+        ASSERT_TRUE(s->done.Wait());
+        EXPECT_EQ(s->trace, traces[p]) << p;
+    }
+}
+
+TEST(cpphfsm, region_sequential)
+{
+    /// r { c { ra { a1 a2 } rb { b1 b2 } } x }
+    TraceSM sm;
+    auto r = std::make_shared<TraceState>("r");
+    auto c = std::make_shared<TraceState>("c", r, std::set<uint32_t>{ 3, 9 });
+    auto ra = std::make_shared<TraceState>("ra", c);
+    auto a1 = std::make_shared<TraceState>("a1", ra, std::set<uint32_t>{ 3 });
+    auto a2 = std::make_shared<TraceState>("a2", ra);
+    auto rb = std::make_shared<TraceState>("rb", c, std::set<uint32_t>{ 4 });
+    auto b1 = std::make_shared<TraceState>("b1", rb);
+    auto b2 = std::make_shared<TraceState>("b2", rb, std::set<uint32_t>{ 3 });
+    auto x = std::make_shared<TraceState>("x", r);
+    c->AddRegion(a1);
+    c->AddRegion(b1);
+    trace_trans(sm, nullptr, c, kStart);
+    trace_trans(sm, a1, a2, 1);
+    trace_trans(sm, b1, b2, 2);
+    trace_trans(sm, a2, x, 5);     /// escapes from both regions
+    trace_trans(sm, b2, x, 5);
+    trace_trans(sm, x, c, 7);
+    ASSERT_TRUE(sm.Start(StartOption()));
+
+    /// entering composite enters initial of every region in order
+    ASSERT_TRUE(trace_send(sm, { kStart }));
+    EXPECT_EQ(sm.trace, "+r+c+ra+a1+rb+b1");
+
+    /// transitions inside regions, an event is offered to every region
+    /// and to composite only if no region took it
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 1, 2, 3, 4, 9 }));
+    EXPECT_EQ(sm.trace, "-a1+a2-b1+b2b2?3rb?4c?9");
+
+    /// escape exits every region and composite, the first region wins
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 5 }));
+    EXPECT_EQ(sm.trace, "-a2-ra-b2-rb-c+x");
+
+    /// regions are entered from their initial again
+    sm.trace.clear();
+    ASSERT_TRUE(trace_send(sm, { 7, 3 }));
+    EXPECT_EQ(sm.trace, "-x+c+ra+a1+rb+b1a1?3");
+}
+
+namespace {
+
+/// State of a parallel region, it only touches data of its own region
+class WorkState : public State
+{
+  public:
+    struct Region {
+        uint32_t works = 0;
+        uint32_t last = 0;
+        bool ordered = true;
+        std::set<std::thread::id> threads;
+    };
+    static constexpr uint32_t kWork = 1;
+    static constexpr uint32_t kToggle = 2;
+    static constexpr uint32_t kEscape = 3;
+    static constexpr uint32_t kBack = 4;
+
+    WorkState(const SpState &parent, Region &region)
+      : State(parent), region_(region) {}
+
+  protected:
+    virtual void Entry(StateMachine*) override {}
+    virtual void Exit(StateMachine*) override {}
+    virtual bool Invoke(const SpEvent &evt, StateMachine*) override
+    {
+        if (evt->ID() != kWork) {
+            return false;
+        }
+        auto *e = static_cast<const TestEvent*>(evt.get());
+        region_.ordered = region_.ordered && e->From() > region_.last;
+        region_.last = e->From();
+        ++region_.works;
+        region_.threads.insert(std::this_thread::get_id());
+        /// long enough for helpers to claim regions
+        auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(50);
+        while (std::chrono::steady_clock::now() < end) {}
+        return true;
+    }
+
+  private:
+    Region &region_;
+};
+
+}
+
+TEST(cpphfsm, region_shared)
+{
+    /// r { c { ra { a1 } rb { b1 } } }, states are shared by SMs
+    auto r = std::make_shared<TraceState>("r");
+    auto c = std::make_shared<TraceState>("c", r);
+    auto ra = std::make_shared<TraceState>("ra", c);
+    auto a1 = std::make_shared<TraceState>("a1", ra);
+    auto rb = std::make_shared<TraceState>("rb", c);
+    auto b1 = std::make_shared<TraceState>("b1", rb);
+    c->AddRegion(a1);
+    c->AddRegion(b1);
+    auto build = [&](TraceSM &sm) {
+        trace_trans(sm, nullptr, c, kStart);
+        return sm.Start(StartOption()) && trace_send(sm, { kStart });
+    };
+    std::unique_ptr<TraceSM> first(new TraceSM);
+    TraceSM second;
+    ASSERT_TRUE(build(*first));
+    ASSERT_TRUE(build(second));
+    EXPECT_EQ(first->trace, "+r+c+ra+a1+rb+b1");
+    first.reset();
+
+    /// destroying an SM leaves regions of states to the others
+    TraceSM third;
+    ASSERT_TRUE(build(third));
+    EXPECT_EQ(third.trace, "+r+c+ra+a1+rb+b1");
+    EXPECT_EQ(second.trace, "+r+c+ra+a1+rb+b1");
+
+    /// initial held by nobody is released, SM refuses to start
+    auto d = std::make_shared<TraceState>("d", r);
+    d->AddRegion(std::make_shared<TraceState>("d1", d));
+    TraceSM fourth;
+    trace_trans(fourth, nullptr, d, kStart);
+    EXPECT_FALSE(fourth.Start(StartOption()));
+}
+
+TEST(cpphfsm, region_parallel)
+{
+    constexpr size_t kRegions = 4;
+    constexpr uint32_t kWorks = 200;
+    Executor exec(kRegions);
+    WorkState::Region data[kRegions];
+    TraceSM sm;
+    auto r = std::make_shared<TraceState>("r");
+    auto p = std::make_shared<TraceState>("p", r);
+    auto x = std::make_shared<TraceState>("x", r);
+    p->SetParallel(true);
+    for (size_t i = 0; i < kRegions; ++i) {
+        /// every region toggles between two leaves, the last one escapes
+        auto root = std::make_shared<TraceState>("g" + std::to_string(i), p);
+        auto w1 = std::make_shared<WorkState>(root, data[i]);
+        auto w2 = std::make_shared<WorkState>(root, data[i]);
+        p->AddRegion(w1);
+        trace_trans(sm, w1, w2, WorkState::kToggle);
+        trace_trans(sm, w2, w1, WorkState::kToggle);
+        if (i == kRegions - 1) {
+            trace_trans(sm, w1, x, WorkState::kEscape);
+            trace_trans(sm, w2, x, WorkState::kEscape);
+        }
+    }
+    trace_trans(sm, nullptr, p, kStart);
+    trace_trans(sm, x, p, WorkState::kBack);
+    StartOption option;
+    option.executor = &exec;
+    option.capacity = kWorks * 4;
+    ASSERT_TRUE(sm.Start(option));
+    ASSERT_TRUE(sm.SendEvent(test_event(kStart)));
+
+    /// helpers are reused by every event, also after regions are left
+    /// and entered again
+    uint32_t seq = 0;
+    for (int round = 0; round < 2; ++round) {
+        for (uint32_t i = 0; i < kWorks; ++i) {
+            ASSERT_TRUE(sm.SendEvent(test_event(WorkState::kWork,
+                EvtPriority::kEvtPriLow, ++seq)));
+            if (i % 10 == 0) {
+                ASSERT_TRUE(sm.SendEvent(test_event(WorkState::kToggle)));
+            }
+        }
+        ASSERT_TRUE(sm.SendEvent(test_event(WorkState::kEscape)));
+        ASSERT_TRUE(sm.SendEvent(test_event(WorkState::kBack)));
+    }
+    ASSERT_TRUE(trace_send(sm, {}));
+
+    std::set<std::thread::id> threads;
+    for (auto &region : data) {
+        EXPECT_EQ(region.works, kWorks * 2);
+        EXPECT_TRUE(region.ordered);
+        threads.insert(region.threads.begin(), region.threads.end());
+    }
+    EXPECT_GT(threads.size(), 1u);
+    /// escape is made by dispatcher after regions are joined
+    std::string cycle = "-g0-g1-g2-g3-p+x-x+p+g0+g1+g2+g3";
+    EXPECT_EQ(sm.trace, "+r+p+g0+g1+g2+g3" + cycle + cycle);
+}
+
+TEST(cpphfsm, region_escape)
+{
+    Executor exec(2);
+    for (bool parallel : { false, true }) {
+        /// r { c { ra { a1 } rb { b1 b2 } } x y }
+        TraceSM sm;
+        auto r = std::make_shared<TraceState>("r");
+        auto c = std::make_shared<TraceState>("c", r);
+        auto ra = std::make_shared<TraceState>("ra", c);
+        auto a1 = std::make_shared<TraceState>("a1", ra);
+        auto rb = std::make_shared<TraceState>("rb", c);
+        auto b1 = std::make_shared<TraceState>("b1", rb, std::set<uint32_t>{ 5 });
+        auto b2 = std::make_shared<TraceState>("b2", rb);
+        auto x = std::make_shared<TraceState>("x", r);
+        auto y = std::make_shared<TraceState>("y", r);
+        c->AddRegion(a1);
+        c->AddRegion(b1);
+        c->SetParallel(parallel);
+        trace_trans(sm, nullptr, c, kStart);
+        trace_trans(sm, a1, x, 5);
+        trace_trans(sm, b1, b2, 6);
+        trace_trans(sm, b2, y, 5);
+        trace_trans(sm, x, c, 7);
+        StartOption option;
+        option.executor = parallel ? &exec : nullptr;
+        ASSERT_TRUE(sm.Start(option));
+        ASSERT_TRUE(trace_send(sm, { kStart }));
+
+        /// every region takes the event before the escape is taken
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 5 }));
+        EXPECT_EQ(sm.trace, "b1?5-a1-ra-b1-rb-c+x");
+
+        /// only the escape of the first region is taken
+        sm.trace.clear();
+        ASSERT_TRUE(trace_send(sm, { 7, 6, 5 }));
+        EXPECT_EQ(sm.trace, "-x+c+ra+a1+rb+b1-b1+b2-a1-ra-b2-rb-c+x");
+    }
+}
+
+namespace {
+
+/// Deferred events and trace are kept in snapshots
+class SnapSM : public TraceSM
+{
+  protected:
+    virtual bool SaveEvent(const SpEvent &evt, std::ostream &out) const override
+    {
+        uint32_t v[2] = { evt->ID(), static_cast<const TestEvent*>(evt.get())->From() };
+        out.write(reinterpret_cast<const char*>(v), sizeof(v));
+        return true;
+    }
+    virtual SpEvent LoadEvent(std::istream &in) override
+    {
+        uint32_t v[2];
+        if (!in.read(reinterpret_cast<char*>(v), sizeof(v))) {
+            return nullptr;
+        }
+        return test_event(v[0], EvtPriority::kEvtPriLow, v[1]);
+    }
+    virtual bool SaveUserData(std::ostream &out) const override
+    {
+        out << trace;
+        return true;
+    }
+    virtual bool LoadUserData(std::istream &in) override
+    {
+        std::getline(in, trace, '\0');
+        return true;
+    }
+};
+
+/// r { h(deep) { h1 h2 { h21 h22 } } c { ra { a1 a2 } rb { b1 b2 } } x },
+/// states are bound in order of transitions, extra binds one more
+void snap_build(SnapSM &sm, bool extra = false)
+{
+    auto r = std::make_shared<TraceState>("r", nullptr, std::set<uint32_t>{ 8 });
+    auto h = std::make_shared<TraceState>("h", r);
+    auto h1 = std::make_shared<TraceState>("h1", h);
+    auto h2 = std::make_shared<TraceState>("h2", h);
+    auto h21 = std::make_shared<TraceState>("h21", h2);
+    auto h22 = std::make_shared<TraceState>("h22", h2);
+    auto c = std::make_shared<TraceState>("c", r);
+    auto ra = std::make_shared<TraceState>("ra", c);
+    auto a1 = std::make_shared<TraceState>("a1", ra);
+    auto a2 = std::make_shared<TraceState>("a2", ra);
+    auto rb = std::make_shared<TraceState>("rb", c);
+    auto b1 = std::make_shared<TraceState>("b1", rb);
+    h->SetHistory(History::kDeep);
+    h2->SetHistory(History::kShallow);
+    c->AddRegion(a1);
+    c->AddRegion(b1);
+    c->Defer(8);
+    trace_trans(sm, nullptr, h1, kStart);
+    trace_trans(sm, h1, h22, 1);
+    trace_trans(sm, h22, c, 2);
+    trace_trans(sm, a1, a2, 3);
+    trace_trans(sm, c, h, 4);
+    trace_trans(sm, h22, h21, 5);
+    trace_trans(sm, h21, c, 2);
+    if (extra) {
+        trace_trans(sm, h21, std::make_shared<TraceState>("x", r), 6);
+    }
+}
+
+}
+
+TEST(cpphfsm, snapshot)
+{
+    SnapSM a, b;
+    snap_build(a);
+    snap_build(b);
+    StartOption option;
+    option.queue = QueueKind::kRing;
+    ASSERT_TRUE(a.Start(option));
+
+    /// history of h is recorded on leaving it, a2 is active in ra and
+    /// events of ID 8 are deferred while c is current
+    ASSERT_TRUE(trace_send(a, { kStart, 1, 2, 3 }));
+    ASSERT_TRUE(a.SendEvent(test_event(8, EvtPriority::kEvtPriLow, 81)));
+    ASSERT_TRUE(a.SendEvent(test_event(8, EvtPriority::kEvtPriLow, 82)));
+    EXPECT_EQ(a.trace, "+r+h+h1-h1+h2+h22-h22-h2-h+c+ra+a1+rb+b1-a1+a2");
+    std::stringstream frames;
+    ASSERT_TRUE(a.Snapshot(frames));
+    std::string frame = frames.str();
+
+    /// restored without entry actions, then it runs the same as a
+    ASSERT_TRUE(b.Restore(frames, option));
+    EXPECT_EQ(b.trace, a.trace);
+    a.trace.clear();
+    b.trace.clear();
+    ASSERT_TRUE(trace_send(a, { 4, 5 }));
+    ASSERT_TRUE(trace_send(b, { 4, 5 }));
+    EXPECT_EQ(a.trace, "-a2-ra-b1-rb-c+h+h2+h22r?8:81r?8:82-h22+h21");
+    EXPECT_EQ(b.trace, a.trace);
+
+    /// frames of other layouts, versions or engines are rejected
+    SnapSM more;
+    snap_build(more, true);
+    std::stringstream in(frame);
+    EXPECT_FALSE(more.Restore(in));
+    for (size_t i : { 0, 4, 5 }) {
+        SnapSM c;
+        snap_build(c);
+        std::string bad = frame;
+        bad[i] ^= 1;
+        std::stringstream bad_in(bad);
+        EXPECT_FALSE(c.Restore(bad_in)) << "byte " << i;
+    }
+    SnapSM cut;
+    snap_build(cut);
+    std::stringstream cut_in(frame.substr(0, frame.size() - 1));
+    EXPECT_FALSE(cut.Restore(cut_in));
+
+    /// SMs are restored in order from frames written at once
+    SnapSM c1, c2;
+    snap_build(c1);
+    snap_build(c2);
+    StateMachine *from[] = { &a, &b };
+    StateMachine *to[] = { &c1, &c2 };
+    std::stringstream all;
+    ASSERT_TRUE(StateMachine::SnapshotAll(from, 2, all));
+    ASSERT_TRUE(StateMachine::RestoreAll(to, 2, all, option));
+    EXPECT_EQ(c1.trace, a.trace);
+    EXPECT_EQ(c2.trace, b.trace);
+    c1.trace.clear();
+    ASSERT_TRUE(trace_send(c1, { 2, 4 }));
+    /// h restores its last descendant h21 through history
+    EXPECT_EQ(c1.trace, "-h21-h2-h+c+ra+a1+rb+b1-a1-ra-b1-rb-c+h+h2+h21");
+}
+
+TEST(cpphfsm, latency_events)
+{
+    LatencyTable table;
+    LatencyStats stats;
+    /// nothing is kept apart before slots are taken
+    table.Record(1, 0, 0, 10);
+    EXPECT_FALSE(table.Read(1, LatencyKind::kHandle, stats));
+    table.Track(16);
+    table.Track(4);
+    for (uint32_t id = 100; id < 120; ++id) {
+        table.Record(id, 1, 2, 3);
+    }
+    EXPECT_EQ(table.Read(LatencyKind::kWait).count, 20u);
+    for (uint32_t id = 100; id < 120; ++id) {
+        EXPECT_EQ(table.Read(id, LatencyKind::kWait, stats), id < 116) << id;
+    }
+    ASSERT_TRUE(table.Read(115, LatencyKind::kTotal, stats));
+    EXPECT_EQ(stats.count, 1u);
+}
@@ -20,8 +20,14 @@
 
 #include <gtest/gtest.h>
 
+#include <fcntl.h>
 #include <unistd.h>
+#include <string>
+#include <atomic>
+#include <thread>
 #include <gtest/gtest.h>
+/// snapshot requests not taken in time fail fast in tests
+#define HFSM_SNAPSHOT_TIMEOUT_MS    (100)
 #include <hfsm.c>
 #include <log.c>
 
@@ -194,6 +200,27 @@ TEST(hfsm, hfsm_add_state)
     EXPECT_EQ(s, HFSM_SUCC);
 }
 
+TEST(hfsm, hfsm_add_duplicated_state)
+{
+    int s;
+    state_t *dup;
+    struct state_info_t *info;
+    struct hfsm_t *handle = (struct hfsm_t*)ghfsm;
+
+    dup = hfsm_new_state(ghfsm);
+    ASSERT_NE(dup, nullptr);
+    dup->id = TEST_STATE_2;
+    dup->parent = NULL;
+    s = hfsm_add_state(ghfsm, dup);
+    EXPECT_EQ(s, HFSM_ERR_DUP_STATE);
+    EXPECT_NE(hfsm_find_state(handle, TEST_STATE_2), dup);
+    EXPECT_EQ(hfsm_find_state(handle, TEST_STATE_2)->id, TEST_STATE_2);
+
+    info = container_of(dup, struct state_info_t, state);
+    s = ALLOCATOR_FREE(state, &handle->pool, info);
+    EXPECT_EQ(s, UTILS_SUCC);
+}
+
 TEST(hfsm, hfsm_start)
 {
     int s = hfsm_start(ghfsm, TEST_STATE_2);
@@ -233,3 +260,1431 @@ TEST(hfsm, hfsm_destroy)
 }
 
 
+
+#define TRACE_ACTIONS(n) \
+void trace_s##n##_entry(void *userdata) \
+{ \
+    *(std::string*)userdata += "+" #n; \
+} \
+void trace_s##n##_exit(void *userdata) \
+{ \
+    *(std::string*)userdata += "-" #n; \
+}
+TRACE_ACTIONS(1)
+TRACE_ACTIONS(2)
+TRACE_ACTIONS(3)
+
+bool trace_s2_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == TEST_EVENT_TRANS_TO_STATE3) {
+        *pstate = TEST_STATE_3;
+        return true;
+    }
+    return false;
+}
+
+bool trace_s1_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    *(std::string*)userdata += "?1";
+    return true;
+}
+
+/// S1 is parent of S2 and S3, S2 transits to S3 on TEST_EVENT_TRANS_TO_STATE3
+void trace_add_states(hfsm_handle hfsm)
+{
+    state_t *s1 = hfsm_new_state(hfsm);
+    state_t *s2 = hfsm_new_state(hfsm);
+    state_t *s3 = hfsm_new_state(hfsm);
+    ASSERT_NE(s3, nullptr);
+    *s1 = state_t{ TEST_STATE_1, NULL,
+        { trace_s1_entry, trace_s1_exit, trace_s1_process } };
+    *s2 = state_t{ TEST_STATE_2, s1,
+        { trace_s2_entry, trace_s2_exit, trace_s2_process } };
+    *s3 = state_t{ TEST_STATE_3, s1,
+        { trace_s3_entry, trace_s3_exit, NULL } };
+    EXPECT_EQ(hfsm_add_state(hfsm, s1), HFSM_SUCC);
+    EXPECT_EQ(hfsm_add_state(hfsm, s2), HFSM_SUCC);
+    EXPECT_EQ(hfsm_add_state(hfsm, s3), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_dispatch_event)
+{
+    int s;
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+
+    trace_add_states(hfsm);
+
+    event_t evt = {
+        .id = TEST_EVENT_AT_STATE2,
+        .priority = 1,
+        .param = NULL
+    };
+    s = hfsm_dispatch_event(hfsm, &evt);
+    EXPECT_EQ(s, HFSM_ERR_NO_STATE);
+
+    s = hfsm_start(hfsm, TEST_STATE_2);
+    EXPECT_EQ(s, HFSM_SUCC);
+    EXPECT_EQ(trace, "+2");
+
+    /// handled before returning, no evthub in inline mode
+    s = hfsm_dispatch_event(hfsm, &evt);
+    EXPECT_EQ(s, HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?1");
+    s = hfsm_send_event(hfsm, &evt);
+    EXPECT_EQ(s, HFSM_ERR_MODE);
+
+    evt.id = TEST_EVENT_TRANS_TO_STATE3;
+    s = hfsm_dispatch_event(hfsm, &evt);
+    EXPECT_EQ(s, HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?1-2+3");
+
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_transit_path)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+    ASSERT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    /// path is compiled by the transition, on this thread in inline mode
+    event_t evt = {
+        .id = TEST_EVENT_TRANS_TO_STATE3,
+        .priority = 1,
+        .param = NULL
+    };
+    ASSERT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+2-2+3");
+
+    struct hfsm_t *handle = (struct hfsm_t*)hfsm;
+    state_t *s2 = hfsm_find_state(handle, TEST_STATE_2);
+    ASSERT_NE(s2, nullptr);
+    struct state_info_t *info = container_of(s2, struct state_info_t, state);
+    ASSERT_EQ(info->path_num, 1u);
+    EXPECT_EQ(hfsm_path_search(info, TEST_STATE_3), 0u);
+    struct transit_path_t *p = info->paths[0];
+    EXPECT_EQ(p->to, TEST_STATE_3);
+    EXPECT_EQ(p->num, 2);
+    EXPECT_EQ(p->exit_num, 1);
+    EXPECT_EQ(p->states[0]->id, TEST_STATE_2);
+    EXPECT_EQ(p->states[1]->id, TEST_STATE_3);
+
+    /// more targets are kept sorted and found again without compiling
+    state_t *s3 = hfsm_find_state(handle, TEST_STATE_3);
+    state_t *s1 = hfsm_find_state(handle, TEST_STATE_1);
+    EXPECT_EQ(hfsm_transit_path(s2, s1)->to, TEST_STATE_1);
+    EXPECT_EQ(hfsm_transit_path(s2, s3), p);
+    ASSERT_EQ(info->path_num, 2u);
+    EXPECT_EQ(info->paths[0]->to, TEST_STATE_1);
+    EXPECT_EQ(info->paths[1], p);
+    EXPECT_EQ(hfsm_path_search(info, TEST_STATE_2), 1u);
+
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_send_events)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+
+    trace_add_states(hfsm);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    event_t evts[] = {
+        { TEST_EVENT_AT_STATE2, 1, NULL },
+        { TEST_EVENT_AT_STATE2, 1, NULL },
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    EXPECT_EQ(hfsm_send_events(hfsm, evts, 4), HFSM_SUCC);
+    EXPECT_EQ(hfsm_send_events(hfsm, evts, 1), HFSM_SUCC);
+    EXPECT_EQ(hfsm_send_events(hfsm, NULL, 1), HFSM_ERR_NULLPTR);
+
+    usleep(10000); // wait for events handled
+    EXPECT_EQ(trace, "+2?1?1-2+3?1?1");
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_queue_ring)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_RING
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    event_t evts[] = {
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    EXPECT_EQ(hfsm_send_events(hfsm, evts, 2), HFSM_SUCC);
+
+    /// more than capacity of a band at once
+    event_t burst[MAX_MESSAGE_NUM+1] = {};
+    EXPECT_EQ(hfsm_send_events(hfsm, burst, MAX_MESSAGE_NUM+1), HFSM_ERR_EVTHUB);
+
+    usleep(10000); // wait for events handled
+    EXPECT_EQ(trace, "+2?1-2+3?1");
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_queue_executor)
+{
+    std::string trace[2];
+    hfsm_handle hfsm[2] = {};
+    hfsm_executor exec = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = NULL,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_EXECUTOR,
+        .executor = NULL
+    };
+    EXPECT_EQ(hfsm_create(&hfsm[0], &param), HFSM_ERR_EXECUTOR);
+    ASSERT_EQ(hfsm_executor_create(&exec, 2), HFSM_SUCC);
+
+    param.executor = exec;
+    for (int i = 0; i < 2; ++i) {
+        param.userdata = &trace[i];
+        ASSERT_EQ(hfsm_create(&hfsm[i], &param), HFSM_SUCC);
+        trace_add_states(hfsm[i]);
+        EXPECT_EQ(hfsm_start(hfsm[i], TEST_STATE_2), HFSM_SUCC);
+    }
+    event_t evts[] = {
+        { TEST_EVENT_AT_STATE2, 1, NULL },
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(hfsm_send_event(hfsm[i], &evts[0]), HFSM_SUCC);
+        EXPECT_EQ(hfsm_send_events(hfsm[i], &evts[1], 2), HFSM_SUCC);
+    }
+
+    usleep(10000); // wait for events handled
+    for (int i = 0; i < 2; ++i) {
+        EXPECT_EQ(trace[i], "+2?1-2+3?1");
+        EXPECT_EQ(hfsm_destroy(&hfsm[i]), HFSM_SUCC);
+    }
+    EXPECT_EQ(hfsm_executor_destroy(&exec), HFSM_SUCC);
+}
+
+/// sends to the target on the same worker and destroys it at once
+static hfsm_handle destroy_target = NULL;
+bool destroy_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+    EXPECT_EQ(hfsm_send_event(destroy_target, &evt), HFSM_SUCC);
+    EXPECT_EQ(hfsm_destroy(&destroy_target), HFSM_SUCC);
+    *(std::string*)userdata += 'd';
+    return true;
+}
+
+TEST(hfsm, hfsm_queue_executor_destroy)
+{
+    std::string trace[2];
+    hfsm_handle hfsm = NULL;
+    hfsm_executor exec = NULL;
+    ASSERT_EQ(hfsm_executor_create(&exec, 1), HFSM_SUCC);
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace[0],
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_EXECUTOR,
+        .executor = exec
+    };
+    ASSERT_EQ(hfsm_create(&destroy_target, &param), HFSM_SUCC);
+    trace_add_states(destroy_target);
+    EXPECT_EQ(hfsm_start(destroy_target, TEST_STATE_2), HFSM_SUCC);
+    param.userdata = &trace[1];
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    state_t *s = hfsm_new_state(hfsm);
+    *s = state_t{ TEST_STATE_1, NULL, { NULL, NULL, destroy_process } };
+    EXPECT_EQ(hfsm_add_state(hfsm, s), HFSM_SUCC);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_1), HFSM_SUCC);
+    usleep(5000);
+
+    /// the target task is queued behind the running one, it is not
+    /// waited for and releases the queue when it runs
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    usleep(10000);
+    /// waits for the run of it, if any
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    EXPECT_EQ(destroy_target, nullptr);
+    EXPECT_EQ(trace[0], "+2");
+    EXPECT_EQ(trace[1], "d");
+    EXPECT_EQ(hfsm_executor_destroy(&exec), HFSM_SUCC);
+}
+
+/// appends inline data and payload of messages to trace
+bool trace_msg_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    std::string *trace = (std::string*)userdata;
+    const hfsm_msg_t *msg = hfsm_event_msg(event);
+    if (msg == NULL) {
+        *trace += "?";
+        return true;
+    }
+    trace->append((const char*)msg->data, msg->size);
+    if (msg->payload) {
+        trace->append((const char*)msg->payload->data, msg->payload->size);
+    }
+    return true;
+}
+
+static int released = 0;
+void trace_payload_release(hfsm_payload *payload)
+{
+    ++released;
+}
+
+TEST(hfsm, hfsm_send_msg)
+{
+    const unsigned char queues[] = { HFSM_QUEUE_EVTHUB, HFSM_QUEUE_RING };
+    for (unsigned char queue : queues) {
+        std::string trace;
+        hfsm_handle hfsm = NULL;
+        hfsm_param param = {
+            .max_states = 1,
+            .userdata = &trace,
+            .mode = HFSM_MODE_THREAD,
+            .queue = queue
+        };
+        ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+        state_t *s1 = hfsm_new_state(hfsm);
+        ASSERT_NE(s1, nullptr);
+        *s1 = state_t{ TEST_STATE_1, NULL, { NULL, NULL, trace_msg_process } };
+        EXPECT_EQ(hfsm_add_state(hfsm, s1), HFSM_SUCC);
+        EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_1), HFSM_SUCC);
+
+        char big[] = "<payload>";
+        hfsm_payload payload;
+        hfsm_payload_init(&payload, big, strlen(big), trace_payload_release);
+        released = 0;
+
+        hfsm_msg_t msg = {};
+        msg.evt.id = TEST_EVENT_AT_STATE2;
+        msg.evt.priority = 1;
+        msg.size = 3;
+        memcpy(msg.data, "abc", 3);
+        EXPECT_EQ(hfsm_send_msg(hfsm, &msg), HFSM_SUCC);
+        /// inline data is copied, caller may reuse the message at once
+        memcpy(msg.data, "xyz", 3);
+        msg.payload = &payload;
+        EXPECT_EQ(hfsm_send_msg(hfsm, &msg), HFSM_SUCC);
+        hfsm_payload_unref(&payload);
+        msg.size = HFSM_MSG_DATA_SIZE + 1;
+        EXPECT_EQ(hfsm_send_msg(hfsm, &msg), HFSM_ERR_MSG_SIZE);
+
+        event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+        EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+
+        usleep(10000); // wait for events handled
+        EXPECT_EQ(trace, "abcxyz<payload>?");
+        EXPECT_EQ(released, 1);
+        EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    }
+}
+
+/// the first event holds dispatcher until released, so later ones stay queued
+static std::atomic<bool> overflow_hold(false);
+bool overflow_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    while (overflow_hold) {
+        usleep(1000);
+    }
+    *(std::string*)userdata += (char)(intptr_t)event->param;
+    return true;
+}
+
+hfsm_handle overflow_create(std::string *trace, unsigned char overflow)
+{
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 1,
+        .userdata = trace,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_RING,
+        .executor = NULL,
+        .capacity = 2,
+        .overflow = overflow,
+        .timeout_ms = 20
+    };
+    EXPECT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    state_t *s1 = hfsm_new_state(hfsm);
+    *s1 = state_t{ TEST_STATE_1, NULL, { NULL, NULL, overflow_process } };
+    EXPECT_EQ(hfsm_add_state(hfsm, s1), HFSM_SUCC);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_1), HFSM_SUCC);
+
+    /// 'a' holds dispatcher, 'b' and 'c' fill the queue
+    overflow_hold = true;
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, (void*)'a' };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    usleep(10000);
+    evt.param = (void*)'b';
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    evt.param = (void*)'c';
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    return hfsm;
+}
+
+TEST(hfsm, hfsm_queue_overflow)
+{
+    std::string trace;
+    hfsm_queue_stats stats;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 1,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_EVTHUB,
+        .executor = NULL,
+        .capacity = 2,
+        .overflow = HFSM_OVERFLOW_DROP_OLDEST
+    };
+    EXPECT_EQ(hfsm_create(&hfsm, &param), HFSM_ERR_OVERFLOW);
+
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, (void*)'d' };
+    event_t high = { TEST_EVENT_AT_STATE2, 0xC0, (void*)'h' };
+
+    hfsm = overflow_create(&trace, HFSM_OVERFLOW_REJECT);
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_ERR_EVTHUB);
+    overflow_hold = false;
+    usleep(10000);
+    EXPECT_EQ(trace, "abc");
+    EXPECT_EQ(hfsm_get_queue_stats(hfsm, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.rejected, 1u);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    trace.clear();
+    hfsm = overflow_create(&trace, HFSM_OVERFLOW_DROP_OLDEST);
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    /// no event in the band of 'h' to drop
+    EXPECT_EQ(hfsm_send_event(hfsm, &high), HFSM_ERR_EVTHUB);
+    overflow_hold = false;
+    usleep(10000);
+    EXPECT_EQ(trace, "acd");
+    EXPECT_EQ(hfsm_get_queue_stats(hfsm, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.dropped, 1u);
+    EXPECT_EQ(stats.rejected, 1u);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    trace.clear();
+    hfsm = overflow_create(&trace, HFSM_OVERFLOW_DROP_LOWEST);
+    EXPECT_EQ(hfsm_send_event(hfsm, &high), HFSM_SUCC);
+    overflow_hold = false;
+    usleep(10000);
+    EXPECT_EQ(trace, "ahc");
+    EXPECT_EQ(hfsm_get_queue_stats(hfsm, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.dropped, 1u);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    trace.clear();
+    hfsm = overflow_create(&trace, HFSM_OVERFLOW_BLOCK);
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_ERR_EVTHUB);
+    std::thread release([] { usleep(5000); overflow_hold = false; });
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    release.join();
+    usleep(10000);
+    EXPECT_EQ(trace, "abcd");
+    EXPECT_EQ(hfsm_get_queue_stats(hfsm, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.blocked, 2u);
+    EXPECT_EQ(stats.timeouts, 1u);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_send_events_long_run)
+{
+    const unsigned char policies[] = {
+        HFSM_OVERFLOW_REJECT, HFSM_OVERFLOW_DROP_OLDEST,
+        HFSM_OVERFLOW_DROP_LOWEST, HFSM_OVERFLOW_BLOCK
+    };
+    const char *traces[] = { "abc", "aef", "aef", "abcdef" };
+    event_t evts[5];
+    for (int i = 0; i < 5; ++i) {
+        evts[i] = event_t{ TEST_EVENT_AT_STATE2, 1, (void*)(intptr_t)('b' + i) };
+    }
+    for (size_t p = 0; p < sizeof(policies); ++p) {
+        std::string trace;
+        hfsm_handle hfsm = NULL;
+        hfsm_param param = {
+            .max_states = 1,
+            .userdata = &trace,
+            .mode = HFSM_MODE_THREAD,
+            .queue = HFSM_QUEUE_RING,
+            .executor = NULL,
+            .capacity = 2,
+            .overflow = policies[p],
+            .timeout_ms = 0
+        };
+        ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+        state_t *s1 = hfsm_new_state(hfsm);
+        *s1 = state_t{ TEST_STATE_1, NULL, { NULL, NULL, overflow_process } };
+        EXPECT_EQ(hfsm_add_state(hfsm, s1), HFSM_SUCC);
+        EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_1), HFSM_SUCC);
+        overflow_hold = true;
+        event_t evt = { TEST_EVENT_AT_STATE2, 1, (void*)'a' };
+        EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+        usleep(10000);
+
+        /*! a run of 5 is sent in parts of capacity 2, 'b' and 'c' fit */
+        std::thread release([] { usleep(5000); overflow_hold = false; });
+        if (policies[p] == HFSM_OVERFLOW_REJECT) {
+            EXPECT_EQ(hfsm_send_events(hfsm, evts, 5), HFSM_ERR_EVTHUB);
+        } else {
+            EXPECT_EQ(hfsm_send_events(hfsm, evts, 5), HFSM_SUCC);
+        }
+        release.join();
+        for (int i = 0; i < 100 && trace != traces[p]; ++i) {
+            usleep(1000);
+        }
+        EXPECT_EQ(trace, traces[p]) << (int)policies[p];
+        EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    }
+}
+
+/// internal events wait behind a worker held by another HFSM
+static hfsm_handle pinned_hfsm = NULL;
+void pinned_entry(void *userdata)
+{
+    *(std::string*)userdata += '+';
+    event_t evt = { TEST_EVENT_AT_STATE2, 0xFF, (void*)'t' };
+    EXPECT_EQ(hfsm_start_timer(pinned_hfsm, &evt, 20), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_overflow_internal)
+{
+    hfsm_executor exec = NULL;
+    ASSERT_EQ(hfsm_executor_create(&exec, 1), HFSM_SUCC);
+    const unsigned char policies[] = {
+        HFSM_OVERFLOW_DROP_OLDEST, HFSM_OVERFLOW_DROP_LOWEST
+    };
+    for (unsigned char policy : policies) {
+        std::string trace, held;
+        hfsm_handle holder = NULL;
+        hfsm_queue_stats stats;
+        hfsm_param param = {
+            .max_states = 1,
+            .userdata = &held,
+            .mode = HFSM_MODE_THREAD,
+            .queue = HFSM_QUEUE_EXECUTOR,
+            .executor = exec,
+            .capacity = 1,
+            .overflow = policy
+        };
+        ASSERT_EQ(hfsm_create(&holder, &param), HFSM_SUCC);
+        state_t *s = hfsm_new_state(holder);
+        *s = state_t{ TEST_STATE_1, NULL, { NULL, NULL, overflow_process } };
+        EXPECT_EQ(hfsm_add_state(holder, s), HFSM_SUCC);
+        EXPECT_EQ(hfsm_start(holder, TEST_STATE_1), HFSM_SUCC);
+        param.userdata = &trace;
+        ASSERT_EQ(hfsm_create(&pinned_hfsm, &param), HFSM_SUCC);
+        s = hfsm_new_state(pinned_hfsm);
+        *s = state_t{ TEST_STATE_1, NULL, { pinned_entry, NULL, overflow_process } };
+        EXPECT_EQ(hfsm_add_state(pinned_hfsm, s), HFSM_SUCC);
+        usleep(5000);
+
+        /// start
+        event_t hold = { TEST_EVENT_AT_STATE2, 1, (void*)'h' };
+        event_t evt = { TEST_EVENT_AT_STATE2, 0xFF, (void*)'x' };
+        overflow_hold = true;
+        EXPECT_EQ(hfsm_send_event(holder, &hold), HFSM_SUCC);
+        usleep(5000);
+        EXPECT_EQ(hfsm_start(pinned_hfsm, TEST_STATE_1), HFSM_SUCC);
+        EXPECT_EQ(hfsm_send_event(pinned_hfsm, &evt), HFSM_ERR_EVTHUB);
+        overflow_hold = false;
+        usleep(5000);
+        EXPECT_EQ(trace, "+");
+
+        /// expiry of timer armed by entry
+        overflow_hold = true;
+        EXPECT_EQ(hfsm_send_event(holder, &hold), HFSM_SUCC);
+        usleep(40000);
+        EXPECT_EQ(hfsm_send_event(pinned_hfsm, &evt), HFSM_ERR_EVTHUB);
+        overflow_hold = false;
+        usleep(5000);
+        EXPECT_EQ(trace, "+t");
+
+        /// snapshot request of the lowest priority
+        overflow_hold = true;
+        EXPECT_EQ(hfsm_send_event(holder, &hold), HFSM_SUCC);
+        usleep(5000);
+        std::thread snapshot([] {
+            hfsm_stream stream;
+            FILE *fp = tmpfile();
+            ASSERT_NE(fp, nullptr);
+            hfsm_stream_file(&stream, fp);
+            EXPECT_EQ(hfsm_snapshot(pinned_hfsm, &stream), HFSM_SUCC);
+            fclose(fp);
+        });
+        usleep(5000);
+        evt.priority = policy == HFSM_OVERFLOW_DROP_OLDEST ? 0 : 0xFF;
+        EXPECT_EQ(hfsm_send_event(pinned_hfsm, &evt), HFSM_ERR_EVTHUB);
+        overflow_hold = false;
+        snapshot.join();
+
+        EXPECT_EQ(trace, "+t");
+        EXPECT_EQ(held, "hhh");
+        EXPECT_EQ(hfsm_get_queue_stats(pinned_hfsm, &stats), HFSM_SUCC);
+        EXPECT_EQ(stats.dropped, 0u);
+        EXPECT_EQ(stats.rejected, 3u);
+        EXPECT_EQ(hfsm_destroy(&pinned_hfsm), HFSM_SUCC);
+        EXPECT_EQ(hfsm_destroy(&holder), HFSM_SUCC);
+    }
+    EXPECT_EQ(hfsm_executor_destroy(&exec), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_defer_event)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+
+    /// S2 defers TEST_EVENT_AT_STATE3 until it transits to S3
+    state_t *s1 = hfsm_new_state(hfsm);
+    state_t *s2 = hfsm_new_state(hfsm);
+    state_t *s3 = hfsm_new_state(hfsm);
+    ASSERT_NE(s3, nullptr);
+    *s1 = state_t{ TEST_STATE_1, NULL,
+        { trace_s1_entry, trace_s1_exit, trace_msg_process } };
+    *s2 = state_t{ TEST_STATE_2, s1,
+        { trace_s2_entry, trace_s2_exit, trace_s2_process } };
+    *s3 = state_t{ TEST_STATE_3, s1,
+        { trace_s3_entry, trace_s3_exit, NULL } };
+    EXPECT_EQ(hfsm_add_state(hfsm, s1), HFSM_SUCC);
+    EXPECT_EQ(hfsm_add_state(hfsm, s2), HFSM_SUCC);
+    EXPECT_EQ(hfsm_add_state(hfsm, s3), HFSM_SUCC);
+    EXPECT_EQ(hfsm_defer_event(hfsm, s2, TEST_EVENT_AT_STATE3), HFSM_SUCC);
+    EXPECT_EQ(hfsm_defer_event(hfsm, s2, TEST_EVENT_AT_STATE3), HFSM_SUCC);
+    EXPECT_EQ(hfsm_defer_event(hfsm, NULL, TEST_EVENT_AT_STATE3), HFSM_ERR_NULLPTR);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    char big[] = "<payload>";
+    hfsm_payload payload;
+    hfsm_payload_init(&payload, big, strlen(big), trace_payload_release);
+    released = 0;
+
+    event_t evt = { TEST_EVENT_AT_STATE3, 1, NULL };
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    hfsm_msg_t msg = {};
+    msg.evt.id = TEST_EVENT_AT_STATE3;
+    msg.evt.priority = 1;
+    msg.payload = &payload;
+    msg.size = 3;
+    memcpy(msg.data, "abc", 3);
+    EXPECT_EQ(hfsm_dispatch_msg(hfsm, &msg), HFSM_SUCC);
+    hfsm_payload_unref(&payload);
+    /// parked events keep their payload
+    EXPECT_EQ(released, 0);
+    evt.id = TEST_EVENT_AT_STATE2;
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?");
+
+    /// recalled in order after the transition
+    evt.id = TEST_EVENT_TRANS_TO_STATE3;
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?-2+3?abc<payload>");
+    EXPECT_EQ(released, 1);
+
+    evt.id = TEST_EVENT_AT_STATE3;
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?-2+3?abc<payload>?");
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+/// S2 arms a timer of timer_event on entry
+static hfsm_handle timer_hfsm = NULL;
+static uint32_t timer_event = 0;
+void timer_s2_entry(void *userdata)
+{
+    trace_s2_entry(userdata);
+    event_t evt = { timer_event, 1, NULL };
+    EXPECT_EQ(hfsm_start_timer(timer_hfsm, &evt, 10), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_start_timer)
+{
+    hfsm_executor exec = NULL;
+    ASSERT_EQ(hfsm_executor_create(&exec, 1), HFSM_SUCC);
+    const unsigned char queues[] = { HFSM_QUEUE_RING, HFSM_QUEUE_EXECUTOR };
+    for (unsigned char queue : queues) {
+        /// expiry transits to S3, or it is cancelled by leaving S2 at once
+        const uint32_t events[] = { TEST_EVENT_TRANS_TO_STATE3, TEST_EVENT_AT_STATE3 };
+        for (uint32_t event : events) {
+            std::string trace;
+            hfsm_param param = {
+                .max_states = 3,
+                .userdata = &trace,
+                .mode = HFSM_MODE_THREAD,
+                .queue = queue,
+                .executor = exec
+            };
+            ASSERT_EQ(hfsm_create(&timer_hfsm, &param), HFSM_SUCC);
+            state_t *s1 = hfsm_new_state(timer_hfsm);
+            state_t *s2 = hfsm_new_state(timer_hfsm);
+            state_t *s3 = hfsm_new_state(timer_hfsm);
+            ASSERT_NE(s3, nullptr);
+            *s1 = state_t{ TEST_STATE_1, NULL,
+                { trace_s1_entry, trace_s1_exit, trace_s1_process } };
+            *s2 = state_t{ TEST_STATE_2, s1,
+                { timer_s2_entry, trace_s2_exit, trace_s2_process } };
+            *s3 = state_t{ TEST_STATE_3, s1,
+                { trace_s3_entry, trace_s3_exit, NULL } };
+            EXPECT_EQ(hfsm_add_state(timer_hfsm, s1), HFSM_SUCC);
+            EXPECT_EQ(hfsm_add_state(timer_hfsm, s2), HFSM_SUCC);
+            EXPECT_EQ(hfsm_add_state(timer_hfsm, s3), HFSM_SUCC);
+
+            timer_event = event;
+            event_t evt = { TEST_EVENT_TRANS_TO_STATE3, 1, NULL };
+            /// only state actions own timers
+            EXPECT_EQ(hfsm_start_timer(timer_hfsm, &evt, 10), HFSM_ERR_NO_STATE);
+            EXPECT_EQ(hfsm_start(timer_hfsm, TEST_STATE_2), HFSM_SUCC);
+            if (event == TEST_EVENT_AT_STATE3) {
+                EXPECT_EQ(hfsm_send_event(timer_hfsm, &evt), HFSM_SUCC);
+            }
+            usleep(50000); // wait for timer expired
+            EXPECT_EQ(trace, "+2-2+3");
+            EXPECT_EQ(hfsm_destroy(&timer_hfsm), HFSM_SUCC);
+        }
+    }
+    EXPECT_EQ(hfsm_executor_destroy(&exec), HFSM_SUCC);
+}
+
+/// C holds region A (A1, A2) and region B (B1), O is out of C
+enum {
+    REGION_TOP = 1,
+    REGION_C,
+    REGION_A,
+    REGION_A1,
+    REGION_A2,
+    REGION_B,
+    REGION_B1,
+    REGION_O
+};
+
+enum {
+    REGION_EVENT_ENTER = EVENT_ID_USER_BASE+1,
+    REGION_EVENT_A,
+    REGION_EVENT_B,
+    REGION_EVENT_OUT,
+    REGION_EVENT_ESCAPE,
+    REGION_EVENT_TICK
+};
+
+#define REGION_ACTIONS(n) \
+void region_##n##_entry(void *userdata) \
+{ \
+    *(std::string*)userdata += "+" #n; \
+} \
+void region_##n##_exit(void *userdata) \
+{ \
+    *(std::string*)userdata += "-" #n; \
+}
+REGION_ACTIONS(c)
+REGION_ACTIONS(a)
+REGION_ACTIONS(a1)
+REGION_ACTIONS(a2)
+REGION_ACTIONS(b)
+REGION_ACTIONS(b1)
+REGION_ACTIONS(o)
+
+static int region_ticks[2];
+bool region_c_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == REGION_EVENT_OUT) {
+        *pstate = REGION_O;
+        return true;
+    }
+    return false;
+}
+
+bool region_a1_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == REGION_EVENT_TICK) {
+        ++region_ticks[0];
+        return true;
+    }
+    if (event->id == REGION_EVENT_A) {
+        *pstate = REGION_A2;
+        return true;
+    }
+    return false;
+}
+
+bool region_a2_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == REGION_EVENT_ESCAPE) {
+        *pstate = REGION_O;
+        return true;
+    }
+    return false;
+}
+
+bool region_b1_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == REGION_EVENT_TICK) {
+        ++region_ticks[1];
+        return true;
+    }
+    if (event->id == REGION_EVENT_B || event->id == REGION_EVENT_ESCAPE) {
+        *(std::string*)userdata += "?b1";
+        return true;
+    }
+    return false;
+}
+
+bool region_o_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == REGION_EVENT_ENTER) {
+        *pstate = REGION_B1;
+        return true;
+    }
+    return false;
+}
+
+void region_add_states(hfsm_handle hfsm)
+{
+    state_t *s[8];
+    for (int i=0; i<8; ++i) {
+        s[i] = hfsm_new_state(hfsm);
+        ASSERT_NE(s[i], nullptr);
+    }
+    *s[0] = state_t{ REGION_TOP, NULL, { NULL, NULL, NULL } };
+    *s[1] = state_t{ REGION_C, s[0],
+        { region_c_entry, region_c_exit, region_c_process } };
+    *s[2] = state_t{ REGION_A, s[1], { region_a_entry, region_a_exit, NULL } };
+    *s[3] = state_t{ REGION_A1, s[2],
+        { region_a1_entry, region_a1_exit, region_a1_process } };
+    *s[4] = state_t{ REGION_A2, s[2],
+        { region_a2_entry, region_a2_exit, region_a2_process } };
+    *s[5] = state_t{ REGION_B, s[1], { region_b_entry, region_b_exit, NULL } };
+    *s[6] = state_t{ REGION_B1, s[5],
+        { region_b1_entry, region_b1_exit, region_b1_process } };
+    *s[7] = state_t{ REGION_O, s[0],
+        { region_o_entry, region_o_exit, region_o_process } };
+    for (int i=0; i<8; ++i) {
+        EXPECT_EQ(hfsm_add_state(hfsm, s[i]), HFSM_SUCC);
+    }
+    EXPECT_EQ(hfsm_add_region(hfsm, s[1], s[7]), HFSM_ERR_REGION);
+    EXPECT_EQ(hfsm_add_region(hfsm, s[1], s[3]), HFSM_SUCC);
+    EXPECT_EQ(hfsm_add_region(hfsm, s[1], s[4]), HFSM_ERR_REGION);
+    EXPECT_EQ(hfsm_add_region(hfsm, s[1], s[6]), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_add_region)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 8,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    region_add_states(hfsm);
+    EXPECT_EQ(hfsm_set_parallel(hfsm, hfsm_find_state((struct hfsm_t*)hfsm, REGION_C),
+        true), HFSM_ERR_EXECUTOR);
+    EXPECT_EQ(hfsm_start(hfsm, REGION_O), HFSM_SUCC);
+
+    /// entering B1 enters initial of region A as well
+    event_t evt = { REGION_EVENT_ENTER, 1, NULL };
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+o-o+c+b+b1+a+a1");
+
+    /// every region gets the event, composite only if none processed it
+    trace.clear();
+    const uint32_t events[] = { REGION_EVENT_A, REGION_EVENT_B, REGION_EVENT_OUT };
+    for (uint32_t id : events) {
+        evt.id = id;
+        EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    }
+    EXPECT_EQ(trace, "-a1+a2?b1-a2-a-b1-b-c+o");
+
+    /// transition out of a region is taken after all regions saw the event
+    trace.clear();
+    const uint32_t escape[] = { REGION_EVENT_ENTER, REGION_EVENT_A, REGION_EVENT_ESCAPE };
+    for (uint32_t id : escape) {
+        evt.id = id;
+        EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    }
+    EXPECT_EQ(trace, "-o+c+b+b1+a+a1-a1+a2?b1-a2-a-b1-b-c+o");
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_set_parallel)
+{
+    const int N = 1000;
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_executor exec = NULL;
+    ASSERT_EQ(hfsm_executor_create(&exec, 2), HFSM_SUCC);
+    hfsm_param param = {
+        .max_states = 8,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_EXECUTOR,
+        .executor = exec,
+        .overflow = HFSM_OVERFLOW_BLOCK
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    region_add_states(hfsm);
+    EXPECT_EQ(hfsm_set_parallel(hfsm, hfsm_find_state((struct hfsm_t*)hfsm, REGION_C),
+        true), HFSM_SUCC);
+    EXPECT_EQ(hfsm_start(hfsm, REGION_O), HFSM_SUCC);
+
+    region_ticks[0] = region_ticks[1] = 0;
+    event_t evt = { REGION_EVENT_ENTER, 1, NULL };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    evt.id = REGION_EVENT_TICK;
+    for (int i=0; i<N; ++i) {
+        EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    }
+    evt.id = REGION_EVENT_OUT;
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    usleep(200000); // wait for events handled
+    EXPECT_EQ(region_ticks[0], N);
+    EXPECT_EQ(region_ticks[1], N);
+    EXPECT_EQ(trace, "+o-o+c+b+b1+a+a1-a1-a-b1-b-c+o");
+
+    /// escape of parallel regions is the same as of sequential ones
+    trace.clear();
+    const uint32_t escape[] = { REGION_EVENT_ENTER, REGION_EVENT_A, REGION_EVENT_ESCAPE };
+    for (uint32_t id : escape) {
+        evt.id = id;
+        EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    }
+    usleep(200000); // wait for events handled
+    EXPECT_EQ(trace, "-o+c+b+b1+a+a1-a1+a2?b1-a2-a-b1-b-c+o");
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    EXPECT_EQ(hfsm_executor_destroy(&exec), HFSM_SUCC);
+}
+
+/// H holds S3 and S4, S4 holds S5, S6 is out of H
+enum {
+    HISTORY_TOP = 1,
+    HISTORY_H,
+    HISTORY_S3,
+    HISTORY_S4,
+    HISTORY_S5,
+    HISTORY_S6
+};
+
+enum {
+    HISTORY_EVENT_ENTER = EVENT_ID_USER_BASE+1,
+    HISTORY_EVENT_DEEP,
+    HISTORY_EVENT_OUT
+};
+
+#define HISTORY_ACTIONS(n) \
+void history_s##n##_entry(void *userdata) \
+{ \
+    *(std::string*)userdata += "+" #n; \
+} \
+void history_s##n##_exit(void *userdata) \
+{ \
+    *(std::string*)userdata += "-" #n; \
+}
+HISTORY_ACTIONS(2)
+HISTORY_ACTIONS(3)
+HISTORY_ACTIONS(4)
+HISTORY_ACTIONS(5)
+HISTORY_ACTIONS(6)
+
+bool history_h_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == HISTORY_EVENT_DEEP) {
+        *pstate = HISTORY_S5;
+        return true;
+    }
+    if (event->id == HISTORY_EVENT_OUT) {
+        *pstate = HISTORY_S6;
+        return true;
+    }
+    return false;
+}
+
+bool history_s6_process(const event_t *event, void *userdata, state_id *pstate)
+{
+    if (event->id == HISTORY_EVENT_ENTER) {
+        *pstate = HISTORY_H;
+        return true;
+    }
+    return false;
+}
+
+TEST(hfsm, hfsm_set_history)
+{
+    const unsigned char kinds[] = { HFSM_HISTORY_SHALLOW, HFSM_HISTORY_DEEP };
+    const char *restored[] = { "-6+2+4", "-6+2+4+5" };
+    for (int k=0; k<2; ++k) {
+        std::string trace;
+        hfsm_handle hfsm = NULL;
+        hfsm_param param = {
+            .max_states = 6,
+            .userdata = &trace,
+            .mode = HFSM_MODE_INLINE
+        };
+        ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+        state_t *s[6];
+        for (int i=0; i<6; ++i) {
+            s[i] = hfsm_new_state(hfsm);
+            ASSERT_NE(s[i], nullptr);
+        }
+        *s[0] = state_t{ HISTORY_TOP, NULL, { NULL, NULL, NULL } };
+        *s[1] = state_t{ HISTORY_H, s[0],
+            { history_s2_entry, history_s2_exit, history_h_process } };
+        *s[2] = state_t{ HISTORY_S3, s[1], { history_s3_entry, history_s3_exit, NULL } };
+        *s[3] = state_t{ HISTORY_S4, s[1], { history_s4_entry, history_s4_exit, NULL } };
+        *s[4] = state_t{ HISTORY_S5, s[3], { history_s5_entry, history_s5_exit, NULL } };
+        *s[5] = state_t{ HISTORY_S6, s[0],
+            { history_s6_entry, history_s6_exit, history_s6_process } };
+        for (int i=0; i<6; ++i) {
+            EXPECT_EQ(hfsm_add_state(hfsm, s[i]), HFSM_SUCC);
+        }
+        EXPECT_EQ(hfsm_set_history(hfsm, s[1], HFSM_HISTORY_DEEP + 1), HFSM_ERR_HISTORY);
+        EXPECT_EQ(hfsm_set_history(hfsm, s[1], kinds[k]), HFSM_SUCC);
+        EXPECT_EQ(hfsm_start(hfsm, HISTORY_S6), HFSM_SUCC);
+
+        /// nothing recorded yet, H itself is entered
+        const uint32_t events[] = { HISTORY_EVENT_ENTER, HISTORY_EVENT_DEEP, HISTORY_EVENT_OUT };
+        event_t evt = { 0, 1, NULL };
+        for (uint32_t id : events) {
+            evt.id = id;
+            EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+        }
+        EXPECT_EQ(trace, "+6-6+2+4+5-5-4-2+6");
+
+        /// restored on entering H again, parents first
+        trace.clear();
+        evt.id = HISTORY_EVENT_ENTER;
+        EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+        EXPECT_EQ(trace, restored[k]);
+        EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    }
+}
+
+TEST(hfsm, hfsm_get_state_stats)
+{
+    std::string trace;
+    hfsm_state_stats stats;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+#ifndef HFSM_STATS
+    EXPECT_EQ(hfsm_get_state_stats(hfsm, TEST_STATE_2, &stats), HFSM_ERR_STATS);
+#else
+    EXPECT_EQ(hfsm_get_state_stats(hfsm, TEST_STATE_3 + 1, &stats), HFSM_ERR_NO_STATE);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    /// S2 passes the first event to S1, and transits to S3 on the second
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    evt.id = TEST_EVENT_TRANS_TO_STATE3;
+    EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "+2?1-2+3");
+
+    EXPECT_EQ(hfsm_get_state_stats(hfsm, TEST_STATE_1, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.entries, 0);
+    EXPECT_EQ(stats.invokes, 1);
+    EXPECT_EQ(stats.handled, 1);
+    EXPECT_EQ(stats.transits, 0);
+    EXPECT_EQ(hfsm_get_state_stats(hfsm, TEST_STATE_2, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.entries, 1);
+    EXPECT_EQ(stats.exits, 1);
+    EXPECT_EQ(stats.invokes, 2);
+    EXPECT_EQ(stats.handled, 1);
+    EXPECT_EQ(stats.transits, 1);
+    EXPECT_EQ(hfsm_get_state_stats(hfsm, TEST_STATE_3, &stats), HFSM_SUCC);
+    EXPECT_EQ(stats.entries, 1);
+    EXPECT_EQ(stats.exits, 0);
+    EXPECT_EQ(stats.invokes, 0);
+#endif
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_get_latency)
+{
+    std::string trace;
+    hfsm_latency latency;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD,
+        .queue = HFSM_QUEUE_RING
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+#ifndef HFSM_STATS
+    EXPECT_EQ(hfsm_get_latency(hfsm, HFSM_LATENCY_TOTAL, &latency), HFSM_ERR_STATS);
+#else
+    EXPECT_EQ(hfsm_get_latency(hfsm, HFSM_LATENCY_KINDS, &latency), HFSM_ERR_STATS);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+
+    event_t evt = { TEST_EVENT_AT_STATE2, 1, NULL };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    event_t evts[] = {
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    EXPECT_EQ(hfsm_send_events(hfsm, evts, 2), HFSM_SUCC);
+    usleep(10000); // wait for events handled
+    EXPECT_EQ(trace, "+2?1-2+3?1");
+
+    for (unsigned char kind = 0; kind < HFSM_LATENCY_KINDS; ++kind) {
+        EXPECT_EQ(hfsm_get_latency(hfsm, kind, &latency), HFSM_SUCC);
+        EXPECT_EQ(latency.count, 3);
+        EXPECT_LE(latency.p50_ns, latency.p99_ns);
+        EXPECT_LE(latency.p99_ns, latency.p999_ns);
+        EXPECT_LE(latency.p999_ns, latency.max_ns);
+        EXPECT_LE(latency.mean_ns, latency.max_ns);
+    }
+    EXPECT_EQ(hfsm_get_event_latency(hfsm, TEST_EVENT_AT_STATE3,
+        HFSM_LATENCY_WAIT, &latency), HFSM_SUCC);
+    EXPECT_EQ(latency.count, 1);
+    EXPECT_EQ(hfsm_get_event_latency(hfsm, TEST_EVENT_AT_STATE3 + 1,
+        HFSM_LATENCY_WAIT, &latency), HFSM_SUCC);
+    EXPECT_EQ(latency.count, 0);
+#endif
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_get_event_latency)
+{
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_THREAD,
+        .latency_events = 16
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+#ifdef HFSM_STATS
+    hfsm_latency latency;
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+    /*! events are queued alone in EventHub, IDs beyond the slots share
+        only the overall histograms */
+    for (uint32_t id = 100; id < 120; ++id) {
+        event_t evt = { id, 1, NULL };
+        EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    }
+    for (int i = 0; i < 1000; ++i) {
+        EXPECT_EQ(hfsm_get_latency(hfsm, HFSM_LATENCY_WAIT, &latency), HFSM_SUCC);
+        if (latency.count == 20) {
+            break;
+        }
+        usleep(1000);
+    }
+    EXPECT_EQ(latency.count, 20);
+    for (uint32_t id = 100; id < 120; ++id) {
+        EXPECT_EQ(hfsm_get_event_latency(hfsm, id, HFSM_LATENCY_WAIT, &latency),
+            HFSM_SUCC);
+        EXPECT_EQ(latency.count, id < 116 ? 1 : 0) << id;
+    }
+#endif
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+}
+
+TEST(hfsm, hfsm_dump_trace)
+{
+    std::string trace;
+    std::string path = testing::TempDir() + "hfsm_trace.bin";
+    hfsm_trace_header header;
+    hfsm_trace_record records[4];
+    hfsm_handle hfsm = NULL;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = &trace,
+        .mode = HFSM_MODE_INLINE
+    };
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    EXPECT_EQ(hfsm_dump_trace(hfsm, path.c_str()), HFSM_ERR_TRACE);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    /// rounded up to 4 records
+    param.trace_records = 3;
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+    event_t evts[] = {
+        { TEST_EVENT_AT_STATE2, 1, NULL },
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    for (const auto &evt : evts) {
+        EXPECT_EQ(hfsm_dispatch_event(hfsm, &evt), HFSM_SUCC);
+    }
+    EXPECT_EQ(hfsm_dump_trace(hfsm, path.c_str()), HFSM_SUCC);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    /// the oldest record is overwritten
+    FILE *fp = fopen(path.c_str(), "rb");
+    ASSERT_NE(fp, nullptr);
+    EXPECT_EQ(fread(&header, sizeof(header), 1, fp), 1);
+    EXPECT_EQ(memcmp(header.magic, HFSM_TRACE_MAGIC, sizeof(header.magic)), 0);
+    EXPECT_EQ(header.record_size, sizeof(hfsm_trace_record));
+    EXPECT_EQ(header.written, 5);
+    ASSERT_EQ(header.count, 4);
+    EXPECT_EQ(fread(records, sizeof(hfsm_trace_record), 4, fp), 4);
+    fclose(fp);
+    remove(path.c_str());
+
+    EXPECT_EQ(records[0].seq, 2);
+    EXPECT_EQ(records[0].event, TEST_EVENT_TRANS_TO_STATE3);
+    EXPECT_EQ(records[0].kind, HFSM_TRACE_HANDLED);
+    EXPECT_EQ(records[0].source, TEST_STATE_2);
+    EXPECT_EQ(records[0].handler, TEST_STATE_2);
+    EXPECT_EQ(records[0].target, TEST_STATE_3);
+    for (int i=1; i<4; ++i) {
+        EXPECT_EQ(records[i].seq, i + 2);
+        EXPECT_GE(records[i].ns, records[i-1].ns);
+        EXPECT_EQ(records[i].event, TEST_EVENT_AT_STATE3);
+        EXPECT_EQ(records[i].source, TEST_STATE_3);
+        EXPECT_EQ(records[i].handler, TEST_STATE_1);
+        EXPECT_EQ(records[i].target, TEST_STATE_3);
+    }
+}
+
+TEST(hfsm, hfsm_log)
+{
+    char buf[256] = {};
+    std::string path = testing::TempDir() + "hfsm_log.txt";
+    int fd = open(path.c_str(), O_CREAT | O_TRUNC | O_RDWR, 0600);
+    ASSERT_GE(fd, 0);
+
+    /// messages are formatted by writer thread into redirected stderr
+    hfsm_log_flush();
+    int saved = dup(STDERR_FILENO);
+    dup2(fd, STDERR_FILENO);
+    hfsm_log_set_level(HFSM_LOG_WARN);
+    hfsm_log(HFSM_LOG_INFO, "hidden %d", 1);
+    std::string shown = "shown";
+    hfsm_log(HFSM_LOG_WARN, "%s %5d|%-4x|%.2f|%*lu|%c%%", shown.c_str(), 42, 255,
+        3.14159, 3, 7UL, 'z');
+    shown.clear();
+    hfsm_log_flush();
+    hfsm_log_set_level(HFSM_LOG_DEBUG);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+
+    EXPECT_GT(pread(fd, buf, sizeof(buf) - 1, 0), 0);
+    close(fd);
+    remove(path.c_str());
+    EXPECT_EQ(std::string(buf), "shown    42|ff  |3.14|  7|z%\n" RST);
+}
+
+/// user data is the trace, saved as its size and bytes
+int snapshot_save(void *userdata, const hfsm_stream *out)
+{
+    const std::string *trace = (const std::string*)userdata;
+    uint32_t size = trace->size();
+    if (out->write(out->ctx, &size, sizeof(size))) {
+        return HFSM_ERR_SNAPSHOT;
+    }
+    return out->write(out->ctx, trace->data(), size);
+}
+
+int snapshot_load(void *userdata, const hfsm_stream *in)
+{
+    std::string *trace = (std::string*)userdata;
+    uint32_t size;
+    if (in->read(in->ctx, &size, sizeof(size))) {
+        return HFSM_ERR_SNAPSHOT;
+    }
+    trace->resize(size);
+    return in->read(in->ctx, &(*trace)[0], size);
+}
+
+TEST(hfsm, hfsm_snapshot)
+{
+    std::string traces[4];
+    hfsm_handle hfsms[4] = {};
+    hfsm_stream stream;
+    hfsm_param param = {
+        .max_states = 3,
+        .userdata = NULL,
+        .mode = HFSM_MODE_INLINE,
+        .save = snapshot_save,
+        .load = snapshot_load
+    };
+    /// odd ones in HFSM_MODE_THREAD, S2 defers TEST_EVENT_AT_STATE3
+    for (int i=0; i<4; ++i) {
+        param.userdata = &traces[i];
+        param.mode = i % 2 ? HFSM_MODE_THREAD : HFSM_MODE_INLINE;
+        ASSERT_EQ(hfsm_create(&hfsms[i], &param), HFSM_SUCC);
+        trace_add_states(hfsms[i]);
+        EXPECT_EQ(hfsm_defer_event(hfsms[i], hfsm_find_state(
+            (struct hfsm_t*)hfsms[i], TEST_STATE_2), TEST_EVENT_AT_STATE3), HFSM_SUCC);
+    }
+    FILE *fp = tmpfile();
+    ASSERT_NE(fp, nullptr);
+    hfsm_stream_file(&stream, fp);
+    EXPECT_EQ(hfsm_snapshot_all(hfsms, 2, &stream), HFSM_ERR_NO_STATE);
+    EXPECT_EQ(hfsm_start(hfsms[0], TEST_STATE_2), HFSM_SUCC);
+    EXPECT_EQ(hfsm_start(hfsms[1], TEST_STATE_2), HFSM_SUCC);
+
+    /// message parked by the first, events queued to the second are
+    /// handled before it is captured
+    hfsm_msg_t msg = {};
+    msg.evt.id = TEST_EVENT_AT_STATE3;
+    msg.evt.priority = 1;
+    msg.size = 3;
+    memcpy(msg.data, "abc", 3);
+    EXPECT_EQ(hfsm_dispatch_msg(hfsms[0], &msg), HFSM_SUCC);
+    event_t evts[] = {
+        { TEST_EVENT_TRANS_TO_STATE3, 1, NULL },
+        { TEST_EVENT_AT_STATE3, 1, NULL },
+    };
+    EXPECT_EQ(hfsm_send_events(hfsms[1], evts, 2), HFSM_SUCC);
+    EXPECT_EQ(hfsm_snapshot_all(hfsms, 2, &stream), HFSM_SUCC);
+    EXPECT_EQ(traces[0], "+2");
+    EXPECT_EQ(traces[1], "+2-2+3?1");
+
+    /// no entry action is run, user data is loaded
+    rewind(fp);
+    EXPECT_EQ(hfsm_restore(hfsms[0], &stream), HFSM_ERR_MODE);
+    EXPECT_EQ(hfsm_restore_all(&hfsms[2], 2, &stream), HFSM_SUCC);
+    EXPECT_EQ(traces[2], "+2");
+    EXPECT_EQ(traces[3], "+2-2+3?1");
+    /// restored ones are started with their queue already
+    for (int i=0; i<4; ++i) {
+        EXPECT_EQ(hfsm_start(hfsms[i], TEST_STATE_2), HFSM_ERR_MODE);
+    }
+
+    /// parked message is recalled after the next transition
+    event_t evt = { TEST_EVENT_TRANS_TO_STATE3, 1, NULL };
+    EXPECT_EQ(hfsm_dispatch_event(hfsms[2], &evt), HFSM_SUCC);
+    EXPECT_EQ(traces[2], "+2-2+3?1");
+    evt.id = TEST_EVENT_AT_STATE3;
+    EXPECT_EQ(hfsm_send_event(hfsms[3], &evt), HFSM_SUCC);
+    usleep(10000); // wait for event handled
+    EXPECT_EQ(traces[3], "+2-2+3?1?1");
+
+    /// the end of stream
+    std::string trace;
+    hfsm_handle hfsm = NULL;
+    param.userdata = &trace;
+    param.mode = HFSM_MODE_INLINE;
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+    EXPECT_EQ(hfsm_restore(hfsm, &stream), HFSM_ERR_SNAPSHOT);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+
+    /// payload of a parked message can not be captured
+    trace.clear();
+    ASSERT_EQ(hfsm_create(&hfsm, &param), HFSM_SUCC);
+    trace_add_states(hfsm);
+    EXPECT_EQ(hfsm_defer_event(hfsm, hfsm_find_state((struct hfsm_t*)hfsm,
+        TEST_STATE_2), TEST_EVENT_AT_STATE3), HFSM_SUCC);
+    EXPECT_EQ(hfsm_start(hfsm, TEST_STATE_2), HFSM_SUCC);
+    char big[] = "<payload>";
+    hfsm_payload payload;
+    hfsm_payload_init(&payload, big, strlen(big), trace_payload_release);
+    released = 0;
+    msg.payload = &payload;
+    EXPECT_EQ(hfsm_dispatch_msg(hfsm, &msg), HFSM_SUCC);
+    hfsm_payload_unref(&payload);
+    long end = ftell(fp);
+    EXPECT_EQ(hfsm_snapshot(hfsm, &stream), HFSM_ERR_SNAPSHOT);
+    EXPECT_EQ(ftell(fp), end);
+    EXPECT_EQ(released, 0);
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    EXPECT_EQ(released, 1);
+    for (int i=0; i<4; ++i) {
+        EXPECT_EQ(hfsm_destroy(&hfsms[i]), HFSM_SUCC);
+    }
+
+    /// active states of regions are restored with their composite
+    hfsm_handle regions[2] = {};
+    param.max_states = 8;
+    for (int i=0; i<2; ++i) {
+        ASSERT_EQ(hfsm_create(&regions[i], &param), HFSM_SUCC);
+        region_add_states(regions[i]);
+    }
+    EXPECT_EQ(hfsm_start(regions[0], REGION_O), HFSM_SUCC);
+    const uint32_t events[] = { REGION_EVENT_ENTER, REGION_EVENT_A };
+    for (uint32_t id : events) {
+        evt.id = id;
+        EXPECT_EQ(hfsm_dispatch_event(regions[0], &evt), HFSM_SUCC);
+    }
+    rewind(fp);
+    EXPECT_EQ(hfsm_snapshot(regions[0], &stream), HFSM_SUCC);
+    rewind(fp);
+    EXPECT_EQ(hfsm_restore(regions[1], &stream), HFSM_SUCC);
+    trace.clear();
+    evt.id = REGION_EVENT_OUT;
+    EXPECT_EQ(hfsm_dispatch_event(regions[1], &evt), HFSM_SUCC);
+    EXPECT_EQ(trace, "-a2-a-b1-b-c+o");
+    for (int i=0; i<2; ++i) {
+        EXPECT_EQ(hfsm_destroy(&regions[i]), HFSM_SUCC);
+    }
+
+    /// requests are not queued into a full queue, or are abandoned in
+    /// the queue of a dispatcher held, both in time
+    trace.clear();
+    hfsm = overflow_create(&trace, HFSM_OVERFLOW_REJECT);
+    EXPECT_EQ(hfsm_snapshot(hfsm, &stream), HFSM_ERR_EVTHUB);
+    overflow_hold = false;
+    usleep(10000);
+    overflow_hold = true;
+    evt = event_t{ TEST_EVENT_AT_STATE2, 1, (void*)'d' };
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    usleep(5000);
+    EXPECT_EQ(hfsm_snapshot(hfsm, &stream), HFSM_ERR_EVTHUB);
+    overflow_hold = false;
+    usleep(10000);
+    EXPECT_EQ(trace, "abcd");
+    /// released by dispatcher above, or by destroy if it is never taken
+    overflow_hold = true;
+    evt.param = (void*)'e';
+    EXPECT_EQ(hfsm_send_event(hfsm, &evt), HFSM_SUCC);
+    usleep(5000);
+    EXPECT_EQ(hfsm_snapshot(hfsm, &stream), HFSM_ERR_EVTHUB);
+    std::thread release([] { usleep(5000); overflow_hold = false; });
+    EXPECT_EQ(hfsm_destroy(&hfsm), HFSM_SUCC);
+    release.join();
+    EXPECT_EQ(trace, "abcde");
+    fclose(fp);
+}
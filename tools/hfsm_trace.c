@@ -0,0 +1,104 @@
+/*
+ * Decoder of HFSM binary trace files
+ *
+ * Author wanch
+ * Date 2026/10/17
+ * Email wzhhnet@gmail.com
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "hfsm.h"
+
+static const char* kind_name(unsigned char kind)
+{
+    switch (kind) {
+    case HFSM_TRACE_HANDLED:
+        return "handled";
+    case HFSM_TRACE_UNHANDLED:
+        return "unhandled";
+    case HFSM_TRACE_DEFERRED:
+        return "deferred";
+    default:
+        return "unknown";
+    }
+}
+
+/*! print records of a file written by hfsm_dump_trace, time is relative
+    to the oldest record */
+static int decode(const unsigned char *data, size_t size)
+{
+    const hfsm_trace_header *header = (const hfsm_trace_header*)data;
+    const hfsm_trace_record *r;
+
+    if (size < sizeof(*header)
+        || memcmp(header->magic, HFSM_TRACE_MAGIC, sizeof(header->magic)) != 0) {
+        fprintf(stderr, "not a trace file\n");
+        return 1;
+    }
+    if (header->record_size != sizeof(hfsm_trace_record)
+        || size < sizeof(*header) + (size_t)header->count * header->record_size) {
+        fprintf(stderr, "truncated or mismatched trace file\n");
+        return 1;
+    }
+    r = (const hfsm_trace_record*)(header + 1);
+    printf("# %u records, %llu written\n", header->count,
+        (unsigned long long)header->written);
+    printf("%10s %14s %10s %-9s %6s %7s %6s\n",
+        "seq", "time(us)", "event", "kind", "source", "handler", "target");
+    for (uint32_t i=0; i<header->count; ++i) {
+        printf("%10llu %14.3f %10u %-9s %6u %7u %6u\n",
+            (unsigned long long)r[i].seq, (r[i].ns - r[0].ns) / 1000.0,
+            r[i].event, kind_name(r[i].kind), r[i].source, r[i].handler,
+            r[i].target);
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int fd, ret;
+    struct stat st;
+    void *data;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <trace file>\n", argv[0]);
+        return 2;
+    }
+    fd = open(argv[1], O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (st.st_size == 0) {
+        fprintf(stderr, "not a trace file\n");
+        close(fd);
+        return 1;
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    ret = decode((const unsigned char*)data, st.st_size);
+    munmap(data, st.st_size);
+    return ret;
+}